@@ -0,0 +1,131 @@
+// Runs the same control flow on every MPRIS player on the session bus, once
+// with the blocking MprisMediaPlayer API, one player after the other, and
+// once as coroutines on a single MprisAsyncLoop, all players at once:
+//
+//   can_seek() -> position() -> seek(0)
+//
+//   async-bench [-r ROUNDS] [PLAYER...]
+//
+// The seek is by zero, so players keep their position. The blocking seek()
+// does not wait for the player, the awaited one does.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "mpris_async.h"
+#include "mpris_media_player.h"
+
+static int64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static int run_blocking(const std::vector<std::string> &players, int rounds) {
+  std::vector<std::unique_ptr<MprisMediaPlayer>> instances;
+  int failures = 0;
+
+  for (const std::string &name : players) {
+    instances.emplace_back(new MprisMediaPlayer(name));
+    instances.back()->set_verbose(false);
+  }
+
+  for (int round = 0; round < rounds; round++) {
+    for (std::unique_ptr<MprisMediaPlayer> &player : instances) {
+      if (!player->can_seek()) {
+        failures++;
+        continue;
+      }
+      player->get_position();
+      if (player->seek(0) != ERROR_NONE) {
+        failures++;
+      }
+    }
+  }
+
+  return failures;
+}
+
+static DBusTask<void> seek_in_place(MprisAsyncPlayer &player, int rounds,
+                                    int &failures) {
+  for (int round = 0; round < rounds; round++) {
+    DBusResult<bool> seekable = co_await player.can_seek();
+    if (!seekable.ok() || !seekable.value) {
+      failures++;
+      continue;
+    }
+    co_await player.position();
+    if (co_await player.seek(0) != ERROR_NONE) {
+      failures++;
+    }
+  }
+}
+
+static int run_async(const std::vector<std::string> &players, int rounds) {
+  MprisAsyncLoop loop;
+  std::vector<std::unique_ptr<MprisAsyncPlayer>> instances;
+  int failures = 0;
+
+  for (const std::string &name : players) {
+    instances.emplace_back(new MprisAsyncPlayer(loop, name));
+    instances.back()->get_player().set_verbose(false);
+    loop.spawn(seek_in_place(*instances.back(), rounds, failures));
+  }
+
+  if (loop.run() != ERROR_NONE) {
+    return -1;
+  }
+
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> players;
+  MprisMediaPlayer lister;
+  int rounds = 100;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:h")) != -1) {
+    switch (opt) {
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-r ROUNDS] [PLAYER...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  for (int i = optind; i < argc; i++) {
+    players.push_back(argv[i]);
+  }
+  lister.set_verbose(false);
+  if (players.empty() &&
+      (lister.get_player_list(players) != ERROR_NONE ||
+       players.empty())) {
+    fprintf(stderr, "no MPRIS player on the session bus\n");
+    return 1;
+  }
+
+  int flows = static_cast<int>(players.size()) * rounds;
+  printf("%zu players, %d rounds\n", players.size(), rounds);
+
+  int64_t start = monotonic_us();
+  int failures = run_blocking(players, rounds);
+  double elapsed_s = (monotonic_us() - start) / 1e6;
+  printf("  blocking:   %8.0f flows/s  %.1f ms  failed %d\n",
+         flows / elapsed_s, elapsed_s * 1000, failures);
+
+  start = monotonic_us();
+  failures = run_async(players, rounds);
+  elapsed_s = (monotonic_us() - start) / 1e6;
+  printf("  coroutines: %8.0f flows/s  %.1f ms  failed %d\n",
+         flows / elapsed_s, elapsed_s * 1000, failures);
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,669 @@
+// Replays a capture written by `dbus-music --record FILE ...` against a
+// private bus, standing in for every player that appears in it.
+//
+//   dbus-replay [-s SPEED] [-a ADDRESS] [-w WARMUP_MS] [-L] CAPTURE
+//               [-- COMMAND ...]
+//
+// Each recorded player gets its own connection claiming its well-known
+// name. Signals the players sent are re-emitted on the original timeline,
+// scaled by SPEED (1 = as recorded, 10 = ten times faster, 0 = as fast as
+// possible), and players appear and vanish where NameOwnerChanged says they
+// did. Method calls are answered with the recorded replies after the
+// recorded latency (-L answers immediately); calls that timed out in the
+// capture are left unanswered again.
+//
+// Without -a a private dbus-daemon is started. COMMAND, typically the
+// build under test, runs with DBUS_SESSION_BUS_ADDRESS pointing at that
+// bus, and the replay ends when it exits; without COMMAND the address is
+// printed and the replay runs until interrupted.
+
+#include <dbus/dbus.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+
+static const char *BUS_NAME = "org.freedesktop.DBus";
+static const std::string MPRIS_PREFIX = "org.mpris.MediaPlayer2.";
+
+static volatile int quit = 0;
+
+static void handle_quit_signal(int) { quit = 1; }
+
+static int64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct StandIn {
+  std::string name;
+  DBusConnection *conn = nullptr;
+  bool initially_owned = true;
+};
+
+typedef enum ReplayEventKinds {
+  EventSignal,
+  EventClaim,
+  EventRelease
+} ReplayEventKind;
+
+struct ReplayEvent {
+  int64_t time_us;
+  ReplayEventKind kind;
+  size_t player;
+  DBusMessage *msg; // owned by the record list
+};
+
+struct Response {
+  DBusMessage *reply; // nullptr: the call was never answered
+  int64_t delay_us;
+};
+
+// Recorded replies for one kind of call, handed out in recorded order and
+// from the start again once exhausted
+struct ResponseQueue {
+  std::vector<size_t> responses;
+  size_t next = 0;
+};
+
+struct ScheduledReply {
+  int64_t due_us;
+  size_t player;
+  DBusMessage *msg;
+};
+
+class Replay {
+public:
+  int load(const std::string &path);
+  int connect(const std::string &address);
+  int run(double speed, bool recorded_latency, int64_t warmup_us,
+          pid_t child);
+  void print_stats(FILE *out);
+  ~Replay();
+
+private:
+  size_t player_for(const char *bus_name);
+  std::string call_key(size_t player, DBusMessage *msg, bool with_args);
+  void append_args(std::string &key, DBusMessageIter *iter);
+  void handle_call(size_t player, DBusMessage *call, double speed,
+                   bool recorded_latency);
+  void perform(const ReplayEvent &event);
+
+  std::vector<DBusRecord> records;
+  std::vector<StandIn> players;
+  std::unordered_map<std::string, size_t> player_index;
+  std::unordered_map<std::string, std::string> owners; // unique -> name
+
+  std::vector<ReplayEvent> events;
+  std::vector<Response> responses;
+  std::unordered_map<std::string, ResponseQueue> exact_calls;
+  std::unordered_map<std::string, ResponseQueue> loose_calls;
+  std::vector<ScheduledReply> scheduled;
+
+  long signals_sent = 0;
+  long name_changes = 0;
+  long calls_answered = 0;
+  long calls_unanswered = 0;
+  long calls_unmatched = 0;
+  int64_t max_lag_us = 0;
+};
+
+Replay::~Replay() {
+  for (ScheduledReply &reply : scheduled) {
+    dbus_message_unref(reply.msg);
+  }
+  for (StandIn &player : players) {
+    if (player.conn) {
+      dbus_connection_close(player.conn);
+      dbus_connection_unref(player.conn);
+    }
+  }
+}
+
+size_t Replay::player_for(const char *bus_name) {
+  std::string name = bus_name ? bus_name : "";
+
+  if (!name.empty() && name[0] == ':') {
+    auto it = owners.find(name);
+    if (it != owners.end()) {
+      name = it->second;
+    } else {
+      // never saw its well-known name; make one up that is stable per run
+      std::string suffix = name.substr(1);
+      std::replace(suffix.begin(), suffix.end(), '.', '_');
+      name = MPRIS_PREFIX + "replay_" + suffix;
+    }
+  }
+
+  auto it = player_index.find(name);
+  if (it != player_index.end()) {
+    return it->second;
+  }
+
+  StandIn player;
+  player.name = name;
+  players.push_back(player);
+  player_index[name] = players.size() - 1;
+
+  return players.size() - 1;
+}
+
+void Replay::append_args(std::string &key, DBusMessageIter *iter) {
+  while (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_INVALID) {
+    int type = dbus_message_iter_get_arg_type(iter);
+    DBusBasicValue value;
+    char buf[32];
+
+    key += static_cast<char>(type);
+    if (type == DBUS_TYPE_VARIANT) {
+      DBusMessageIter sub;
+      dbus_message_iter_recurse(iter, &sub);
+      append_args(key, &sub);
+    } else if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH ||
+               type == DBUS_TYPE_SIGNATURE) {
+      dbus_message_iter_get_basic(iter, &value);
+      key += value.str;
+    } else if (dbus_type_is_basic(type) && type != DBUS_TYPE_UNIX_FD) {
+      // compare the raw bits, the width comes from the type code
+      memset(&value, 0, sizeof(value));
+      dbus_message_iter_get_basic(iter, &value);
+      snprintf(buf, sizeof(buf), "%llx",
+               static_cast<unsigned long long>(value.u64));
+      key += buf;
+    } else {
+      char *signature = dbus_message_iter_get_signature(iter);
+      key += signature;
+      dbus_free(signature);
+    }
+    key += '\x1f';
+    dbus_message_iter_next(iter);
+  }
+}
+
+std::string Replay::call_key(size_t player, DBusMessage *msg,
+                             bool with_args) {
+  const char *path = dbus_message_get_path(msg);
+  const char *iface = dbus_message_get_interface(msg);
+  const char *member = dbus_message_get_member(msg);
+  std::string key = players[player].name;
+
+  key += '\x1e';
+  key += path ? path : "";
+  key += '\x1e';
+  key += iface ? iface : "";
+  key += '\x1e';
+  key += member ? member : "";
+
+  if (with_args) {
+    DBusMessageIter iter;
+    key += '\x1e';
+    if (dbus_message_iter_init(msg, &iter)) {
+      append_args(key, &iter);
+    }
+  }
+
+  return key;
+}
+
+int Replay::load(const std::string &path) {
+  DBusCaptureReader reader;
+  DBusRecord record;
+  std::unordered_map<dbus_uint32_t, size_t> calls;
+  std::unordered_map<dbus_uint32_t, size_t> replies;
+  const std::string &prefix = MPRIS_PREFIX;
+  int output;
+
+  if ((output = reader.open(path)) != ERROR_NONE) {
+    return output;
+  }
+  while (reader.next(record)) {
+    records.push_back(std::move(record));
+  }
+
+  // learn who owned which name: from the bus itself, and from replies to
+  // calls addressed by well-known name
+  for (size_t i = 0; i < records.size(); i++) {
+    DBusMessage *msg = records[i].msg.get();
+    const char *name;
+    const char *old_owner;
+    const char *new_owner;
+
+    if (records[i].direction == RecordSent &&
+        dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+      calls[dbus_message_get_serial(msg)] = i;
+    } else if (records[i].direction == RecordReceived &&
+               dbus_message_get_reply_serial(msg)) {
+      auto call = calls.find(dbus_message_get_reply_serial(msg));
+      if (call == calls.end()) {
+        continue;
+      }
+      replies[call->first] = i;
+
+      DBusMessage *call_msg = records[call->second].msg.get();
+      const char *destination = dbus_message_get_destination(call_msg);
+      const char *sender = dbus_message_get_sender(msg);
+      if (destination && sender && destination[0] != ':' &&
+          strcmp(destination, BUS_NAME) != 0) {
+        owners[sender] = destination;
+      } else if (dbus_message_is_method_call(call_msg, BUS_NAME,
+                                             "GetNameOwner") &&
+                 dbus_message_get_args(call_msg, nullptr, DBUS_TYPE_STRING,
+                                       &name, DBUS_TYPE_INVALID) &&
+                 dbus_message_get_args(msg, nullptr, DBUS_TYPE_STRING,
+                                       &new_owner, DBUS_TYPE_INVALID)) {
+        owners[new_owner] = name;
+      }
+    } else if (dbus_message_is_signal(msg, BUS_NAME, "NameOwnerChanged") &&
+               dbus_message_get_args(msg, nullptr, DBUS_TYPE_STRING, &name,
+                                     DBUS_TYPE_STRING, &old_owner,
+                                     DBUS_TYPE_STRING, &new_owner,
+                                     DBUS_TYPE_INVALID) &&
+               strncmp(name, prefix.c_str(), prefix.size()) == 0 &&
+               *new_owner) {
+      owners[new_owner] = name;
+    }
+  }
+
+  for (size_t i = 0; i < records.size(); i++) {
+    DBusMessage *msg = records[i].msg.get();
+    int64_t time_us = records[i].time_us;
+    const char *sender = dbus_message_get_sender(msg);
+    const char *destination = dbus_message_get_destination(msg);
+
+    if (records[i].direction == RecordSent) {
+      if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+          dbus_message_get_no_reply(msg) || !destination ||
+          strcmp(destination, BUS_NAME) == 0) {
+        continue;
+      }
+
+      Response response = {nullptr, 0};
+      auto reply = replies.find(dbus_message_get_serial(msg));
+      if (reply != replies.end()) {
+        response.reply = records[reply->second].msg.get();
+        response.delay_us = records[reply->second].time_us - time_us;
+      }
+      responses.push_back(response);
+
+      size_t player = player_for(destination);
+      exact_calls[call_key(player, msg, true)].responses.push_back(
+          responses.size() - 1);
+      loose_calls[call_key(player, msg, false)].responses.push_back(
+          responses.size() - 1);
+      continue;
+    }
+
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL || !sender) {
+      continue;
+    }
+
+    if (strcmp(sender, BUS_NAME) == 0) {
+      const char *name;
+      const char *old_owner;
+      const char *new_owner;
+
+      if (!dbus_message_is_signal(msg, BUS_NAME, "NameOwnerChanged") ||
+          !dbus_message_get_args(msg, nullptr, DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_STRING, &old_owner,
+                                 DBUS_TYPE_STRING, &new_owner,
+                                 DBUS_TYPE_INVALID) ||
+          strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+        continue;
+      }
+
+      size_t player = player_for(name);
+      if (*old_owner) {
+        events.push_back({time_us, EventRelease, player, nullptr});
+      }
+      if (*new_owner) {
+        events.push_back({time_us, EventClaim, player, nullptr});
+      }
+      continue;
+    }
+
+    events.push_back({time_us, EventSignal, player_for(sender), msg});
+  }
+
+  // a player whose name shows up before it is claimed was already running
+  std::vector<bool> seen(players.size(), false);
+  for (const ReplayEvent &event : events) {
+    if (event.kind == EventClaim && !seen[event.player]) {
+      players[event.player].initially_owned = false;
+    }
+    if (event.kind != EventSignal) {
+      seen[event.player] = true;
+    }
+  }
+
+  std::cerr << records.size() << " records, " << players.size()
+            << " players, " << events.size() << " timeline events, "
+            << responses.size() << " recorded calls" << std::endl;
+
+  return ERROR_NONE;
+}
+
+int Replay::connect(const std::string &address) {
+  DBusError err;
+
+  dbus_error_init(&err);
+  for (StandIn &player : players) {
+    player.conn = dbus_connection_open_private(address.c_str(), &err);
+    if (!player.conn || !dbus_bus_register(player.conn, &err)) {
+      std::cerr << "cannot connect to " << address << ": " << err.message
+                << std::endl;
+      dbus_error_free(&err);
+      return ERROR_DBUS;
+    }
+    dbus_connection_set_exit_on_disconnect(player.conn, false);
+
+    if (player.initially_owned) {
+      dbus_bus_request_name(player.conn, player.name.c_str(),
+                            DBUS_NAME_FLAG_DO_NOT_QUEUE, nullptr);
+    }
+  }
+
+  return ERROR_NONE;
+}
+
+void Replay::perform(const ReplayEvent &event) {
+  StandIn &player = players[event.player];
+
+  switch (event.kind) {
+  case EventSignal: {
+    DBusMessage *msg = dbus_message_copy(event.msg);
+    // the bus fills in the stand-in as sender
+    dbus_message_set_sender(msg, nullptr);
+    dbus_message_set_destination(msg, nullptr);
+    dbus_connection_send(player.conn, msg, nullptr);
+    dbus_message_unref(msg);
+    signals_sent++;
+    break;
+  }
+  case EventClaim:
+    dbus_bus_request_name(player.conn, player.name.c_str(),
+                          DBUS_NAME_FLAG_DO_NOT_QUEUE, nullptr);
+    name_changes++;
+    break;
+  case EventRelease:
+    dbus_bus_release_name(player.conn, player.name.c_str(), nullptr);
+    name_changes++;
+    break;
+  }
+}
+
+void Replay::handle_call(size_t player, DBusMessage *call, double speed,
+                         bool recorded_latency) {
+  ResponseQueue *queue = nullptr;
+
+  auto exact = exact_calls.find(call_key(player, call, true));
+  if (exact != exact_calls.end()) {
+    queue = &exact->second;
+  } else {
+    // e.g. a Set with a value the capture never used
+    auto loose = loose_calls.find(call_key(player, call, false));
+    if (loose != loose_calls.end()) {
+      queue = &loose->second;
+    }
+  }
+
+  if (!queue) {
+    calls_unmatched++;
+    if (!dbus_message_get_no_reply(call)) {
+      DBusMessage *error = dbus_message_new_error(
+          call, DBUS_ERROR_UNKNOWN_METHOD, "not in the capture");
+      dbus_connection_send(players[player].conn, error, nullptr);
+      dbus_message_unref(error);
+    }
+    return;
+  }
+
+  const Response &response = responses[queue->responses[queue->next]];
+  queue->next = (queue->next + 1) % queue->responses.size();
+
+  if (!response.reply) {
+    calls_unanswered++;
+    return;
+  }
+  if (dbus_message_get_no_reply(call)) {
+    return;
+  }
+
+  DBusMessage *reply = dbus_message_copy(response.reply);
+  dbus_message_set_sender(reply, nullptr);
+  dbus_message_set_destination(reply, dbus_message_get_sender(call));
+  dbus_message_set_reply_serial(reply, dbus_message_get_serial(call));
+
+  int64_t delay = 0;
+  if (recorded_latency && speed > 0) {
+    delay = static_cast<int64_t>(response.delay_us / speed);
+  }
+  scheduled.push_back({monotonic_us() + delay, player, reply});
+  calls_answered++;
+}
+
+int Replay::run(double speed, bool recorded_latency, int64_t warmup_us,
+                pid_t child) {
+  std::vector<struct pollfd> fds(players.size());
+  int64_t first_us = events.empty() ? 0 : events.front().time_us;
+  int64_t start_us = monotonic_us() + warmup_us;
+  size_t next_event = 0;
+
+  for (size_t i = 0; i < players.size(); i++) {
+    int fd = -1;
+    dbus_connection_get_unix_fd(players[i].conn, &fd);
+    fds[i].fd = fd;
+    fds[i].events = POLLIN;
+  }
+
+  while (!quit) {
+    int64_t now = monotonic_us();
+    int64_t wake_us = now + 100000;
+
+    while (next_event < events.size()) {
+      const ReplayEvent &event = events[next_event];
+      int64_t due = start_us;
+      if (speed > 0) {
+        due += static_cast<int64_t>((event.time_us - first_us) / speed);
+      }
+      if (due > now) {
+        wake_us = std::min(wake_us, due);
+        break;
+      }
+      max_lag_us = std::max(max_lag_us, now - due);
+      perform(event);
+      next_event++;
+    }
+
+    for (size_t i = 0; i < scheduled.size();) {
+      if (scheduled[i].due_us <= now) {
+        dbus_connection_send(players[scheduled[i].player].conn,
+                             scheduled[i].msg, nullptr);
+        dbus_message_unref(scheduled[i].msg);
+        scheduled[i] = scheduled.back();
+        scheduled.pop_back();
+      } else {
+        wake_us = std::min(wake_us, scheduled[i].due_us);
+        i++;
+      }
+    }
+
+    for (StandIn &player : players) {
+      dbus_connection_flush(player.conn);
+    }
+
+    if (child > 0 && waitpid(child, nullptr, WNOHANG) == child) {
+      return ERROR_NONE;
+    }
+
+    int timeout_ms =
+        static_cast<int>(std::max<int64_t>(0, wake_us - now) / 1000);
+    if (poll(fds.data(), fds.size(), timeout_ms) <= 0) {
+      continue;
+    }
+
+    for (size_t i = 0; i < players.size(); i++) {
+      DBusMessage *msg;
+
+      if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      if (!dbus_connection_read_write(players[i].conn, 0)) {
+        std::cerr << "bus connection closed" << std::endl;
+        return ERROR_DBUS;
+      }
+      while ((msg = dbus_connection_pop_message(players[i].conn))) {
+        if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+          handle_call(i, msg, speed, recorded_latency);
+        }
+        dbus_message_unref(msg);
+      }
+    }
+  }
+
+  return ERROR_NONE;
+}
+
+void Replay::print_stats(FILE *out) {
+  fprintf(out, "signals sent:      %ld\n", signals_sent);
+  fprintf(out, "name changes:      %ld\n", name_changes);
+  fprintf(out, "calls answered:    %ld\n", calls_answered);
+  fprintf(out, "calls unanswered:  %ld (timed out in the capture)\n",
+          calls_unanswered);
+  fprintf(out, "calls unmatched:   %ld\n", calls_unmatched);
+  fprintf(out, "max timeline lag:  %lld us\n",
+          static_cast<long long>(max_lag_us));
+}
+
+static pid_t start_bus(std::string &address) {
+  int fds[2];
+  char buf[512];
+  ssize_t n;
+
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::string print_address = "--print-address=" + std::to_string(fds[1]);
+    close(fds[0]);
+    execlp("dbus-daemon", "dbus-daemon", "--session", "--nofork",
+           print_address.c_str(), static_cast<char *>(nullptr));
+    perror("dbus-daemon");
+    _exit(127);
+  }
+  close(fds[1]);
+
+  n = read(fds[0], buf, sizeof(buf) - 1);
+  close(fds[0]);
+  if (n <= 0) {
+    return -1;
+  }
+  buf[n] = '\0';
+  address = buf;
+  address.erase(address.find_last_not_of("\n") + 1);
+
+  return pid;
+}
+
+static void print_usage(const char *prog) {
+  std::cerr << "usage: " << prog
+            << " [-s SPEED] [-a ADDRESS] [-w WARMUP_MS] [-L] CAPTURE"
+               " [-- COMMAND ...]"
+            << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  double speed = 1.0;
+  bool recorded_latency = true;
+  int64_t warmup_us = 200000;
+  std::string address;
+  std::string capture;
+  char **command = nullptr;
+  pid_t bus = -1;
+  pid_t child = -1;
+  Replay replay;
+  int output;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      speed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      address = argv[++i];
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      warmup_us = atol(argv[++i]) * 1000;
+    } else if (strcmp(argv[i], "-L") == 0) {
+      recorded_latency = false;
+    } else if (strcmp(argv[i], "--") == 0) {
+      command = argv + i + 1;
+      break;
+    } else if (capture.empty() && argv[i][0] != '-') {
+      capture = argv[i];
+    } else {
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (capture.empty() || speed < 0) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  if (replay.load(capture) != ERROR_NONE) {
+    return 1;
+  }
+
+  if (address.empty() && (bus = start_bus(address)) < 0) {
+    std::cerr << "cannot start dbus-daemon" << std::endl;
+    return 1;
+  }
+
+  signal(SIGINT, handle_quit_signal);
+  signal(SIGTERM, handle_quit_signal);
+
+  if ((output = replay.connect(address)) == ERROR_NONE) {
+    if (command && *command) {
+      child = fork();
+      if (child == 0) {
+        setenv("DBUS_SESSION_BUS_ADDRESS", address.c_str(), 1);
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+      }
+    } else {
+      printf("DBUS_SESSION_BUS_ADDRESS=%s\n", address.c_str());
+      fflush(stdout);
+    }
+
+    int64_t started = monotonic_us();
+    output = replay.run(speed, recorded_latency, warmup_us, child);
+    fprintf(stderr, "replay time:       %.3f s\n",
+            (monotonic_us() - started) / 1e6);
+    replay.print_stats(stderr);
+  }
+
+  if (child > 0 && quit) {
+    kill(child, SIGTERM);
+    waitpid(child, nullptr, 0);
+  }
+  if (bus > 0) {
+    kill(bus, SIGTERM);
+    waitpid(bus, nullptr, 0);
+  }
+
+  return output == ERROR_NONE ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+// Measures how fast replies are decoded: Metadata through
+// DBusPropertyCodec<DBusMetadata> (and so fill_in_metadata()), the path
+// every Metadata Get, GetAll and PropertiesChanged takes.
+//
+//   decode-bench [-t MS] [-w DIR] [CAPTURE ...]
+//
+// Runs the built-in corpus (see decode_corpus.h) and the received messages
+// carrying Metadata in any captures given (dbus-music --record FILE), each
+// for about MS milliseconds (default 200), and prints messages/s and ns per
+// Metadata entry. -w writes the corpus to DIR, one marshalled message per
+// file, as seeds for decode-fuzzer. No bus is needed.
+
+#include <dbus/dbus.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "dbus_recorder.h"
+#include "decode_corpus.h"
+
+static int64_t monotonic_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static int write_corpus(const std::vector<DBusDecodeCase> &corpus,
+                        const std::string &dir) {
+  for (const DBusDecodeCase &entry : corpus) {
+    std::string path = dir + "/" + entry.name + ".msg";
+    char *data;
+    int length;
+
+    if (!dbus_message_marshal(entry.msg.get(), &data, &length)) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+      perror(path.c_str());
+      dbus_free(data);
+      return 1;
+    }
+    fwrite(data, 1, length, file);
+    fclose(file);
+    dbus_free(data);
+  }
+
+  printf("%zu messages written to %s\n", corpus.size(), dir.c_str());
+  return 0;
+}
+
+static int read_capture(const std::string &path,
+                        std::vector<DBusDecodeCase> &corpus) {
+  DBusCaptureReader reader;
+  DBusRecord record;
+  int count = 0;
+
+  if (reader.open(path) != ERROR_NONE) {
+    return 1;
+  }
+
+  while (reader.next(record)) {
+    DBusMetadata metadata = DBusMetadata();
+    if (record.direction == RecordReceived &&
+        DBusDecoderHarness::decode(record.msg.get(), metadata) > 0) {
+      count++;
+      corpus.push_back({path + "#" + std::to_string(count),
+                        std::move(record.msg)});
+    }
+  }
+
+  if (count == 0) {
+    fprintf(stderr, "%s: no message with Metadata\n", path.c_str());
+  }
+  return 0;
+}
+
+static void run_case(const DBusDecodeCase &entry, int64_t budget_ns) {
+  DBusMetadata metadata = DBusMetadata();
+  size_t fields = DBusDecoderHarness::decode(entry.msg.get(), metadata);
+  int64_t decoded = 0;
+  int64_t start = monotonic_ns();
+  int64_t elapsed;
+
+  // in batches, so reading the clock stays out of the numbers
+  do {
+    for (int i = 0; i < 64; i++) {
+      DBusDecoderHarness::decode(entry.msg.get(), metadata);
+    }
+    decoded += 64;
+    elapsed = monotonic_ns() - start;
+  } while (elapsed < budget_ns);
+
+  double ns_per_msg = static_cast<double>(elapsed) / decoded;
+  printf("  %-22s %6zu fields %12.0f msg/s %10.0f ns/msg", entry.name.c_str(),
+         fields, 1e9 / ns_per_msg, ns_per_msg);
+  if (fields > 0) {
+    printf(" %8.1f ns/field", ns_per_msg / fields);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<DBusDecodeCase> corpus;
+  std::string corpus_dir;
+  int budget_ms = 200;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:w:h")) != -1) {
+    switch (opt) {
+    case 't':
+      budget_ms = atoi(optarg);
+      break;
+    case 'w':
+      corpus_dir = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t MS] [-w DIR] [CAPTURE ...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  build_decode_corpus(corpus);
+  if (!corpus_dir.empty()) {
+    return write_corpus(corpus, corpus_dir);
+  }
+
+  for (int i = optind; i < argc; i++) {
+    if (read_capture(argv[i], corpus) != 0) {
+      return 1;
+    }
+  }
+
+  printf("%zu messages, %d ms each\n", corpus.size(), budget_ms);
+  for (const DBusDecodeCase &entry : corpus) {
+    run_case(entry, budget_ms * 1000000LL);
+  }
+
+  return 0;
+}
@@ -0,0 +1,732 @@
+#include "decode_corpus.h"
+
+#include <cstring>
+#include <iostream>
+#include <streambuf>
+
+static const char *const METADATA_KEYS[] = {
+    "mpris:trackid", "mpris:length",      "mpris:artUrl",
+    "xesam:album",   "xesam:albumArtist", "xesam:artist",
+    "xesam:title",   "xesam:url",         "xesam:discNumber",
+    "xesam:trackNumber", "xesam:userRating", "xesam:comment",
+    "xesam:genre",   "x-player:private"};
+
+static DBusMessageHandle new_reply() {
+  DBusMessageHandle msg(dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN));
+
+  // what a reply read off the bus carries; demarshalling insists on them
+  dbus_message_set_serial(msg.get(), 2);
+  dbus_message_set_reply_serial(msg.get(), 1);
+
+  return msg;
+}
+
+static void append_string(DBusMessageIter *iter, const std::string &value) {
+  const char *str = value.c_str();
+  dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &str);
+}
+
+static void append_path(DBusMessageIter *iter, const std::string &value) {
+  const char *str = value.c_str();
+  dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH, &str);
+}
+
+static void append_strings(DBusMessageIter *iter,
+                           const std::vector<std::string> &values) {
+  DBusMessageIter array_iter;
+
+  dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "s", &array_iter);
+  for (const std::string &value : values) {
+    append_string(&array_iter, value);
+  }
+  dbus_message_iter_close_container(iter, &array_iter);
+}
+
+template <typename T>
+static void append_basic(DBusMessageIter *iter, int type, T value) {
+  dbus_message_iter_append_basic(iter, type, &value);
+}
+
+// One "key: variant" entry of an a{sv}; fill appends the value
+template <typename F>
+static void append_entry(DBusMessageIter *dict_iter, const char *key,
+                         const char *signature, F fill) {
+  DBusMessageIter entry_iter;
+  DBusMessageIter variant_iter;
+
+  dbus_message_iter_open_container(dict_iter, DBUS_TYPE_DICT_ENTRY, nullptr,
+                                   &entry_iter);
+  dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container(&entry_iter, DBUS_TYPE_VARIANT, signature,
+                                   &variant_iter);
+  fill(&variant_iter);
+  dbus_message_iter_close_container(&entry_iter, &variant_iter);
+  dbus_message_iter_close_container(dict_iter, &entry_iter);
+}
+
+static void append_typical_metadata(DBusMessageIter *dict_iter) {
+  append_entry(dict_iter, "mpris:trackid", "o", [](DBusMessageIter *it) {
+    append_path(it, "/org/mpris/MediaPlayer2/Track/42");
+  });
+  append_entry(dict_iter, "mpris:length", "x", [](DBusMessageIter *it) {
+    append_basic<dbus_int64_t>(it, DBUS_TYPE_INT64, 215000000);
+  });
+  append_entry(dict_iter, "mpris:artUrl", "s", [](DBusMessageIter *it) {
+    append_string(it, "file:///home/user/.cache/covers/42.jpg");
+  });
+  append_entry(dict_iter, "xesam:album", "s", [](DBusMessageIter *it) {
+    append_string(it, "Album");
+  });
+  append_entry(dict_iter, "xesam:albumArtist", "as", [](DBusMessageIter *it) {
+    append_strings(it, {"Album Artist"});
+  });
+  append_entry(dict_iter, "xesam:artist", "as", [](DBusMessageIter *it) {
+    append_strings(it, {"Artist", "Featured Artist"});
+  });
+  append_entry(dict_iter, "xesam:title", "s", [](DBusMessageIter *it) {
+    append_string(it, "Title");
+  });
+  append_entry(dict_iter, "xesam:url", "s", [](DBusMessageIter *it) {
+    append_string(it, "file:///home/user/Music/Artist/Album/07.flac");
+  });
+  append_entry(dict_iter, "xesam:discNumber", "i", [](DBusMessageIter *it) {
+    append_basic<dbus_int32_t>(it, DBUS_TYPE_INT32, 1);
+  });
+  append_entry(dict_iter, "xesam:trackNumber", "i", [](DBusMessageIter *it) {
+    append_basic<dbus_int32_t>(it, DBUS_TYPE_INT32, 7);
+  });
+  append_entry(dict_iter, "xesam:userRating", "d", [](DBusMessageIter *it) {
+    append_basic<double>(it, DBUS_TYPE_DOUBLE, 0.8);
+  });
+}
+
+// A Get reply for Metadata: v holding a{sv}
+template <typename F> static DBusMessageHandle metadata_reply(F fill) {
+  DBusMessageHandle msg = new_reply();
+  DBusMessageIter args;
+  DBusMessageIter variant_iter;
+  DBusMessageIter dict_iter;
+
+  dbus_message_iter_init_append(msg.get(), &args);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "a{sv}",
+                                   &variant_iter);
+  dbus_message_iter_open_container(&variant_iter, DBUS_TYPE_ARRAY, "{sv}",
+                                   &dict_iter);
+  fill(&dict_iter);
+  dbus_message_iter_close_container(&variant_iter, &dict_iter);
+  dbus_message_iter_close_container(&args, &variant_iter);
+
+  return msg;
+}
+
+static void append_player_properties(DBusMessageIter *dict_iter) {
+  append_entry(dict_iter, "PlaybackStatus", "s", [](DBusMessageIter *it) {
+    append_string(it, "Playing");
+  });
+  append_entry(dict_iter, "Volume", "d", [](DBusMessageIter *it) {
+    append_basic<double>(it, DBUS_TYPE_DOUBLE, 0.5);
+  });
+  append_entry(dict_iter, "Metadata", "a{sv}", [](DBusMessageIter *it) {
+    DBusMessageIter metadata_iter;
+    dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "{sv}",
+                                     &metadata_iter);
+    append_typical_metadata(&metadata_iter);
+    dbus_message_iter_close_container(it, &metadata_iter);
+  });
+  append_entry(dict_iter, "CanSeek", "b", [](DBusMessageIter *it) {
+    append_basic<dbus_bool_t>(it, DBUS_TYPE_BOOLEAN, TRUE);
+  });
+}
+
+// as some players send it: trackid as a string, extra keys of their own
+static void append_trackid_string(DBusMessageIter *dict_iter) {
+  append_entry(dict_iter, "mpris:trackid", "s", [](DBusMessageIter *it) {
+    append_string(it, "spotify:track:42");
+  });
+  append_entry(dict_iter, "mpris:length", "t", [](DBusMessageIter *it) {
+    append_basic<dbus_uint64_t>(it, DBUS_TYPE_UINT64, 215000000);
+  });
+  append_entry(dict_iter, "xesam:autoRating", "d", [](DBusMessageIter *it) {
+    append_basic<double>(it, DBUS_TYPE_DOUBLE, 0.3);
+  });
+  append_entry(dict_iter, "xesam:artist", "as", [](DBusMessageIter *it) {
+    append_strings(it, {"Artist"});
+  });
+  append_entry(dict_iter, "xesam:title", "s", [](DBusMessageIter *it) {
+    append_string(it, "Title");
+  });
+}
+
+static void append_many_artists(DBusMessageIter *dict_iter) {
+  std::vector<std::string> artists;
+
+  for (int i = 0; i < 10000; i++) {
+    artists.push_back("Artist " + std::to_string(i));
+  }
+  append_entry(dict_iter, "xesam:artist", "as", [&](DBusMessageIter *it) {
+    append_strings(it, artists);
+  });
+  append_entry(dict_iter, "xesam:albumArtist", "as",
+               [&](DBusMessageIter *it) { append_strings(it, artists); });
+}
+
+// cover art inlined as a data: URL, as browsers do
+static void append_long_urls(DBusMessageIter *dict_iter) {
+  std::string art = "data:image/png;base64," + std::string(256 * 1024, 'A');
+  std::string url =
+      "https://example.com/watch?v=" + std::string(64 * 1024, 'x');
+
+  append_entry(dict_iter, "mpris:artUrl", "s",
+               [&](DBusMessageIter *it) { append_string(it, art); });
+  append_entry(dict_iter, "xesam:url", "s",
+               [&](DBusMessageIter *it) { append_string(it, url); });
+  append_entry(dict_iter, "xesam:title", "s", [](DBusMessageIter *it) {
+    append_string(it, "Title");
+  });
+}
+
+static void append_wrong_types(DBusMessageIter *dict_iter) {
+  append_entry(dict_iter, "xesam:artist", "s", [](DBusMessageIter *it) {
+    append_string(it, "Artist");
+  });
+  append_entry(dict_iter, "xesam:albumArtist", "ai", [](DBusMessageIter *it) {
+    DBusMessageIter array_iter;
+    dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "i", &array_iter);
+    append_basic<dbus_int32_t>(&array_iter, DBUS_TYPE_INT32, 1);
+    dbus_message_iter_close_container(it, &array_iter);
+  });
+  append_entry(dict_iter, "xesam:title", "i", [](DBusMessageIter *it) {
+    append_basic<dbus_int32_t>(it, DBUS_TYPE_INT32, 42);
+  });
+  append_entry(dict_iter, "mpris:length", "s", [](DBusMessageIter *it) {
+    append_string(it, "3:35");
+  });
+  append_entry(dict_iter, "mpris:trackid", "x", [](DBusMessageIter *it) {
+    append_basic<dbus_int64_t>(it, DBUS_TYPE_INT64, 42);
+  });
+  append_entry(dict_iter, "mpris:artUrl", "as", [](DBusMessageIter *it) {
+    append_strings(it, {"a", "b"});
+  });
+  append_entry(dict_iter, "xesam:discNumber", "d", [](DBusMessageIter *it) {
+    append_basic<double>(it, DBUS_TYPE_DOUBLE, 1.0);
+  });
+  append_entry(dict_iter, "xesam:trackNumber", "u", [](DBusMessageIter *it) {
+    append_basic<dbus_uint32_t>(it, DBUS_TYPE_UINT32, 7);
+  });
+  append_entry(dict_iter, "xesam:userRating", "s", [](DBusMessageIter *it) {
+    append_string(it, "*****");
+  });
+}
+
+// values wrapped in one variant too many
+static void append_nested_variants(DBusMessageIter *dict_iter) {
+  append_entry(dict_iter, "xesam:title", "v", [](DBusMessageIter *it) {
+    DBusMessageIter inner_iter;
+    dbus_message_iter_open_container(it, DBUS_TYPE_VARIANT, "s", &inner_iter);
+    append_string(&inner_iter, "Title");
+    dbus_message_iter_close_container(it, &inner_iter);
+  });
+  append_entry(dict_iter, "xesam:artist", "v", [](DBusMessageIter *it) {
+    DBusMessageIter inner_iter;
+    dbus_message_iter_open_container(it, DBUS_TYPE_VARIANT, "as",
+                                     &inner_iter);
+    append_strings(&inner_iter, {"Artist"});
+    dbus_message_iter_close_container(it, &inner_iter);
+  });
+}
+
+static void append_unknown_keys(DBusMessageIter *dict_iter) {
+  for (int i = 0; i < 200; i++) {
+    std::string key = "x-player:field" + std::to_string(i);
+    append_entry(dict_iter, key.c_str(), "as", [](DBusMessageIter *it) {
+      append_strings(it, {"a", "b", "c"});
+    });
+  }
+  append_typical_metadata(dict_iter);
+}
+
+// A Get reply for ActivePlaylist: v holding (b(oss)), the flag sent as
+// flag_signature
+static DBusMessageHandle active_playlist_reply(const char *flag_signature,
+                                               const std::string &name) {
+  DBusMessageHandle msg = new_reply();
+  DBusMessageIter args;
+  DBusMessageIter variant_iter;
+  DBusMessageIter struct_iter;
+  DBusMessageIter playlist_iter;
+  std::string signature = std::string("(") + flag_signature + "(oss))";
+
+  dbus_message_iter_init_append(msg.get(), &args);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT,
+                                   signature.c_str(), &variant_iter);
+  dbus_message_iter_open_container(&variant_iter, DBUS_TYPE_STRUCT, nullptr,
+                                   &struct_iter);
+  if (*flag_signature == DBUS_TYPE_BOOLEAN) {
+    append_basic<dbus_bool_t>(&struct_iter, DBUS_TYPE_BOOLEAN, TRUE);
+  } else {
+    append_string(&struct_iter, "true");
+  }
+  dbus_message_iter_open_container(&struct_iter, DBUS_TYPE_STRUCT, nullptr,
+                                   &playlist_iter);
+  append_path(&playlist_iter, "/org/mpris/MediaPlayer2/Playlist/1");
+  append_string(&playlist_iter, name);
+  append_string(&playlist_iter, "");
+  dbus_message_iter_close_container(&struct_iter, &playlist_iter);
+  dbus_message_iter_close_container(&variant_iter, &struct_iter);
+  dbus_message_iter_close_container(&args, &variant_iter);
+
+  return msg;
+}
+
+void build_decode_corpus(std::vector<DBusDecodeCase> &corpus) {
+  corpus.clear();
+
+  corpus.push_back({"typical", metadata_reply(append_typical_metadata)});
+  corpus.push_back({"trackid-string", metadata_reply(append_trackid_string)});
+  corpus.push_back({"empty", metadata_reply([](DBusMessageIter *) {})});
+  corpus.push_back({"many-artists", metadata_reply(append_many_artists)});
+  corpus.push_back({"long-urls", metadata_reply(append_long_urls)});
+  corpus.push_back({"wrong-types", metadata_reply(append_wrong_types)});
+  corpus.push_back(
+      {"nested-variants", metadata_reply(append_nested_variants)});
+  corpus.push_back({"unknown-keys", metadata_reply(append_unknown_keys)});
+
+  // Metadata as something other than a{sv}
+  {
+    DBusMessageHandle msg = new_reply();
+    DBusMessageIter args;
+    DBusMessageIter variant_iter;
+
+    dbus_message_iter_init_append(msg.get(), &args);
+    dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "as",
+                                     &variant_iter);
+    append_strings(&variant_iter, {"xesam:title", "Title"});
+    dbus_message_iter_close_container(&args, &variant_iter);
+    corpus.push_back({"not-a-dict", std::move(msg)});
+  }
+
+  {
+    DBusMessageHandle msg = new_reply();
+    DBusMessageIter args;
+    DBusMessageIter dict_iter;
+
+    dbus_message_iter_init_append(msg.get(), &args);
+    dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}",
+                                     &dict_iter);
+    append_player_properties(&dict_iter);
+    dbus_message_iter_close_container(&args, &dict_iter);
+    corpus.push_back({"getall", std::move(msg)});
+  }
+
+  {
+    DBusMessageHandle msg(dbus_message_new_signal(
+        MprisMediaPlayer::PATH.c_str(), DBUS_INTERFACE_PROPERTIES,
+        "PropertiesChanged"));
+    DBusMessageIter args;
+    DBusMessageIter dict_iter;
+
+    dbus_message_set_serial(msg.get(), 2);
+    dbus_message_iter_init_append(msg.get(), &args);
+    append_string(&args, "org.mpris.MediaPlayer2.Player");
+    dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}",
+                                     &dict_iter);
+    append_player_properties(&dict_iter);
+    dbus_message_iter_close_container(&args, &dict_iter);
+    append_strings(&args, {});
+    corpus.push_back({"properties-changed", std::move(msg)});
+  }
+
+  corpus.push_back(
+      {"active-playlist", active_playlist_reply("b", "Favourites")});
+  // the flag as a string, as no player should send it
+  corpus.push_back(
+      {"playlist-bad-flag", active_playlist_reply("s", "Favourites")});
+}
+
+/*******************************************************************************
+ * Fuzzing
+ ******************************************************************************/
+
+namespace {
+// Hands out the fuzz input; zeros once it is used up
+struct FuzzBytes {
+  const uint8_t *data;
+  size_t size;
+
+  uint8_t byte() {
+    if (size == 0) {
+      return 0;
+    }
+    size--;
+    return *data++;
+  }
+
+  uint64_t number(int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+      value = (value << 8) | byte();
+    }
+    return value;
+  }
+
+  // libdbus refuses (and aborts on) strings that are not valid UTF-8
+  std::string text() {
+    std::string value(byte(), 'a');
+    for (char &c : value) {
+      c = 'a' + byte() % 26;
+    }
+    return value;
+  }
+};
+} // namespace
+
+static void append_fuzz_dict(FuzzBytes &in, DBusMessageIter *dict_iter,
+                             int depth);
+
+static void append_fuzz_value(FuzzBytes &in, DBusMessageIter *dict_iter,
+                              const char *key, int depth) {
+  switch (in.byte() % 15) {
+  case 0:
+    append_entry(dict_iter, key, "s", [&](DBusMessageIter *it) {
+      append_string(it, in.text());
+    });
+    break;
+  case 1:
+    append_entry(dict_iter, key, "o", [&](DBusMessageIter *it) {
+      std::string name = in.text();
+      append_path(it, name.empty() ? "/" : "/org/mpris/" + name);
+    });
+    break;
+  case 2:
+    append_entry(dict_iter, key, "as", [&](DBusMessageIter *it) {
+      std::vector<std::string> values(in.number(2) % 4096);
+      for (std::string &value : values) {
+        value = in.text();
+      }
+      append_strings(it, values);
+    });
+    break;
+  case 3:
+    append_entry(dict_iter, key, "ai", [&](DBusMessageIter *it) {
+      DBusMessageIter array_iter;
+      int count = in.byte();
+      dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "i", &array_iter);
+      for (int i = 0; i < count; i++) {
+        append_basic<dbus_int32_t>(&array_iter, DBUS_TYPE_INT32,
+                                   static_cast<dbus_int32_t>(in.number(4)));
+      }
+      dbus_message_iter_close_container(it, &array_iter);
+    });
+    break;
+  case 4:
+    append_entry(dict_iter, key, "i", [&](DBusMessageIter *it) {
+      append_basic<dbus_int32_t>(it, DBUS_TYPE_INT32,
+                                 static_cast<dbus_int32_t>(in.number(4)));
+    });
+    break;
+  case 5:
+    append_entry(dict_iter, key, "u", [&](DBusMessageIter *it) {
+      append_basic<dbus_uint32_t>(it, DBUS_TYPE_UINT32,
+                                  static_cast<dbus_uint32_t>(in.number(4)));
+    });
+    break;
+  case 6:
+    append_entry(dict_iter, key, "x", [&](DBusMessageIter *it) {
+      append_basic<dbus_int64_t>(it, DBUS_TYPE_INT64,
+                                 static_cast<dbus_int64_t>(in.number(8)));
+    });
+    break;
+  case 7:
+    append_entry(dict_iter, key, "t", [&](DBusMessageIter *it) {
+      append_basic<dbus_uint64_t>(it, DBUS_TYPE_UINT64, in.number(8));
+    });
+    break;
+  case 8:
+    append_entry(dict_iter, key, "d", [&](DBusMessageIter *it) {
+      uint64_t bits = in.number(8);
+      double value;
+      memcpy(&value, &bits, sizeof(value));
+      append_basic<double>(it, DBUS_TYPE_DOUBLE, value);
+    });
+    break;
+  case 9:
+    append_entry(dict_iter, key, "b", [&](DBusMessageIter *it) {
+      append_basic<dbus_bool_t>(it, DBUS_TYPE_BOOLEAN, in.byte() & 1);
+    });
+    break;
+  case 10:
+    append_entry(dict_iter, key, "y", [&](DBusMessageIter *it) {
+      append_basic<unsigned char>(it, DBUS_TYPE_BYTE, in.byte());
+    });
+    break;
+  case 11:
+    append_entry(dict_iter, key, "n", [&](DBusMessageIter *it) {
+      append_basic<dbus_int16_t>(it, DBUS_TYPE_INT16,
+                                 static_cast<dbus_int16_t>(in.number(2)));
+    });
+    break;
+  case 12:
+    append_entry(dict_iter, key, "v", [&](DBusMessageIter *it) {
+      DBusMessageIter inner_iter;
+      dbus_message_iter_open_container(it, DBUS_TYPE_VARIANT, "s",
+                                       &inner_iter);
+      append_string(&inner_iter, in.text());
+      dbus_message_iter_close_container(it, &inner_iter);
+    });
+    break;
+  case 13:
+    append_entry(dict_iter, key, "a{sv}", [&](DBusMessageIter *it) {
+      DBusMessageIter inner_iter;
+      dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "{sv}",
+                                       &inner_iter);
+      if (depth < 2) {
+        append_fuzz_dict(in, &inner_iter, depth + 1);
+      }
+      dbus_message_iter_close_container(it, &inner_iter);
+    });
+    break;
+  default:
+    append_entry(dict_iter, key, "(oss)", [&](DBusMessageIter *it) {
+      DBusMessageIter struct_iter;
+      dbus_message_iter_open_container(it, DBUS_TYPE_STRUCT, nullptr,
+                                       &struct_iter);
+      append_path(&struct_iter, "/org/mpris/playlist");
+      append_string(&struct_iter, in.text());
+      append_string(&struct_iter, in.text());
+      dbus_message_iter_close_container(it, &struct_iter);
+    });
+    break;
+  }
+}
+
+static void append_fuzz_dict(FuzzBytes &in, DBusMessageIter *dict_iter,
+                             int depth) {
+  static const size_t key_count =
+      sizeof(METADATA_KEYS) / sizeof(METADATA_KEYS[0]);
+  int count = in.byte() % 32;
+
+  for (int i = 0; i < count && in.size > 0; i++) {
+    append_fuzz_value(in, dict_iter, METADATA_KEYS[in.byte() % key_count],
+                      depth);
+  }
+}
+
+DBusMessageHandle build_fuzz_reply(const uint8_t *data, size_t size) {
+  FuzzBytes in = {data, size};
+  DBusMessageHandle msg = new_reply();
+  DBusMessageIter args;
+  DBusMessageIter outer_iter;
+  DBusMessageIter dict_iter;
+
+  dbus_message_iter_init_append(msg.get(), &args);
+
+  switch (in.byte() % 4) {
+  case 0: // Get Metadata
+    dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "a{sv}",
+                                     &outer_iter);
+    dbus_message_iter_open_container(&outer_iter, DBUS_TYPE_ARRAY, "{sv}",
+                                     &dict_iter);
+    append_fuzz_dict(in, &dict_iter, 0);
+    dbus_message_iter_close_container(&outer_iter, &dict_iter);
+    dbus_message_iter_close_container(&args, &outer_iter);
+    break;
+  case 1: // GetAll, its Metadata made up from the rest
+    dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}",
+                                     &dict_iter);
+    append_entry(&dict_iter, "Metadata", "a{sv}", [&](DBusMessageIter *it) {
+      DBusMessageIter metadata_iter;
+      dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "{sv}",
+                                       &metadata_iter);
+      append_fuzz_dict(in, &metadata_iter, 0);
+      dbus_message_iter_close_container(it, &metadata_iter);
+    });
+    append_fuzz_dict(in, &dict_iter, 1);
+    dbus_message_iter_close_container(&args, &dict_iter);
+    break;
+  case 2: // Get of any other property
+    switch (in.byte() % 6) {
+    case 0:
+      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "s",
+                                       &outer_iter);
+      append_string(&outer_iter, in.text());
+      break;
+    case 1:
+      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "x",
+                                       &outer_iter);
+      append_basic<dbus_int64_t>(&outer_iter, DBUS_TYPE_INT64,
+                                 static_cast<dbus_int64_t>(in.number(8)));
+      break;
+    case 2:
+      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "b",
+                                       &outer_iter);
+      append_basic<dbus_bool_t>(&outer_iter, DBUS_TYPE_BOOLEAN, in.byte() & 1);
+      break;
+    case 3:
+      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "i",
+                                       &outer_iter);
+      append_basic<dbus_int32_t>(&outer_iter, DBUS_TYPE_INT32,
+                                 static_cast<dbus_int32_t>(in.number(4)));
+      break;
+    case 4:
+      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "as",
+                                       &outer_iter);
+      append_strings(&outer_iter, {in.text(), in.text()});
+      break;
+    default: // ActivePlaylist
+      return active_playlist_reply((in.byte() & 1) ? "b" : "s", in.text());
+    }
+    dbus_message_iter_close_container(&args, &outer_iter);
+    break;
+  default: { // ListNames
+    std::vector<std::string> names(in.byte());
+    for (std::string &name : names) {
+      name = "org.mpris.MediaPlayer2." + in.text();
+    }
+    append_strings(&args, names);
+    break;
+  }
+  }
+
+  return msg;
+}
+
+/*******************************************************************************
+ * DBusDecoderHarness
+ ******************************************************************************/
+
+// Positions value_iter on the Metadata value of msg, if it has one
+static bool find_metadata(DBusMessage *msg, DBusMessageIter *value_iter) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+
+  if (!dbus_message_iter_init(msg, &args)) {
+    return false;
+  }
+  // PropertiesChanged starts with the interface name
+  if (dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_STRING) {
+    dbus_message_iter_next(&args);
+  }
+
+  if (dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_VARIANT) {
+    dbus_message_iter_recurse(&args, value_iter);
+    return true;
+  }
+
+  if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type(&args) != DBUS_TYPE_DICT_ENTRY) {
+    return false;
+  }
+
+  dbus_message_iter_recurse(&args, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entry_iter;
+    const char *key;
+
+    dbus_message_iter_recurse(&dict_iter, &entry_iter);
+    if (dbus_message_iter_get_arg_type(&entry_iter) == DBUS_TYPE_STRING) {
+      dbus_message_iter_get_basic(&entry_iter, &key);
+      dbus_message_iter_next(&entry_iter);
+      if (strcmp(key, "Metadata") == 0 &&
+          dbus_message_iter_get_arg_type(&entry_iter) == DBUS_TYPE_VARIANT) {
+        dbus_message_iter_recurse(&entry_iter, value_iter);
+        return true;
+      }
+    }
+    dbus_message_iter_next(&dict_iter);
+  }
+
+  return false;
+}
+
+size_t DBusDecoderHarness::decode(DBusMessage *msg, DBusMetadata &metadata) {
+  DBusMessageIter value_iter;
+  DBusMessageIter dict_iter;
+  size_t fields = 0;
+
+  if (!find_metadata(msg, &value_iter) ||
+      !DBusPropertyCodec<DBusMetadata>::read(&value_iter, metadata)) {
+    return 0;
+  }
+
+  dbus_message_iter_recurse(&value_iter, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    fields++;
+    dbus_message_iter_next(&dict_iter);
+  }
+
+  return fields;
+}
+
+namespace {
+struct NullBuffer : std::streambuf {
+  int overflow(int c) override { return c; }
+};
+} // namespace
+
+void DBusDecoderHarness::decode_all(DBusMessage *msg) {
+  static MprisMediaPlayer player;
+  static NullBuffer null_buffer;
+  DBusMetadata metadata = DBusMetadata();
+  DBusMessageIter args;
+
+  // the decoders report what they refuse, and print_dbus_variant() prints
+  std::streambuf *out = std::cout.rdbuf(&null_buffer);
+  std::streambuf *err = std::cerr.rdbuf(&null_buffer);
+  player.set_verbose(false);
+
+  decode(msg, metadata);
+
+  if (dbus_message_iter_init(msg, &args) &&
+      dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_VARIANT) {
+    DBusMessageIter variant_iter;
+    DBusPlaylist playlist;
+    bool flag;
+    int32_t int32_value;
+    int64_t int64_value;
+    double double_value;
+    std::string string_value;
+
+    player.read_reply(msg, DBUS_TYPE_BOOLEAN, &flag);
+    player.read_reply(msg, DBUS_TYPE_INT32, &int32_value);
+    player.read_reply(msg, DBUS_TYPE_INT64, &int64_value);
+    player.read_reply(msg, DBUS_TYPE_DOUBLE, &double_value);
+    player.read_reply(msg, DBUS_TYPE_STRING, &string_value);
+    player.read_reply(msg, DBUS_TYPE_ARRAY, &metadata);
+
+    dbus_message_iter_recurse(&args, &variant_iter);
+    player.read_active_playlist(&variant_iter, playlist);
+  } else {
+    std::vector<std::string> names;
+    player.read_reply(msg, DBUS_TYPE_ARRAY, &names);
+  }
+
+  for (bool more = dbus_message_iter_init(msg, &args); more;
+       more = dbus_message_iter_next(&args)) {
+    player.print_dbus_variant(&args);
+  }
+
+  // playlists, (oss), are only found inside the fuzzed dictionaries
+  DBusMessageIter value_iter;
+  if (find_metadata(msg, &value_iter) &&
+      dbus_message_iter_get_arg_type(&value_iter) == DBUS_TYPE_ARRAY) {
+    DBusMessageIter dict_iter;
+    dbus_message_iter_recurse(&value_iter, &dict_iter);
+    while (dbus_message_iter_get_arg_type(&dict_iter) ==
+           DBUS_TYPE_DICT_ENTRY) {
+      DBusMessageIter entry_iter;
+      DBusMessageIter variant_iter;
+      DBusPlaylist playlist;
+
+      dbus_message_iter_recurse(&dict_iter, &entry_iter);
+      dbus_message_iter_next(&entry_iter);
+      if (dbus_message_iter_get_arg_type(&entry_iter) == DBUS_TYPE_VARIANT) {
+        dbus_message_iter_recurse(&entry_iter, &variant_iter);
+        player.read_playlist(&variant_iter, playlist);
+      }
+      dbus_message_iter_next(&dict_iter);
+    }
+  }
+
+  std::cout.rdbuf(out);
+  std::cerr.rdbuf(err);
+}
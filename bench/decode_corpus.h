@@ -0,0 +1,41 @@
+#ifndef DECODE_CORPUS_H
+#define DECODE_CORPUS_H
+
+// Metadata replies for decode-bench and the decode fuzzer: well-formed ones
+// shaped like what common players send, and ones that are not (huge artist
+// lists, long URLs, values of the wrong type, nested variants). A few
+// ActivePlaylist replies go with them.
+
+#include <dbus/dbus.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dbus_handle.h"
+#include "mpris_media_player.h"
+
+struct DBusDecodeCase {
+  std::string name;
+  DBusMessageHandle msg;
+};
+
+void build_decode_corpus(std::vector<DBusDecodeCase> &corpus);
+
+// A reply built from arbitrary bytes: they pick the keys, the value types
+// and their contents, so the fuzzer reaches the decoder with well-formed
+// messages instead of mostly being turned away by libdbus' validation.
+DBusMessageHandle build_fuzz_reply(const uint8_t *data, size_t size);
+
+// Runs a message through the reply decoders of MprisMediaPlayer the way it
+// would be met: a Get reply (v), a GetAll reply (a{sv}), a
+// PropertiesChanged signal (sa{sv}as) or a ListNames reply (as).
+struct DBusDecoderHarness {
+  // Returns the number of Metadata entries decoded.
+  static size_t decode(DBusMessage *msg, DBusMetadata &metadata);
+  // Everything else that reads replies, including print_dbus_variant()
+  static void decode_all(DBusMessage *msg);
+};
+
+#endif /* DECODE_CORPUS_H */
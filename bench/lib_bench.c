@@ -0,0 +1,187 @@
+/*
+ * Cost of one action through libdbus-music against running the dbus-music
+ * executable for it, the way clients without the library have to:
+ *
+ *   library   one handle, opened once, runs COMMAND COUNT times
+ *   reopen    a handle opened and closed around every COMMAND: the bus
+ *             connect of each action, without the process start
+ *   spawn     "dbus-music batch -p PLAYER COMMAND" for every COMMAND
+ *
+ *   lib-bench [-n COUNT] [-c COMMAND] [-x DBUS_MUSIC] [PLAYER]
+ *
+ * COMMAND defaults to "get PlaybackStatus", which waits for the player's
+ * answer and changes nothing. Without PLAYER the first MPRIS player on the
+ * session bus is used. Written in C, so it also checks that dbus_music.h
+ * stays usable from C.
+ */
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbus_music.h"
+
+extern char **environ;
+
+#ifndef DBUS_MUSIC_CLI
+#define DBUS_MUSIC_CLI "dbus-music"
+#endif
+
+typedef int (*action_func)(const char *player, const char *command,
+                           void *context);
+
+static int64_t monotonic_us(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_us(const void *a, const void *b) {
+  int64_t lhs = *(const int64_t *)a;
+  int64_t rhs = *(const int64_t *)b;
+
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+static int run_library(const char *player, const char *command,
+                       void *context) {
+  (void)player;
+  return dbus_music_player_execute((dbus_music_player *)context, command,
+                                   NULL);
+}
+
+static int run_reopen(const char *player, const char *command,
+                      void *context) {
+  dbus_music_player *handle;
+  int status;
+
+  (void)context;
+  if (!(handle = dbus_music_player_open(player, &status))) {
+    return status;
+  }
+  status = dbus_music_player_execute(handle, command, NULL);
+  dbus_music_player_close(handle);
+
+  return status;
+}
+
+static int run_spawn(const char *player, const char *command,
+                     void *context) {
+  const char *cli = (const char *)context;
+  char *argv[] = {(char *)cli,    "batch", "-p", (char *)player,
+                  (char *)command, NULL};
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status;
+  int output;
+
+  /* batch prints one JSON line per command; only its exit status counts */
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  output = posix_spawnp(&pid, cli, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (output != 0) {
+    return DBUS_MUSIC_ERROR_IO;
+  }
+
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return DBUS_MUSIC_ERROR_DBUS;
+  }
+
+  return DBUS_MUSIC_OK;
+}
+
+static int measure(const char *label, action_func action, const char *player,
+                   const char *command, void *context, int count) {
+  int64_t *samples_us = malloc(count * sizeof(*samples_us));
+  int64_t total_us = 0;
+  int failures = 0;
+  int i;
+
+  if (!samples_us) {
+    return 1;
+  }
+
+  for (i = 0; i < count; i++) {
+    int64_t start_us = monotonic_us();
+    if (action(player, command, context) != DBUS_MUSIC_OK) {
+      failures++;
+    }
+    samples_us[i] = monotonic_us() - start_us;
+    total_us += samples_us[i];
+  }
+
+  qsort(samples_us, count, sizeof(*samples_us), compare_us);
+  printf("%-8s %5d actions %4d failed  mean %8.3f ms  p50 %8.3f ms"
+         "  p99 %8.3f ms\n",
+         label, count, failures, total_us / 1000.0 / count,
+         samples_us[count / 2] / 1000.0,
+         samples_us[(int)(0.99 * (count - 1))] / 1000.0);
+  free(samples_us);
+
+  return failures == count ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *command = "get PlaybackStatus";
+  const char *cli = DBUS_MUSIC_CLI;
+  dbus_music_player *handle;
+  char *player;
+  int count = 200;
+  int status;
+  int output = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:c:x:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    case 'c':
+      command = optarg;
+      break;
+    case 'x':
+      cli = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-n COUNT] [-c COMMAND] [-x DBUS_MUSIC] [PLAYER]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  if (dbus_music_abi_version() != DBUS_MUSIC_ABI_VERSION) {
+    fprintf(stderr, "built against ABI %d, running with %d\n",
+            DBUS_MUSIC_ABI_VERSION, dbus_music_abi_version());
+    return 1;
+  }
+
+  if (!(handle = dbus_music_player_open(optind < argc ? argv[optind] : NULL,
+                                        &status))) {
+    fprintf(stderr, "cannot open player: %s\n",
+            dbus_music_error_name(status));
+    return 1;
+  }
+  /* the full name, so every mode talks to the same player */
+  player = strdup(dbus_music_player_name(handle));
+
+  printf("%s, \"%s\", %d actions per mode\n", player, command, count);
+  output |= measure("library", run_library, player, command, handle, count);
+  /* handles share one connection; with none left open each reopen connects */
+  dbus_music_player_close(handle);
+  output |= measure("reopen", run_reopen, player, command, NULL, count);
+  output |= measure("spawn", run_spawn, player, command, (void *)cli, count);
+
+  free(player);
+
+  return output;
+}
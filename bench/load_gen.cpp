@@ -0,0 +1,877 @@
+// Load generator: N synthetic MPRIS players and M client processes on a
+// private bus, to find where MprisMediaPlayer and the bus stop keeping up.
+//
+//   load-gen [-n PLAYERS] [-m CLIENTS] [-e EVENTS] [-c CALLS] [-t SECONDS]
+//            [-p METADATA_PERCENT] [-b PAYLOAD_BYTES] [-d DEADLINE_MS]
+//            [-a ADDRESS] [--csv]
+//
+//   -e  PropertiesChanged signals per player per second (default 10)
+//   -c  GetAll round trips per client per second (default 1)
+//   -p  share of signals that replace the Metadata (default 20)
+//   -b  padding added to xesam:title, to mimic heavy payloads (default 0)
+//   -d  an event delivered later than this counts as late (default 100)
+//
+// The players all live in this process, one private connection each, and
+// stamp every signal with a per-player sequence number and its send time.
+// Client i is a separate process running one subscribed MprisMediaPlayer
+// for player i % N; it measures signal latency through process_events(),
+// sequence gaps, and the latency of refresh_capabilities(). Without -a a
+// dbus-daemon is started for the run.
+
+#include <dbus/dbus.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <poll.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "mpris_media_player.h"
+
+static const char *PLAYER_IFACE = "org.mpris.MediaPlayer2.Player";
+static const char *SEQ_KEY = "loadgen:seq";
+static const char *SENT_KEY = "loadgen:sent";
+
+static int64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static std::string player_name(int index) {
+  return "org.mpris.MediaPlayer2.load" + std::to_string(index);
+}
+
+struct Options {
+  int players = 10;
+  int clients = 10;
+  double event_rate = 10;
+  double call_rate = 1;
+  double duration_s = 10;
+  int metadata_percent = 20;
+  int payload_bytes = 0;
+  int deadline_ms = 100;
+  std::string address;
+  bool csv = false;
+};
+
+/*******************************************************************************
+ * Synthetic players
+ ******************************************************************************/
+
+struct Player {
+  std::string name;
+  DBusConnection *conn = nullptr;
+  int64_t seq = 0;
+  int64_t track = 0;
+  double volume = 1.0;
+  bool playing = false;
+};
+
+static void open_dict_entry(DBusMessageIter *dict, DBusMessageIter *entry,
+                            DBusMessageIter *variant, const char *key,
+                            const char *signature) {
+  dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, nullptr, entry);
+  dbus_message_iter_append_basic(entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container(entry, DBUS_TYPE_VARIANT, signature,
+                                   variant);
+}
+
+static void close_dict_entry(DBusMessageIter *dict, DBusMessageIter *entry,
+                             DBusMessageIter *variant) {
+  dbus_message_iter_close_container(entry, variant);
+  dbus_message_iter_close_container(dict, entry);
+}
+
+static void append_entry(DBusMessageIter *dict, const char *key, int type,
+                         const void *value) {
+  DBusMessageIter entry;
+  DBusMessageIter variant;
+  char signature[2] = {static_cast<char>(type), '\0'};
+
+  open_dict_entry(dict, &entry, &variant, key, signature);
+  dbus_message_iter_append_basic(&variant, type, value);
+  close_dict_entry(dict, &entry, &variant);
+}
+
+static void append_metadata(DBusMessageIter *dict, const Player &player,
+                            const std::string &padding) {
+  DBusMessageIter entry;
+  DBusMessageIter variant;
+  DBusMessageIter metadata;
+  DBusMessageIter artists;
+  std::string track_id = "/org/mpris/MediaPlayer2/load/track" +
+                         std::to_string(player.track);
+  std::string title = "Track " + std::to_string(player.track) + padding;
+  const char *track_id_cstr = track_id.c_str();
+  const char *title_cstr = title.c_str();
+  const char *artist = "Load Generator";
+  dbus_int64_t length = 180000000;
+
+  open_dict_entry(dict, &entry, &variant, "Metadata", "a{sv}");
+  dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "{sv}",
+                                   &metadata);
+  append_entry(&metadata, "mpris:trackid", DBUS_TYPE_OBJECT_PATH,
+               &track_id_cstr);
+  append_entry(&metadata, "mpris:length", DBUS_TYPE_INT64, &length);
+  append_entry(&metadata, "xesam:title", DBUS_TYPE_STRING, &title_cstr);
+  {
+    DBusMessageIter artist_entry;
+    DBusMessageIter artist_variant;
+    open_dict_entry(&metadata, &artist_entry, &artist_variant, "xesam:artist",
+                    "as");
+    dbus_message_iter_open_container(&artist_variant, DBUS_TYPE_ARRAY, "s",
+                                     &artists);
+    dbus_message_iter_append_basic(&artists, DBUS_TYPE_STRING, &artist);
+    dbus_message_iter_close_container(&artist_variant, &artists);
+    close_dict_entry(&metadata, &artist_entry, &artist_variant);
+  }
+  dbus_message_iter_close_container(&variant, &metadata);
+  close_dict_entry(dict, &entry, &variant);
+}
+
+static void append_player_properties(DBusMessageIter *dict,
+                                     const Player &player) {
+  const char *can[] = {"CanControl", "CanGoNext", "CanGoPrevious",
+                       "CanPause",   "CanPlay",   "CanSeek"};
+  const char *status = player.playing ? "Playing" : "Paused";
+  dbus_bool_t yes = true;
+  dbus_int64_t position = 0;
+  double rate = 1.0;
+
+  for (const char *name : can) {
+    append_entry(dict, name, DBUS_TYPE_BOOLEAN, &yes);
+  }
+  append_entry(dict, "PlaybackStatus", DBUS_TYPE_STRING, &status);
+  append_entry(dict, "Volume", DBUS_TYPE_DOUBLE, &player.volume);
+  append_entry(dict, "Rate", DBUS_TYPE_DOUBLE, &rate);
+  append_entry(dict, "Position", DBUS_TYPE_INT64, &position);
+}
+
+static void emit_change(Player &player, bool metadata,
+                        const std::string &padding) {
+  DBusMessage *msg = dbus_message_new_signal(
+      "/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties",
+      "PropertiesChanged");
+  DBusMessageIter args;
+  DBusMessageIter dict;
+  DBusMessageIter invalidated;
+  dbus_int64_t seq = ++player.seq;
+  dbus_int64_t sent;
+
+  dbus_message_iter_init_append(msg, &args);
+  dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &PLAYER_IFACE);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}", &dict);
+
+  if (metadata) {
+    player.track++;
+    append_metadata(&dict, player, padding);
+  } else if (seq % 2) {
+    const char *status;
+    player.playing = !player.playing;
+    status = player.playing ? "Playing" : "Paused";
+    append_entry(&dict, "PlaybackStatus", DBUS_TYPE_STRING, &status);
+  } else {
+    player.volume = (seq % 100) / 100.0;
+    append_entry(&dict, "Volume", DBUS_TYPE_DOUBLE, &player.volume);
+  }
+
+  append_entry(&dict, SEQ_KEY, DBUS_TYPE_INT64, &seq);
+  sent = monotonic_us();
+  append_entry(&dict, SENT_KEY, DBUS_TYPE_INT64, &sent);
+  dbus_message_iter_close_container(&args, &dict);
+
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "s", &invalidated);
+  dbus_message_iter_close_container(&args, &invalidated);
+
+  dbus_connection_send(player.conn, msg, nullptr);
+  dbus_message_unref(msg);
+}
+
+static void answer_call(Player &player, DBusMessage *call,
+                        const std::string &padding) {
+  DBusMessage *reply = nullptr;
+  DBusMessageIter args;
+  DBusMessageIter out;
+  DBusMessageIter dict;
+  const char *iface = dbus_message_get_interface(call);
+  const char *member = dbus_message_get_member(call);
+  const char *requested = "";
+
+  if (iface && strcmp(iface, "org.freedesktop.DBus.Properties") == 0 &&
+      dbus_message_iter_init(call, &args) &&
+      dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_STRING) {
+    dbus_message_iter_get_basic(&args, &requested);
+  }
+
+  if (member && strcmp(member, "GetAll") == 0 &&
+      strcmp(requested, PLAYER_IFACE) == 0) {
+    reply = dbus_message_new_method_return(call);
+    dbus_message_iter_init_append(reply, &out);
+    dbus_message_iter_open_container(&out, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_player_properties(&dict, player);
+    append_metadata(&dict, player, padding);
+    dbus_message_iter_close_container(&out, &dict);
+  } else if (member && strcmp(member, "Get") == 0 &&
+             strcmp(requested, PLAYER_IFACE) == 0) {
+    // every numeric property is answered with the volume; enough for load
+    DBusMessageIter variant;
+    reply = dbus_message_new_method_return(call);
+    dbus_message_iter_init_append(reply, &out);
+    dbus_message_iter_open_container(&out, DBUS_TYPE_VARIANT, "d", &variant);
+    dbus_message_iter_append_basic(&variant, DBUS_TYPE_DOUBLE, &player.volume);
+    dbus_message_iter_close_container(&out, &variant);
+  } else if (iface && strcmp(iface, PLAYER_IFACE) == 0) {
+    reply = dbus_message_new_method_return(call);
+  } else {
+    reply = dbus_message_new_error(call, DBUS_ERROR_UNKNOWN_METHOD,
+                                   "not implemented by load-gen");
+  }
+
+  if (!dbus_message_get_no_reply(call)) {
+    dbus_connection_send(player.conn, reply, nullptr);
+  }
+  dbus_message_unref(reply);
+}
+
+/*******************************************************************************
+ * Clients
+ ******************************************************************************/
+
+struct ClientReport {
+  int64_t first_seq;
+  int64_t last_seq;
+  int64_t received;
+  int64_t late;
+  int64_t calls;
+  int64_t call_failures;
+  int64_t cpu_us;
+  int64_t max_rss_kb;
+  int64_t event_samples;
+  int64_t call_samples;
+};
+
+struct ClientState {
+  ClientReport report;
+  // the player's unique name; the library subscribes to every player's
+  // signals on the connection
+  std::string owner;
+  int64_t deadline_us;
+  std::vector<int64_t> event_latencies;
+  std::vector<int64_t> call_latencies;
+};
+
+static volatile int client_quit = 0;
+
+static void handle_client_quit(int) { client_quit = 1; }
+
+static bool read_int64_entry(DBusMessageIter *variant, int64_t &value) {
+  dbus_int64_t v;
+
+  if (dbus_message_iter_get_arg_type(variant) != DBUS_TYPE_INT64) {
+    return false;
+  }
+  dbus_message_iter_get_basic(variant, &v);
+  value = v;
+  return true;
+}
+
+// Sits next to the library's own filter on the shared connection, so it
+// sees each signal at the moment process_events() dispatches it
+static DBusHandlerResult measure_filter(DBusConnection * /* connection */,
+                                        DBusMessage *msg, void *user_data) {
+  ClientState *state = static_cast<ClientState *>(user_data);
+  int64_t now = monotonic_us();
+  DBusMessageIter args;
+  DBusMessageIter dict;
+  int64_t seq = -1;
+  int64_t sent = -1;
+
+  if (!dbus_message_is_signal(msg, "org.freedesktop.DBus.Properties",
+                              "PropertiesChanged") ||
+      !dbus_message_has_signature(msg, "sa{sv}as") ||
+      !dbus_message_has_sender(msg, state->owner.c_str())) {
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict);
+  while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entry;
+    DBusMessageIter variant;
+    const char *key;
+
+    dbus_message_iter_recurse(&dict, &entry);
+    dbus_message_iter_get_basic(&entry, &key);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_recurse(&entry, &variant);
+    if (strcmp(key, SEQ_KEY) == 0) {
+      read_int64_entry(&variant, seq);
+    } else if (strcmp(key, SENT_KEY) == 0) {
+      read_int64_entry(&variant, sent);
+    }
+    dbus_message_iter_next(&dict);
+  }
+
+  if (seq < 0 || sent < 0) {
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  ClientReport &report = state->report;
+  if (report.first_seq == 0) {
+    report.first_seq = seq;
+  }
+  report.last_seq = seq;
+  report.received++;
+  if (now - sent > state->deadline_us) {
+    report.late++;
+  }
+  state->event_latencies.push_back(now - sent);
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static std::string get_name_owner(DBusConnection *conn,
+                                  const std::string &name) {
+  DBusMessage *msg = dbus_message_new_method_call(
+      "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+      "GetNameOwner");
+  const char *name_cstr = name.c_str();
+  const char *owner = "";
+  std::string output;
+
+  dbus_message_append_args(msg, DBUS_TYPE_STRING, &name_cstr,
+                           DBUS_TYPE_INVALID);
+  DBusMessage *reply =
+      dbus_connection_send_with_reply_and_block(conn, msg, -1, nullptr);
+  dbus_message_unref(msg);
+  if (reply) {
+    dbus_message_get_args(reply, nullptr, DBUS_TYPE_STRING, &owner,
+                          DBUS_TYPE_INVALID);
+    output = owner;
+    dbus_message_unref(reply);
+  }
+  return output;
+}
+
+static void write_all(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+  char *p = static_cast<char *>(data);
+
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static int run_client(const Options &options, int index, int report_fd,
+                      int go_fd) {
+  ClientState state;
+  MprisMediaPlayer mmp(player_name(index % options.players));
+  DBusRequestPolicy policy;
+  DBusError err;
+  char ready = 1;
+  char go;
+  struct rusage usage;
+
+  memset(&state.report, 0, sizeof(state.report));
+  state.deadline_us = options.deadline_ms * 1000;
+  state.event_latencies.reserve(
+      static_cast<size_t>(options.event_rate * options.duration_s * 1.1));
+
+  signal(SIGTERM, handle_client_quit);
+
+  // no retries: a slow answer should show up as latency, not be hidden
+  policy.max_retries = 0;
+  mmp.set_request_policy(policy);
+  mmp.set_verbose(false);
+  if (mmp.subscribe() != ERROR_NONE) {
+    fprintf(stderr, "client %d: subscribe failed\n", index);
+    return 1;
+  }
+
+  dbus_error_init(&err);
+  DBusConnection *conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+  dbus_connection_add_filter(conn, measure_filter, &state, nullptr);
+
+  write_all(report_fd, &ready, 1);
+  // the parent closes the go pipe once every client is subscribed
+  if (read(go_fd, &go, 1) < 0) {
+    return 1;
+  }
+  // the players claim their names after the clients were forked
+  state.owner = get_name_owner(conn, player_name(index % options.players));
+
+  int64_t call_interval =
+      options.call_rate > 0 ? static_cast<int64_t>(1e6 / options.call_rate)
+                            : 0;
+  // spread the clients' calls over the interval
+  int64_t next_call =
+      monotonic_us() +
+      (call_interval ? (call_interval * index / options.clients) : 0);
+
+  while (!client_quit) {
+    int64_t now = monotonic_us();
+    int timeout_ms = 50;
+
+    if (call_interval && now >= next_call) {
+      int64_t start = monotonic_us();
+      int output = mmp.refresh_capabilities();
+      state.call_latencies.push_back(monotonic_us() - start);
+      state.report.calls++;
+      if (output != ERROR_NONE) {
+        state.report.call_failures++;
+      }
+      next_call += call_interval;
+      continue;
+    }
+    if (call_interval) {
+      timeout_ms = static_cast<int>(
+          std::min<int64_t>(timeout_ms, (next_call - now) / 1000 + 1));
+    }
+
+    if (mmp.process_events(timeout_ms) != ERROR_NONE) {
+      break;
+    }
+  }
+
+  dbus_connection_remove_filter(conn, measure_filter, &state);
+  dbus_connection_unref(conn);
+
+  getrusage(RUSAGE_SELF, &usage);
+  state.report.cpu_us =
+      usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec +
+      usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+  state.report.max_rss_kb = usage.ru_maxrss;
+  state.report.event_samples = state.event_latencies.size();
+  state.report.call_samples = state.call_latencies.size();
+
+  write_all(report_fd, &state.report, sizeof(state.report));
+  write_all(report_fd, state.event_latencies.data(),
+            state.event_latencies.size() * sizeof(int64_t));
+  write_all(report_fd, state.call_latencies.data(),
+            state.call_latencies.size() * sizeof(int64_t));
+
+  return 0;
+}
+
+/*******************************************************************************
+ * Driver
+ ******************************************************************************/
+
+static pid_t start_bus(std::string &address) {
+  int fds[2];
+  char buf[512];
+  ssize_t n;
+
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::string print_address = "--print-address=" + std::to_string(fds[1]);
+    close(fds[0]);
+    execlp("dbus-daemon", "dbus-daemon", "--session", "--nofork",
+           print_address.c_str(), static_cast<char *>(nullptr));
+    perror("dbus-daemon");
+    _exit(127);
+  }
+  close(fds[1]);
+
+  n = read(fds[0], buf, sizeof(buf) - 1);
+  close(fds[0]);
+  if (n <= 0) {
+    return -1;
+  }
+  buf[n] = '\0';
+  address = buf;
+  address.erase(address.find_last_not_of("\n") + 1);
+
+  return pid;
+}
+
+// utime + stime in microseconds and peak RSS in KiB of another process
+static bool process_usage(pid_t pid, int64_t &cpu_us, int64_t &max_rss_kb) {
+  std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+  std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  long ticks = sysconf(_SC_CLK_TCK);
+
+  if (!stat || !std::getline(stat, line)) {
+    return false;
+  }
+  // fields after the parenthesised command name; utime and stime are the
+  // 14th and 15th overall
+  size_t pos = line.rfind(')');
+  std::vector<std::string> fields;
+  size_t start = pos + 2;
+  while (start < line.size()) {
+    size_t end = line.find(' ', start);
+    fields.push_back(line.substr(start, end - start));
+    if (end == std::string::npos) {
+      break;
+    }
+    start = end + 1;
+  }
+  if (fields.size() < 13) {
+    return false;
+  }
+  cpu_us = (atoll(fields[11].c_str()) + atoll(fields[12].c_str())) *
+           1000000LL / ticks;
+
+  max_rss_kb = 0;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      max_rss_kb = atoll(line.c_str() + 6);
+    }
+  }
+
+  return true;
+}
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)];
+}
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-n PLAYERS] [-m CLIENTS] [-e EVENTS] [-c CALLS] "
+          "[-t SECONDS]\n"
+          "          [-p METADATA_PERCENT] [-b PAYLOAD_BYTES] "
+          "[-d DEADLINE_MS] [-a ADDRESS] [--csv]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  std::vector<Player> players;
+  std::vector<pid_t> clients;
+  std::vector<int> report_fds;
+  int go_fds[2];
+  pid_t bus = -1;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "-n") == 0 && has_value) {
+      options.players = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0 && has_value) {
+      options.clients = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-e") == 0 && has_value) {
+      options.event_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0 && has_value) {
+      options.call_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0 && has_value) {
+      options.duration_s = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-p") == 0 && has_value) {
+      options.metadata_percent = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-b") == 0 && has_value) {
+      options.payload_bytes = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0 && has_value) {
+      options.deadline_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-a") == 0 && has_value) {
+      options.address = argv[++i];
+    } else if (strcmp(argv[i], "--csv") == 0) {
+      options.csv = true;
+    } else {
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (options.players < 1 || options.clients < 0 || options.event_rate < 0 ||
+      options.duration_s <= 0) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  if (options.address.empty() && (bus = start_bus(options.address)) < 0) {
+    fprintf(stderr, "cannot start dbus-daemon\n");
+    return 1;
+  }
+  setenv("DBUS_SESSION_BUS_ADDRESS", options.address.c_str(), 1);
+  signal(SIGPIPE, SIG_IGN);
+
+  // clients first, so none of them inherits a player connection
+  if (pipe(go_fds) != 0) {
+    perror("pipe");
+    return 1;
+  }
+  for (int i = 0; i < options.clients; i++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      close(go_fds[1]);
+      _exit(run_client(options, i, fds[1], go_fds[0]));
+    }
+    close(fds[1]);
+    clients.push_back(pid);
+    report_fds.push_back(fds[0]);
+  }
+  close(go_fds[0]);
+
+  DBusError err;
+  dbus_error_init(&err);
+  for (int i = 0; i < options.players; i++) {
+    Player player;
+    player.name = player_name(i);
+    player.conn = dbus_connection_open_private(options.address.c_str(), &err);
+    if (!player.conn || !dbus_bus_register(player.conn, &err) ||
+        dbus_bus_request_name(player.conn, player.name.c_str(),
+                              DBUS_NAME_FLAG_DO_NOT_QUEUE, &err) !=
+            DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+      fprintf(stderr, "player %d: %s\n", i,
+              dbus_error_is_set(&err) ? err.message : "name taken");
+      return 1;
+    }
+    dbus_connection_set_exit_on_disconnect(player.conn, false);
+    players.push_back(player);
+  }
+
+  for (size_t i = 0; i < report_fds.size(); i++) {
+    char ready;
+    if (!read_all(report_fds[i], &ready, 1)) {
+      fprintf(stderr, "client %zu did not start\n", i);
+      return 1;
+    }
+  }
+
+  std::vector<struct pollfd> fds(players.size());
+  for (size_t i = 0; i < players.size(); i++) {
+    int fd = -1;
+    dbus_connection_get_unix_fd(players[i].conn, &fd);
+    fds[i].fd = fd;
+    fds[i].events = POLLIN;
+  }
+
+  std::string padding(options.payload_bytes, 'x');
+  double total_rate = options.event_rate * options.players;
+  int64_t start_us = monotonic_us();
+  int64_t end_us = start_us + static_cast<int64_t>(options.duration_s * 1e6);
+  int64_t stop_us = end_us + 1000000; // grace period for stragglers
+  int64_t emitted = 0;
+  std::vector<int64_t> emit_lag;
+  std::vector<bool> dirty(players.size(), false);
+
+  close(go_fds[1]);
+
+  while (true) {
+    int64_t now = monotonic_us();
+    int64_t wake_us = now + 10000;
+
+    if (now >= stop_us) {
+      break;
+    }
+
+    // emit everything that is due, round-robin over the players
+    while (total_rate > 0 && now < end_us) {
+      int64_t due = start_us + static_cast<int64_t>(emitted * 1e6 / total_rate);
+      if (due > now) {
+        wake_us = std::min(wake_us, due);
+        break;
+      }
+      size_t index = emitted % players.size();
+      bool metadata =
+          static_cast<int>((emitted * 7919) % 100) < options.metadata_percent;
+      emit_change(players[index], metadata, padding);
+      emit_lag.push_back(now - due);
+      dirty[index] = true;
+      emitted++;
+    }
+
+    for (size_t i = 0; i < players.size(); i++) {
+      if (dirty[i]) {
+        dbus_connection_flush(players[i].conn);
+        dirty[i] = false;
+      }
+    }
+
+    int timeout_ms =
+        static_cast<int>(std::max<int64_t>(0, wake_us - monotonic_us()) / 1000);
+    if (poll(fds.data(), fds.size(), timeout_ms) <= 0) {
+      continue;
+    }
+
+    for (size_t i = 0; i < players.size(); i++) {
+      DBusMessage *msg;
+      if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      dbus_connection_read_write(players[i].conn, 0);
+      while ((msg = dbus_connection_pop_message(players[i].conn))) {
+        if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+          answer_call(players[i], msg, padding);
+        }
+        dbus_message_unref(msg);
+      }
+      dbus_connection_flush(players[i].conn);
+    }
+  }
+  double elapsed_s = (monotonic_us() - start_us) / 1e6;
+
+  // collect the client reports
+  std::vector<int64_t> event_latencies;
+  std::vector<int64_t> call_latencies;
+  int64_t expected = 0;
+  int64_t received = 0;
+  int64_t late = 0;
+  int64_t calls = 0;
+  int64_t call_failures = 0;
+  int64_t client_cpu_us = 0;
+  int64_t client_rss_max = 0;
+  int64_t client_rss_total = 0;
+  int reports = 0;
+
+  for (pid_t pid : clients) {
+    kill(pid, SIGTERM);
+  }
+  for (size_t i = 0; i < clients.size(); i++) {
+    ClientReport report;
+    const Player &player = players[i % players.size()];
+
+    if (!read_all(report_fds[i], &report, sizeof(report))) {
+      // a client that died takes all of its player's events with it
+      expected += player.seq;
+      continue;
+    }
+    size_t offset = event_latencies.size();
+    event_latencies.resize(offset + report.event_samples);
+    read_all(report_fds[i], event_latencies.data() + offset,
+             report.event_samples * sizeof(int64_t));
+    offset = call_latencies.size();
+    call_latencies.resize(offset + report.call_samples);
+    read_all(report_fds[i], call_latencies.data() + offset,
+             report.call_samples * sizeof(int64_t));
+    close(report_fds[i]);
+
+    // everything the player sent from the client's first event on
+    expected += player.seq - (report.first_seq ? report.first_seq - 1 : 0);
+    received += report.received;
+    late += report.late;
+    calls += report.calls;
+    call_failures += report.call_failures;
+    client_cpu_us += report.cpu_us;
+    client_rss_max = std::max(client_rss_max, report.max_rss_kb);
+    client_rss_total += report.max_rss_kb;
+    reports++;
+  }
+  for (pid_t pid : clients) {
+    waitpid(pid, nullptr, 0);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  int64_t player_cpu_us =
+      usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec +
+      usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+  int64_t bus_cpu_us = 0;
+  int64_t bus_rss_kb = 0;
+  if (bus > 0) {
+    process_usage(bus, bus_cpu_us, bus_rss_kb);
+  }
+
+  std::sort(event_latencies.begin(), event_latencies.end());
+  std::sort(call_latencies.begin(), call_latencies.end());
+  std::sort(emit_lag.begin(), emit_lag.end());
+  int64_t dropped = std::max<int64_t>(0, expected - received);
+
+  if (options.csv) {
+    printf("players,clients,event_rate,call_rate,emitted,delivered,dropped,"
+           "late,ev_p50_us,ev_p99_us,ev_max_us,calls,call_failures,"
+           "call_p50_us,call_p99_us,player_cpu_s,client_cpu_s,bus_cpu_s,"
+           "client_rss_max_kb,bus_rss_kb\n");
+    printf("%d,%d,%g,%g,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,"
+           "%lld,%.3f,%.3f,%.3f,%lld,%lld\n",
+           options.players, options.clients, options.event_rate,
+           options.call_rate, (long long)emitted, (long long)received,
+           (long long)dropped, (long long)late,
+           (long long)percentile(event_latencies, 0.50),
+           (long long)percentile(event_latencies, 0.99),
+           (long long)(event_latencies.empty() ? 0 : event_latencies.back()),
+           (long long)calls, (long long)call_failures,
+           (long long)percentile(call_latencies, 0.50),
+           (long long)percentile(call_latencies, 0.99), player_cpu_us / 1e6,
+           client_cpu_us / 1e6, bus_cpu_us / 1e6, (long long)client_rss_max,
+           (long long)bus_rss_kb);
+  } else {
+    printf("players %d, clients %d (%d reported), %.1f s\n", options.players,
+           options.clients, reports, elapsed_s);
+    printf("emitted:       %lld signals (%.0f/s), emit lag p99 %lld us\n",
+           (long long)emitted, emitted / options.duration_s,
+           (long long)percentile(emit_lag, 0.99));
+    printf("delivered:     %lld of %lld, dropped %lld, late %lld (> %d ms)\n",
+           (long long)received, (long long)expected, (long long)dropped,
+           (long long)late, options.deadline_ms);
+    printf("event latency: p50 %lld  p90 %lld  p99 %lld  p99.9 %lld  max "
+           "%lld us\n",
+           (long long)percentile(event_latencies, 0.50),
+           (long long)percentile(event_latencies, 0.90),
+           (long long)percentile(event_latencies, 0.99),
+           (long long)percentile(event_latencies, 0.999),
+           (long long)(event_latencies.empty() ? 0 : event_latencies.back()));
+    printf("calls:         %lld, failed %lld, latency p50 %lld  p99 %lld  "
+           "max %lld us\n",
+           (long long)calls, (long long)call_failures,
+           (long long)percentile(call_latencies, 0.50),
+           (long long)percentile(call_latencies, 0.99),
+           (long long)(call_latencies.empty() ? 0 : call_latencies.back()));
+    printf("cpu:           players %.2f s, clients %.2f s (%.3f s each), "
+           "bus %.2f s\n",
+           player_cpu_us / 1e6, client_cpu_us / 1e6,
+           reports ? client_cpu_us / 1e6 / reports : 0.0, bus_cpu_us / 1e6);
+    printf("memory:        client rss avg %lld max %lld KiB, bus %lld KiB\n",
+           (long long)(reports ? client_rss_total / reports : 0),
+           (long long)client_rss_max, (long long)bus_rss_kb);
+  }
+
+  for (Player &player : players) {
+    dbus_connection_close(player.conn);
+    dbus_connection_unref(player.conn);
+  }
+  if (bus > 0) {
+    kill(bus, SIGTERM);
+    waitpid(bus, nullptr, 0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,169 @@
+// Latency of control commands while players are being polled. Every player
+// gets background reads (refresh, get Metadata, get Position) every 20 ms,
+// as a UI keeping itself up to date would, and COMMAND every INTERVAL ms.
+// The run is made twice through MprisRequestScheduler:
+//
+//   shared    COMMAND and the polling in one class, as if on one path
+//   priority  COMMAND as PriorityInteractive, the polling as background
+//
+//   sched-bench [-t SECONDS] [-i INTERVAL_MS] [-c COMMAND] [PLAYER...]
+//
+// COMMAND defaults to "seek 0", which leaves players where they are. Without
+// PLAYERs every MPRIS player on the session bus is used. Slow players (or a
+// busy bus) are where the two runs differ.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "mpris_media_player.h"
+#include "mpris_scheduler.h"
+
+static const char *POLL_COMMANDS[] = {"refresh", "get Metadata",
+                                      "get Position"};
+static const int POLL_INTERVAL_MS = 20;
+
+static int64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct Probe {
+  std::vector<int64_t> *latencies_us;
+  int *failures;
+  int64_t submitted_us;
+};
+
+static void command_done(const DBusBatchResult &result, void *user_data) {
+  Probe *probe = static_cast<Probe *>(user_data);
+
+  probe->latencies_us->push_back(monotonic_us() - probe->submitted_us);
+  if (result.status != ERROR_NONE) {
+    (*probe->failures)++;
+  }
+  delete probe;
+}
+
+static int64_t percentile(std::vector<int64_t> &samples, double fraction) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(fraction * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+static int run(const char *label, bool prioritized,
+               const std::vector<std::string> &players,
+               const std::string &command, int seconds, int interval_ms) {
+  DBusRequestPriorityType command_priority =
+      prioritized ? PriorityInteractive : PriorityNormal;
+  DBusRequestPriorityType poll_priority =
+      prioritized ? PriorityBackground : PriorityNormal;
+  MprisRequestScheduler scheduler;
+  std::vector<int64_t> latencies_us;
+  int failures = 0;
+  int64_t end_us = monotonic_us() + seconds * 1000000LL;
+  int64_t next_command_us = 0;
+
+  if (scheduler.start() != ERROR_NONE) {
+    return 1;
+  }
+
+  while (monotonic_us() < end_us) {
+    int64_t now_us = monotonic_us();
+
+    for (const std::string &player : players) {
+      for (const char *poll : POLL_COMMANDS) {
+        scheduler.submit(player, poll, poll_priority);
+      }
+      if (now_us >= next_command_us) {
+        Probe *probe = new Probe{&latencies_us, &failures, now_us};
+        if (scheduler.submit(player, command, command_priority, command_done,
+                             probe) != ERROR_NONE) {
+          delete probe;
+          fprintf(stderr, "%s: \"%s\" refused\n", player.c_str(),
+                  command.c_str());
+          return 1;
+        }
+      }
+    }
+    if (now_us >= next_command_us) {
+      next_command_us = now_us + interval_ms * 1000LL;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(POLL_INTERVAL_MS));
+  }
+
+  scheduler.wait_idle();
+  DBusSchedulerStats polls = scheduler.get_stats(poll_priority);
+  scheduler.stop();
+
+  size_t count = latencies_us.size();
+  printf("%-9s %5zu commands %4d failed  p50 %8.2f ms  p99 %8.2f ms"
+         "  max %8.2f ms\n",
+         label, count, failures, percentile(latencies_us, 0.5) / 1000.0,
+         percentile(latencies_us, 0.99) / 1000.0,
+         percentile(latencies_us, 1.0) / 1000.0);
+  printf("          polls: %llu sent, %llu coalesced, %llu dropped\n",
+         static_cast<unsigned long long>(polls.sent),
+         static_cast<unsigned long long>(polls.coalesced),
+         static_cast<unsigned long long>(polls.dropped));
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> players;
+  std::string command = "seek 0";
+  int seconds = 5;
+  int interval_ms = 100;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:i:c:h")) != -1) {
+    switch (opt) {
+    case 't':
+      seconds = std::max(1, atoi(optarg));
+      break;
+    case 'i':
+      interval_ms = std::max(1, atoi(optarg));
+      break;
+    case 'c':
+      command = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-t SECONDS] [-i INTERVAL_MS] [-c COMMAND] "
+              "[PLAYER...]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  for (int i = optind; i < argc; i++) {
+    players.push_back(argv[i]);
+  }
+  if (players.empty()) {
+    MprisMediaPlayer lookup;
+    lookup.set_verbose(false);
+    if (lookup.get_player_list(players) != ERROR_NONE || players.empty()) {
+      fprintf(stderr, "no MPRIS players on the session bus\n");
+      return 1;
+    }
+  }
+
+  printf("%zu players, \"%s\" every %d ms, %d s per run\n", players.size(),
+         command.c_str(), interval_ms, seconds);
+  if (run("shared", false, players, command, seconds, interval_ms) != 0 ||
+      run("priority", true, players, command, seconds, interval_ms) != 0) {
+    return 1;
+  }
+
+  return 0;
+}
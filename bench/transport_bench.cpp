@@ -0,0 +1,230 @@
+// Compares the DBusTransport backends on the traffic MprisMediaPlayer
+// generates: blocking round trips, as every getter makes, and pipelined
+// asynchronous calls, as execute_batch() makes.
+//
+//   transport-bench [-n CALLS] [-w WINDOW] [-d PLAYER] [-b BACKEND]
+//
+// Without -d the bus daemon answers (GetId), so the numbers are mostly the
+// cost of the client library; with -d every call is a Get of the player's
+// Volume. All built-in backends are measured unless -b picks one (configure
+// with -DBUILD_SDBUS_TRANSPORT=ON to build the sd-bus backend). Needs a
+// session bus.
+
+#include <dbus/dbus.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+#include "dbus_transport.h"
+#include "mpris_media_player.h"
+
+struct Options {
+  int calls = 20000;
+  int window = 64;
+  std::string player;
+  std::string backend;
+};
+
+static int64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static int64_t cpu_us() {
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int64_t percentile(std::vector<int64_t> &samples, double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+static DBusMessageHandle new_call(const Options &options) {
+  DBusMessageHandle msg;
+
+  if (options.player.empty()) {
+    msg.reset(dbus_message_new_method_call(
+        "org.freedesktop.DBus", "/org/freedesktop/DBus",
+        "org.freedesktop.DBus", "GetId"));
+  } else {
+    const char *iface = "org.mpris.MediaPlayer2.Player";
+    const char *property = "Volume";
+    msg.reset(dbus_message_new_method_call(
+        options.player.c_str(), "/org/mpris/MediaPlayer2",
+        "org.freedesktop.DBus.Properties", "Get"));
+    dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &iface,
+                             DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+  }
+
+  return msg;
+}
+
+static bool is_error(DBusMessage *reply) {
+  return !reply || dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR;
+}
+
+static void run_blocking(DBusTransport &transport, const Options &options) {
+  std::vector<int64_t> latencies;
+  int failures = 0;
+
+  latencies.reserve(options.calls);
+
+  int64_t cpu_start = cpu_us();
+  int64_t start = monotonic_us();
+  for (int i = 0; i < options.calls; i++) {
+    DBusMessageHandle msg = new_call(options);
+    DBusMessageHandle reply;
+    DBusErrorHandle err;
+
+    int64_t sent = monotonic_us();
+    if (transport.call(msg.get(), 2000, reply, err) != ERROR_NONE) {
+      failures++;
+    }
+    latencies.push_back(monotonic_us() - sent);
+  }
+  double elapsed_s = (monotonic_us() - start) / 1e6;
+  int64_t cpu = cpu_us() - cpu_start;
+
+  printf("  blocking:  %8.0f calls/s  p50 %lld  p99 %lld  max %lld us  "
+         "cpu %.1f us/call  failed %d\n",
+         options.calls / elapsed_s,
+         static_cast<long long>(percentile(latencies, 0.50)),
+         static_cast<long long>(percentile(latencies, 0.99)),
+         static_cast<long long>(percentile(latencies, 1.0)),
+         static_cast<double>(cpu) / options.calls, failures);
+}
+
+static void run_pipelined(DBusTransport &transport, const Options &options) {
+  std::deque<std::pair<int64_t, std::unique_ptr<DBusTransportCall>>> in_flight;
+  std::vector<int64_t> latencies;
+  int sent = 0;
+  int failures = 0;
+
+  latencies.reserve(options.calls);
+
+  int64_t cpu_start = cpu_us();
+  int64_t start = monotonic_us();
+  while (sent < options.calls || !in_flight.empty()) {
+    while (sent < options.calls &&
+           static_cast<int>(in_flight.size()) < options.window) {
+      DBusMessageHandle msg = new_call(options);
+      std::unique_ptr<DBusTransportCall> call;
+
+      sent++;
+      if (transport.call_async(msg.get(), 2000, call) != ERROR_NONE) {
+        failures++;
+        continue;
+      }
+      in_flight.emplace_back(monotonic_us(), std::move(call));
+    }
+    transport.flush();
+
+    if (in_flight.empty()) {
+      continue;
+    }
+    DBusMessageHandle reply = in_flight.front().second->block();
+    latencies.push_back(monotonic_us() - in_flight.front().first);
+    if (is_error(reply.get())) {
+      failures++;
+    }
+    in_flight.pop_front();
+  }
+  double elapsed_s = (monotonic_us() - start) / 1e6;
+  int64_t cpu = cpu_us() - cpu_start;
+
+  printf("  pipelined: %8.0f calls/s  p50 %lld  p99 %lld  max %lld us  "
+         "cpu %.1f us/call  failed %d (window %d)\n",
+         options.calls / elapsed_s,
+         static_cast<long long>(percentile(latencies, 0.50)),
+         static_cast<long long>(percentile(latencies, 0.99)),
+         static_cast<long long>(percentile(latencies, 1.0)),
+         static_cast<double>(cpu) / options.calls, failures, options.window);
+}
+
+static int run_backend(const std::string &backend, const Options &options) {
+  std::shared_ptr<DBusTransport> transport = DBusTransport::create(backend);
+  DBusErrorHandle err;
+
+  if (!transport) {
+    fprintf(stderr, "backend %s is not built in\n", backend.c_str());
+    return 1;
+  }
+
+  int64_t start = monotonic_us();
+  if (transport->connect(err) != ERROR_NONE) {
+    fprintf(stderr, "%s: cannot connect: %s\n", backend.c_str(),
+            err.message().c_str());
+    return 1;
+  }
+  printf("%s (connect %lld us)\n", transport->name(),
+         static_cast<long long>(monotonic_us() - start));
+
+  run_blocking(*transport, options);
+  run_pipelined(*transport, options);
+
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-n CALLS] [-w WINDOW] [-d PLAYER] [-b BACKEND]\n"
+          "backends:",
+          prog);
+  for (const std::string &backend : DBusTransport::backends()) {
+    fprintf(stderr, " %s", backend.c_str());
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  int opt;
+  int output = 0;
+
+  while ((opt = getopt(argc, argv, "n:w:d:b:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      options.calls = atoi(optarg);
+      break;
+    case 'w':
+      options.window = std::max(1, atoi(optarg));
+      break;
+    case 'd':
+      options.player = optarg;
+      break;
+    case 'b':
+      options.backend = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (!options.backend.empty()) {
+    return run_backend(options.backend, options);
+  }
+
+  for (const std::string &backend : DBusTransport::backends()) {
+    output |= run_backend(backend, options);
+  }
+
+  return output;
+}
@@ -0,0 +1,292 @@
+// Measures `dbus-music watch`: sustained event rate and the latency from a
+// signal leaving the emitter to its NDJSON line being readable on the
+// watcher's stdout.
+//
+// The bench claims an MPRIS name, starts the watcher as a child process and
+// emits signals whose position field carries the CLOCK_MONOTONIC send time,
+// so every output line can be matched with the moment it was sent.
+//
+//   watch-bench [-n EVENTS] [-r RATE] [-k seeked|properties] [WATCH_CMD ...]
+//
+// RATE is in events per second, 0 (default) sends as fast as possible.
+// WATCH_CMD defaults to "./dbus-music watch". Needs a session bus.
+
+#include <dbus/dbus.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static const char *BENCH_NAME = "org.mpris.MediaPlayer2.watchbench";
+static const char *PATH = "/org/mpris/MediaPlayer2";
+
+static int64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static DBusMessage *new_seeked(int64_t stamp) {
+  DBusMessage *msg =
+      dbus_message_new_signal(PATH, "org.mpris.MediaPlayer2.Player", "Seeked");
+  dbus_int64_t position = stamp;
+
+  dbus_message_append_args(msg, DBUS_TYPE_INT64, &position, DBUS_TYPE_INVALID);
+  return msg;
+}
+
+static void append_variant(DBusMessageIter *dict, const char *key, int type,
+                           const void *value) {
+  DBusMessageIter entry;
+  DBusMessageIter variant;
+  char signature[2] = {static_cast<char>(type), '\0'};
+
+  dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, nullptr,
+                                   &entry);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature,
+                                   &variant);
+  dbus_message_iter_append_basic(&variant, type, value);
+  dbus_message_iter_close_container(&entry, &variant);
+  dbus_message_iter_close_container(dict, &entry);
+}
+
+// A typical track change: new metadata plus the status, with the send time
+// in Position
+static DBusMessage *new_properties_changed(int64_t stamp) {
+  DBusMessage *msg = dbus_message_new_signal(
+      PATH, "org.freedesktop.DBus.Properties", "PropertiesChanged");
+  const char *iface = "org.mpris.MediaPlayer2.Player";
+  const char *status = "Playing";
+  const char *title = "Benchmark Track";
+  const char *track_id = "/org/mpris/MediaPlayer2/watchbench/track/1";
+  dbus_int64_t position = stamp;
+  dbus_int64_t length = 215000000;
+  DBusMessageIter args;
+  DBusMessageIter dict;
+  DBusMessageIter entry;
+  DBusMessageIter variant;
+  DBusMessageIter metadata;
+  DBusMessageIter invalidated;
+  const char *key = "Metadata";
+
+  dbus_message_iter_init_append(msg, &args);
+  dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &iface);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "{sv}", &dict);
+
+  dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, nullptr,
+                                   &entry);
+  dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "a{sv}",
+                                   &variant);
+  dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "{sv}",
+                                   &metadata);
+  append_variant(&metadata, "mpris:trackid", DBUS_TYPE_OBJECT_PATH, &track_id);
+  append_variant(&metadata, "mpris:length", DBUS_TYPE_INT64, &length);
+  append_variant(&metadata, "xesam:title", DBUS_TYPE_STRING, &title);
+  dbus_message_iter_close_container(&variant, &metadata);
+  dbus_message_iter_close_container(&entry, &variant);
+  dbus_message_iter_close_container(&dict, &entry);
+
+  append_variant(&dict, "PlaybackStatus", DBUS_TYPE_STRING, &status);
+  append_variant(&dict, "Position", DBUS_TYPE_INT64, &position);
+  dbus_message_iter_close_container(&args, &dict);
+
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "s", &invalidated);
+  dbus_message_iter_close_container(&args, &invalidated);
+
+  return msg;
+}
+
+struct Receiver {
+  const char *field;
+  std::atomic<long> received{0};
+  std::atomic<bool> warmed_up{false};
+  std::atomic<int64_t> last_receive_us{0};
+  std::vector<int64_t> latencies_us;
+
+  void run(FILE *in) {
+    char *line = nullptr;
+    size_t capacity = 0;
+    size_t field_len = strlen(field);
+
+    while (getline(&line, &capacity, in) > 0) {
+      int64_t now = monotonic_us();
+      const char *p = strstr(line, field);
+      if (!p) {
+        continue;
+      }
+      long long stamp = strtoll(p + field_len, nullptr, 10);
+      if (stamp < 0) {
+        // warm-up probe
+        warmed_up = true;
+        continue;
+      }
+      latencies_us.push_back(now - stamp);
+      last_receive_us = now;
+      received++;
+    }
+    free(line);
+  }
+};
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+int main(int argc, char *argv[]) {
+  long events = 100000;
+  long rate = 0;
+  bool properties = false;
+  std::vector<char *> watch_cmd;
+  DBusError err;
+  int pipe_fds[2];
+
+  int i = 1;
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      events = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      rate = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      properties = strcmp(argv[++i], "properties") == 0;
+    } else {
+      break;
+    }
+  }
+  for (; i < argc; i++) {
+    watch_cmd.push_back(argv[i]);
+  }
+  if (watch_cmd.empty()) {
+    watch_cmd = {const_cast<char *>("./dbus-music"),
+                 const_cast<char *>("watch")};
+  }
+  watch_cmd.push_back(nullptr);
+
+  dbus_error_init(&err);
+  DBusConnection *conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+  if (!conn) {
+    std::cerr << "cannot connect: " << err.message << std::endl;
+    return 1;
+  }
+  dbus_connection_set_exit_on_disconnect(conn, false);
+  if (dbus_bus_request_name(conn, BENCH_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                            &err) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+    std::cerr << "cannot own " << BENCH_NAME << std::endl;
+    return 1;
+  }
+
+  // start the watcher with its stdout on our pipe
+  if (pipe(pipe_fds) != 0) {
+    perror("pipe");
+    return 1;
+  }
+  pid_t child = fork();
+  if (child == 0) {
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    execvp(watch_cmd[0], watch_cmd.data());
+    perror("execvp");
+    _exit(127);
+  }
+  close(pipe_fds[1]);
+
+  FILE *in = fdopen(pipe_fds[0], "r");
+  Receiver receiver;
+  receiver.field = properties ? "\"Position\":" : "\"position\":";
+  receiver.latencies_us.reserve(events);
+  std::thread reader([&] { receiver.run(in); });
+
+  auto make_signal = properties ? new_properties_changed : new_seeked;
+
+  // probe until the watcher is subscribed and knows our name
+  int64_t warmup_deadline = monotonic_us() + 5000000;
+  while (!receiver.warmed_up && monotonic_us() < warmup_deadline) {
+    DBusMessage *msg = make_signal(-1);
+    dbus_connection_send(conn, msg, nullptr);
+    dbus_message_unref(msg);
+    dbus_connection_flush(conn);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  if (!receiver.warmed_up) {
+    std::cerr << "watcher did not come up" << std::endl;
+    kill(child, SIGTERM);
+    reader.join();
+    return 1;
+  }
+
+  int64_t start = monotonic_us();
+  for (long n = 0; n < events; n++) {
+    if (rate > 0) {
+      int64_t due = start + n * 1000000 / rate;
+      int64_t now = monotonic_us();
+      if (due > now) {
+        std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+      }
+    }
+    DBusMessage *msg = make_signal(monotonic_us());
+    dbus_connection_send(conn, msg, nullptr);
+    dbus_message_unref(msg);
+    if (rate > 0 || n % 64 == 63) {
+      dbus_connection_flush(conn);
+    }
+  }
+  dbus_connection_flush(conn);
+  int64_t sent_done = monotonic_us();
+
+  // wait until everything arrived or nothing did for a second
+  int64_t idle_since = monotonic_us();
+  long last_seen = -1;
+  while (receiver.received < events) {
+    long seen = receiver.received;
+    if (seen != last_seen) {
+      last_seen = seen;
+      idle_since = monotonic_us();
+    } else if (monotonic_us() - idle_since > 1000000) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  kill(child, SIGTERM);
+  reader.join();
+  fclose(in);
+  waitpid(child, nullptr, 0);
+
+  long received = receiver.received;
+  std::vector<int64_t> sorted(receiver.latencies_us);
+  std::sort(sorted.begin(), sorted.end());
+  double elapsed_s =
+      std::max<int64_t>(receiver.last_receive_us - start, 1) / 1e6;
+
+  printf("kind:        %s\n", properties ? "properties" : "seeked");
+  printf("sent:        %ld in %.3f s (%.0f/s)\n", events,
+         (sent_done - start) / 1e6, events / ((sent_done - start) / 1e6));
+  printf("received:    %ld (%.0f/s), dropped %ld\n", received,
+         received / elapsed_s, events - received);
+  printf("latency us:  p50 %lld  p90 %lld  p99 %lld  max %lld\n",
+         static_cast<long long>(percentile(sorted, 0.50)),
+         static_cast<long long>(percentile(sorted, 0.90)),
+         static_cast<long long>(percentile(sorted, 0.99)),
+         static_cast<long long>(sorted.empty() ? 0 : sorted.back()));
+
+  dbus_connection_close(conn);
+  dbus_connection_unref(conn);
+
+  return received == events ? 0 : 1;
+}
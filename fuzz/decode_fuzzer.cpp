@@ -0,0 +1,40 @@
+// libFuzzer harness for the reply decoders of MprisMediaPlayer.
+//
+// An input that is a marshalled D-Bus message (e.g. from decode-bench -w)
+// is decoded as it is; anything else is turned into a well-formed reply by
+// build_fuzz_reply(), so most inputs get past libdbus' own validation and
+// reach the decoders with keys and value types of the fuzzer's choosing.
+//
+//   decode-fuzzer -max_len=65536 CORPUS_DIR
+//
+// Built with clang and -DBUILD_FUZZERS=ON. Other compilers get a driver
+// that runs the harness once over each file given, under the sanitizers,
+// to replay a corpus or a crash.
+
+#include <dbus/dbus.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "decode_corpus.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  DBusMessageHandle msg;
+  DBusError err;
+
+  dbus_error_init(&err);
+  if (size >= 16 && dbus_message_demarshal_bytes_needed(
+                        reinterpret_cast<const char *>(data),
+                        static_cast<int>(size)) == static_cast<int>(size)) {
+    msg.reset(dbus_message_demarshal(reinterpret_cast<const char *>(data),
+                                     static_cast<int>(size), &err));
+    dbus_error_free(&err);
+  }
+  if (!msg) {
+    msg = build_fuzz_reply(data, size);
+  }
+
+  DBusDecoderHarness::decode_all(msg.get());
+
+  return 0;
+}
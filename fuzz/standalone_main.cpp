@@ -0,0 +1,27 @@
+// Stands in for libFuzzer's main() where it is not available: runs
+// LLVMFuzzerTestOneInput() once over every file given.
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    if (!file) {
+      perror(argv[i]);
+      return 1;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+  }
+
+  printf("%d inputs run\n", argc - 1);
+  return 0;
+}
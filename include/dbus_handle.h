@@ -0,0 +1,102 @@
+#ifndef DBUS_HANDLE_H
+#define DBUS_HANDLE_H
+
+#include <dbus/dbus.h>
+#include <string>
+
+// Move-only owner of a single libdbus reference. Constructing from a raw
+// pointer adopts the reference the caller already holds (e.g. the return
+// value of dbus_message_new_*); use ref() to take an additional one.
+template <typename T, T *(*RefFunc)(T *), void (*UnrefFunc)(T *)>
+class DBusRefHandle {
+public:
+  DBusRefHandle() : ptr(nullptr) {}
+  explicit DBusRefHandle(T *p) : ptr(p) {}
+  ~DBusRefHandle() { reset(); }
+
+  DBusRefHandle(const DBusRefHandle &) = delete;
+  DBusRefHandle &operator=(const DBusRefHandle &) = delete;
+
+  DBusRefHandle(DBusRefHandle &&other) noexcept : ptr(other.release()) {}
+  DBusRefHandle &operator=(DBusRefHandle &&other) noexcept {
+    if (this != &other) {
+      reset(other.release());
+    }
+    return *this;
+  }
+
+  static DBusRefHandle ref(T *p) { return DBusRefHandle(p ? RefFunc(p) : p); }
+
+  T *get() const { return ptr; }
+  explicit operator bool() const { return ptr != nullptr; }
+
+  T *release() {
+    T *p = ptr;
+    ptr = nullptr;
+    return p;
+  }
+
+  void reset(T *p = nullptr) {
+    if (ptr) {
+      UnrefFunc(ptr);
+    }
+    ptr = p;
+  }
+
+private:
+  T *ptr;
+};
+
+typedef DBusRefHandle<DBusMessage, dbus_message_ref, dbus_message_unref>
+    DBusMessageHandle;
+typedef DBusRefHandle<DBusConnection, dbus_connection_ref,
+                      dbus_connection_unref>
+    DBusConnectionHandle;
+typedef DBusRefHandle<DBusPendingCall, dbus_pending_call_ref,
+                      dbus_pending_call_unref>
+    DBusPendingCallHandle;
+
+// Owns a DBusError: initialized on construction, freed on destruction, so
+// early returns can no longer leak the name/message strings.
+class DBusErrorHandle {
+public:
+  DBusErrorHandle() { dbus_error_init(&err); }
+  ~DBusErrorHandle() { dbus_error_free(&err); }
+
+  DBusErrorHandle(const DBusErrorHandle &) = delete;
+  DBusErrorHandle &operator=(const DBusErrorHandle &) = delete;
+
+  DBusErrorHandle(DBusErrorHandle &&other) noexcept {
+    dbus_error_init(&err);
+    dbus_move_error(&other.err, &err);
+  }
+  DBusErrorHandle &operator=(DBusErrorHandle &&other) noexcept {
+    if (this != &other) {
+      dbus_error_free(&err);
+      dbus_move_error(&other.err, &err);
+    }
+    return *this;
+  }
+
+  DBusError *get() { return &err; }
+  bool is_set() const { return dbus_error_is_set(&err); }
+  bool has_name(const char *name) const {
+    return dbus_error_has_name(&err, name);
+  }
+  // The call got no answer in time. libdbus reports its own timeout as
+  // NoReply; Timeout and TimedOut come from services and proxies.
+  bool is_timeout() const {
+    return has_name(DBUS_ERROR_NO_REPLY) || has_name(DBUS_ERROR_TIMEOUT) ||
+           has_name(DBUS_ERROR_TIMED_OUT);
+  }
+  std::string name() const { return is_set() ? err.name : ""; }
+  std::string message() const { return is_set() ? err.message : ""; }
+
+  // dbus_error_free() also re-initializes, so the handle can be reused
+  void clear() { dbus_error_free(&err); }
+
+private:
+  DBusError err;
+};
+
+#endif /* DBUS_HANDLE_H */
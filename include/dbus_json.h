@@ -0,0 +1,21 @@
+#ifndef DBUS_JSON_H
+#define DBUS_JSON_H
+
+#include <cstdint>
+#include <dbus/dbus.h>
+#include <string>
+
+// Appends value as a quoted, escaped JSON string.
+void append_json_string(std::string &out, const char *value);
+
+// Appends the value under iter as JSON. Dictionaries with string keys become
+// objects, other arrays and structs become arrays and variants are
+// unwrapped. Returns false (and appends null) for types it cannot express.
+bool append_json_value(std::string &out, DBusMessageIter *iter);
+
+// Reads an integer of any D-Bus width into value; players disagree on the
+// width of the numeric fields, e.g. mpris:length. False if iter holds
+// something else.
+bool read_dbus_integer(DBusMessageIter *iter, int64_t &value);
+
+#endif /* DBUS_JSON_H */
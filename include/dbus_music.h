@@ -0,0 +1,119 @@
+#ifndef DBUS_MUSIC_H
+#define DBUS_MUSIC_H
+
+/*
+ * C interface to libdbus-music, for programs that would otherwise run the
+ * dbus-music executable for every action. A handle keeps its connection to
+ * the session bus for as long as it is open, so an action costs one round
+ * trip instead of a process start and a bus connect. Handles share that
+ * connection.
+ *
+ * Only the functions declared here are exported from the shared library,
+ * and they only grow; DBUS_MUSIC_ABI_VERSION (the soname version) changes
+ * when one of them has to change incompatibly.
+ *
+ * Functions return DBUS_MUSIC_OK or one of the negative codes below. The
+ * library is not thread safe: use it from one thread, or lock around it.
+ * Strings it hands out are allocated with malloc() and released with
+ * dbus_music_free().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define DBUS_MUSIC_API __attribute__((visibility("default")))
+#else
+#define DBUS_MUSIC_API
+#endif
+
+#define DBUS_MUSIC_ABI_VERSION 1
+
+/* the values of ErrorCodeType */
+enum {
+  DBUS_MUSIC_OK = 1,
+  DBUS_MUSIC_ERROR_DBUS = -1,
+  DBUS_MUSIC_ERROR_NULL_PTR = -2,
+  DBUS_MUSIC_ERROR_UNKNOWN_TYPE = -3,
+  DBUS_MUSIC_ERROR_NOT_SUPPORTED = -4,
+  DBUS_MUSIC_ERROR_INVALID_ARGUMENT = -5,
+  DBUS_MUSIC_ERROR_TIMEOUT = -6,
+  DBUS_MUSIC_ERROR_CIRCUIT_OPEN = -7,
+  DBUS_MUSIC_ERROR_IO = -8,
+  DBUS_MUSIC_ERROR_NOT_FOUND = -9
+};
+
+typedef struct dbus_music_player dbus_music_player;
+
+/* DBUS_MUSIC_ABI_VERSION of the library actually loaded */
+DBUS_MUSIC_API int dbus_music_abi_version(void);
+/* e.g. "ERROR_TIMEOUT"; never NULL */
+DBUS_MUSIC_API const char *dbus_music_error_name(int code);
+DBUS_MUSIC_API void dbus_music_free(void *ptr);
+
+/* the MPRIS players on the session bus, as a JSON array of bus names */
+DBUS_MUSIC_API int dbus_music_list_players(char **players_json);
+
+/*
+ * Connects and opens player, e.g. "org.mpris.MediaPlayer2.vlc" or just
+ * "vlc"; NULL or "" opens the first player on the bus. Returns NULL on
+ * failure, with the reason in *status when status is not NULL:
+ * DBUS_MUSIC_ERROR_NOT_FOUND when there is no player to open.
+ */
+DBUS_MUSIC_API dbus_music_player *dbus_music_player_open(const char *player,
+                                                        int *status);
+DBUS_MUSIC_API void dbus_music_player_close(dbus_music_player *player);
+/* full bus name of the player; valid until the handle is closed */
+DBUS_MUSIC_API const char *dbus_music_player_name(dbus_music_player *player);
+/* reply timeout of every call, 2000 ms unless changed */
+DBUS_MUSIC_API int dbus_music_player_set_timeout(dbus_music_player *player,
+                                                 int timeout_ms);
+
+/* Control methods are sent without waiting for the player to answer. */
+DBUS_MUSIC_API int dbus_music_player_play(dbus_music_player *player);
+DBUS_MUSIC_API int dbus_music_player_pause(dbus_music_player *player);
+DBUS_MUSIC_API int dbus_music_player_play_pause(dbus_music_player *player);
+DBUS_MUSIC_API int dbus_music_player_stop(dbus_music_player *player);
+DBUS_MUSIC_API int dbus_music_player_next(dbus_music_player *player);
+DBUS_MUSIC_API int dbus_music_player_previous(dbus_music_player *player);
+DBUS_MUSIC_API int dbus_music_player_seek(dbus_music_player *player,
+                                          int64_t offset_us);
+
+DBUS_MUSIC_API int dbus_music_player_get_volume(dbus_music_player *player,
+                                                double *volume);
+DBUS_MUSIC_API int dbus_music_player_set_volume(dbus_music_player *player,
+                                                double volume);
+DBUS_MUSIC_API int dbus_music_player_get_position(dbus_music_player *player,
+                                                  int64_t *position_us);
+/* "Playing", "Paused" or "Stopped" */
+DBUS_MUSIC_API int
+dbus_music_player_get_playback_status(dbus_music_player *player,
+                                      char **status);
+
+/*
+ * Runs one command of "dbus-music batch", e.g. "volume 0.4" or
+ * "get Metadata". *value_json receives what a "get" read, as JSON, and is
+ * set to NULL for other commands or on failure; value_json may be NULL.
+ */
+DBUS_MUSIC_API int dbus_music_player_execute(dbus_music_player *player,
+                                             const char *command,
+                                             char **value_json);
+/*
+ * Runs count commands the way "dbus-music batch" does, all requests sent
+ * before the first reply is awaited. *results_json receives a JSON array
+ * holding the object batch prints for each command, in command order. The
+ * return value is the first failure, if any.
+ */
+DBUS_MUSIC_API int dbus_music_player_execute_batch(
+    dbus_music_player *player, const char *const *commands, size_t count,
+    char **results_json);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DBUS_MUSIC_H */
@@ -0,0 +1,99 @@
+#ifndef DBUS_RECORDER_H
+#define DBUS_RECORDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <dbus/dbus.h>
+#include <mutex>
+#include <string>
+
+#include "dbus_handle.h"
+
+// Capture file layout (host byte order):
+//
+//   char     magic[8]         "DBMREC\0" followed by the format version
+//   repeated:
+//     int64  time_us          since the start of the capture (monotonic)
+//     uint32 length           of the marshalled message
+//     uint8  direction        DBusRecordDirection
+//     uint8  reserved[3]
+//     char   message[length]  dbus_message_marshal() output
+#define DBUS_RECORD_MAGIC "DBMREC"
+#define DBUS_RECORD_VERSION 1
+
+typedef enum DBusRecordDirections {
+  RecordSent = 0,
+  RecordReceived = 1
+} DBusRecordDirection;
+
+struct DBusRecord {
+  int64_t time_us = 0;
+  DBusRecordDirection direction = RecordSent;
+  DBusMessageHandle msg;
+};
+
+// Process-wide capture of the messages MprisMediaPlayer and MprisWatcher
+// exchange with the bus. Recording is off until start() is called, and
+// record() costs a single pointer check while it is. Any thread may
+// record; each message goes out as one frame.
+class DBusRecorder {
+public:
+  static int start(const std::string &path);
+  static void stop();
+
+  static bool is_recording() {
+    return file.load(std::memory_order_relaxed) != nullptr;
+  }
+  static int64_t now_us();
+
+  static void record(DBusRecordDirection direction, DBusMessage *msg) {
+    if (is_recording()) {
+      write_record(direction, msg, now_us());
+    }
+  }
+  // For calls whose serial is only assigned once they were sent
+  static void record(DBusRecordDirection direction, DBusMessage *msg,
+                     int64_t time_us) {
+    if (is_recording()) {
+      write_record(direction, msg, time_us);
+    }
+  }
+
+private:
+  static void write_record(DBusRecordDirection direction, DBusMessage *msg,
+                           int64_t time_us);
+
+  // Set and cleared under mutex, which also guards everything below; the
+  // unlocked check in record() is only a shortcut.
+  static std::atomic<FILE *> file;
+  static std::mutex mutex;
+  static int64_t start_time_us;
+
+  // every filter on a shared connection sees the same signal
+  static DBusMessage *last_received;
+  static dbus_uint32_t last_received_serial;
+  // header and message of the record being written, reused
+  static std::string frame;
+};
+
+class DBusCaptureReader {
+public:
+  DBusCaptureReader();
+  ~DBusCaptureReader();
+
+  DBusCaptureReader(const DBusCaptureReader &) = delete;
+  DBusCaptureReader &operator=(const DBusCaptureReader &) = delete;
+
+  int open(const std::string &path);
+  void close();
+
+  // Returns false at the end of the file or on a truncated record.
+  bool next(DBusRecord &record);
+
+private:
+  FILE *file;
+  std::string data;
+};
+
+#endif /* DBUS_RECORDER_H */
@@ -0,0 +1,117 @@
+#ifndef DBUS_TRANSPORT_H
+#define DBUS_TRANSPORT_H
+
+#include <chrono>
+#include <dbus/dbus.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dbus_handle.h"
+
+// A call whose reply has not been waited for yet.
+//
+// libdbus only times a call out while blocking on it, so a caller that
+// waits by dispatching learns of the timeout from expired(): once that is
+// true block() returns the NoReply error at once.
+class DBusTransportCall {
+public:
+  typedef std::chrono::steady_clock Clock;
+  typedef void (*NotifyHandler)(void *user_data);
+
+  // Dropping a call that is still in flight cancels it.
+  virtual ~DBusTransportCall() {}
+
+  // The reply, or an error standing in for it, is in.
+  virtual bool completed() = 0;
+  // When the call times out; the timeout of -1 is libdbus' default, 25 s.
+  Clock::time_point deadline() const { return deadline_at; }
+  // Past the deadline without a reply.
+  bool expired() { return !completed() && Clock::now() >= deadline_at; }
+
+  // Waits for the reply. A call that timed out or was lost along with the
+  // connection yields an error reply made up locally, without a sender.
+  virtual DBusMessageHandle block() = 0;
+
+  // Has handler called from DBusTransport::dispatch() once the reply is in,
+  // after which block() returns without waiting. A timeout is not notified;
+  // see expired().
+  virtual void set_notify(NotifyHandler handler, void *user_data) = 0;
+
+protected:
+  explicit DBusTransportCall(int timeout_ms)
+      : deadline_at(Clock::now() + std::chrono::milliseconds(
+                                       timeout_ms < 0 ? 25000 : timeout_ms)) {}
+
+private:
+  Clock::time_point deadline_at;
+};
+
+// The part of a bus library MprisMediaPlayer relies on. Messages are built
+// and parsed with libdbus everywhere else, so they cross this interface as
+// DBusMessage and a backend on another library converts at the boundary.
+//
+// Calls assign the serial of the message they send, so it can be recorded
+// afterwards like one sent by libdbus itself.
+class DBusTransport {
+public:
+  typedef void (*SignalHandler)(DBusMessage *msg, void *user_data);
+
+  virtual ~DBusTransport() {}
+
+  virtual const char *name() const = 0;
+
+  // Connects to the session bus.
+  virtual int connect(DBusErrorHandle &err) = 0;
+  // Connects on a connection of its own, which nothing else in the process
+  // dispatches; for use from another thread.
+  virtual int connect_private(DBusErrorHandle &err) = 0;
+
+  // Sends msg and waits for the reply; an error reply or a timeout is
+  // returned through err.
+  virtual int call(DBusMessage *msg, int timeout_ms, DBusMessageHandle &reply,
+                   DBusErrorHandle &err) = 0;
+  virtual int call_async(DBusMessage *msg, int timeout_ms,
+                         std::unique_ptr<DBusTransportCall> &call) = 0;
+  // Queues msg without waiting for (or asking for) a reply.
+  virtual int send(DBusMessage *msg) = 0;
+  virtual void flush() = 0;
+
+  virtual int add_match(const std::string &rule, DBusErrorHandle &err) = 0;
+  // Does not wait for the bus daemon to answer.
+  virtual void remove_match(const std::string &rule) = 0;
+
+  // Handlers see every signal the connection receives.
+  virtual int add_signal_handler(SignalHandler handler, void *user_data) = 0;
+  virtual void remove_signal_handler(SignalHandler handler,
+                                     void *user_data) = 0;
+
+  // Waits up to timeout_ms for traffic, then dispatches everything queued.
+  // Fails once the connection is gone.
+  virtual int dispatch(int timeout_ms) = 0;
+  // For callers that wait on other descriptors too: once it is readable,
+  // dispatch(0). -1 while not connected.
+  virtual int get_fd() = 0;
+
+  // The session bus connection shared by every MprisMediaPlayer in the
+  // process, on the default backend (DBUS_TRANSPORT at configure time).
+  static int open_session(std::shared_ptr<DBusTransport> &transport,
+                          DBusErrorHandle &err);
+
+  // A connection of its own on the same backend (see connect_private()).
+  static int open_private(std::shared_ptr<DBusTransport> &transport,
+                          DBusErrorHandle &err);
+
+  // An unconnected transport on the named backend, or nullptr if it was not
+  // built in; backends() lists those that were.
+  static std::shared_ptr<DBusTransport> create(const std::string &backend);
+  static std::vector<std::string> backends();
+
+  // call_async() on a libdbus connection that no transport owns, such as
+  // those of MprisWatcher.
+  static int call_async_on(DBusConnection *conn, DBusMessage *msg,
+                           int timeout_ms,
+                           std::unique_ptr<DBusTransportCall> &call);
+};
+
+#endif /* DBUS_TRANSPORT_H */
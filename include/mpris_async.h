@@ -0,0 +1,359 @@
+#ifndef MPRIS_ASYNC_H
+#define MPRIS_ASYNC_H
+
+// Coroutine versions of the MprisMediaPlayer operations (C++20). Each call
+// is sent asynchronously and the coroutine is resumed by MprisAsyncLoop once
+// its reply is in, so chains such as
+//
+//   DBusTask<void> skip_intro(MprisAsyncPlayer &player) {
+//     DBusResult<bool> seekable = co_await player.can_seek();
+//     if (seekable.ok() && seekable.value) {
+//       co_await player.seek(30000000);
+//     }
+//   }
+//
+// run for many players at once on one thread, without blocking it.
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+
+template <typename T> class DBusTask;
+
+// A status code from ErrorCode along with the value, which is default
+// constructed unless the status is ERROR_NONE.
+template <typename T> struct DBusResult {
+  int status = ERROR_NONE;
+  T value{};
+
+  bool ok() const { return status == ERROR_NONE; }
+};
+
+struct DBusTaskPromiseBase {
+  // the coroutine awaiting this one; none for a task run by the loop
+  std::coroutine_handle<> continuation;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      std::coroutine_handle<> next = handle.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  // tasks are lazy: nothing is sent before they are awaited or spawned
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  // errors are status codes here; anything thrown is a bug
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T> struct DBusTaskPromise : DBusTaskPromiseBase {
+  T value{};
+
+  DBusTask<T> get_return_object();
+  void return_value(T result) { value = std::move(result); }
+  T result() { return std::move(value); }
+};
+
+template <> struct DBusTaskPromise<void> : DBusTaskPromiseBase {
+  DBusTask<void> get_return_object();
+  void return_void() {}
+  void result() {}
+};
+
+// A coroutine producing a T. It starts when awaited, or when handed to
+// MprisAsyncLoop::spawn(), and owns its frame.
+template <typename T> class DBusTask {
+public:
+  typedef DBusTaskPromise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  struct Awaiter {
+    Handle handle;
+
+    bool await_ready() { return handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+      handle.promise().continuation = awaiting;
+      return handle;
+    }
+
+    T await_resume() { return handle.promise().result(); }
+  };
+
+  explicit DBusTask(Handle task_handle) : handle(task_handle) {}
+  DBusTask(DBusTask &&other) noexcept
+      : handle(std::exchange(other.handle, nullptr)) {}
+  DBusTask &operator=(DBusTask &&other) noexcept {
+    if (this != &other) {
+      if (handle) {
+        handle.destroy();
+      }
+      handle = std::exchange(other.handle, nullptr);
+    }
+    return *this;
+  }
+  DBusTask(const DBusTask &) = delete;
+  DBusTask &operator=(const DBusTask &) = delete;
+  ~DBusTask() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool done() const { return !handle || handle.done(); }
+
+  Awaiter operator co_await() { return Awaiter{handle}; }
+
+private:
+  friend class MprisAsyncLoop;
+
+  Handle handle;
+};
+
+template <typename T> DBusTask<T> DBusTaskPromise<T>::get_return_object() {
+  return DBusTask<T>(DBusTask<T>::Handle::from_promise(*this));
+}
+
+inline DBusTask<void> DBusTaskPromise<void>::get_return_object() {
+  return DBusTask<void>(DBusTask<void>::Handle::from_promise(*this));
+}
+
+class MprisAsyncLoop;
+
+// One call in flight. Resumes the awaiting coroutine with the reply, an
+// error reply made up locally for a timeout, or nullptr if it could not be
+// sent at all.
+class DBusCallAwaiter {
+public:
+  DBusCallAwaiter(MprisAsyncLoop &loop, DBusMessage *msg, int timeout_ms);
+  DBusCallAwaiter(const DBusCallAwaiter &) = delete;
+  ~DBusCallAwaiter();
+
+  bool await_ready() { return false; }
+  bool await_suspend(std::coroutine_handle<> awaiting);
+  DBusMessageHandle await_resume();
+
+private:
+  friend class MprisAsyncLoop;
+
+  static void notify(void *user_data);
+  void wake();
+
+  MprisAsyncLoop &loop;
+  DBusMessage *msg;
+  int timeout_ms;
+  std::unique_ptr<DBusTransportCall> call;
+  std::coroutine_handle<> waiting;
+  bool scheduled;
+};
+
+// Runs coroutines on the session transport. Everything happens on the
+// thread calling run(): coroutines are resumed from there, never from
+// inside a libdbus callback, and signals for subscribed players are
+// dispatched along the way.
+class MprisAsyncLoop {
+public:
+  MprisAsyncLoop();
+  ~MprisAsyncLoop();
+
+  int connect();
+  DBusTransport *get_transport() { return transport.get(); }
+
+  // Takes the task over; it starts on the next run().
+  void spawn(DBusTask<void> task);
+  // Runs until every spawned task has finished.
+  int run();
+
+  DBusCallAwaiter call(DBusMessage *msg, int timeout_ms) {
+    return DBusCallAwaiter(*this, msg, timeout_ms);
+  }
+
+private:
+  friend class DBusCallAwaiter;
+
+  void schedule(std::coroutine_handle<> handle);
+  void expire_calls();
+  int next_timeout_ms();
+
+  std::shared_ptr<DBusTransport> transport;
+  std::deque<std::coroutine_handle<>> ready;
+  std::vector<DBusCallAwaiter *> in_flight;
+  // last, so unfinished tasks are dropped while the rest is still alive
+  std::vector<DBusTask<void>> tasks;
+};
+
+// The operations of an MprisMediaPlayer as coroutines. Control methods wait
+// for the player's (empty) reply, so an awaited seek() has been carried out
+// or refused by the time it returns; they are checked against the cached
+// capabilities first, as the blocking ones are. Retries are not made: a
+// timeout is reported at once and counts towards the circuit breaker.
+class MprisAsyncPlayer {
+public:
+  MprisAsyncPlayer(MprisAsyncLoop &loop, const std::string &session);
+
+  // the blocking API on the same player, e.g. for subscribe()
+  MprisMediaPlayer &get_player() { return player; }
+
+  template <DBusPropertyType P>
+  DBusTask<DBusResult<typename DBusPropertyTraits<P>::type>> get();
+  // the exact value type only, as MprisMediaPlayer::set()
+  template <DBusPropertyType P, typename V> DBusTask<int> set(V value);
+
+  // from the capability cache, filled by one GetAll, like the blocking ones
+  DBusTask<DBusResult<bool>> has_capability(DBusCapabilityType capability);
+  DBusTask<DBusResult<bool>> can_control() {
+    return has_capability(CapabilityCanControl);
+  }
+  DBusTask<DBusResult<bool>> can_go_next() {
+    return has_capability(CapabilityCanGoNext);
+  }
+  DBusTask<DBusResult<bool>> can_go_previous() {
+    return has_capability(CapabilityCanGoPrevious);
+  }
+  DBusTask<DBusResult<bool>> can_pause() {
+    return has_capability(CapabilityCanPause);
+  }
+  DBusTask<DBusResult<bool>> can_play() {
+    return has_capability(CapabilityCanPlay);
+  }
+  DBusTask<DBusResult<bool>> can_seek() {
+    return has_capability(CapabilityCanSeek);
+  }
+
+  DBusTask<DBusResult<int64_t>> position() { return get<Prop::Position>(); }
+  DBusTask<DBusResult<double>> volume() { return get<Prop::Volume>(); }
+  DBusTask<DBusResult<double>> rate() { return get<Prop::Rate>(); }
+  DBusTask<DBusResult<bool>> shuffle() { return get<Prop::Shuffle>(); }
+  DBusTask<DBusResult<std::string>> playback_status() {
+    return get<Prop::PlaybackStatus>();
+  }
+  DBusTask<DBusResult<DBusLoopStatusType>> loop_status() {
+    return get<Prop::LoopStatus>();
+  }
+  DBusTask<DBusResult<DBusMetadata>> metadata() {
+    return get<Prop::Metadata>();
+  }
+
+  DBusTask<int> refresh_capabilities();
+
+  DBusTask<int> next() { return call_method(Next); }
+  DBusTask<int> previous() { return call_method(Previous); }
+  DBusTask<int> play() { return call_method(Play); }
+  DBusTask<int> pause() { return call_method(Pause); }
+  DBusTask<int> play_pause() { return call_method(PlayPause); }
+  DBusTask<int> stop() { return call_method(Stop); }
+  DBusTask<int> seek(int64_t offset);
+  DBusTask<int> set_position(std::string track_id, int64_t position);
+  DBusTask<int> open_uri(std::string uri);
+
+  /* org.mpris.MediaPlayer2 */
+  // shares the cache of MprisMediaPlayer::get_root_info() (DBusNameCache),
+  // when it can be used without asking the bus who owns the name
+  DBusTask<DBusResult<DBusRootInfo>> root_info();
+  DBusTask<DBusResult<std::string>> identity();
+  // ERROR_NOT_SUPPORTED when CanRaise/CanQuit is false
+  DBusTask<int> raise();
+  DBusTask<int> quit();
+
+  /* org.mpris.MediaPlayer2.TrackList */
+  // as MprisMediaPlayer::get_tracks(), sharing its track list cache; each
+  // call is refused with ERROR_NOT_SUPPORTED when HasTrackList is false
+  DBusTask<DBusResult<std::vector<DBusMetadata>>> get_tracks(size_t offset,
+                                                             size_t count);
+  DBusTask<int> add_track(std::string uri, std::string after_track,
+                          bool set_as_current);
+  DBusTask<int> remove_track(std::string track_id);
+  DBusTask<int> go_to(std::string track_id);
+
+  /* org.mpris.MediaPlayer2.Playlists */
+  DBusTask<DBusResult<std::vector<DBusPlaylist>>>
+  get_playlists(uint32_t index, uint32_t max_count, std::string order,
+                bool reverse_order);
+  DBusTask<int> activate_playlist(std::string playlist_id);
+
+private:
+  // msg and reply belong to the awaiting coroutine
+  DBusTask<int> call(DBusMessage *msg, DBusMessageHandle &reply);
+  DBusTask<int> call_method(DBusMethodType type, void *value = nullptr);
+  DBusTask<int> check_capability(DBusMethodType type);
+  // Raise or Quit, if the root property allowed names says it may be called
+  DBusTask<int> call_root_method(std::string method,
+                                 bool DBusRootInfo::*allowed);
+  DBusTask<int> fetch_track_ids();
+  // as MprisMediaPlayer::check_track_list()
+  DBusTask<int> check_track_list();
+
+  MprisAsyncLoop &loop;
+  MprisMediaPlayer player;
+};
+
+template <DBusPropertyType P>
+DBusTask<DBusResult<typename DBusPropertyTraits<P>::type>>
+MprisAsyncPlayer::get() {
+  typedef DBusPropertyTraits<P> Traits;
+  DBusResult<typename Traits::type> result;
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  DBusMessageIter args;
+  DBusMessageIter value_iter;
+
+  if ((result.status = player.construct_get_msg(Traits::iface, Traits::name,
+                                                msg)) != ERROR_NONE) {
+    co_return result;
+  }
+
+  if ((result.status = co_await call(msg.get(), reply)) != ERROR_NONE) {
+    co_return result;
+  }
+
+  if (!dbus_message_iter_init(reply.get(), &args) ||
+      dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_VARIANT) {
+    std::cerr << "Argument is not variant!" << std::endl;
+    result.status = ERROR_DBUS;
+    co_return result;
+  }
+  dbus_message_iter_recurse(&args, &value_iter);
+
+  if (!DBusPropertyCodec<typename Traits::type>::read(&value_iter,
+                                                       result.value)) {
+    std::cerr << Traits::name << " is not of type " << Traits::signature
+              << std::endl;
+    result.status = ERROR_DBUS;
+  }
+
+  co_return result;
+}
+
+template <DBusPropertyType P, typename V>
+DBusTask<int> MprisAsyncPlayer::set(V value) {
+  static_assert(DBusPropertyTraits<P>::writable, "property is read-only");
+  static_assert(std::is_same<typename std::decay<V>::type,
+                             typename DBusPropertyTraits<P>::type>::value,
+                "value is not of the property's type");
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = player.construct_set_msg<P>(value, msg)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  co_return co_await call(msg.get(), reply);
+}
+
+#endif /* MPRIS_ASYNC_H */
@@ -0,0 +1,82 @@
+#ifndef MPRIS_BUS_MONITOR_H
+#define MPRIS_BUS_MONITOR_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mpris_watcher.h"
+
+// Watches the MPRIS players of any number of buses, e.g. one session bus
+// per seat plus the system bus, from one thread. Every bus gets an
+// MprisWatcher on a private connection, and one epoll(7) set waits on all
+// of their sockets, so a quiet bus costs nothing and a busy one is served
+// as soon as its socket is readable.
+//
+// Events are the watcher's NDJSON lines, written to the same fd, with the
+// bus label as "bus". A bus that cannot be reached, or goes away (its
+// players are then reported as having lost their names), is retried every
+// RETRY_INTERVAL_MS while the others carry on. Polls (see
+// MprisWatcher::set_poll_policy()) share the same wait.
+class MprisBusMonitor {
+public:
+  static constexpr int RETRY_INTERVAL_MS = 5000;
+
+public:
+  MprisBusMonitor(int fd = 1);
+  ~MprisBusMonitor();
+
+  MprisBusMonitor(const MprisBusMonitor &) = delete;
+  MprisBusMonitor &operator=(const MprisBusMonitor &) = delete;
+
+  // address as for MprisWatcher::set_bus(); labels must be unique
+  int add_bus(const std::string &label, const std::string &address);
+  // Polls the silent players of every bus, including those added later.
+  void set_poll_policy(const DBusPollPolicy &policy);
+  void get_poll_stats(std::vector<DBusPollStats> &stats);
+
+  // Buses that cannot be reached yet, e.g. a seat nobody has logged in
+  // to, do not make it fail; they are retried.
+  int start();
+  void stop();
+
+  // Waits up to timeout_ms (-1 blocks) for any bus and handles what came
+  // in; fails once the output is gone.
+  int process_events(int timeout_ms);
+  int run(volatile int *quit);
+
+  size_t get_bus_count() const { return buses.size(); }
+  size_t get_connected_count() const;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Bus {
+    std::string label;
+    std::string address;
+    MprisWatcher watcher;
+    bool connected = false;
+    Clock::time_point next_attempt;
+
+    Bus(int fd, const std::string &label, const std::string &address)
+        : label(label), address(address), watcher(fd) {
+      watcher.set_bus(address, label);
+    }
+  };
+
+  int connect_bus(Bus &bus);
+  void disconnect_bus(Bus &bus);
+  int service_bus(Bus &bus);
+  void retry_buses();
+  int next_timeout_ms(int timeout_ms);
+
+  int fd;
+  int epoll_fd;
+  bool is_started;
+  bool polling;
+  DBusPollPolicy poll_policy;
+  std::vector<std::unique_ptr<Bus>> buses;
+};
+
+#endif /* MPRIS_BUS_MONITOR_H */
@@ -0,0 +1,89 @@
+#ifndef MPRIS_ELECTION_H
+#define MPRIS_ELECTION_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dbus_handle.h"
+#include "mpris_watcher.h"
+
+// Ranks the MPRIS players on a bus by how recently they were in use, so a
+// media key goes to the player the user means without asking every player
+// for its PlaybackStatus on each press.
+//
+// A player moves to the front when its PlaybackStatus turns to Playing
+// (signalled, or found by a poll with set_poll_policy()) and when a routed
+// command or note_command() is sent to it. Pausing or stopping does not
+// demote it, so the play/pause key resumes what it just paused. New players
+// join at the back; each is asked for its PlaybackStatus once, when first
+// seen, and counts as having started to play if it already is.
+//
+// Routed commands are a single method call to the front player that asks
+// for no reply. Signals queued up since the last process_events() are
+// applied first, so the ranking is current without touching the bus.
+class MprisPlayerElection : public MprisWatcher {
+public:
+  MprisPlayerElection();
+  ~MprisPlayerElection();
+
+  // MPRIS name of the front player; "" while there is none
+  const std::string &active_player() const;
+  // most recently used first
+  void get_ranking(std::vector<std::string> &ranking) const;
+  // The user acted on player by another route; it becomes the active one.
+  void note_command(const std::string &player);
+
+  // ERROR_NOT_SUPPORTED when no player is there to take the command. player
+  // receives the name of the one it went to, "" if none; the front player
+  // may have changed since active_player() was last asked.
+  int play_pause();
+  int play_pause(std::string &player);
+  int next();
+  int next(std::string &player);
+  int previous();
+  int previous(std::string &player);
+
+protected:
+  void on_started() override;
+  void on_owner_changed(const std::string &name, const char *old_owner,
+                        const char *new_owner) override;
+  void on_properties_changed(const std::string &player,
+                             DBusMessage *msg) override;
+  void on_seeked(const std::string &, DBusMessage *) override {}
+
+private:
+  struct Candidate {
+    std::list<std::string>::iterator rank;
+    // "" until the first answer or signal
+    std::string playback_status;
+  };
+
+  struct PendingStatus {
+    MprisPlayerElection *election;
+    std::string player;
+    // the Get sent when the player was first seen
+    bool initial;
+  };
+
+  static void status_reply(DBusPendingCall *call, void *user_data);
+  static void free_pending_status(void *user_data);
+  void fetch_status(const std::string &owner, const std::string &player,
+                    bool initial);
+
+  void add_candidate(const std::string &player);
+  void remove_candidate(const std::string &player);
+  void promote(const std::string &player);
+  void update_status(const std::string &player, const std::string &status);
+  int route(const char *method, std::string &player);
+
+  // front: the active player
+  std::list<std::string> ranking;
+  std::unordered_map<std::string, Candidate> candidates;
+  // outstanding PlaybackStatus Gets; cancelled on destruction, as in
+  // MprisPublisher
+  std::vector<DBusPendingCallHandle> fetches;
+};
+
+#endif /* MPRIS_ELECTION_H */
@@ -1,18 +1,32 @@
 #ifndef MPRIS_MEDIA_PLAYER_H
 #define MPRIS_MEDIA_PLAYER_H
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <dbus/dbus.h>
 #include <iostream>
+#include <list>
+#include <memory>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#include "dbus_handle.h"
+#include "dbus_transport.h"
+
 typedef enum ErrorCode {
   ERROR_NONE = 1,
   ERROR_DBUS = -1,
   ERROR_NULL_PTR = -2,
-  ERROR_UNKNOWN_TYPE = -3
+  ERROR_UNKNOWN_TYPE = -3,
+  ERROR_NOT_SUPPORTED = -4,
+  ERROR_INVALID_ARGUMENT = -5,
+  ERROR_TIMEOUT = -6,
+  ERROR_CIRCUIT_OPEN = -7,
+  ERROR_IO = -8,
+  ERROR_NOT_FOUND = -9
 
 } ErrorCodeType;
 
@@ -46,6 +60,16 @@ typedef enum DBusProperties {
   Volume
 } DBusPropertyType;
 
+typedef enum DBusCapabilities {
+  CapabilityNone = 0,
+  CapabilityCanControl = 1 << 0,
+  CapabilityCanGoNext = 1 << 1,
+  CapabilityCanGoPrevious = 1 << 2,
+  CapabilityCanPause = 1 << 3,
+  CapabilityCanPlay = 1 << 4,
+  CapabilityCanSeek = 1 << 5
+} DBusCapabilityType;
+
 typedef enum DBusLoopStatus {
   LoopStatusNone = 1,
   LoopStatusTrack,
@@ -130,17 +154,308 @@ struct DBusMetadata {
   }
 };
 
+// Compile-time description of the org.mpris.MediaPlayer2.Player
+// properties: the C++ type a value is read into, the D-Bus signature it is
+// sent with and whether it may be Set.
+template <DBusPropertyType P> struct DBusPropertyTraits;
+
+#define MPRIS_PLAYER_PROPERTY(prop, cpp_type, sig, is_writable)              \
+  template <> struct DBusPropertyTraits<prop> {                                \
+    typedef cpp_type type;                                                     \
+    static constexpr const char *iface = "org.mpris.MediaPlayer2.Player";     \
+    static constexpr const char *name = #prop;                                 \
+    static constexpr const char *signature = sig;                              \
+    static constexpr bool writable = is_writable;                              \
+  };
+
+MPRIS_PLAYER_PROPERTY(CanControl, bool, "b", false)
+MPRIS_PLAYER_PROPERTY(CanGoNext, bool, "b", false)
+MPRIS_PLAYER_PROPERTY(CanGoPrevious, bool, "b", false)
+MPRIS_PLAYER_PROPERTY(CanPause, bool, "b", false)
+MPRIS_PLAYER_PROPERTY(CanPlay, bool, "b", false)
+MPRIS_PLAYER_PROPERTY(CanSeek, bool, "b", false)
+MPRIS_PLAYER_PROPERTY(LoopStatus, DBusLoopStatusType, "s", true)
+MPRIS_PLAYER_PROPERTY(MaximumRate, double, "d", false)
+MPRIS_PLAYER_PROPERTY(Metadata, DBusMetadata, "a{sv}", false)
+MPRIS_PLAYER_PROPERTY(MinimumRate, double, "d", false)
+MPRIS_PLAYER_PROPERTY(PlaybackStatus, std::string, "s", false)
+MPRIS_PLAYER_PROPERTY(Position, int64_t, "x", false)
+MPRIS_PLAYER_PROPERTY(Rate, double, "d", true)
+MPRIS_PLAYER_PROPERTY(Shuffle, bool, "b", true)
+MPRIS_PLAYER_PROPERTY(Volume, double, "d", true)
+
+#undef MPRIS_PLAYER_PROPERTY
+
+// lets callers write get<Prop::Volume>()
+typedef DBusPropertyType Prop;
+
+// Reads a property value out of its variant and appends it to one. read()
+// fails instead of writing through a mismatched type when a player sends
+// something other than the specified signature.
+template <typename T> struct DBusPropertyCodec;
+
+template <typename T, typename WireT, int dbus_type> struct DBusBasicCodec {
+  static bool read(DBusMessageIter *iter, T &value) {
+    WireT wire_value;
+    if (dbus_message_iter_get_arg_type(iter) != dbus_type) {
+      return false;
+    }
+    dbus_message_iter_get_basic(iter, &wire_value);
+    value = wire_value;
+    return true;
+  }
+
+  static void append(DBusMessageIter *iter, const T &value) {
+    WireT wire_value = value;
+    dbus_message_iter_append_basic(iter, dbus_type, &wire_value);
+  }
+};
+
+// D-Bus booleans are 32 bit wide
+template <>
+struct DBusPropertyCodec<bool>
+    : DBusBasicCodec<bool, dbus_bool_t, DBUS_TYPE_BOOLEAN> {};
+template <>
+struct DBusPropertyCodec<double>
+    : DBusBasicCodec<double, double, DBUS_TYPE_DOUBLE> {};
+template <>
+struct DBusPropertyCodec<int64_t>
+    : DBusBasicCodec<int64_t, dbus_int64_t, DBUS_TYPE_INT64> {};
+
+template <> struct DBusPropertyCodec<std::string> {
+  static bool read(DBusMessageIter *iter, std::string &value) {
+    const char *str;
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) {
+      return false;
+    }
+    dbus_message_iter_get_basic(iter, &str);
+    value = str;
+    return true;
+  }
+
+  static void append(DBusMessageIter *iter, const std::string &value) {
+    const char *str = value.c_str();
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &str);
+  }
+};
+
+template <> struct DBusPropertyCodec<DBusLoopStatusType> {
+  static bool read(DBusMessageIter *iter, DBusLoopStatusType &value);
+  static void append(DBusMessageIter *iter, const DBusLoopStatusType &value);
+};
+
+template <> struct DBusPropertyCodec<DBusMetadata> {
+  static bool read(DBusMessageIter *iter, DBusMetadata &value);
+};
+
+// Per player request handling. Only idempotent calls (property Gets and
+// read-only methods) are retried; the breaker opens after breaker_threshold
+// consecutive timeouts and fast-fails every call to that player with
+// ERROR_CIRCUIT_OPEN until breaker_cooldown_ms has passed.
+struct DBusRequestPolicy {
+  int timeout_ms = 2000;
+  int max_retries = 2;
+  int retry_backoff_ms = 50;
+  int breaker_threshold = 3;
+  int breaker_cooldown_ms = 5000;
+};
+
+// Outcome of one command of execute_batch(). value holds the JSON encoding
+// of a property read and is empty for everything else.
+struct DBusBatchResult {
+  std::string command;
+  int status = 1; // ErrorCodeType
+  std::string value;
+  std::string error;
+};
+
+struct DBusRootInfo {
+  std::string identity;
+  std::string desktop_entry;
+  std::vector<std::string> supported_uri_schemes;
+  std::vector<std::string> supported_mime_types;
+  bool can_quit = false;
+  bool can_raise = false;
+  bool has_track_list = false;
+};
+
+struct DBusPlaylist {
+  std::string id;
+  std::string name;
+  std::string icon;
+};
+
+// Client side copy of org.mpris.MediaPlayer2.TrackList. The ordered list of
+// track ids is cheap and kept complete; metadata is only present for tracks
+// that have been paged in or announced by TrackAdded/TrackMetadataChanged.
+// Each id is indexed, so a TrackList signal costs one hash lookup however
+// long the list is.
+struct DBusTrackList {
+  typedef std::list<std::string>::iterator Position;
+
+  std::list<std::string> track_ids;
+  std::unordered_map<std::string, Position> positions;
+  std::unordered_map<std::string, DBusMetadata> metadata;
+  bool valid = false;
+
+  void replace(const std::vector<std::string> &ids) {
+    track_ids.clear();
+    positions.clear();
+    for (const std::string &id : ids) {
+      unlink(id);
+      positions[id] = track_ids.insert(track_ids.end(), id);
+    }
+    metadata.clear();
+    valid = true;
+  }
+
+  void insert_after(const std::string &after, const std::string &id) {
+    unlink(id);
+    auto it = positions.find(after);
+    // NoTrack (or an unknown id) means "at the start of the list"
+    positions[id] = track_ids.insert(
+        (it == positions.end()) ? track_ids.begin() : std::next(it->second),
+        id);
+  }
+
+  void remove(const std::string &id) {
+    unlink(id);
+    metadata.erase(id);
+  }
+
+  void rename(const std::string &old_id, const std::string &new_id) {
+    auto it = positions.find(old_id);
+    if (it != positions.end()) {
+      Position position = it->second;
+      positions.erase(it);
+      unlink(new_id);
+      *position = new_id;
+      positions[new_id] = position;
+    }
+    metadata.erase(old_id);
+  }
+
+  // the id at offset; offset must be below track_ids.size()
+  Position at(size_t offset) {
+    return std::next(track_ids.begin(), offset);
+  }
+
+private:
+  // an id is in the list once; a repeated one moves
+  void unlink(const std::string &id) {
+    auto it = positions.find(id);
+    if (it != positions.end()) {
+      track_ids.erase(it->second);
+      positions.erase(it);
+    }
+  }
+};
+
+class MprisMediaPlayer;
+
+// What the bus says about the MPRIS names, shared by every instance: who
+// owns each name and the root properties of each owner. It watches
+// NameOwnerChanged and the root interface's PropertiesChanged on a
+// connection of its own, opened by the first lookup, so it stays current
+// whether or not any player is subscribed. Nothing else dispatches that
+// connection; the signals queued on it are applied before each lookup.
+struct DBusNameCache {
+  std::shared_ptr<DBusTransport> transport;
+  // MPRIS well-known name -> unique name ("" until resolved)
+  std::unordered_map<std::string, std::string> name_owners;
+  bool name_owners_seeded = false;
+  // unique name -> root properties
+  std::unordered_map<std::string, DBusRootInfo> root_info;
+  // bumped by every signal applied and every reconnect; a reply is only
+  // cached if nothing changed while it was out
+  uint64_t generation = 0;
+};
+
+// Signal routing for one connection, shared by every instance subscribed on
+// it. The bus delivers the signals of all MPRIS players through the same two
+// match rules and they are handed to the instances watching the sender with
+// one hash lookup, so subscribing a player never touches the bus daemon.
+struct DBusSignalRouter {
+  std::shared_ptr<DBusTransport> transport;
+  // unique name -> instances subscribed to the player owning it
+  std::unordered_map<std::string, std::vector<MprisMediaPlayer *>> senders;
+  // session name -> instances, including those of players not running
+  std::unordered_map<std::string, std::vector<MprisMediaPlayer *>> sessions;
+
+  template <typename Map>
+  static void remove(Map &map, const std::string &key,
+                     MprisMediaPlayer *player) {
+    auto it = map.find(key);
+    if (it == map.end()) {
+      return;
+    }
+    auto &players = it->second;
+    players.erase(std::remove(players.begin(), players.end(), player),
+                  players.end());
+    if (players.empty()) {
+      map.erase(it);
+    }
+  }
+};
+
 class MprisMediaPlayer {
 public:
   static const std::string PATH;
+  static const std::string ROOT_IFACE;
+  static const std::string TRACKLIST_IFACE;
+  static const std::string PLAYLISTS_IFACE;
+  static const std::string NO_TRACK;
 
 public:
   MprisMediaPlayer();
   MprisMediaPlayer(const std::string &session);
+  ~MprisMediaPlayer();
 
   void set_session_name(const std::string &session);
+  void set_verbose(bool verbose_on);
+
+  void set_request_policy(const DBusRequestPolicy &request_policy);
+  const DBusRequestPolicy &get_request_policy();
+  bool is_circuit_open();
 
   int get_session_list(std::vector<std::string> &sessions);
+  int get_player_list(std::vector<std::string> &players);
+
+  /* org.mpris.MediaPlayer2 */
+  // Root properties are cached per unique bus name and shared by every
+  // instance (see DBusNameCache); after the first lookup of a player they
+  // cost no IPC until it changes them or goes away.
+  int get_root_info(DBusRootInfo &info);
+  std::string get_identity();
+  std::string get_desktop_entry();
+  bool can_quit();
+  bool can_raise();
+  int raise();
+  int quit();
+
+  // Capabilities are cached as a bitset of DBusCapabilityType. The cache is
+  // filled by a single GetAll and kept up to date by PropertiesChanged once
+  // subscribe() has been called; control methods check it locally and return
+  // ERROR_NOT_SUPPORTED without touching the bus. Without a subscription
+  // nothing tells the cache about changes, so it is only trusted for
+  // UNSUBSCRIBED_CAPABILITY_TTL_MS and then fetched again.
+  //
+  // A subscribed instance applies the signals already queued before it
+  // looks at the cache: get_capabilities(), has_capability() and the
+  // control methods run process_events(0), which dispatches the shared
+  // connection and with it the signals of every instance on it.
+  static constexpr int UNSUBSCRIBED_CAPABILITY_TTL_MS = 1000;
+
+  int refresh_capabilities();
+  uint32_t get_capabilities();
+  bool has_capability(DBusCapabilityType capability);
+
+  // Only the first subscription on a connection installs match rules (see
+  // DBusSignalRouter); later ones are local bookkeeping, plus a GetNameOwner
+  // for a player no instance has looked up yet.
+  int subscribe();
+  void unsubscribe();
+  int process_events(int timeout_ms = 0);
 
   bool can_control();
   bool can_go_next();
@@ -158,65 +473,324 @@ public:
   double get_volume();
   void set_volume(double volume);
 
+  void set_rate(double rate);
+
   int64_t get_position();
 
+  std::string get_playback_status();
+
   std::string get_loop_status();
   void set_loop_status(DBusLoopStatusType loop_status);
 
   void get_metadata(DBusMetadata &metadata);
 
-  void next();
-  void pause();
-  void play();
-  void play_pause();
-  void previous();
-  void seek(int64_t offset);
-  // void set_position(track, int64_t position);
-  void stop();
+  // Typed access to the Player properties, e.g. get<Prop::Volume>() or
+  // set<Prop::Shuffle>(true). The value type, signature and writability come
+  // from DBusPropertyTraits, so a mismatch fails to compile; set() takes the
+  // exact type only, so set<Prop::Shuffle>(0.5) is refused rather than
+  // converted. The getter returning the value yields a default constructed
+  // one on failure.
+  template <DBusPropertyType P>
+  int get(typename DBusPropertyTraits<P>::type &value);
+  template <DBusPropertyType P> typename DBusPropertyTraits<P>::type get();
+  template <DBusPropertyType P, typename V> int set(const V &value);
+
+  /* org.mpris.MediaPlayer2.TrackList */
+  // ERROR_NOT_SUPPORTED for a player whose HasTrackList is false. The track
+  // list is cached only while subscribed, when the TrackList signals keep it
+  // current. Otherwise Tracks is read again at the start of every sweep:
+  // get_tracks() at offset 0 and get_track_count() read it, the pages after
+  // the first (offset > 0) go with the ids the sweep started with.
+  void set_track_list_batch_size(size_t batch_size);
+  int get_track_count(size_t &count);
+  int get_tracks(size_t offset, size_t count, std::vector<DBusMetadata> &page);
+  int add_track(const std::string &uri, const std::string &after_track,
+                bool set_as_current);
+  int remove_track(const std::string &track_id);
+  int go_to(const std::string &track_id);
+
+  /* org.mpris.MediaPlayer2.Playlists */
+  int get_playlist_count(uint32_t &count);
+  int get_playlist_orderings(std::vector<std::string> &orderings);
+  int get_active_playlist(DBusPlaylist &playlist);
+  int get_playlists(uint32_t index, uint32_t max_count,
+                    const std::string &order, bool reverse_order,
+                    std::vector<DBusPlaylist> &playlists);
+  int activate_playlist(const std::string &playlist_id);
+
+  int next();
+  int pause();
+  int play();
+  int play_pause();
+  int previous();
+  int seek(int64_t offset);
+  int set_position(const std::string &track_id, int64_t position);
+  int stop();
+  int open_uri(const std::string &uri);
+
+  // Runs commands such as "play", "volume 0.4", "seek -10s" or
+  // "get Metadata" over one connection. Every request is sent before the
+  // first reply is awaited, so a batch costs about one round trip.
+  int execute_batch(const std::vector<std::string> &commands,
+                    std::vector<DBusBatchResult> &results);
 
   std::string convert_dbus_method_type_to_string(DBusMethodType method);
   std::string convert_dbus_property_type_to_string(DBusPropertyType property);
-  std::string convert_dbus_loop_status(DBusLoopStatusType loopStatus);
+  int convert_string_to_dbus_property_type(const std::string &property,
+                                           DBusPropertyType &type);
+  static std::string convert_dbus_loop_status(DBusLoopStatusType loopStatus);
+  static std::string convert_error_code_to_string(int code);
+  // One JSON object, as "batch" prints it: {"command":..,"ok":true,
+  // "value":..} or {"command":..,"ok":false,"code":..,"error":..}
+  static std::string format_batch_result(const DBusBatchResult &result);
 
   /* Test */
   void test_menu();
 
 private:
-  std::string get_dbus_error(const std::string &msg, DBusError *err);
+  template <typename T> friend struct DBusPropertyCodec;
+  friend class MprisAsyncPlayer;
+  friend struct DBusDecoderHarness;
+  friend class MprisRequestScheduler;
+  friend class MprisSnapshot;
+  friend class MprisVolumeRamp;
+
+  std::ostream &log();
+  // std::cerr, unless set_verbose(false): library callers print themselves
+  std::ostream &log_error();
+  std::string get_dbus_error(const std::string &msg, DBusErrorHandle &err);
   void print_dbus_variant(DBusMessageIter *iter);
 
   int connect();
   void disconnect();
 
-  DBusMessage *_dbus_msg_new_method_call(const std::string &dest,
-                                         const std::string &path,
-                                         const std::string &iface,
-                                         const std::string &method);
-  int construct_new_dbus_msg(DBusMethodType type, DBusMessage *&msg,
-                             void *set_value = nullptr);
-  int construct_new_dbus_msg(DBusPropertyType type, DBusMessage *&msg,
+  DBusMessageHandle _dbus_msg_new_method_call(const std::string &dest,
+                                              const std::string &path,
+                                              const std::string &iface,
+                                              const std::string &method);
+  int construct_new_dbus_msg(DBusMethodType type, DBusMessageHandle &msg,
                              void *set_value = nullptr);
+  int construct_new_dbus_msg(DBusPropertyType type, DBusMessageHandle &msg);
+  // leaves args ready for the value variant
+  int construct_set_msg(const char *param_iface_name,
+                        const char *param_property_name,
+                        DBusMessageHandle &msg, DBusMessageIter *args);
+  template <DBusPropertyType P, typename V>
+  int construct_set_msg(const V &value, DBusMessageHandle &msg);
+
+  int construct_get_all_msg(const std::string &param_iface_name,
+                            DBusMessageHandle &msg);
+  int construct_get_msg(const std::string &param_iface_name,
+                        const std::string &param_property_name,
+                        DBusMessageHandle &msg);
+  // iface.method taking a single object path (GoTo, ActivatePlaylist, ...);
+  // ERROR_INVALID_ARGUMENT when object is not one
+  int construct_path_call_msg(const std::string &iface,
+                              const std::string &method,
+                              const std::string &object,
+                              DBusMessageHandle &msg);
+  int construct_add_track_msg(const std::string &uri,
+                              const std::string &after_track,
+                              bool set_as_current, DBusMessageHandle &msg);
+  // the batch of track_ids starting at start
+  int construct_tracks_metadata_msg(const std::vector<std::string> &track_ids,
+                                    size_t start, DBusMessageHandle &msg);
+  int construct_get_playlists_msg(uint32_t index, uint32_t max_count,
+                                  const std::string &order,
+                                  bool reverse_order, DBusMessageHandle &msg);
+
+  int send_dbus_msg(DBusMessage *msg);
+  int send_dbus_msg_with_reply(DBusMessage *msg, DBusMessageHandle &reply,
+                               DBusErrorHandle &err, bool idempotent = false);
+  void record_call(DBusMessage *msg, int64_t sent_us, DBusMessage *reply,
+                   const DBusErrorHandle &err);
+
+  bool is_bus_daemon_msg(DBusMessage *msg);
+  void record_call_result(bool timed_out);
+  void retry_backoff(int attempt);
+
+  int execute_base_method_func(DBusMethodType type, void *set_value = nullptr);
+
+  static void fill_in_metadata(DBusMetadata &metadata, const std::string &key,
+                               DBusMessageIter *value_iter);
+
+  // output must point at the C++ type matching expected_type (a D-Bus
+  // type code); replies of any other type are refused
+  int read_reply(DBusMessage *reply, int expected_type, void *output);
+  // fetch_unknown as for check_capability()
+  int construct_batch_msg(const std::string &command, DBusMessageHandle &msg,
+                          bool &returns_value, bool fetch_unknown = true);
+  static void read_metadata(DBusMessageIter *dict_iter,
+                            DBusMetadata &metadata);
+  int read_playlist(DBusMessageIter *struct_iter, DBusPlaylist &playlist);
+  // the value of ActivePlaylist, (b(oss))
+  int read_active_playlist(DBusMessageIter *value_iter,
+                           DBusPlaylist &playlist);
+  int read_playlists(DBusMessage *reply, std::vector<DBusPlaylist> &playlists);
+  int read_root_info(DBusMessage *reply, DBusRootInfo &info);
+
+  int execute_method_call(DBusMessage *msg, DBusMessageHandle &reply,
+                          bool idempotent = false);
+  int execute_method_call_no_reply(DBusMessage *msg);
+  int execute_get_property(const std::string &iface,
+                           const std::string &property,
+                           DBusMessageHandle &reply,
+                           DBusMessageIter *value_iter);
+
+  int fetch_track_ids();
+  // the value of Tracks, ao; replaces track_list
+  int read_track_ids(DBusMessageIter *value_iter);
+  // whether track_list can be used as it is, as capabilities_current()
+  bool track_list_current();
+  // ERROR_NOT_SUPPORTED when the root info says HasTrackList is false
+  int check_track_list();
+  int fetch_tracks_metadata(const std::vector<std::string> &track_ids);
+  // a GetTracksMetadata reply, added to track_list
+  void read_tracks_metadata(DBusMessage *reply);
+  // the ids of the page without metadata in track_list
+  void list_missing_tracks(size_t offset, size_t count,
+                           std::vector<std::string> &missing);
+  // the page as far as track_list has it
+  void read_tracks_page(size_t offset, size_t count,
+                       std::vector<DBusMetadata> &page);
+  void handle_track_list_signal(DBusMessage *msg);
+
+  // the owner of session_name if it is known without asking the bus
+  bool known_name_owner(std::string &owner);
+  int resolve_name_owner(std::string &owner);
+  int fetch_root_info(DBusRootInfo &info);
+  static void read_root_property(const std::string &key,
+                                 DBusMessageIter *value_iter,
+                                 DBusRootInfo &info);
+  static void handle_name_owner_changed(DBusSignalRouter &router,
+                                        DBusMessage *msg);
+  void reset_player_state();
+  static void read_string_array(DBusMessageIter *value_iter,
+                                std::vector<std::string> &output);
+
+  // connection -> routing of the signals received on it
+  static std::unordered_map<DBusTransport *, DBusSignalRouter> routers;
+
+  static DBusNameCache name_cache;
+  // name_cache with the signals queued so far applied, or nullptr if it
+  // cannot watch the bus; lookups then ask the bus every time
+  static DBusNameCache *watch_names();
+  static std::vector<std::string> name_cache_match_rules();
+  static void name_cache_handler(DBusMessage *msg, void *user_data);
+  static void update_root_info(DBusMessage *msg);
+
+  DBusCapabilityType method_capability(DBusMethodType type);
+  DBusCapabilityType property_capability(DBusPropertyType type);
+  // Capabilities the cache cannot vouch for are fetched first, unless
+  // fetch_unknown is false; the call is then let through for the player to
+  // decide, and the cache is left as it is.
+  int check_capability(DBusMethodType type, bool fetch_unknown = true);
+  // Whether the cached bitset can be used as it is, going by the signals
+  // applied so far; it does not dispatch.
+  bool capabilities_current();
+  // against the cached bitset only; capabilities_valid must be set
+  int test_capability(DBusMethodType type);
+  int read_capabilities(DBusMessage *reply);
+  void update_capabilities(DBusMessageIter *dict_iter);
+
+  static void signal_handler(DBusMessage *msg, void *user_data);
+  void handle_properties_changed(DBusMessage *msg);
+  static std::vector<std::string> subscription_match_rules();
+  DBusSignalRouter *attach_router();
+  void detach_router();
 
-  int send_dbus_msg(DBusMessage *&msg);
-  int send_dbus_msg_with_reply(DBusMessage *&msg, DBusMessage *&reply,
-                               DBusError &err);
+  bool is_connected;
+  std::shared_ptr<DBusTransport> transport;
+  int connection_holds;
 
-  void execute_base_method_func(DBusMethodType type, void *set_value = nullptr);
-  int execute_base_property_func(DBusPropertyType type, DBusMessage *&reply,
-                                 void *set_value = nullptr);
+  std::string session_name;
+  bool verbose;
 
-  bool property_func_return_bool(DBusPropertyType type);
-  double property_func_return_double(DBusPropertyType type);
+  uint32_t capabilities;
+  bool capabilities_valid;
+  std::chrono::steady_clock::time_point capabilities_read_at;
+  bool is_subscribed;
+  // unique name this instance is routed under ("" while the player is gone)
+  std::string subscribed_owner;
 
-  void fill_in_metadata(DBusMetadata &metadata, std::string key,
-                        DBusMessageIter *value_iter);
+  DBusTrackList track_list;
+  size_t track_list_batch_size;
 
-  int read_reply(DBusMessage *reply, void *output);
+  DBusRequestPolicy policy;
+  int consecutive_timeouts;
+  std::chrono::steady_clock::time_point breaker_open_until;
+};
 
-  bool is_connected;
-  DBusConnection *conn;
+template <DBusPropertyType P>
+int MprisMediaPlayer::get(typename DBusPropertyTraits<P>::type &value) {
+  typedef DBusPropertyTraits<P> Traits;
+  DBusMessageHandle reply;
+  DBusMessageIter value_iter;
+  int output = ERROR_NONE;
 
-  std::string session_name;
-};
+  if ((output = execute_get_property(Traits::iface, Traits::name, reply,
+                                     &value_iter)) != ERROR_NONE) {
+    return output;
+  }
+
+  if (!DBusPropertyCodec<typename Traits::type>::read(&value_iter, value)) {
+    log_error() << Traits::name << " is not of type " << Traits::signature
+                << std::endl;
+    return ERROR_DBUS;
+  }
+
+  return ERROR_NONE;
+}
+
+template <DBusPropertyType P>
+typename DBusPropertyTraits<P>::type MprisMediaPlayer::get() {
+  typename DBusPropertyTraits<P>::type value{};
+
+  get<P>(value);
+
+  return value;
+}
+
+template <DBusPropertyType P, typename V>
+int MprisMediaPlayer::construct_set_msg(const V &value,
+                                        DBusMessageHandle &msg) {
+  typedef DBusPropertyTraits<P> Traits;
+  static_assert(Traits::writable, "property is read-only");
+  static_assert(std::is_same<typename std::decay<V>::type,
+                             typename Traits::type>::value,
+                "value is not of the property's type");
+  DBusMessageIter args;
+  DBusMessageIter value_iter;
+  int output = ERROR_NONE;
+
+  if ((output = construct_set_msg(Traits::iface, Traits::name, msg, &args)) !=
+      ERROR_NONE) {
+    return output;
+  }
+
+  dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, Traits::signature,
+                                   &value_iter);
+  DBusPropertyCodec<typename Traits::type>::append(&value_iter, value);
+  dbus_message_iter_close_container(&args, &value_iter);
+
+  return ERROR_NONE;
+}
+
+template <DBusPropertyType P, typename V>
+int MprisMediaPlayer::set(const V &value) {
+  static_assert(std::is_same<typename std::decay<V>::type,
+                             typename DBusPropertyTraits<P>::type>::value,
+                "value is not of the property's type");
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = construct_set_msg<P>(value, msg)) != ERROR_NONE) {
+    return output;
+  }
+
+  // Set has side effects and is sent once
+  return execute_method_call(msg.get(), reply);
+}
 
 #endif /* MPRIS_MEDIA_PLAYER_H */
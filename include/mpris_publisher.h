@@ -0,0 +1,68 @@
+#ifndef MPRIS_PUBLISHER_H
+#define MPRIS_PUBLISHER_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mpris_media_player.h"
+#include "mpris_shm.h"
+#include "mpris_watcher.h"
+
+// Keeps the state of every MPRIS player in the shared-memory region
+// described in mpris_shm.h, so local processes can read it with
+// MprisShmReader instead of each talking to the bus.
+//
+// Each player is fetched with one GetAll when it is first seen; after that
+// the slot is only updated from PropertiesChanged and Seeked. Position is
+// published as a sample plus its timestamp and extrapolated by readers.
+class MprisPublisher : public MprisWatcher {
+public:
+  MprisPublisher(const std::string &shm_name = MPRIS_SHM_NAME);
+  ~MprisPublisher();
+
+  // Creates (or takes over) and maps the region; call before run().
+  int open();
+  // Clears the slots and removes the region.
+  void close();
+
+protected:
+  void on_started() override;
+  void on_owner_changed(const std::string &name, const char *old_owner,
+                        const char *new_owner) override;
+  void on_properties_changed(const std::string &player,
+                             DBusMessage *msg) override;
+  void on_seeked(const std::string &player, DBusMessage *msg) override;
+
+private:
+  struct PendingFetch {
+    MprisPublisher *publisher;
+    std::string player;
+    bool position_only;
+  };
+
+  static void fetch_reply(DBusPendingCall *call, void *user_data);
+  static void free_pending_fetch(void *user_data);
+
+  void fetch_state(const std::string &owner, const std::string &player,
+                   bool position_only);
+  int find_slot(const std::string &player, bool allocate);
+  void apply_properties(MprisShmPlayer &state, DBusMessageIter *dict_iter);
+  void apply_metadata(MprisShmPlayer &state, const DBusMetadata &metadata);
+  void anchor_position(MprisShmPlayer &state, int64_t position);
+  void release_slot(const std::string &player);
+  void publish(int slot);
+
+  std::string shm_name;
+  MprisShmRegion *region;
+
+  // what each slot holds; copied into the region under its seqlock
+  MprisShmPlayer states[MPRIS_SHM_MAX_PLAYERS];
+  std::unordered_map<std::string, int> slots;
+
+  // outstanding GetAll/Get calls; cancelled on destruction so a late reply
+  // dispatched by another user of the shared connection cannot reach us
+  std::vector<DBusPendingCallHandle> fetches;
+};
+
+#endif /* MPRIS_PUBLISHER_H */
@@ -0,0 +1,191 @@
+#ifndef MPRIS_SCHEDULER_H
+#define MPRIS_SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "dbus_transport.h"
+#include "mpris_media_player.h"
+
+typedef enum DBusRequestPriorities {
+  // a user pressed something: play, pause, next, a volume change
+  PriorityInteractive = 0,
+  // reads a user is waiting on, e.g. to draw a window
+  PriorityNormal,
+  // refreshes nobody is waiting on; dropped when they cannot go out in time
+  PriorityBackground,
+  PriorityCount
+} DBusRequestPriorityType;
+
+// How one priority class is treated, per player.
+struct DBusRequestClassPolicy {
+  // calls of this class awaiting their reply at once
+  int max_in_flight = 1;
+  int timeout_ms = 2000;
+  // A request not sent within this is dropped with ERROR_TIMEOUT instead of
+  // going out late; 0 keeps it until it can be sent.
+  int max_queue_ms = 0;
+};
+
+// Counters of one priority class over all players. Latencies run from
+// submit() to the reply, or to the drop, and are in microseconds.
+struct DBusSchedulerStats {
+  uint64_t submitted = 0;
+  uint64_t sent = 0;
+  uint64_t completed = 0;
+  uint64_t failed = 0;
+  uint64_t dropped = 0;
+  uint64_t coalesced = 0;
+  int64_t total_latency_us = 0;
+  int64_t max_latency_us = 0;
+};
+
+// Called on the scheduler thread (or in stop()), without the scheduler's
+// lock held, so it may submit more work. result.value holds the JSON
+// encoding of what a read returned.
+typedef void (*DBusRequestHandler)(const DBusBatchResult &result,
+                                   void *user_data);
+
+// Sends requests to any number of players from one thread, in priority
+// order, so a pause press does not wait behind a slow Metadata fetch.
+//
+// Requests are the commands of execute_batch() ("pause", "volume 0.4",
+// "get Metadata"), plus "refresh", a GetAll of the Player interface that
+// also updates the capabilities used to check control commands. Until a
+// player's capabilities have been refreshed, and again once the refresh is
+// older than MprisMediaPlayer::UNSUBSCRIBED_CAPABILITY_TTL_MS, every command
+// is sent and the player decides.
+//
+// Each class has its own in-flight limit per player, and a class only gets
+// to send to a player while no higher class has a request queued or in
+// flight for it. A player handles its calls in the order they come in, so
+// an interactive request waits behind at most the few lower ones already
+// sent. Requests of a class queue in order, and identical reads queued
+// below PriorityInteractive are answered by one call.
+//
+// Like MprisVolumeRamp, the scheduler talks to the bus over a private
+// connection of its own and its traffic is not captured by DBusRecorder.
+class MprisRequestScheduler {
+public:
+  MprisRequestScheduler();
+  ~MprisRequestScheduler();
+
+  MprisRequestScheduler(const MprisRequestScheduler &) = delete;
+  MprisRequestScheduler &operator=(const MprisRequestScheduler &) = delete;
+
+  void set_class_policy(DBusRequestPriorityType priority,
+                        const DBusRequestClassPolicy &class_policy);
+  DBusRequestClassPolicy get_class_policy(DBusRequestPriorityType priority);
+
+  // Connects and starts the scheduler thread.
+  int start();
+  // Stops the thread; requests not answered yet are completed with
+  // ERROR_DBUS.
+  void stop();
+
+  // Queues command for session. A command that does not parse, or that the
+  // player's known capabilities rule out, is refused right away and the
+  // handler is not called; otherwise it is called exactly once.
+  int submit(const std::string &session, const std::string &command,
+             DBusRequestPriorityType priority,
+             DBusRequestHandler handler = nullptr,
+             void *user_data = nullptr);
+
+  // Waits until nothing is queued or in flight and every handler has
+  // returned; false if timeout_ms (-1: forever) passed.
+  bool wait_idle(int timeout_ms = -1);
+
+  DBusSchedulerStats get_stats(DBusRequestPriorityType priority);
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  // one per submit() a request answers
+  struct Waiter {
+    DBusRequestHandler handler;
+    void *user_data;
+    Clock::time_point submitted;
+  };
+
+  struct Request {
+    std::string command;
+    DBusRequestPriorityType priority = PriorityNormal;
+    DBusMessageHandle msg;
+    bool returns_value = false;
+    bool is_refresh = false;
+    // Clock::time_point::max() when the request is never dropped
+    Clock::time_point drop_at;
+    std::vector<Waiter> waiters;
+  };
+
+  struct Call {
+    Request request;
+    std::unique_ptr<DBusTransportCall> call;
+  };
+
+  // Guarded by mutex, as is everything below it. Entries stay until the
+  // scheduler goes away.
+  struct PlayerQueues {
+    MprisMediaPlayer player;
+    std::deque<Request> queued[PriorityCount];
+    std::vector<std::unique_ptr<Call>> in_flight;
+    int in_flight_count[PriorityCount] = {};
+
+    explicit PlayerQueues(const std::string &session) : player(session) {}
+  };
+
+  struct Completion {
+    DBusRequestHandler handler;
+    void *user_data;
+    DBusBatchResult result;
+  };
+
+  void run();
+  // wakes the scheduler, whether it is idle or waiting for replies
+  void wake();
+  // until the connection has traffic, wake() is called or timeout_ms passed
+  void wait_for_traffic(int timeout_ms);
+  void collect_replies(PlayerQueues &queues);
+  Clock::time_point drop_expired(PlayerQueues &queues, Clock::time_point now);
+  void send_ready(PlayerQueues &queues, DBusRequestPriorityType priority);
+  void send_request(PlayerQueues &queues, Request &request);
+  void read_reply(PlayerQueues &queues, Call &call, DBusMessage *reply,
+                  DBusBatchResult &result);
+  // result.command is filled in from request
+  void complete(Request &request, DBusBatchResult result, bool dropped);
+  void fail_all(const DBusBatchResult &result);
+  void run_handlers(std::vector<Completion> &done);
+  Clock::time_point drop_deadline(DBusRequestPriorityType priority,
+                                  Clock::time_point now);
+  bool is_idle();
+  PlayerQueues &find_or_add(const std::string &session);
+
+  DBusRequestClassPolicy class_policies[PriorityCount];
+  std::shared_ptr<DBusTransport> transport;
+  std::thread scheduler;
+  // eventfd that wake() writes to; the wait for replies polls it alongside
+  // the connection
+  int wake_fd;
+  bool running;
+  // submit() fails from then on
+  bool connection_lost;
+
+  std::mutex mutex;
+  // wakes the scheduler when it is idle, and wait_idle() when it becomes so
+  std::condition_variable changed;
+  std::unordered_map<std::string, std::unique_ptr<PlayerQueues>> players;
+  // finished requests whose handlers have not been called yet
+  std::vector<Completion> completions;
+  int handlers_running;
+  DBusSchedulerStats stats[PriorityCount];
+};
+
+#endif /* MPRIS_SCHEDULER_H */
@@ -0,0 +1,219 @@
+#ifndef MPRIS_SHM_H
+#define MPRIS_SHM_H
+
+// Fixed layout of the state region written by `dbus-music publish` and the
+// reader API for it. This header only needs libc and <atomic>, so local
+// consumers can include it without linking libdbus.
+//
+// Every player slot is guarded by its own seqlock: the publisher makes the
+// sequence odd, updates the slot and makes it even again, and a reader
+// retries its copy if the sequence was odd or moved underneath it, up to
+// MPRIS_SHM_READ_RETRIES times. Once open() has mapped the region, reads
+// are plain memory loads: no syscalls and no D-Bus traffic.
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MPRIS_SHM_NAME "/dbus-music"
+#define MPRIS_SHM_MAGIC 0x5350524dU /* "MRPS" */
+#define MPRIS_SHM_VERSION 1
+#define MPRIS_SHM_MAX_PLAYERS 16
+// A slot update takes well under a microsecond; a slot still being written
+// after this many attempts belongs to a publisher that was descheduled or
+// died in the middle of it.
+#define MPRIS_SHM_READ_RETRIES 4096
+
+// Fixed-size strings are always NUL terminated; longer values are cut.
+struct MprisShmPlayer {
+  char name[128];           // well-known bus name, "" if the slot is free
+  char playback_status[16]; // "Playing", "Paused" or "Stopped"
+  char track_id[128];
+  char title[256];
+  char artist[256]; // xesam:artist entries joined with ", "
+  char album[256];
+  char art_url[256];
+  int64_t length;        // us, 0 if unknown
+  int64_t position;      // us, as of position_time
+  int64_t position_time; // CLOCK_MONOTONIC us when position was sampled
+  double rate;
+  double volume;
+  uint64_t update_count;
+};
+
+struct MprisShmSlot {
+  std::atomic<uint32_t> sequence;
+  uint32_t reserved;
+  MprisShmPlayer player;
+};
+
+struct MprisShmRegion {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t max_players;
+  uint32_t struct_size;
+  std::atomic<uint32_t> publisher_pid;
+  uint32_t reserved;
+  MprisShmSlot slots[MPRIS_SHM_MAX_PLAYERS];
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "seqlock needs an address-free atomic");
+
+inline int64_t mpris_shm_monotonic_now() {
+  struct timespec ts;
+
+  // served from the vDSO, so this does not enter the kernel either
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Position extrapolated to now from the last sample, playback rate and
+// status, since players only signal jumps (Seeked), not progress.
+inline int64_t mpris_shm_current_position(const MprisShmPlayer &player) {
+  int64_t position = player.position;
+
+  if (strcmp(player.playback_status, "Playing") == 0) {
+    position += static_cast<int64_t>(
+        (mpris_shm_monotonic_now() - player.position_time) * player.rate);
+  }
+  if (player.length > 0 && position > player.length) {
+    position = player.length;
+  }
+
+  return position < 0 ? 0 : position;
+}
+
+typedef enum MprisShmReadStatus {
+  MprisShmSlotRead = 0,
+  MprisShmSlotFree,
+  // a write was in progress on every attempt; try again later, or check
+  // publisher_alive()
+  MprisShmSlotBusy
+} MprisShmReadStatus;
+
+class MprisShmReader {
+public:
+  MprisShmReader() : region(nullptr) {}
+  ~MprisShmReader() { close(); }
+
+  MprisShmReader(const MprisShmReader &) = delete;
+  MprisShmReader &operator=(const MprisShmReader &) = delete;
+
+  // Maps the region read-only. Returns false if no publisher has created
+  // it or its layout does not match this header.
+  bool open(const char *name = MPRIS_SHM_NAME) {
+    close();
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(MprisShmRegion)) {
+      ::close(fd);
+      return false;
+    }
+
+    void *addr =
+        mmap(nullptr, sizeof(MprisShmRegion), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+
+    region = static_cast<const MprisShmRegion *>(addr);
+    if (region->magic != MPRIS_SHM_MAGIC ||
+        region->version != MPRIS_SHM_VERSION ||
+        region->struct_size != sizeof(MprisShmRegion)) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  void close() {
+    if (region) {
+      munmap(const_cast<MprisShmRegion *>(region), sizeof(MprisShmRegion));
+      region = nullptr;
+    }
+  }
+
+  bool is_open() const { return region != nullptr; }
+
+  // Process id of the publisher, 0 once it has closed the region (or if
+  // none is mapped).
+  uint32_t publisher_pid() const {
+    return region ? region->publisher_pid.load(std::memory_order_acquire) : 0;
+  }
+
+  // Whether the publisher is still running; unlike the reads this is a
+  // syscall. A publisher that crashed leaves its pid behind, and its slots
+  // stop changing.
+  bool publisher_alive() const {
+    uint32_t pid = publisher_pid();
+
+    if (pid == 0) {
+      return false;
+    }
+    // EPERM: it exists, under another user
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+  }
+
+  // Consistent copy of one slot into out.
+  MprisShmReadStatus read_slot(int slot, MprisShmPlayer &out) const {
+    if (!region || slot < 0 || slot >= MPRIS_SHM_MAX_PLAYERS) {
+      return MprisShmSlotFree;
+    }
+
+    const MprisShmSlot &s = region->slots[slot];
+
+    for (int attempt = 0; attempt < MPRIS_SHM_READ_RETRIES; attempt++) {
+      uint32_t before = s.sequence.load(std::memory_order_acquire);
+      if (before & 1) {
+        // write in progress
+        continue;
+      }
+      memcpy(&out, &s.player, sizeof(out));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (s.sequence.load(std::memory_order_relaxed) == before) {
+        return out.name[0] != '\0' ? MprisShmSlotRead : MprisShmSlotFree;
+      }
+    }
+
+    return MprisShmSlotBusy;
+  }
+
+  // Consistent copy of one slot; false if the slot is free or busy (see
+  // read_slot()).
+  bool read_player(int slot, MprisShmPlayer &out) const {
+    return read_slot(slot, out) == MprisShmSlotRead;
+  }
+
+  // Consistent copy of the slot published for the given bus name; a busy
+  // slot is skipped.
+  bool find_player(const char *name, MprisShmPlayer &out) const {
+    for (int i = 0; i < MPRIS_SHM_MAX_PLAYERS; i++) {
+      if (read_player(i, out) && strcmp(out.name, name) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+private:
+  const MprisShmRegion *region;
+};
+
+#endif /* MPRIS_SHM_H */
@@ -0,0 +1,112 @@
+#ifndef MPRIS_SNAPSHOT_H
+#define MPRIS_SNAPSHOT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dbus_transport.h"
+#include "mpris_media_player.h"
+
+// Snapshot file layout (host byte order):
+//
+//   char    magic[8]          "DBMSNP\0" followed by the format version
+//   int64   saved_us          wall clock, us since the epoch
+//   uint32  player_count
+//   repeated:
+//     str   name
+//     int64 updated_us        when the player last confirmed the state
+//     uint32 capabilities     DBusCapabilityType bits
+//     str   playback_status
+//     double volume
+//     str   art_url, url, track_id
+//     strs  album_artist, artist
+//     str   album, title
+//     int32 disc_number, track_number
+//     int64 length
+//     double user_rating
+//
+// where str is a uint32 length followed by the bytes and strs is a uint32
+// count followed by that many str.
+#define MPRIS_SNAPSHOT_MAGIC "DBMSNP"
+#define MPRIS_SNAPSHOT_VERSION 1
+
+// What is known about one player, either read from it or from a snapshot.
+struct DBusPlayerState {
+  std::string name; // well-known bus name
+  uint32_t capabilities = CapabilityNone;
+  std::string playback_status;
+  double volume = 0;
+  DBusMetadata metadata = DBusMetadata();
+  int64_t updated_us = 0; // wall clock, us since the epoch
+  // from a previous run and not confirmed by the player yet
+  bool stale = false;
+};
+
+// Warm start for dashboards: the last known state of every player is kept
+// in a small binary file, so the next start can show it right away instead
+// of waiting for ListNames and a round of Gets per player.
+//
+// load() serves the file's players, marked stale. start() reconciles them
+// with the bus in a background thread: one ListNames and one GetAll per
+// player, all in flight at once. Players that are gone are dropped, new
+// ones added and the rest refreshed and no longer stale. With a save
+// interval the thread then refreshes and saves periodically; stop() saves
+// one last time.
+//
+// The background thread uses a private connection (as MprisVolumeRamp
+// does), so other threads keep using MprisMediaPlayer as before.
+class MprisSnapshot {
+public:
+  MprisSnapshot(const std::string &path);
+  ~MprisSnapshot();
+
+  MprisSnapshot(const MprisSnapshot &) = delete;
+  MprisSnapshot &operator=(const MprisSnapshot &) = delete;
+
+  // A missing file is a cold start, not an error.
+  int load();
+  // Written to a temporary file and renamed over the old snapshot, so a
+  // crash never leaves half of one.
+  int save();
+
+  int start(int interval_ms = 0);
+  void stop();
+
+  std::vector<DBusPlayerState> get_players();
+  bool get_player(const std::string &name, DBusPlayerState &state);
+  // Takes fresher state, e.g. from PropertiesChanged, in between rounds.
+  void update_player(const DBusPlayerState &state);
+
+  bool is_reconciled();
+  // false if timeout_ms (-1: forever) passed first
+  bool wait_reconciled(int timeout_ms = -1);
+
+  static int64_t wall_clock_us();
+
+private:
+  void run();
+  int reconcile();
+  int list_players(std::vector<std::string> &names);
+  static void read_player_state(MprisMediaPlayer &player, DBusMessage *reply,
+                                DBusPlayerState &state);
+
+  std::string path;
+  int save_interval_ms;
+  std::shared_ptr<DBusTransport> transport;
+  std::thread worker;
+  bool running;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  // sorted by name, as get_player_list() returns them
+  std::map<std::string, DBusPlayerState> players;
+  bool reconciled;
+};
+
+#endif /* MPRIS_SNAPSHOT_H */
@@ -0,0 +1,124 @@
+#ifndef MPRIS_VOLUME_RAMP_H
+#define MPRIS_VOLUME_RAMP_H
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "dbus_transport.h"
+#include "mpris_media_player.h"
+
+typedef enum VolumeCurves {
+  // constant change per update
+  CurveLinear = 1,
+  // constant ratio per update, i.e. linear in dB; sounds even to the ear
+  CurveExponential
+} VolumeCurveType;
+
+// Fades and ducking for any number of players from one scheduler thread.
+//
+// A ramp moves a player's Volume to a target over a duration, following a
+// curve. The scheduler sends at most max_rate_hz Set calls per player per
+// second and never more than one at a time: while a player has not answered
+// the previous Set, updates are coalesced into the next one. The last update
+// always carries the target itself.
+//
+// ramp() on a player that is already ramping retargets it from wherever it
+// has got to; cancel() leaves the player at its current level. A player's
+// first ramp starts from its Volume, read with one Get, unless ramp_from()
+// gives the level; after that the engine remembers what it last set.
+//
+// The engine talks to the bus over a private connection of its own, so it
+// does not get in the way of MprisMediaPlayer instances on other threads.
+// Its traffic is not captured by DBusRecorder.
+class MprisVolumeRamp {
+public:
+  static const int DEFAULT_MAX_RATE_HZ = 20;
+  // below this an exponential curve is treated as silence (-60 dB)
+  static constexpr double SILENCE = 0.001;
+  static constexpr double MIN_STEP = 0.0001;
+
+public:
+  MprisVolumeRamp(int max_rate_hz = DEFAULT_MAX_RATE_HZ);
+  ~MprisVolumeRamp();
+
+  MprisVolumeRamp(const MprisVolumeRamp &) = delete;
+  MprisVolumeRamp &operator=(const MprisVolumeRamp &) = delete;
+
+  // Connects and starts the scheduler thread.
+  int start();
+  // Stops the thread; ramps still running are left where they are.
+  void stop();
+
+  int ramp(const std::string &session, double target, int duration_ms,
+           VolumeCurveType curve = CurveLinear);
+  int ramp_from(const std::string &session, double from, double target,
+                int duration_ms, VolumeCurveType curve = CurveLinear);
+  void cancel(const std::string &session);
+  void cancel_all();
+
+  bool is_ramping(const std::string &session);
+  // Waits until no ramp is left; false if timeout_ms (-1: forever) passed.
+  bool wait_idle(int timeout_ms = -1);
+
+  // Set calls sent and updates coalesced away so far, over all players.
+  uint64_t get_set_count();
+  uint64_t get_coalesced_count();
+
+  static double curve_level(VolumeCurveType curve, double from, double target,
+                            double progress);
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  // Guarded by mutex, as is everything below it. Entries stay until the
+  // engine goes away, remembering the level last set.
+  struct PlayerRamp {
+    MprisMediaPlayer player;
+
+    bool active = false;
+    bool level_known = false;
+    double level = 0;  // last level set, or read from the player
+    double from = 0;
+    double target = 0;
+    Clock::time_point start;
+    Clock::duration duration{};
+    VolumeCurveType curve = CurveLinear;
+    Clock::time_point next_update;
+
+    std::unique_ptr<DBusTransportCall> call;
+    bool call_is_get = false;
+    // an update fell due while the call was in flight
+    bool update_waiting = false;
+
+    explicit PlayerRamp(const std::string &session) : player(session) {}
+  };
+
+  void run();
+  Clock::time_point update(PlayerRamp &state, Clock::time_point now);
+  void collect_reply(PlayerRamp &state);
+  int send_get(PlayerRamp &state);
+  int send_set(PlayerRamp &state, double value);
+  int send_call(PlayerRamp &state, DBusMessage *msg, bool is_get);
+  double current_level(const PlayerRamp &state, Clock::time_point now);
+  PlayerRamp &find_or_add(const std::string &session);
+
+  Clock::duration min_interval;
+  std::shared_ptr<DBusTransport> transport;
+  std::thread scheduler;
+  bool running;
+
+  std::mutex mutex;
+  // wakes the scheduler when it is idle, and wait_idle() when it becomes so
+  std::condition_variable changed;
+  std::unordered_map<std::string, std::unique_ptr<PlayerRamp>> players;
+  int active_count;
+  uint64_t set_count;
+  uint64_t coalesced_count;
+};
+
+#endif /* MPRIS_VOLUME_RAMP_H */
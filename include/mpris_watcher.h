@@ -0,0 +1,224 @@
+#ifndef MPRIS_WATCHER_H
+#define MPRIS_WATCHER_H
+
+#include <chrono>
+#include <cstdint>
+#include <dbus/dbus.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dbus_handle.h"
+#include "dbus_transport.h"
+
+// Polling of players that do not send PropertiesChanged (reliably); see
+// MprisWatcher::set_poll_policy(). A poll is one GetAll of the Player
+// interface. Right after a change or note_input() a player is polled every
+// fast_interval_ms; each poll that finds nothing new doubles the interval,
+// up to the ceiling for its PlaybackStatus. A ceiling of 0 suspends polling
+// until the next input.
+struct DBusPollPolicy {
+  int fast_interval_ms = 500;
+  int playing_interval_ms = 2000;
+  int paused_interval_ms = 10000;
+  int stopped_interval_ms = 30000;
+  // players known to send signals are still checked this often; 0: never
+  int audit_interval_ms = 60000;
+  // A player that once missed a change is trusted to signal again only
+  // after this many polls in a row found nothing missed and it sent
+  // PropertiesChanged meanwhile.
+  int trust_after_polls = 5;
+  int timeout_ms = 2000;
+};
+
+typedef enum DBusPollModes {
+  // no change seen yet either way; polled like a silent player
+  PollUnknown = 1,
+  // a poll found a change no signal had reported; polled until it earns
+  // trust again (DBusPollPolicy::trust_after_polls)
+  PollSilent,
+  // sends PropertiesChanged; only audited
+  PollSignals
+} DBusPollModeType;
+
+// What polling one player has cost so far. Round trips are from sending
+// the GetAll to its reply; decoding is the time spent diffing replies.
+struct DBusPollStats {
+  std::string player;
+  std::string bus; // the watcher's bus label
+  DBusPollModeType mode = PollUnknown;
+  int interval_ms = 0; // current; 0 while suspended
+  uint64_t polls = 0;
+  uint64_t failures = 0;
+  uint64_t changes = 0;
+  // changes found by polling that no signal had reported
+  uint64_t misses = 0;
+  int64_t total_rtt_us = 0;
+  int64_t max_rtt_us = 0;
+  int64_t total_decode_us = 0;
+};
+
+// Streams PropertiesChanged, Seeked and NameOwnerChanged signals of every
+// MPRIS player on the session bus as NDJSON, one compact object per event:
+//
+//   {"ts":..,"player":"org.mpris.MediaPlayer2.vlc","event":"properties",
+//    "interface":"org.mpris.MediaPlayer2.Player","changed":{..},
+//    "invalidated":[..]}
+//   {"ts":..,"player":..,"event":"seeked","position":..}
+//   {"ts":..,"player":..,"event":"owner","old_owner":..,"new_owner":..}
+//
+// "ts" is the wall-clock receive time in microseconds since the epoch. A
+// watcher given a bus label (see set_bus()) adds it as "bus" after "ts".
+// With polling on, changes a poll found end in "polled":true.
+// Lines are appended to a preallocated buffer and written with a single
+// write(2) whenever the incoming queue runs dry or the buffer fills up, so
+// a burst of signals costs one syscall rather than one flush per line.
+class MprisWatcher {
+public:
+  static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+public:
+  MprisWatcher(int fd = 1, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+  virtual ~MprisWatcher();
+
+  // Watches the bus at a D-Bus address ("unix:path=...") instead of the
+  // session bus; "session" and "system" name the standard buses. Either way
+  // the connection is private to this watcher. With a label every event
+  // carries it, so players of the same name on different buses stay apart.
+  // Takes effect on the next start().
+  void set_bus(const std::string &address, const std::string &label = "");
+  const std::string &get_bus_label() const { return bus_label; }
+
+  // Turns on polling for players that do not signal their changes. Every
+  // player is polled until it is seen to send PropertiesChanged; after
+  // that it is only audited, unless an audit finds a change it did not
+  // signal. Changes a poll finds are delivered through
+  // on_properties_changed() as if the player had sent them, Position
+  // aside, which players do not signal either. Call before start().
+  void set_poll_policy(const DBusPollPolicy &policy);
+  // The user just acted on player (by its MPRIS name), so its state is
+  // about to change: poll it fast again.
+  void note_input(const std::string &player);
+  // Until the next poll is due, for callers waiting on get_fd() themselves;
+  // -1 when none is.
+  int next_poll_ms();
+  // of the players present, or at stop() if stopped
+  void get_poll_stats(std::vector<DBusPollStats> &stats);
+
+  // Adds the match rules and learns the current owners of all MPRIS names.
+  int start();
+  void stop();
+
+  // Dispatches incoming signals for up to timeout_ms (-1 blocks) and writes
+  // out whatever they produced.
+  int process_events(int timeout_ms);
+
+  // Runs process_events() until *quit becomes non-zero or the bus or the
+  // output goes away.
+  int run(volatile int *quit);
+
+  // The connection's socket, for callers waiting on many watchers with
+  // poll(2) or epoll(7); process_events(0) once it is readable. -1 while
+  // stopped.
+  int get_fd();
+
+  uint64_t get_event_count() const { return event_count; }
+  uint64_t get_write_count() const { return write_count; }
+
+protected:
+  // Event hooks, called from the dispatch loop. The default implementations
+  // emit the NDJSON lines described above; the player map is already
+  // up to date when they run.
+  virtual void on_started() {}
+  virtual void on_owner_changed(const std::string &name, const char *old_owner,
+                                const char *new_owner);
+  virtual void on_properties_changed(const std::string &player,
+                                     DBusMessage *msg);
+  virtual void on_seeked(const std::string &player, DBusMessage *msg);
+
+  DBusConnectionHandle conn;
+
+  // unique bus name -> well-known MPRIS name; signals carry the former
+  std::unordered_map<std::string, std::string> players;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct PendingPoll {
+    MprisWatcher *watcher;
+    std::string owner;
+  };
+
+  // Polling state of one player, by unique name. values holds the JSON of
+  // each property as last seen, in a poll or a signal.
+  struct PlayerPoll {
+    DBusPollStats stats;
+    std::unordered_map<std::string, std::string> values;
+    std::string playback_status;
+    bool primed = false;
+    // note_input() since the last poll
+    bool input = false;
+    // while PollSilent: polls in a row that found nothing missed, and
+    // whether PropertiesChanged came meanwhile
+    int clean_polls = 0;
+    bool signalled = false;
+    Clock::time_point next_poll;
+    // what the notify of call is given; goes after it
+    PendingPoll reply_to;
+    std::unique_ptr<DBusTransportCall> call;
+    Clock::time_point sent;
+  };
+
+  int connect();
+  static DBusHandlerResult signal_filter(DBusConnection *connection,
+                                         DBusMessage *msg, void *user_data);
+  static std::vector<std::string> match_rules();
+
+  int seed_name_owners();
+  const std::string *lookup_player(DBusMessage *msg);
+  void handle_name_owner_changed(DBusMessage *msg);
+  void drop_players();
+
+  // mpris_watcher_poll.cpp
+  static void poll_reply(void *user_data);
+  void add_poll(const std::string &owner, const std::string &name);
+  void remove_poll(const std::string &owner);
+  void cancel_polls();
+  void clear_polls();
+  void send_due_polls();
+  void send_poll(const std::string &owner, PlayerPoll &poll);
+  void handle_poll_reply(const std::string &owner, PlayerPoll &poll,
+                         DBusMessage *reply);
+  void note_signal(const std::string &owner, DBusMessage *msg);
+  // moves a PollSilent player to PollSignals once it has earned it
+  void check_trust(PlayerPoll &poll);
+  void schedule_poll(PlayerPoll &poll, bool changed);
+  int poll_ceiling_ms(const PlayerPoll &poll);
+
+  void begin_event(const std::string &player, const char *event);
+  void end_event();
+
+  int flush();
+
+  int fd;
+  size_t flush_threshold;
+  std::string buffer;
+  bool write_failed;
+
+  bool is_started;
+
+  std::string bus_address; // empty: the shared session bus connection
+  std::string bus_label;
+
+  bool polling;
+  DBusPollPolicy poll_policy;
+  std::unordered_map<std::string, PlayerPoll> polls;
+  // set while a poll's changes go through on_properties_changed()
+  bool delivering_poll;
+
+  uint64_t event_count;
+  uint64_t write_count;
+};
+
+#endif /* MPRIS_WATCHER_H */
@@ -0,0 +1,208 @@
+#include "dbus_json.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+void append_json_string(std::string &out, const char *value) {
+  static const char hex[] = "0123456789abcdef";
+
+  out.push_back('"');
+  for (const char *c = value; *c; c++) {
+    switch (*c) {
+    case '"':
+      out.append("\\\"");
+      break;
+    case '\\':
+      out.append("\\\\");
+      break;
+    case '\n':
+      out.append("\\n");
+      break;
+    case '\r':
+      out.append("\\r");
+      break;
+    case '\t':
+      out.append("\\t");
+      break;
+    default:
+      if (static_cast<unsigned char>(*c) < 0x20) {
+        out.append("\\u00");
+        out.push_back(hex[(*c >> 4) & 0xf]);
+        out.push_back(hex[*c & 0xf]);
+      } else {
+        // D-Bus strings are valid UTF-8 already
+        out.push_back(*c);
+      }
+      break;
+    }
+  }
+  out.push_back('"');
+}
+
+bool append_json_value(std::string &out, DBusMessageIter *iter) {
+  int type = dbus_message_iter_get_arg_type(iter);
+
+  switch (type) {
+  case DBUS_TYPE_BOOLEAN: {
+    dbus_bool_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(value ? "true" : "false");
+    return true;
+  }
+  case DBUS_TYPE_BYTE: {
+    uint8_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(std::to_string(value));
+    return true;
+  }
+  case DBUS_TYPE_INT16: {
+    int16_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(std::to_string(value));
+    return true;
+  }
+  case DBUS_TYPE_UINT16: {
+    uint16_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(std::to_string(value));
+    return true;
+  }
+  case DBUS_TYPE_INT32: {
+    int32_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(std::to_string(value));
+    return true;
+  }
+  case DBUS_TYPE_UINT32: {
+    uint32_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(std::to_string(value));
+    return true;
+  }
+  case DBUS_TYPE_INT64: {
+    int64_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(std::to_string(value));
+    return true;
+  }
+  case DBUS_TYPE_UINT64: {
+    uint64_t value;
+    dbus_message_iter_get_basic(iter, &value);
+    out.append(std::to_string(value));
+    return true;
+  }
+  case DBUS_TYPE_DOUBLE: {
+    double value;
+    dbus_message_iter_get_basic(iter, &value);
+    if (std::isfinite(value)) {
+      // shortest of the two precisions that still round-trips
+      char buf[32];
+      int len = snprintf(buf, sizeof(buf), "%.15g", value);
+      if (strtod(buf, nullptr) != value) {
+        len = snprintf(buf, sizeof(buf), "%.17g", value);
+      }
+      out.append(buf, len);
+    } else {
+      out.append("null");
+    }
+    return true;
+  }
+  case DBUS_TYPE_STRING:
+  case DBUS_TYPE_OBJECT_PATH:
+  case DBUS_TYPE_SIGNATURE: {
+    const char *value;
+    dbus_message_iter_get_basic(iter, &value);
+    append_json_string(out, value);
+    return true;
+  }
+  case DBUS_TYPE_VARIANT: {
+    DBusMessageIter sub_iter;
+    dbus_message_iter_recurse(iter, &sub_iter);
+    return append_json_value(out, &sub_iter);
+  }
+  case DBUS_TYPE_ARRAY:
+  case DBUS_TYPE_STRUCT: {
+    DBusMessageIter sub_iter;
+    bool ok = true;
+    bool is_object = (type == DBUS_TYPE_ARRAY &&
+                      dbus_message_iter_get_element_type(iter) ==
+                          DBUS_TYPE_DICT_ENTRY);
+    bool first = true;
+
+    dbus_message_iter_recurse(iter, &sub_iter);
+    out.push_back(is_object ? '{' : '[');
+    while (dbus_message_iter_get_arg_type(&sub_iter) != DBUS_TYPE_INVALID) {
+      if (!first) {
+        out.push_back(',');
+      }
+      first = false;
+
+      if (is_object) {
+        DBusMessageIter entry_iter;
+        dbus_message_iter_recurse(&sub_iter, &entry_iter);
+
+        // JSON keys have to be strings; other key types are stringified
+        if (dbus_message_iter_get_arg_type(&entry_iter) == DBUS_TYPE_STRING ||
+            dbus_message_iter_get_arg_type(&entry_iter) ==
+                DBUS_TYPE_OBJECT_PATH) {
+          ok &= append_json_value(out, &entry_iter);
+        } else {
+          std::string key;
+          ok &= append_json_value(key, &entry_iter);
+          append_json_string(out, key.c_str());
+        }
+        out.push_back(':');
+        dbus_message_iter_next(&entry_iter);
+        ok &= append_json_value(out, &entry_iter);
+      } else {
+        ok &= append_json_value(out, &sub_iter);
+      }
+      dbus_message_iter_next(&sub_iter);
+    }
+    out.push_back(is_object ? '}' : ']');
+    return ok;
+  }
+  default:
+    out.append("null");
+    return false;
+  }
+}
+
+bool read_dbus_integer(DBusMessageIter *iter, int64_t &value) {
+  DBusBasicValue basic;
+
+  switch (dbus_message_iter_get_arg_type(iter)) {
+  case DBUS_TYPE_BYTE:
+    dbus_message_iter_get_basic(iter, &basic);
+    value = basic.byt;
+    return true;
+  case DBUS_TYPE_INT16:
+    dbus_message_iter_get_basic(iter, &basic);
+    value = basic.i16;
+    return true;
+  case DBUS_TYPE_UINT16:
+    dbus_message_iter_get_basic(iter, &basic);
+    value = basic.u16;
+    return true;
+  case DBUS_TYPE_INT32:
+    dbus_message_iter_get_basic(iter, &basic);
+    value = basic.i32;
+    return true;
+  case DBUS_TYPE_UINT32:
+    dbus_message_iter_get_basic(iter, &basic);
+    value = basic.u32;
+    return true;
+  case DBUS_TYPE_INT64:
+    dbus_message_iter_get_basic(iter, &basic);
+    value = basic.i64;
+    return true;
+  case DBUS_TYPE_UINT64:
+    dbus_message_iter_get_basic(iter, &basic);
+    value = static_cast<int64_t>(basic.u64);
+    return true;
+  default:
+    return false;
+  }
+}
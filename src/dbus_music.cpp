@@ -0,0 +1,339 @@
+#include "dbus_music.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dbus_json.h"
+#include "mpris_media_player.h"
+
+/*******************************************************************************
+ * C interface
+ ******************************************************************************/
+
+// The handle is subscribed to its player for as long as it is open, which
+// keeps the session connection up between calls and the capability cache
+// current through PropertiesChanged. Nothing pumps the connection between
+// calls, so each call first applies the signals queued up since the last.
+struct dbus_music_player {
+  MprisMediaPlayer player;
+  std::string name;
+};
+
+static char *copy_string(const std::string &value) {
+  char *copy = static_cast<char *>(malloc(value.size() + 1));
+
+  if (copy) {
+    memcpy(copy, value.c_str(), value.size() + 1);
+  }
+
+  return copy;
+}
+
+static int hand_out(const std::string &value, char **output) {
+  if (!(*output = copy_string(value))) {
+    return ERROR_NULL_PTR;
+  }
+
+  return ERROR_NONE;
+}
+
+// No exception may cross into a C caller. What the library throws is
+// std::bad_alloc and the like, so it is reported as an allocation failure.
+template <typename F> static int guard(F body) {
+  try {
+    return body();
+  } catch (...) {
+    return ERROR_NULL_PTR;
+  }
+}
+
+static MprisMediaPlayer *prepare(dbus_music_player *player) {
+  if (!player) {
+    return nullptr;
+  }
+  player->player.process_events(0);
+
+  return &player->player;
+}
+
+int dbus_music_abi_version(void) { return DBUS_MUSIC_ABI_VERSION; }
+
+const char *dbus_music_error_name(int code) {
+  // convert_error_code_to_string() returns a temporary; these stay valid
+  static const char *names[] = {
+      "ERROR_DBUS",          "ERROR_NULL_PTR",         "ERROR_UNKNOWN_TYPE",
+      "ERROR_NOT_SUPPORTED", "ERROR_INVALID_ARGUMENT", "ERROR_TIMEOUT",
+      "ERROR_CIRCUIT_OPEN",  "ERROR_IO",               "ERROR_NOT_FOUND"};
+
+  if (code == ERROR_NONE) {
+    return "ERROR_NONE";
+  }
+  if (code < 0 && -code <= static_cast<int>(sizeof(names) / sizeof(*names))) {
+    return names[-code - 1];
+  }
+
+  return "ERROR_UNKNOWN";
+}
+
+void dbus_music_free(void *ptr) { free(ptr); }
+
+int dbus_music_list_players(char **players_json) {
+  return guard([&]() -> int {
+    MprisMediaPlayer lookup;
+    std::vector<std::string> players;
+    std::string json = "[";
+    int output = ERROR_NONE;
+
+    if (!players_json) {
+      return ERROR_NULL_PTR;
+    }
+    *players_json = nullptr;
+
+    lookup.set_verbose(false);
+    if ((output = lookup.get_player_list(players)) != ERROR_NONE) {
+      return output;
+    }
+
+    for (size_t i = 0; i < players.size(); i++) {
+      if (i > 0) {
+        json += ",";
+      }
+      append_json_string(json, players[i].c_str());
+    }
+    json += "]";
+
+    return hand_out(json, players_json);
+  });
+}
+
+dbus_music_player *dbus_music_player_open(const char *player, int *status) {
+  std::unique_ptr<dbus_music_player> handle;
+  int result = guard([&]() -> int {
+    std::string name = player ? player : "";
+    int output = ERROR_NONE;
+
+    handle.reset(new dbus_music_player());
+    handle->player.set_verbose(false);
+
+    if (name.empty()) {
+      std::vector<std::string> players;
+      if ((output = handle->player.get_player_list(players)) == ERROR_NONE &&
+          players.empty()) {
+        output = ERROR_NOT_FOUND;
+      }
+      if (output == ERROR_NONE) {
+        name = players.front();
+      }
+    } else if (name.find('.') == std::string::npos) {
+      // the short form, as "batch -p vlc" takes it
+      name = MprisMediaPlayer::ROOT_IFACE + "." + name;
+    }
+
+    if (output == ERROR_NONE) {
+      handle->name = name;
+      handle->player.set_session_name(name);
+      output = handle->player.subscribe();
+    }
+
+    return output;
+  });
+
+  if (status) {
+    *status = result;
+  }
+  if (result != ERROR_NONE) {
+    return nullptr;
+  }
+
+  return handle.release();
+}
+
+void dbus_music_player_close(dbus_music_player *player) { delete player; }
+
+const char *dbus_music_player_name(dbus_music_player *player) {
+  return player ? player->name.c_str() : "";
+}
+
+int dbus_music_player_set_timeout(dbus_music_player *player, int timeout_ms) {
+  return guard([&]() -> int {
+    if (!player) {
+      return ERROR_NULL_PTR;
+    }
+    if (timeout_ms <= 0) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+
+    DBusRequestPolicy policy = player->player.get_request_policy();
+    policy.timeout_ms = timeout_ms;
+    player->player.set_request_policy(policy);
+
+    return ERROR_NONE;
+  });
+}
+
+int dbus_music_player_play(dbus_music_player *player) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->play() : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_pause(dbus_music_player *player) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->pause() : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_play_pause(dbus_music_player *player) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->play_pause() : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_stop(dbus_music_player *player) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->stop() : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_next(dbus_music_player *player) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->next() : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_previous(dbus_music_player *player) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->previous() : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_seek(dbus_music_player *player, int64_t offset_us) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->seek(offset_us) : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_get_volume(dbus_music_player *player, double *volume) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+
+    if (!mmp || !volume) {
+      return ERROR_NULL_PTR;
+    }
+
+    return mmp->get<Prop::Volume>(*volume);
+  });
+}
+
+int dbus_music_player_set_volume(dbus_music_player *player, double volume) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    return mmp ? mmp->set<Prop::Volume>(volume) : ERROR_NULL_PTR;
+  });
+}
+
+int dbus_music_player_get_position(dbus_music_player *player,
+                                   int64_t *position_us) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+
+    if (!mmp || !position_us) {
+      return ERROR_NULL_PTR;
+    }
+
+    return mmp->get<Prop::Position>(*position_us);
+  });
+}
+
+int dbus_music_player_get_playback_status(dbus_music_player *player,
+                                          char **status) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    std::string value;
+    int output = ERROR_NONE;
+
+    if (!mmp || !status) {
+      return ERROR_NULL_PTR;
+    }
+    *status = nullptr;
+
+    if ((output = mmp->get<Prop::PlaybackStatus>(value)) != ERROR_NONE) {
+      return output;
+    }
+
+    return hand_out(value, status);
+  });
+}
+
+int dbus_music_player_execute(dbus_music_player *player, const char *command,
+                              char **value_json) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    std::vector<DBusBatchResult> results;
+    int output = ERROR_NONE;
+
+    if (value_json) {
+      *value_json = nullptr;
+    }
+    if (!mmp || !command) {
+      return ERROR_NULL_PTR;
+    }
+
+    output = mmp->execute_batch({command}, results);
+    if (output != ERROR_NONE || !value_json || results.empty() ||
+        results[0].value.empty()) {
+      return output;
+    }
+
+    return hand_out(results[0].value, value_json);
+  });
+}
+
+int dbus_music_player_execute_batch(dbus_music_player *player,
+                                    const char *const *commands, size_t count,
+                                    char **results_json) {
+  return guard([&]() -> int {
+    MprisMediaPlayer *mmp = prepare(player);
+    std::vector<std::string> batch;
+    std::vector<DBusBatchResult> results;
+    std::string json = "[";
+    int output = ERROR_NONE;
+
+    if (!mmp || !results_json || (!commands && count > 0)) {
+      return ERROR_NULL_PTR;
+    }
+    *results_json = nullptr;
+
+    for (size_t i = 0; i < count; i++) {
+      if (!commands[i]) {
+        return ERROR_NULL_PTR;
+      }
+      batch.push_back(commands[i]);
+    }
+
+    output = mmp->execute_batch(batch, results);
+    for (size_t i = 0; i < results.size(); i++) {
+      if (i > 0) {
+        json += ",";
+      }
+      json += MprisMediaPlayer::format_batch_result(results[i]);
+    }
+    json += "]";
+
+    if (hand_out(json, results_json) != ERROR_NONE) {
+      return ERROR_NULL_PTR;
+    }
+
+    return output;
+  });
+}
@@ -0,0 +1,161 @@
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+std::atomic<FILE *> DBusRecorder::file(nullptr);
+std::mutex DBusRecorder::mutex;
+int64_t DBusRecorder::start_time_us = 0;
+DBusMessage *DBusRecorder::last_received = nullptr;
+dbus_uint32_t DBusRecorder::last_received_serial = 0;
+std::string DBusRecorder::frame;
+
+struct DBusRecordHeader {
+  int64_t time_us;
+  uint32_t length;
+  uint8_t direction;
+  uint8_t reserved[3];
+};
+
+int64_t DBusRecorder::now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+             .count() -
+         start_time_us;
+}
+
+int DBusRecorder::start(const std::string &path) {
+  char magic[8] = DBUS_RECORD_MAGIC;
+  FILE *capture;
+
+  stop();
+
+  capture = fopen(path.c_str(), "wb");
+  if (!capture) {
+    std::cerr << "cannot record to " << path << ": " << strerror(errno)
+              << std::endl;
+    return ERROR_IO;
+  }
+
+  magic[7] = DBUS_RECORD_VERSION;
+  fwrite(magic, sizeof(magic), 1, capture);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  start_time_us = 0;
+  start_time_us = now_us();
+  file.store(capture, std::memory_order_relaxed);
+
+  return ERROR_NONE;
+}
+
+void DBusRecorder::stop() {
+  std::lock_guard<std::mutex> lock(mutex);
+  FILE *capture = file.exchange(nullptr, std::memory_order_relaxed);
+
+  if (!capture) {
+    return;
+  }
+
+  fclose(capture);
+  last_received = nullptr;
+}
+
+void DBusRecorder::write_record(DBusRecordDirection direction,
+                                DBusMessage *msg, int64_t time_us) {
+  std::lock_guard<std::mutex> lock(mutex);
+  FILE *capture = file.load(std::memory_order_relaxed);
+  DBusRecordHeader header;
+  char *data;
+  int length;
+
+  // stopped since record() looked
+  if (!capture || !msg) {
+    return;
+  }
+
+  if (direction == RecordReceived) {
+    dbus_uint32_t serial = dbus_message_get_serial(msg);
+    if (msg == last_received && serial == last_received_serial) {
+      return;
+    }
+    last_received = msg;
+    last_received_serial = serial;
+  }
+
+  if (!dbus_message_marshal(msg, &data, &length)) {
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.time_us = time_us;
+  header.length = length;
+  header.direction = direction;
+
+  // header and message in one write; stdio buffering batches the writes
+  // and a capture is flushed on stop()
+  frame.assign(reinterpret_cast<const char *>(&header), sizeof(header));
+  frame.append(data, length);
+  dbus_free(data);
+  fwrite(frame.data(), frame.size(), 1, capture);
+}
+
+DBusCaptureReader::DBusCaptureReader() : file(nullptr) {}
+
+DBusCaptureReader::~DBusCaptureReader() { close(); }
+
+int DBusCaptureReader::open(const std::string &path) {
+  char magic[8];
+
+  close();
+
+  file = fopen(path.c_str(), "rb");
+  if (!file) {
+    std::cerr << "cannot open " << path << ": " << strerror(errno)
+              << std::endl;
+    return ERROR_IO;
+  }
+
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, DBUS_RECORD_MAGIC, sizeof(DBUS_RECORD_MAGIC)) != 0 ||
+      magic[7] != DBUS_RECORD_VERSION) {
+    std::cerr << path << " is not a dbus-music capture" << std::endl;
+    close();
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  return ERROR_NONE;
+}
+
+void DBusCaptureReader::close() {
+  if (file) {
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+bool DBusCaptureReader::next(DBusRecord &record) {
+  DBusRecordHeader header;
+  DBusErrorHandle err;
+
+  if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+    return false;
+  }
+
+  data.resize(header.length);
+  if (fread(&data[0], 1, header.length, file) != header.length) {
+    return false;
+  }
+
+  record.msg.reset(
+      dbus_message_demarshal(data.data(), header.length, err.get()));
+  if (!record.msg) {
+    std::cerr << "corrupt record: " << err.message() << std::endl;
+    return false;
+  }
+  record.time_us = header.time_us;
+  record.direction = static_cast<DBusRecordDirection>(header.direction);
+
+  return true;
+}
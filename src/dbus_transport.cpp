@@ -0,0 +1,290 @@
+#include "dbus_transport.h"
+#include "mpris_media_player.h"
+
+#include <algorithm>
+
+#ifdef DBUS_MUSIC_SDBUS
+// src/dbus_transport_sdbus.cpp
+std::shared_ptr<DBusTransport> create_sdbus_transport();
+#endif
+
+#ifdef DBUS_MUSIC_SDBUS_DEFAULT
+#define DBUS_TRANSPORT_DEFAULT "sd-bus"
+#else
+#define DBUS_TRANSPORT_DEFAULT "libdbus"
+#endif
+
+/*******************************************************************************
+ * libdbus backend
+ ******************************************************************************/
+
+class LibDBusCall : public DBusTransportCall {
+public:
+  LibDBusCall(DBusMessage *msg, DBusPendingCall *call, int timeout_ms)
+      : DBusTransportCall(timeout_ms), msg(DBusMessageHandle::ref(msg)),
+        pending(call), cancelled(false), handler(nullptr),
+        user_data(nullptr) {}
+
+  ~LibDBusCall() {
+    // libdbus would otherwise keep it, and its notify, until the reply
+    if (!cancelled && !completed()) {
+      dbus_pending_call_cancel(pending.get());
+    }
+  }
+
+  bool completed() override {
+    return dbus_pending_call_get_completed(pending.get());
+  }
+
+  DBusMessageHandle block() override {
+    if (expired()) {
+      // libdbus would start the timeout over, so the call is given up and
+      // the NoReply error made up here, like the one libdbus makes
+      if (!cancelled) {
+        dbus_pending_call_cancel(pending.get());
+        cancelled = true;
+      }
+      return DBusMessageHandle(dbus_message_new_error(
+          msg.get(), DBUS_ERROR_NO_REPLY, "Did not receive a reply in time"));
+    }
+
+    // libdbus completes a timed out call with a NoReply error of its own
+    dbus_pending_call_block(pending.get());
+    return DBusMessageHandle(dbus_pending_call_steal_reply(pending.get()));
+  }
+
+  void set_notify(NotifyHandler notify_handler, void *notify_data) override {
+    handler = notify_handler;
+    user_data = notify_data;
+    dbus_pending_call_set_notify(pending.get(), notify, this, nullptr);
+  }
+
+private:
+  static void notify(DBusPendingCall * /* call */, void *user_data) {
+    LibDBusCall *self = static_cast<LibDBusCall *>(user_data);
+    self->handler(self->user_data);
+  }
+
+  // the request, which the made up NoReply answers
+  DBusMessageHandle msg;
+  DBusPendingCallHandle pending;
+  bool cancelled;
+  NotifyHandler handler;
+  void *user_data;
+};
+
+class LibDBusTransport : public DBusTransport {
+public:
+  LibDBusTransport() : has_filter(false), is_private(false) {}
+
+  ~LibDBusTransport() {
+    if (has_filter) {
+      dbus_connection_remove_filter(conn.get(), filter, this);
+    }
+    if (is_private) {
+      dbus_connection_close(conn.get());
+    }
+  }
+
+  const char *name() const override { return "libdbus"; }
+
+  int connect(DBusErrorHandle &err) override {
+    // the shared connection; other users in the process may hold it too
+    conn.reset(dbus_bus_get(DBUS_BUS_SESSION, err.get()));
+    return add_filter();
+  }
+
+  int connect_private(DBusErrorHandle &err) override {
+    conn.reset(dbus_bus_get_private(DBUS_BUS_SESSION, err.get()));
+    if (conn) {
+      // libdbus insists on private connections being closed by their owner
+      is_private = true;
+      dbus_connection_set_exit_on_disconnect(conn.get(), false);
+    }
+    return add_filter();
+  }
+
+  int call(DBusMessage *msg, int timeout_ms, DBusMessageHandle &reply,
+           DBusErrorHandle &err) override {
+    reply.reset(dbus_connection_send_with_reply_and_block(
+        conn.get(), msg, timeout_ms, err.get()));
+    return reply ? ERROR_NONE : ERROR_DBUS;
+  }
+
+  int call_async(DBusMessage *msg, int timeout_ms,
+                 std::unique_ptr<DBusTransportCall> &call) override {
+    return call_async_on(conn.get(), msg, timeout_ms, call);
+  }
+
+  int send(DBusMessage *msg) override {
+    if (!dbus_connection_send(conn.get(), msg, nullptr)) {
+      return ERROR_DBUS;
+    }
+    return ERROR_NONE;
+  }
+
+  void flush() override { dbus_connection_flush(conn.get()); }
+
+  int add_match(const std::string &rule, DBusErrorHandle &err) override {
+    dbus_bus_add_match(conn.get(), rule.c_str(), err.get());
+    return err.is_set() ? ERROR_DBUS : ERROR_NONE;
+  }
+
+  void remove_match(const std::string &rule) override {
+    // passing a null error makes the call non-blocking
+    dbus_bus_remove_match(conn.get(), rule.c_str(), nullptr);
+  }
+
+  int add_signal_handler(SignalHandler handler, void *user_data) override {
+    handlers.push_back({handler, user_data});
+    return ERROR_NONE;
+  }
+
+  void remove_signal_handler(SignalHandler handler, void *user_data) override {
+    handlers.erase(std::remove_if(handlers.begin(), handlers.end(),
+                                  [&](const Handler &h) {
+                                    return h.handler == handler &&
+                                           h.user_data == user_data;
+                                  }),
+                   handlers.end());
+  }
+
+  int dispatch(int timeout_ms) override {
+    if (!dbus_connection_read_write_dispatch(conn.get(), timeout_ms)) {
+      return ERROR_DBUS;
+    }
+
+    // drain whatever else is already queued without blocking
+    while (dbus_connection_dispatch(conn.get()) ==
+           DBUS_DISPATCH_DATA_REMAINS) {
+    }
+
+    return ERROR_NONE;
+  }
+
+  int get_fd() override {
+    int unix_fd = -1;
+
+    if (!conn || !dbus_connection_get_unix_fd(conn.get(), &unix_fd)) {
+      return -1;
+    }
+
+    return unix_fd;
+  }
+
+private:
+  struct Handler {
+    SignalHandler handler;
+    void *user_data;
+  };
+
+  int add_filter() {
+    if (!conn) {
+      return ERROR_DBUS;
+    }
+
+    if (!dbus_connection_add_filter(conn.get(), filter, this, nullptr)) {
+      if (is_private) {
+        dbus_connection_close(conn.get());
+        is_private = false;
+      }
+      conn.reset();
+      return ERROR_DBUS;
+    }
+    has_filter = true;
+
+    return ERROR_NONE;
+  }
+
+  static DBusHandlerResult filter(DBusConnection * /* connection */,
+                                  DBusMessage *msg, void *user_data) {
+    LibDBusTransport *transport = static_cast<LibDBusTransport *>(user_data);
+
+    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL) {
+      for (const Handler &h : transport->handlers) {
+        h.handler(msg, h.user_data);
+      }
+    }
+
+    // other users may share this connection
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  DBusConnectionHandle conn;
+  bool has_filter;
+  bool is_private;
+  std::vector<Handler> handlers;
+};
+
+/*******************************************************************************
+ * Backend selection
+ ******************************************************************************/
+
+int DBusTransport::open_session(std::shared_ptr<DBusTransport> &transport,
+                                DBusErrorHandle &err) {
+  // shared like dbus_bus_get(): alive as long as some player holds it
+  static std::weak_ptr<DBusTransport> session;
+  int output = ERROR_NONE;
+
+  if ((transport = session.lock())) {
+    return ERROR_NONE;
+  }
+
+  transport = create(DBUS_TRANSPORT_DEFAULT);
+  if ((output = transport->connect(err)) != ERROR_NONE) {
+    transport.reset();
+    return output;
+  }
+  session = transport;
+
+  return ERROR_NONE;
+}
+
+int DBusTransport::open_private(std::shared_ptr<DBusTransport> &transport,
+                                DBusErrorHandle &err) {
+  int output = ERROR_NONE;
+
+  transport = create(DBUS_TRANSPORT_DEFAULT);
+  if ((output = transport->connect_private(err)) != ERROR_NONE) {
+    transport.reset();
+  }
+
+  return output;
+}
+
+std::shared_ptr<DBusTransport>
+DBusTransport::create(const std::string &backend) {
+  if (backend == "libdbus") {
+    return std::make_shared<LibDBusTransport>();
+  }
+#ifdef DBUS_MUSIC_SDBUS
+  if (backend == "sd-bus") {
+    return create_sdbus_transport();
+  }
+#endif
+
+  return nullptr;
+}
+
+std::vector<std::string> DBusTransport::backends() {
+#ifdef DBUS_MUSIC_SDBUS
+  return {"libdbus", "sd-bus"};
+#else
+  return {"libdbus"};
+#endif
+}
+
+int DBusTransport::call_async_on(DBusConnection *conn, DBusMessage *msg,
+                                 int timeout_ms,
+                                 std::unique_ptr<DBusTransportCall> &call) {
+  DBusPendingCall *pending = nullptr;
+
+  if (!dbus_connection_send_with_reply(conn, msg, &pending, timeout_ms) ||
+      !pending) {
+    // no memory, or the connection is already gone
+    return ERROR_DBUS;
+  }
+  call.reset(new LibDBusCall(msg, pending, timeout_ms));
+
+  return ERROR_NONE;
+}
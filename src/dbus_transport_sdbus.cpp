@@ -0,0 +1,462 @@
+#include "dbus_transport.h"
+#include "mpris_media_player.h"
+
+#include <cerrno>
+#include <cstring>
+#include <systemd/sd-bus.h>
+#include <unordered_map>
+
+// sd-bus backend, built with -DBUILD_SDBUS_TRANSPORT=ON. libdbus messages are
+// rebuilt as sd-bus messages on the way out and back on the way in; both
+// libraries use the same type codes, so the conversion is a plain walk over
+// the arguments.
+
+static uint64_t timeout_us(int timeout_ms) {
+  // libdbus' -1 means "the default", as 0 does for sd-bus
+  return timeout_ms < 0 ? 0 : static_cast<uint64_t>(timeout_ms) * 1000;
+}
+
+static void set_error(DBusErrorHandle &err, const sd_bus_error *error,
+                      int r) {
+  if (error && sd_bus_error_is_set(error)) {
+    dbus_set_error(err.get(), error->name, "%s",
+                   error->message ? error->message : "");
+  } else {
+    dbus_set_error(err.get(), DBUS_ERROR_FAILED, "%s", strerror(-r));
+  }
+}
+
+static int append_args(sd_bus_message *m, DBusMessageIter *iter) {
+  int type;
+  int r = 0;
+
+  while ((type = dbus_message_iter_get_arg_type(iter)) != DBUS_TYPE_INVALID) {
+    if (dbus_type_is_basic(type)) {
+      DBusBasicValue value;
+      dbus_message_iter_get_basic(iter, &value);
+      // sd-bus takes strings as the pointer itself
+      r = sd_bus_message_append_basic(
+          m, type,
+          (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH ||
+           type == DBUS_TYPE_SIGNATURE)
+              ? static_cast<const void *>(value.str)
+              : static_cast<const void *>(&value));
+    } else {
+      DBusMessageIter sub_iter;
+      char *signature;
+      std::string contents;
+
+      dbus_message_iter_recurse(iter, &sub_iter);
+      signature = dbus_message_iter_get_signature(
+          type == DBUS_TYPE_VARIANT ? &sub_iter : iter);
+      contents = signature;
+      dbus_free(signature);
+
+      // sd-bus wants what is inside the container: "a{sv}" -> "{sv}",
+      // "(si)" -> "si"
+      if (type == DBUS_TYPE_ARRAY) {
+        contents.erase(0, 1);
+      } else if (type == DBUS_TYPE_STRUCT || type == DBUS_TYPE_DICT_ENTRY) {
+        contents = contents.substr(1, contents.size() - 2);
+      }
+
+      if ((r = sd_bus_message_open_container(m, type, contents.c_str())) < 0 ||
+          (r = append_args(m, &sub_iter)) < 0 ||
+          (r = sd_bus_message_close_container(m)) < 0) {
+        return r;
+      }
+    }
+
+    if (r < 0) {
+      return r;
+    }
+    dbus_message_iter_next(iter);
+  }
+
+  return 0;
+}
+
+static int read_args(sd_bus_message *m, DBusMessageIter *iter) {
+  const char *contents;
+  char type;
+  int r;
+
+  while ((r = sd_bus_message_peek_type(m, &type, &contents)) > 0) {
+    if (dbus_type_is_basic(type)) {
+      DBusBasicValue value;
+      if ((r = sd_bus_message_read_basic(m, type, &value)) < 0) {
+        return r;
+      }
+      dbus_message_iter_append_basic(iter, type, &value);
+    } else {
+      DBusMessageIter sub_iter;
+
+      if ((r = sd_bus_message_enter_container(m, type, contents)) < 0) {
+        return r;
+      }
+      // only arrays and variants state their contents up front
+      dbus_message_iter_open_container(
+          iter, type,
+          (type == DBUS_TYPE_ARRAY || type == DBUS_TYPE_VARIANT) ? contents
+                                                                 : nullptr,
+          &sub_iter);
+      if ((r = read_args(m, &sub_iter)) < 0) {
+        dbus_message_iter_abandon_container(iter, &sub_iter);
+        return r;
+      }
+      dbus_message_iter_close_container(iter, &sub_iter);
+      if ((r = sd_bus_message_exit_container(m)) < 0) {
+        return r;
+      }
+    }
+  }
+
+  return r;
+}
+
+static int to_sd_bus_message(sd_bus *bus, DBusMessage *msg,
+                             sd_bus_message **m) {
+  DBusMessageIter args;
+  int r;
+
+  if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL) {
+    return -EINVAL;
+  }
+
+  if ((r = sd_bus_message_new_method_call(
+           bus, m, dbus_message_get_destination(msg),
+           dbus_message_get_path(msg), dbus_message_get_interface(msg),
+           dbus_message_get_member(msg))) < 0) {
+    return r;
+  }
+
+  if (dbus_message_get_no_reply(msg)) {
+    sd_bus_message_set_expect_reply(*m, 0);
+  }
+
+  if (dbus_message_iter_init(msg, &args) &&
+      (r = append_args(*m, &args)) < 0) {
+    *m = sd_bus_message_unref(*m);
+    return r;
+  }
+
+  return 0;
+}
+
+// call is the request m answers, or nullptr for a signal
+static DBusMessageHandle to_dbus_message(sd_bus_message *m, DBusMessage *call) {
+  DBusMessageHandle msg;
+  DBusMessageIter args;
+  uint64_t cookie;
+  uint8_t type;
+
+  if (sd_bus_message_get_type(m, &type) < 0) {
+    return msg;
+  }
+
+  if (type == SD_BUS_MESSAGE_METHOD_RETURN && call) {
+    msg.reset(dbus_message_new_method_return(call));
+  } else if (type == SD_BUS_MESSAGE_METHOD_ERROR && call) {
+    const sd_bus_error *error = sd_bus_message_get_error(m);
+    // the error text is the only argument and comes along with it
+    return DBusMessageHandle(dbus_message_new_error(
+        call, error->name, error->message ? error->message : ""));
+  } else if (type == SD_BUS_MESSAGE_SIGNAL) {
+    msg.reset(dbus_message_new_signal(sd_bus_message_get_path(m),
+                                      sd_bus_message_get_interface(m),
+                                      sd_bus_message_get_member(m)));
+  }
+
+  if (!msg) {
+    return msg;
+  }
+
+  if (sd_bus_message_get_sender(m)) {
+    dbus_message_set_sender(msg.get(), sd_bus_message_get_sender(m));
+  }
+  if (sd_bus_message_get_cookie(m, &cookie) >= 0) {
+    dbus_message_set_serial(msg.get(), static_cast<dbus_uint32_t>(cookie));
+  }
+
+  sd_bus_message_rewind(m, 1);
+  dbus_message_iter_init_append(msg.get(), &args);
+  if (read_args(m, &args) < 0) {
+    msg.reset();
+  }
+
+  return msg;
+}
+
+// Mirrors the serial sd-bus gave the message, so recording sees it as sent
+static void copy_cookie(sd_bus_message *m, DBusMessage *msg) {
+  uint64_t cookie;
+
+  if (sd_bus_message_get_cookie(m, &cookie) >= 0) {
+    dbus_message_set_serial(msg, static_cast<dbus_uint32_t>(cookie));
+  }
+}
+
+class SdBusCall : public DBusTransportCall {
+public:
+  SdBusCall(sd_bus *bus, DBusMessage *call, int timeout_ms)
+      : DBusTransportCall(timeout_ms), bus(sd_bus_ref(bus)), slot(nullptr),
+        call(DBusMessageHandle::ref(call)), done(false), handler(nullptr),
+        user_data(nullptr) {}
+
+  ~SdBusCall() {
+    // dropping the slot of a call still in flight cancels it
+    sd_bus_slot_unref(slot);
+    sd_bus_unref(bus);
+  }
+
+  static int on_reply(sd_bus_message *m, void *user_data,
+                      sd_bus_error * /* ret_error */) {
+    SdBusCall *pending = static_cast<SdBusCall *>(user_data);
+
+    pending->reply = to_dbus_message(m, pending->call.get());
+    pending->done = true;
+    if (pending->handler) {
+      pending->handler(pending->user_data);
+    }
+
+    return 1;
+  }
+
+  bool completed() override { return done; }
+
+  DBusMessageHandle block() override {
+    int r = 0;
+
+    if (expired()) {
+      // sd-bus times the call out only once it is processed again; give it
+      // up now, like LibDBusCall does
+      slot = sd_bus_slot_unref(slot);
+      return DBusMessageHandle(dbus_message_new_error(
+          call.get(), DBUS_ERROR_NO_REPLY, "Did not receive a reply in time"));
+    }
+
+    while (!done && r >= 0) {
+      if ((r = sd_bus_process(bus, nullptr)) == 0) {
+        r = sd_bus_wait(bus, UINT64_MAX);
+      }
+    }
+
+    if (!reply) {
+      // the connection went away before an answer came
+      reply.reset(dbus_message_new_error(call.get(), DBUS_ERROR_DISCONNECTED,
+                                         "Connection closed"));
+    }
+
+    return std::move(reply);
+  }
+
+  void set_notify(NotifyHandler notify_handler, void *notify_data) override {
+    handler = notify_handler;
+    user_data = notify_data;
+  }
+
+  sd_bus *bus;
+  sd_bus_slot *slot;
+  DBusMessageHandle call;
+  DBusMessageHandle reply;
+  bool done;
+  NotifyHandler handler;
+  void *user_data;
+};
+
+class SdBusTransport : public DBusTransport {
+public:
+  SdBusTransport() : bus(nullptr), last_cookie(0) {}
+
+  ~SdBusTransport() {
+    for (auto &match : matches) {
+      sd_bus_slot_unref(match.second);
+    }
+    sd_bus_flush_close_unref(bus);
+  }
+
+  const char *name() const override { return "sd-bus"; }
+
+  int connect(DBusErrorHandle &err) override {
+    int r;
+
+    if ((r = sd_bus_open_user(&bus)) < 0) {
+      set_error(err, nullptr, r);
+      return ERROR_DBUS;
+    }
+
+    return ERROR_NONE;
+  }
+
+  // sd_bus_open_user() always opens a connection of its own
+  int connect_private(DBusErrorHandle &err) override { return connect(err); }
+
+  int call(DBusMessage *msg, int timeout_ms, DBusMessageHandle &reply,
+           DBusErrorHandle &err) override {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *m = nullptr;
+    sd_bus_message *reply_m = nullptr;
+    int r;
+
+    if ((r = to_sd_bus_message(bus, msg, &m)) < 0) {
+      set_error(err, nullptr, r);
+      return ERROR_DBUS;
+    }
+
+    r = sd_bus_call(bus, m, timeout_us(timeout_ms), &error, &reply_m);
+    copy_cookie(m, msg);
+    sd_bus_message_unref(m);
+
+    if (r < 0) {
+      set_error(err, &error, r);
+      sd_bus_error_free(&error);
+      return ERROR_DBUS;
+    }
+
+    reply = to_dbus_message(reply_m, msg);
+    sd_bus_message_unref(reply_m);
+
+    return reply ? ERROR_NONE : ERROR_NULL_PTR;
+  }
+
+  int call_async(DBusMessage *msg, int timeout_ms,
+                 std::unique_ptr<DBusTransportCall> &call) override {
+    sd_bus_message *m = nullptr;
+    int r;
+
+    if (to_sd_bus_message(bus, msg, &m) < 0) {
+      return ERROR_DBUS;
+    }
+
+    SdBusCall *pending = new SdBusCall(bus, msg, timeout_ms);
+    r = sd_bus_call_async(bus, &pending->slot, m, SdBusCall::on_reply,
+                          pending, timeout_us(timeout_ms));
+    copy_cookie(m, msg);
+    sd_bus_message_unref(m);
+
+    if (r < 0) {
+      delete pending;
+      return ERROR_DBUS;
+    }
+    call.reset(pending);
+
+    return ERROR_NONE;
+  }
+
+  int send(DBusMessage *msg) override {
+    sd_bus_message *m = nullptr;
+    int r;
+
+    if (to_sd_bus_message(bus, msg, &m) < 0) {
+      return ERROR_DBUS;
+    }
+
+    r = sd_bus_send(bus, m, nullptr);
+    copy_cookie(m, msg);
+    sd_bus_message_unref(m);
+
+    return r < 0 ? ERROR_DBUS : ERROR_NONE;
+  }
+
+  void flush() override { sd_bus_flush(bus); }
+
+  int add_match(const std::string &rule, DBusErrorHandle &err) override {
+    sd_bus_slot *slot = nullptr;
+    int r;
+
+    if (matches.count(rule)) {
+      return ERROR_NONE;
+    }
+
+    if ((r = sd_bus_add_match(bus, &slot, rule.c_str(), on_signal, this)) <
+        0) {
+      set_error(err, nullptr, r);
+      return ERROR_DBUS;
+    }
+    matches[rule] = slot;
+
+    return ERROR_NONE;
+  }
+
+  void remove_match(const std::string &rule) override {
+    auto it = matches.find(rule);
+    if (it != matches.end()) {
+      // sends RemoveMatch without waiting for the answer
+      sd_bus_slot_unref(it->second);
+      matches.erase(it);
+    }
+  }
+
+  int add_signal_handler(SignalHandler handler, void *user_data) override {
+    handlers.push_back({handler, user_data});
+    return ERROR_NONE;
+  }
+
+  void remove_signal_handler(SignalHandler handler, void *user_data) override {
+    for (auto it = handlers.begin(); it != handlers.end(); ++it) {
+      if (it->handler == handler && it->user_data == user_data) {
+        handlers.erase(it);
+        return;
+      }
+    }
+  }
+
+  int dispatch(int timeout_ms) override {
+    int r;
+
+    if ((r = sd_bus_process(bus, nullptr)) == 0) {
+      r = sd_bus_wait(bus,
+                      timeout_ms < 0 ? UINT64_MAX : timeout_us(timeout_ms));
+    }
+
+    // drain whatever else is already queued without blocking
+    while (r >= 0 && (r = sd_bus_process(bus, nullptr)) > 0) {
+    }
+
+    return r < 0 ? ERROR_DBUS : ERROR_NONE;
+  }
+
+  int get_fd() override { return bus ? sd_bus_get_fd(bus) : -1; }
+
+private:
+  struct Handler {
+    SignalHandler handler;
+    void *user_data;
+  };
+
+  static int on_signal(sd_bus_message *m, void *user_data,
+                       sd_bus_error * /* ret_error */) {
+    SdBusTransport *transport = static_cast<SdBusTransport *>(user_data);
+    const char *sender = sd_bus_message_get_sender(m);
+    uint64_t cookie = 0;
+
+    // every match slot the signal fits calls us; libdbus filters see it once
+    sd_bus_message_get_cookie(m, &cookie);
+    if (cookie == transport->last_cookie && sender &&
+        transport->last_sender == sender) {
+      return 0;
+    }
+    transport->last_cookie = cookie;
+    transport->last_sender = sender ? sender : "";
+
+    DBusMessageHandle msg = to_dbus_message(m, nullptr);
+    if (msg) {
+      for (const Handler &h : transport->handlers) {
+        h.handler(msg.get(), h.user_data);
+      }
+    }
+
+    return 0;
+  }
+
+  sd_bus *bus;
+  std::unordered_map<std::string, sd_bus_slot *> matches;
+  std::vector<Handler> handlers;
+
+  uint64_t last_cookie;
+  std::string last_sender;
+};
+
+std::shared_ptr<DBusTransport> create_sdbus_transport() {
+  return std::make_shared<SdBusTransport>();
+}
@@ -1,9 +1,503 @@
+#include <algorithm>
+#include <cerrno>
 #include <dbus/dbus.h>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <poll.h>
 #include <string>
+#include <unistd.h>
+#include <vector>
 
+#include "dbus_json.h"
+#include "dbus_recorder.h"
+#include "mpris_bus_monitor.h"
+#include "mpris_election.h"
 #include "mpris_media_player.h"
+#include "mpris_publisher.h"
+#include "mpris_snapshot.h"
+#include "mpris_volume_ramp.h"
+#include "mpris_watcher.h"
 
-int main(void) {
+static void print_usage(const char *prog) {
+  std::cerr << "usage: " << prog << " [--record FILE] [MODE]\n"
+            << "\n"
+            << "modes (without one, the interactive test menu runs):\n"
+            << "  batch [-p PLAYER] [-f FILE|-] [-v] [COMMAND ...]\n"
+            << "  watch [-P] [-b LABEL=ADDRESS ...]  ADDRESS: D-Bus address, "
+               "session or system\n"
+            << "                         -P: poll players that send no "
+               "signals\n"
+            << "  publish [-n SHM_NAME]\n"
+            << "  fade [-c linear|exp] [-r HZ] VOLUME MS [PLAYER ...]\n"
+            << "  players [-s SNAPSHOT_FILE]\n"
+            << "  keys                   media keys from stdin, one per line, "
+               "go to the\n"
+            << "                         active player: play-pause, next, "
+               "previous;\n"
+            << "                         active and ranking print the "
+               "election\n"
+            << "\n"
+            << "batch commands (one per argument or per input line):\n"
+            << "  next | pause | play | play-pause | previous | stop\n"
+            << "  seek OFFSET            e.g. -10s, 500ms, 250us\n"
+            << "  set-position TRACK POS\n"
+            << "  open URI\n"
+            << "  volume LEVEL           e.g. 0.4\n"
+            << "  shuffle on|off\n"
+            << "  loop none|track|playlist\n"
+            << "  get PROPERTY           e.g. Volume, Metadata\n";
+}
+
+static void read_commands(std::istream &in, std::vector<std::string> &commands) {
+  std::string line;
+
+  while (std::getline(in, line)) {
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string::npos || line[begin] == '#') {
+      continue;
+    }
+    size_t end = line.find_last_not_of(" \t\r");
+    commands.push_back(line.substr(begin, end - begin + 1));
+  }
+}
+
+static int run_batch(int argc, char *argv[]) {
+  std::vector<std::string> commands;
+  std::vector<DBusBatchResult> results;
+  std::string player;
+  bool verbose = false;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      player = argv[++i];
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      const char *path = argv[++i];
+      if (strcmp(path, "-") == 0) {
+        read_commands(std::cin, commands);
+      } else {
+        std::ifstream file(path);
+        if (!file) {
+          std::cerr << "cannot open " << path << std::endl;
+          return 2;
+        }
+        read_commands(file, commands);
+      }
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0' &&
+               !isdigit(static_cast<unsigned char>(argv[i][1]))) {
+      print_usage(argv[0]);
+      return 2;
+    } else {
+      commands.push_back(argv[i]);
+    }
+  }
+
+  MprisMediaPlayer mmp;
+  mmp.set_verbose(verbose);
+
+  if (player.empty()) {
+    std::vector<std::string> players;
+    if (mmp.get_player_list(players) != ERROR_NONE || players.empty()) {
+      std::cerr << "no MPRIS player found on the session bus" << std::endl;
+      return 1;
+    }
+    player = players.front();
+  } else if (player.find('.') == std::string::npos) {
+    // allow the short form, e.g. "-p vlc"
+    player = MprisMediaPlayer::ROOT_IFACE + "." + player;
+  }
+  mmp.set_session_name(player);
+
+  int output = mmp.execute_batch(commands, results);
+  // one JSON object per command, in command order
+  for (const DBusBatchResult &result : results) {
+    std::cout << MprisMediaPlayer::format_batch_result(result) << "\n";
+  }
+  std::cout.flush();
+
+  if (results.empty() && output != ERROR_NONE) {
+    std::cerr << MprisMediaPlayer::convert_error_code_to_string(output)
+              << std::endl;
+  }
+
+  return output == ERROR_NONE ? 0 : 1;
+}
+
+static volatile int watch_quit = 0;
+
+static void handle_quit_signal(int) { watch_quit = 1; }
+
+// What polling cost, one line per player on stderr
+static void print_poll_stats(const std::vector<DBusPollStats> &stats) {
+  static const char *modes[] = {"", "unknown", "silent", "signals"};
+
+  for (const DBusPollStats &player : stats) {
+    uint64_t polls = std::max<uint64_t>(1, player.polls);
+
+    std::cerr << "poll " << (player.bus.empty() ? "" : player.bus + "/")
+              << player.player << ": " << modes[player.mode] << ", "
+              << player.polls << " polls (" << player.failures
+              << " failed), " << player.changes << " changes ("
+              << player.misses << " missed by signals), rtt avg "
+              << player.total_rtt_us / polls << " us max "
+              << player.max_rtt_us << " us, decode avg "
+              << player.total_decode_us / polls << " us, every "
+              << player.interval_ms << " ms" << std::endl;
+  }
+}
+
+// Without -b, the session bus; with it, every bus given, each event
+// labelled with its bus
+static int run_watch(int argc, char *argv[]) {
+  MprisBusMonitor monitor(STDOUT_FILENO);
+  std::vector<DBusPollStats> poll_stats;
+  bool poll = false;
+  int output = ERROR_NONE;
+
+  for (int i = 2; i < argc; i++) {
+    const char *bus = (i + 1 < argc) ? argv[i + 1] : "";
+    const char *equals = strchr(bus, '=');
+
+    if (strcmp(argv[i], "-P") == 0) {
+      poll = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-b") != 0 || !equals || equals == bus ||
+        monitor.add_bus(std::string(bus, equals), equals + 1) != ERROR_NONE) {
+      print_usage(argv[0]);
+      return 2;
+    }
+    i++;
+  }
+  if (poll) {
+    monitor.set_poll_policy(DBusPollPolicy());
+  }
+
+  signal(SIGINT, handle_quit_signal);
+  signal(SIGTERM, handle_quit_signal);
+  // a closed pipe shows up as a failed write instead of killing us
+  signal(SIGPIPE, SIG_IGN);
+
+  if (monitor.get_bus_count() > 0) {
+    output = monitor.run(&watch_quit);
+    monitor.get_poll_stats(poll_stats);
+  } else {
+    MprisWatcher watcher(STDOUT_FILENO);
+    if (poll) {
+      watcher.set_poll_policy(DBusPollPolicy());
+    }
+    output = watcher.run(&watch_quit);
+    watcher.get_poll_stats(poll_stats);
+  }
+  print_poll_stats(poll_stats);
+
+  if (output != ERROR_NONE) {
+    std::cerr << MprisMediaPlayer::convert_error_code_to_string(output)
+              << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int run_publish(int argc, char *argv[]) {
+  std::string shm_name = MPRIS_SHM_NAME;
+
+  if (argc == 4 && strcmp(argv[2], "-n") == 0) {
+    shm_name = argv[3];
+  } else if (argc != 2) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  signal(SIGINT, handle_quit_signal);
+  signal(SIGTERM, handle_quit_signal);
+
+  MprisPublisher publisher(shm_name);
+  int output = publisher.open();
+  if (output == ERROR_NONE) {
+    output = publisher.run(&watch_quit);
+  }
+  publisher.close();
+
+  if (output != ERROR_NONE) {
+    std::cerr << MprisMediaPlayer::convert_error_code_to_string(output)
+              << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+// Fades every player given (all of them without any) to VOLUME over MS
+// milliseconds
+static int run_fade(int argc, char *argv[]) {
+  std::vector<std::string> players;
+  VolumeCurveType curve = CurveLinear;
+  int rate_hz = MprisVolumeRamp::DEFAULT_MAX_RATE_HZ;
+  int i = 2;
+
+  for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (strcmp(argv[i], "-c") == 0 && strcmp(argv[i + 1], "exp") == 0) {
+      curve = CurveExponential;
+    } else if (strcmp(argv[i], "-c") == 0 &&
+               strcmp(argv[i + 1], "linear") == 0) {
+      curve = CurveLinear;
+    } else if (strcmp(argv[i], "-r") == 0 && atoi(argv[i + 1]) > 0) {
+      rate_hz = atoi(argv[i + 1]);
+    } else {
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - i < 2) {
+    print_usage(argv[0]);
+    return 2;
+  }
+  double target = atof(argv[i]);
+  int duration_ms = atoi(argv[i + 1]);
+
+  for (i += 2; i < argc; i++) {
+    std::string player = argv[i];
+    if (player.find('.') == std::string::npos) {
+      player = MprisMediaPlayer::ROOT_IFACE + "." + player;
+    }
+    players.push_back(player);
+  }
+  if (players.empty()) {
+    MprisMediaPlayer mmp;
+    mmp.set_verbose(false);
+    if (mmp.get_player_list(players) != ERROR_NONE || players.empty()) {
+      std::cerr << "no MPRIS player found on the session bus" << std::endl;
+      return 1;
+    }
+  }
+
+  MprisVolumeRamp ramps(rate_hz);
+  if (ramps.start() != ERROR_NONE) {
+    return 1;
+  }
+  for (const std::string &player : players) {
+    if (ramps.ramp(player, target, duration_ms, curve) != ERROR_NONE) {
+      std::cerr << "invalid fade" << std::endl;
+      return 2;
+    }
+  }
+  ramps.wait_idle();
+
+  std::cerr << ramps.get_set_count() << " Set calls, "
+            << ramps.get_coalesced_count() << " updates coalesced"
+            << std::endl;
+
+  return 0;
+}
+
+static void print_player_state(const DBusPlayerState &state) {
+  std::string line = "{\"player\":";
+
+  append_json_string(line, state.name.c_str());
+  line += std::string(",\"stale\":") + (state.stale ? "true" : "false");
+  line += ",\"updated_us\":" + std::to_string(state.updated_us);
+  line += ",\"capabilities\":" + std::to_string(state.capabilities);
+  line += ",\"status\":";
+  append_json_string(line, state.playback_status.c_str());
+  line += ",\"volume\":" + std::to_string(state.volume);
+  line += ",\"title\":";
+  append_json_string(line, state.metadata.title.c_str());
+  line += ",\"artist\":[";
+  for (size_t i = 0; i < state.metadata.artist.size(); i++) {
+    if (i > 0) {
+      line += ",";
+    }
+    append_json_string(line, state.metadata.artist[i].c_str());
+  }
+  line += "]}\n";
+
+  std::cout << line;
+}
+
+static std::string default_snapshot_path() {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  if (cache && *cache) {
+    return std::string(cache) + "/dbus-music.snapshot";
+  }
+  if (home && *home) {
+    return std::string(home) + "/.cache/dbus-music.snapshot";
+  }
+  return "dbus-music.snapshot";
+}
+
+// Lists the players from the last run's snapshot right away (stale), then
+// again once the bus has confirmed them, and saves the result for next time
+static int run_players(int argc, char *argv[]) {
+  std::string path = default_snapshot_path();
+
+  if (argc == 4 && strcmp(argv[2], "-s") == 0) {
+    path = argv[3];
+  } else if (argc != 2) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  MprisSnapshot snapshot(path);
+  snapshot.load();
+  for (const DBusPlayerState &state : snapshot.get_players()) {
+    print_player_state(state);
+  }
+  std::cout.flush();
+
+  if (snapshot.start() != ERROR_NONE) {
+    return 1;
+  }
+  if (!snapshot.wait_reconciled(2 * DBusRequestPolicy().timeout_ms + 1000)) {
+    std::cerr << "no answer from the bus, state left as it was" << std::endl;
+  }
+  snapshot.stop();
+
+  for (const DBusPlayerState &state : snapshot.get_players()) {
+    if (!state.stale) {
+      print_player_state(state);
+    }
+  }
+
+  return 0;
+}
+
+// One JSON object per key on stdout
+static void handle_key(MprisPlayerElection &election, const std::string &key) {
+  std::string line = "{\"key\":";
+  int output = ERROR_NONE;
+
+  append_json_string(line, key.c_str());
+  if (key == "ranking") {
+    std::vector<std::string> ranking;
+    election.get_ranking(ranking);
+    line += ",\"players\":[";
+    for (size_t i = 0; i < ranking.size(); i++) {
+      line += (i > 0) ? "," : "";
+      append_json_string(line, ranking[i].c_str());
+    }
+    std::cout << line << "]}" << std::endl;
+    return;
+  }
+
+  // routing applies what changed on the bus first, so the player is the
+  // one route() sent the key to, not the front player before it
+  std::string player;
+  if (key == "play-pause") {
+    output = election.play_pause(player);
+  } else if (key == "next") {
+    output = election.next(player);
+  } else if (key == "previous") {
+    output = election.previous(player);
+  } else if (key == "active") {
+    player = election.active_player();
+  } else {
+    output = ERROR_INVALID_ARGUMENT;
+  }
+  line += ",\"player\":";
+  append_json_string(line, player.c_str());
+
+  if (output == ERROR_NONE) {
+    line += ",\"ok\":true";
+  } else {
+    line += ",\"ok\":false,\"error\":";
+    append_json_string(
+        line, MprisMediaPlayer::convert_error_code_to_string(output).c_str());
+  }
+  std::cout << line << "}" << std::endl;
+}
+
+// Keys come in on stdin while the election follows the bus, until stdin
+// ends
+static int run_keys(int argc, char *argv[]) {
+  MprisPlayerElection election;
+  std::string input;
+  int output = ERROR_NONE;
+
+  if (argc != 2) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  signal(SIGINT, handle_quit_signal);
+  signal(SIGTERM, handle_quit_signal);
+
+  if ((output = election.start()) != ERROR_NONE) {
+    std::cerr << MprisMediaPlayer::convert_error_code_to_string(output)
+              << std::endl;
+    return 1;
+  }
+
+  while (!watch_quit) {
+    struct pollfd fds[2] = {{election.get_fd(), POLLIN, 0},
+                            {STDIN_FILENO, POLLIN, 0}};
+    char chunk[256];
+    ssize_t n;
+    size_t eol;
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      output = ERROR_IO;
+      break;
+    }
+    if ((output = election.process_events(0)) != ERROR_NONE) {
+      break;
+    }
+    if (!fds[1].revents) {
+      continue;
+    }
+
+    if ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) <= 0) {
+      break;
+    }
+    input.append(chunk, n);
+    while ((eol = input.find('\n')) != std::string::npos) {
+      std::string key = input.substr(0, eol);
+      input.erase(0, eol + 1);
+      key.erase(key.find_last_not_of(" \t\r") + 1);
+      if (!key.empty()) {
+        handle_key(election, key);
+      }
+    }
+  }
+  election.stop();
+
+  return output == ERROR_NONE ? 0 : 1;
+}
+
+static int run_command(int argc, char *argv[]) {
+
+  if (argc > 1) {
+    if (strcmp(argv[1], "batch") == 0) {
+      return run_batch(argc, argv);
+    }
+    if (strcmp(argv[1], "watch") == 0) {
+      return run_watch(argc, argv);
+    }
+    if (strcmp(argv[1], "publish") == 0) {
+      return run_publish(argc, argv);
+    }
+    if (strcmp(argv[1], "fade") == 0) {
+      return run_fade(argc, argv);
+    }
+    if (strcmp(argv[1], "players") == 0) {
+      return run_players(argc, argv);
+    }
+    if (strcmp(argv[1], "keys") == 0) {
+      return run_keys(argc, argv);
+    }
+    print_usage(argv[0]);
+    return 2;
+  }
 
   const std::string service_name =
       "org.mpris.MediaPlayer2.firefox.instance_1_30";
@@ -18,3 +512,23 @@ int main(void) {
 
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  int output;
+
+  // "--record FILE" in front of any mode captures its bus traffic for
+  // dbus-replay
+  if (argc > 2 && strcmp(argv[1], "--record") == 0) {
+    if (DBusRecorder::start(argv[2]) != ERROR_NONE) {
+      return 1;
+    }
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  }
+
+  output = run_command(argc, argv);
+  DBusRecorder::stop();
+
+  return output;
+}
@@ -0,0 +1,536 @@
+#include "mpris_async.h"
+
+#include <algorithm>
+
+/*******************************************************************************
+ * DBusCallAwaiter
+ ******************************************************************************/
+
+DBusCallAwaiter::DBusCallAwaiter(MprisAsyncLoop &loop, DBusMessage *msg,
+                                 int timeout_ms)
+    : loop(loop), msg(msg), timeout_ms(timeout_ms), scheduled(false) {}
+
+DBusCallAwaiter::~DBusCallAwaiter() {
+  // a task dropped mid-call; the pending call is cancelled along with it
+  loop.in_flight.erase(
+      std::remove(loop.in_flight.begin(), loop.in_flight.end(), this),
+      loop.in_flight.end());
+}
+
+bool DBusCallAwaiter::await_suspend(std::coroutine_handle<> awaiting) {
+  if (loop.transport->call_async(msg, timeout_ms, call) != ERROR_NONE) {
+    // no memory, or the connection is already gone; resume with nullptr
+    return false;
+  }
+  DBusRecorder::record(RecordSent, msg);
+
+  waiting = awaiting;
+  call->set_notify(notify, this);
+  loop.in_flight.push_back(this);
+
+  return true;
+}
+
+DBusMessageHandle DBusCallAwaiter::await_resume() {
+  if (!call) {
+    return DBusMessageHandle();
+  }
+
+  loop.in_flight.erase(
+      std::remove(loop.in_flight.begin(), loop.in_flight.end(), this),
+      loop.in_flight.end());
+
+  // woken by the reply or by expire_calls(); either way block() returns
+  // without waiting
+  return call->block();
+}
+
+void DBusCallAwaiter::notify(void *user_data) {
+  static_cast<DBusCallAwaiter *>(user_data)->wake();
+}
+
+void DBusCallAwaiter::wake() {
+  if (!scheduled) {
+    scheduled = true;
+    loop.schedule(waiting);
+  }
+}
+
+/*******************************************************************************
+ * MprisAsyncLoop
+ ******************************************************************************/
+
+MprisAsyncLoop::MprisAsyncLoop() {}
+
+MprisAsyncLoop::~MprisAsyncLoop() {
+  // unfinished tasks unregister their calls while in_flight is still here
+  tasks.clear();
+}
+
+int MprisAsyncLoop::connect() {
+  DBusErrorHandle err;
+  int output = ERROR_NONE;
+
+  if (transport) {
+    return ERROR_NONE;
+  }
+
+  if ((output = DBusTransport::open_session(transport, err)) != ERROR_NONE) {
+    std::cerr << "Connection Error (" << err.message() << ")" << std::endl;
+  }
+
+  return output;
+}
+
+void MprisAsyncLoop::spawn(DBusTask<void> task) {
+  schedule(task.handle);
+  tasks.push_back(std::move(task));
+}
+
+void MprisAsyncLoop::schedule(std::coroutine_handle<> handle) {
+  ready.push_back(handle);
+}
+
+void MprisAsyncLoop::expire_calls() {
+  for (size_t i = 0; i < in_flight.size(); i++) {
+    if (in_flight[i]->call->expired()) {
+      in_flight[i]->wake();
+    }
+  }
+}
+
+int MprisAsyncLoop::next_timeout_ms() {
+  std::chrono::steady_clock::time_point nearest;
+
+  if (in_flight.empty()) {
+    // only signals could wake a task now; wait for them
+    return -1;
+  }
+
+  nearest = in_flight.front()->call->deadline();
+  for (DBusCallAwaiter *awaiter : in_flight) {
+    nearest = std::min(nearest, awaiter->call->deadline());
+  }
+
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      nearest - std::chrono::steady_clock::now());
+  return std::max<int64_t>(0, remaining.count() + 1);
+}
+
+int MprisAsyncLoop::run() {
+  int output = ERROR_NONE;
+
+  if ((output = connect()) != ERROR_NONE) {
+    return output;
+  }
+
+  for (;;) {
+    while (!ready.empty()) {
+      std::coroutine_handle<> handle = ready.front();
+      ready.pop_front();
+      handle.resume();
+    }
+
+    tasks.erase(std::remove_if(tasks.begin(), tasks.end(),
+                               [](const DBusTask<void> &task) {
+                                 return task.done();
+                               }),
+                tasks.end());
+    if (tasks.empty()) {
+      return ERROR_NONE;
+    }
+
+    // everything resumed above has sent what it is waiting for
+    transport->flush();
+    if (transport->dispatch(next_timeout_ms()) != ERROR_NONE) {
+      std::cerr << "Connection lost" << std::endl;
+      return ERROR_DBUS;
+    }
+    expire_calls();
+  }
+}
+
+/*******************************************************************************
+ * MprisAsyncPlayer
+ ******************************************************************************/
+
+MprisAsyncPlayer::MprisAsyncPlayer(MprisAsyncLoop &loop,
+                                   const std::string &session)
+    : loop(loop), player(session) {}
+
+DBusTask<int> MprisAsyncPlayer::call(DBusMessage *msg,
+                                     DBusMessageHandle &reply) {
+  DBusErrorHandle err;
+
+  if (player.is_circuit_open()) {
+    std::cerr << "Circuit open, not calling " << player.session_name
+              << std::endl;
+    co_return ERROR_CIRCUIT_OPEN;
+  }
+
+  reply = co_await loop.call(msg, player.policy.timeout_ms);
+  if (!reply) {
+    co_return ERROR_DBUS;
+  }
+  // a timeout is synthesized locally and has no sender; the player never
+  // answered, so there is nothing to record
+  if (dbus_message_get_sender(reply.get())) {
+    DBusRecorder::record(RecordReceived, reply.get());
+  }
+
+  if (dbus_set_error_from_message(err.get(), reply.get())) {
+    bool timed_out = err.is_timeout();
+    player.record_call_result(timed_out);
+    std::cerr << player.get_dbus_error(dbus_message_get_member(msg), err)
+              << std::endl;
+    co_return timed_out ? ERROR_TIMEOUT : ERROR_DBUS;
+  }
+  player.record_call_result(false);
+
+  co_return ERROR_NONE;
+}
+
+DBusTask<int> MprisAsyncPlayer::refresh_capabilities() {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = player.construct_get_all_msg("org.mpris.MediaPlayer2.Player",
+                                             msg)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  if ((output = co_await call(msg.get(), reply)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  co_return player.read_capabilities(reply.get());
+}
+
+DBusTask<DBusResult<bool>>
+MprisAsyncPlayer::has_capability(DBusCapabilityType capability) {
+  DBusResult<bool> result;
+
+  if (!player.capabilities_current()) {
+    result.status = co_await refresh_capabilities();
+  }
+  result.value = (player.capabilities & capability) == capability;
+
+  co_return result;
+}
+
+DBusTask<int> MprisAsyncPlayer::check_capability(DBusMethodType type) {
+  int output = ERROR_NONE;
+
+  if (player.method_capability(type) == CapabilityNone) {
+    co_return ERROR_NONE;
+  }
+
+  // The first control action pays for a single GetAll, later ones are
+  // local. (g++ 12 miscompiles co_await on the right of &&, so no shortcut.)
+  if (!player.capabilities_current()) {
+    output = co_await refresh_capabilities();
+    if (output != ERROR_NONE) {
+      // unknown capabilities; let the player decide
+      co_return ERROR_NONE;
+    }
+  }
+
+  co_return player.test_capability(type);
+}
+
+DBusTask<int> MprisAsyncPlayer::call_method(DBusMethodType type, void *value) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = co_await check_capability(type)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  if ((output = player.construct_new_dbus_msg(type, msg, value)) !=
+      ERROR_NONE) {
+    co_return output;
+  }
+
+  co_return co_await call(msg.get(), reply);
+}
+
+DBusTask<int> MprisAsyncPlayer::seek(int64_t offset) {
+  // offset lives in this frame until the call is answered
+  co_return co_await call_method(Seek, &offset);
+}
+
+DBusTask<int> MprisAsyncPlayer::set_position(std::string track_id,
+                                             int64_t position) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  const char *track_cstr = track_id.c_str();
+  int output = ERROR_NONE;
+
+  if (!dbus_validate_path(track_cstr, nullptr)) {
+    co_return ERROR_INVALID_ARGUMENT;
+  }
+
+  if ((output = co_await check_capability(SetPosition)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  if ((output = player.construct_new_dbus_msg(SetPosition, msg)) !=
+      ERROR_NONE) {
+    co_return output;
+  }
+
+  dbus_message_append_args(msg.get(), DBUS_TYPE_OBJECT_PATH, &track_cstr,
+                           DBUS_TYPE_INT64, &position, DBUS_TYPE_INVALID);
+
+  co_return co_await call(msg.get(), reply);
+}
+
+DBusTask<int> MprisAsyncPlayer::open_uri(std::string uri) {
+  co_return co_await call_method(OpenUri, &uri);
+}
+
+DBusTask<DBusResult<DBusRootInfo>> MprisAsyncPlayer::root_info() {
+  DBusResult<DBusRootInfo> result;
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  std::string owner;
+  DBusNameCache *cache = MprisMediaPlayer::watch_names();
+  bool cached = cache && player.known_name_owner(owner);
+  uint64_t generation = cache ? cache->generation : 0;
+
+  if (cached) {
+    auto it = cache->root_info.find(owner);
+    if (it != cache->root_info.end()) {
+      result.value = it->second;
+      co_return result;
+    }
+  }
+
+  if ((result.status = player.construct_get_all_msg(
+           MprisMediaPlayer::ROOT_IFACE, msg)) != ERROR_NONE) {
+    co_return result;
+  }
+
+  if ((result.status = co_await call(msg.get(), reply)) != ERROR_NONE) {
+    co_return result;
+  }
+
+  if ((result.status = player.read_root_info(reply.get(), result.value)) ==
+          ERROR_NONE &&
+      cached && cache->generation == generation) {
+    // other lookups may have applied newer signals while the call was out
+    cache->root_info[owner] = result.value;
+  }
+
+  co_return result;
+}
+
+DBusTask<DBusResult<std::string>> MprisAsyncPlayer::identity() {
+  DBusResult<DBusRootInfo> info = co_await root_info();
+  DBusResult<std::string> result;
+
+  result.status = info.status;
+  result.value = info.value.identity;
+
+  co_return result;
+}
+
+DBusTask<int> MprisAsyncPlayer::raise() {
+  co_return co_await call_root_method("Raise", &DBusRootInfo::can_raise);
+}
+
+DBusTask<int> MprisAsyncPlayer::quit() {
+  co_return co_await call_root_method("Quit", &DBusRootInfo::can_quit);
+}
+
+DBusTask<int> MprisAsyncPlayer::call_root_method(std::string method,
+                                                 bool DBusRootInfo::*allowed) {
+  DBusResult<DBusRootInfo> info = co_await root_info();
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+
+  if (!info.ok()) {
+    co_return info.status;
+  }
+  if (!(info.value.*allowed)) {
+    co_return ERROR_NOT_SUPPORTED;
+  }
+
+  msg = player._dbus_msg_new_method_call(player.session_name,
+                                         MprisMediaPlayer::PATH,
+                                         MprisMediaPlayer::ROOT_IFACE, method);
+  if (!msg) {
+    std::cerr << "Message Null" << std::endl;
+    co_return ERROR_NULL_PTR;
+  }
+
+  co_return co_await call(msg.get(), reply);
+}
+
+DBusTask<int> MprisAsyncPlayer::fetch_track_ids() {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  DBusMessageIter args;
+  DBusMessageIter value_iter;
+  int output = ERROR_NONE;
+
+  if ((output = player.construct_get_msg(MprisMediaPlayer::TRACKLIST_IFACE,
+                                         "Tracks", msg)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  if ((output = co_await call(msg.get(), reply)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  if (!dbus_message_iter_init(reply.get(), &args) ||
+      dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_VARIANT) {
+    std::cerr << "Argument is not variant!" << std::endl;
+    co_return ERROR_DBUS;
+  }
+  dbus_message_iter_recurse(&args, &value_iter);
+
+  co_return player.read_track_ids(&value_iter);
+}
+
+DBusTask<int> MprisAsyncPlayer::check_track_list() {
+  DBusResult<DBusRootInfo> info = co_await root_info();
+
+  // unknown; let the player decide
+  if (!info.ok() || info.value.has_track_list) {
+    co_return ERROR_NONE;
+  }
+
+  std::cerr << "TrackList is not supported by " << player.session_name
+            << std::endl;
+  co_return ERROR_NOT_SUPPORTED;
+}
+
+DBusTask<DBusResult<std::vector<DBusMetadata>>>
+MprisAsyncPlayer::get_tracks(size_t offset, size_t count) {
+  DBusResult<std::vector<DBusMetadata>> result;
+  std::vector<std::string> missing;
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+
+  if ((result.status = co_await check_track_list()) != ERROR_NONE) {
+    co_return result;
+  }
+
+  // later pages of a sweep reuse the ids of its first one
+  if (!player.track_list_current() &&
+      !(offset > 0 && player.track_list.valid)) {
+    result.status = co_await fetch_track_ids();
+    if (result.status != ERROR_NONE) {
+      co_return result;
+    }
+  }
+
+  // one GetTracksMetadata per batch, as the blocking get_tracks()
+  player.list_missing_tracks(offset, count, missing);
+  for (size_t start = 0; start < missing.size();
+       start += player.track_list_batch_size) {
+    if ((result.status = player.construct_tracks_metadata_msg(
+             missing, start, msg)) != ERROR_NONE) {
+      co_return result;
+    }
+    if ((result.status = co_await call(msg.get(), reply)) != ERROR_NONE) {
+      co_return result;
+    }
+    player.read_tracks_metadata(reply.get());
+  }
+
+  player.read_tracks_page(offset, count, result.value);
+
+  co_return result;
+}
+
+DBusTask<int> MprisAsyncPlayer::add_track(std::string uri,
+                                          std::string after_track,
+                                          bool set_as_current) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = player.construct_add_track_msg(uri, after_track,
+                                               set_as_current, msg)) !=
+      ERROR_NONE) {
+    co_return output;
+  }
+  if ((output = co_await check_track_list()) != ERROR_NONE) {
+    co_return output;
+  }
+
+  co_return co_await call(msg.get(), reply);
+}
+
+DBusTask<int> MprisAsyncPlayer::remove_track(std::string track_id) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = player.construct_path_call_msg(
+           MprisMediaPlayer::TRACKLIST_IFACE, "RemoveTrack", track_id, msg)) !=
+      ERROR_NONE) {
+    co_return output;
+  }
+  if ((output = co_await check_track_list()) != ERROR_NONE) {
+    co_return output;
+  }
+
+  co_return co_await call(msg.get(), reply);
+}
+
+DBusTask<int> MprisAsyncPlayer::go_to(std::string track_id) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = player.construct_path_call_msg(
+           MprisMediaPlayer::TRACKLIST_IFACE, "GoTo", track_id, msg)) !=
+      ERROR_NONE) {
+    co_return output;
+  }
+  if ((output = co_await check_track_list()) != ERROR_NONE) {
+    co_return output;
+  }
+
+  co_return co_await call(msg.get(), reply);
+}
+
+DBusTask<DBusResult<std::vector<DBusPlaylist>>>
+MprisAsyncPlayer::get_playlists(uint32_t index, uint32_t max_count,
+                                std::string order, bool reverse_order) {
+  DBusResult<std::vector<DBusPlaylist>> result;
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+
+  if ((result.status = player.construct_get_playlists_msg(
+           index, max_count, order, reverse_order, msg)) != ERROR_NONE) {
+    co_return result;
+  }
+
+  if ((result.status = co_await call(msg.get(), reply)) != ERROR_NONE) {
+    co_return result;
+  }
+
+  result.status = player.read_playlists(reply.get(), result.value);
+
+  co_return result;
+}
+
+DBusTask<int> MprisAsyncPlayer::activate_playlist(std::string playlist_id) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = player.construct_path_call_msg(
+           MprisMediaPlayer::PLAYLISTS_IFACE, "ActivatePlaylist", playlist_id,
+           msg)) != ERROR_NONE) {
+    co_return output;
+  }
+
+  co_return co_await call(msg.get(), reply);
+}
@@ -0,0 +1,272 @@
+#include "dbus_json.h"
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+
+#include <cstdlib>
+#include <sstream>
+
+/*******************************************************************************
+ * Batch command mode
+ ******************************************************************************/
+
+// "-10s", "500ms", "250us" or a bare number of microseconds
+static bool parse_offset(const std::string &str, int64_t &offset) {
+  char *end;
+  double value = strtod(str.c_str(), &end);
+  std::string unit(end);
+
+  if (end == str.c_str()) {
+    return false;
+  }
+
+  if (unit == "" || unit == "us") {
+    offset = static_cast<int64_t>(value);
+  } else if (unit == "ms") {
+    offset = static_cast<int64_t>(value * 1000);
+  } else if (unit == "s") {
+    offset = static_cast<int64_t>(value * 1000000);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static bool parse_bool(const std::string &str, bool &value) {
+  if (str == "on" || str == "true" || str == "1") {
+    value = true;
+  } else if (str == "off" || str == "false" || str == "0") {
+    value = false;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+int MprisMediaPlayer::construct_batch_msg(const std::string &command,
+                                          DBusMessageHandle &msg,
+                                          bool &returns_value,
+                                          bool fetch_unknown) {
+  static const std::unordered_map<std::string, DBusMethodType> methodMap = {
+      {"next", Next},         {"pause", Pause},       {"play", Play},
+      {"play-pause", PlayPause}, {"previous", Previous}, {"stop", Stop}};
+
+  std::istringstream tokens(command);
+  std::string verb;
+  std::string arg;
+  std::string extra;
+  int output = ERROR_NONE;
+
+  returns_value = false;
+
+  tokens >> verb >> arg;
+  std::getline(tokens >> std::ws, extra);
+
+  auto it = methodMap.find(verb);
+  if (it != methodMap.end()) {
+    if (!arg.empty()) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    if ((output = check_capability(it->second, fetch_unknown)) !=
+        ERROR_NONE) {
+      return output;
+    }
+    return construct_new_dbus_msg(it->second, msg);
+  }
+
+  if (verb == "seek") {
+    int64_t offset;
+    if (!parse_offset(arg, offset) || !extra.empty()) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    if ((output = check_capability(Seek, fetch_unknown)) != ERROR_NONE) {
+      return output;
+    }
+    return construct_new_dbus_msg(Seek, msg, &offset);
+  }
+
+  if (verb == "set-position") {
+    int64_t position;
+    const char *track_cstr = arg.c_str();
+    if (!dbus_validate_path(track_cstr, nullptr) ||
+        !parse_offset(extra, position)) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    if ((output = check_capability(SetPosition, fetch_unknown)) !=
+            ERROR_NONE ||
+        (output = construct_new_dbus_msg(SetPosition, msg)) != ERROR_NONE) {
+      return output;
+    }
+    dbus_message_append_args(msg.get(), DBUS_TYPE_OBJECT_PATH, &track_cstr,
+                             DBUS_TYPE_INT64, &position, DBUS_TYPE_INVALID);
+    return ERROR_NONE;
+  }
+
+  if (verb == "open") {
+    // URIs may not contain spaces, but keep whatever follows the verb
+    std::string uri = extra.empty() ? arg : arg + " " + extra;
+    if (uri.empty()) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    return construct_new_dbus_msg(OpenUri, msg, &uri);
+  }
+
+  if (verb == "volume") {
+    char *end;
+    double volume = strtod(arg.c_str(), &end);
+    if (arg.empty() || *end || !extra.empty()) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    return construct_set_msg<Volume>(volume, msg);
+  }
+
+  if (verb == "shuffle") {
+    bool shuffle_on;
+    if (!parse_bool(arg, shuffle_on) || !extra.empty()) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    return construct_set_msg<Shuffle>(shuffle_on, msg);
+  }
+
+  if (verb == "loop") {
+    DBusLoopStatusType loop_status;
+    if (arg == "none") {
+      loop_status = LoopStatusNone;
+    } else if (arg == "track") {
+      loop_status = LoopStatusTrack;
+    } else if (arg == "playlist") {
+      loop_status = LoopStatusPlaylist;
+    } else {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    return construct_set_msg<LoopStatus>(loop_status, msg);
+  }
+
+  if (verb == "get") {
+    DBusPropertyType type;
+    if (!extra.empty() ||
+        convert_string_to_dbus_property_type(arg, type) != ERROR_NONE) {
+      return ERROR_INVALID_ARGUMENT;
+    }
+    returns_value = true;
+    return construct_new_dbus_msg(type, msg);
+  }
+
+  return ERROR_UNKNOWN_TYPE;
+}
+
+int MprisMediaPlayer::execute_batch(const std::vector<std::string> &commands,
+                                    std::vector<DBusBatchResult> &results) {
+  std::vector<std::unique_ptr<DBusTransportCall>> pending(commands.size());
+  std::vector<bool> returns_value(commands.size(), false);
+  int output = ERROR_NONE;
+
+  results.assign(commands.size(), DBusBatchResult());
+
+  // Connect to the session bus
+  if (!is_connected && ((output = connect()) != ERROR_NONE)) {
+    return output;
+  }
+
+  // the capability lookup below must not drop the connection under us
+  connection_holds++;
+
+  // Queue every request before waiting for any reply
+  for (size_t i = 0; i < commands.size(); i++) {
+    DBusMessageHandle msg;
+    bool value = false;
+
+    results[i].command = commands[i];
+
+    if ((results[i].status = construct_batch_msg(commands[i], msg, value)) !=
+        ERROR_NONE) {
+      continue;
+    }
+    returns_value[i] = value;
+
+    if (is_circuit_open()) {
+      results[i].status = ERROR_CIRCUIT_OPEN;
+      continue;
+    }
+
+    if (transport->call_async(msg.get(), policy.timeout_ms, pending[i]) !=
+        ERROR_NONE) {
+      // no memory, or the connection is already gone
+      results[i].status = ERROR_DBUS;
+      continue;
+    }
+    DBusRecorder::record(RecordSent, msg.get());
+  }
+
+  transport->flush();
+
+  // Collect the replies in order
+  for (size_t i = 0; i < commands.size(); i++) {
+    DBusMessageHandle reply;
+    DBusErrorHandle err;
+    DBusMessageIter args;
+
+    if (!pending[i]) {
+      continue;
+    }
+
+    reply = pending[i]->block();
+    if (!reply) {
+      results[i].status = ERROR_NULL_PTR;
+      continue;
+    }
+    // a timeout is synthesized locally and has no sender; the player never
+    // answered, so there is nothing to record
+    if (dbus_message_get_sender(reply.get())) {
+      DBusRecorder::record(RecordReceived, reply.get());
+    }
+
+    if (dbus_set_error_from_message(err.get(), reply.get())) {
+      bool timed_out = err.is_timeout();
+      record_call_result(timed_out);
+      results[i].status = timed_out ? ERROR_TIMEOUT : ERROR_DBUS;
+      results[i].error = err.name() + ": " + err.message();
+      continue;
+    }
+    record_call_result(false);
+
+    if (returns_value[i] && dbus_message_iter_init(reply.get(), &args)) {
+      append_json_value(results[i].value, &args);
+    }
+  }
+
+  connection_holds--;
+  disconnect();
+
+  for (const DBusBatchResult &result : results) {
+    if (result.status != ERROR_NONE) {
+      return result.status;
+    }
+  }
+
+  return ERROR_NONE;
+}
+
+std::string
+MprisMediaPlayer::format_batch_result(const DBusBatchResult &result) {
+  std::string json = "{\"command\":";
+
+  append_json_string(json, result.command.c_str());
+  if (result.status == ERROR_NONE) {
+    json += ",\"ok\":true";
+    if (!result.value.empty()) {
+      json += ",\"value\":" + result.value;
+    }
+  } else {
+    json += ",\"ok\":false,\"code\":" + std::to_string(result.status) +
+            ",\"error\":";
+    append_json_string(json, result.error.empty()
+                                 ? convert_error_code_to_string(result.status)
+                                       .c_str()
+                                 : result.error.c_str());
+  }
+  json += "}";
+
+  return json;
+}
@@ -0,0 +1,233 @@
+#include "mpris_bus_monitor.h"
+#include "mpris_media_player.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+MprisBusMonitor::MprisBusMonitor(int fd)
+    : fd(fd), epoll_fd(-1), is_started(false), polling(false) {}
+
+MprisBusMonitor::~MprisBusMonitor() { stop(); }
+
+int MprisBusMonitor::add_bus(const std::string &label,
+                             const std::string &address) {
+  if (address.empty()) {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  for (const auto &bus : buses) {
+    if (bus->label == label) {
+      std::cerr << "bus " << label << " added twice" << std::endl;
+      return ERROR_INVALID_ARGUMENT;
+    }
+  }
+
+  buses.emplace_back(new Bus(fd, label, address));
+  if (polling) {
+    buses.back()->watcher.set_poll_policy(poll_policy);
+  }
+  if (is_started) {
+    connect_bus(*buses.back());
+  }
+
+  return ERROR_NONE;
+}
+
+void MprisBusMonitor::set_poll_policy(const DBusPollPolicy &policy) {
+  polling = true;
+  poll_policy = policy;
+  for (const auto &bus : buses) {
+    bus->watcher.set_poll_policy(policy);
+  }
+}
+
+void MprisBusMonitor::get_poll_stats(std::vector<DBusPollStats> &stats) {
+  std::vector<DBusPollStats> bus_stats;
+
+  stats.clear();
+  for (const auto &bus : buses) {
+    bus->watcher.get_poll_stats(bus_stats);
+    stats.insert(stats.end(), bus_stats.begin(), bus_stats.end());
+  }
+}
+
+int MprisBusMonitor::start() {
+  if (is_started) {
+    return ERROR_NONE;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    std::cerr << "epoll_create1 failed: " << strerror(errno) << std::endl;
+    return ERROR_IO;
+  }
+  is_started = true;
+
+  for (const auto &bus : buses) {
+    connect_bus(*bus);
+  }
+
+  return ERROR_NONE;
+}
+
+void MprisBusMonitor::stop() {
+  if (!is_started) {
+    return;
+  }
+
+  for (const auto &bus : buses) {
+    disconnect_bus(*bus);
+  }
+  close(epoll_fd);
+  epoll_fd = -1;
+  is_started = false;
+}
+
+size_t MprisBusMonitor::get_connected_count() const {
+  return std::count_if(buses.begin(), buses.end(),
+                       [](const std::unique_ptr<Bus> &bus) {
+                         return bus->connected;
+                       });
+}
+
+int MprisBusMonitor::connect_bus(Bus &bus) {
+  struct epoll_event event = {};
+  int output = ERROR_NONE;
+
+  bus.next_attempt =
+      Clock::now() + std::chrono::milliseconds(RETRY_INTERVAL_MS);
+
+  if ((output = bus.watcher.start()) != ERROR_NONE) {
+    std::cerr << "bus " << bus.label << " (" << bus.address
+              << ") not reachable, retrying" << std::endl;
+    return output;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &bus;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bus.watcher.get_fd(), &event) != 0) {
+    std::cerr << "epoll_ctl failed: " << strerror(errno) << std::endl;
+    bus.watcher.stop();
+    return ERROR_IO;
+  }
+  bus.connected = true;
+
+  // signals that came in while the owners were being seeded are already
+  // queued, and the socket will not tell about them
+  return bus.watcher.process_events(0);
+}
+
+void MprisBusMonitor::disconnect_bus(Bus &bus) {
+  if (!bus.connected) {
+    return;
+  }
+
+  // before stop() closes the socket
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, bus.watcher.get_fd(), nullptr);
+  bus.watcher.stop();
+  bus.connected = false;
+  bus.next_attempt =
+      Clock::now() + std::chrono::milliseconds(RETRY_INTERVAL_MS);
+}
+
+void MprisBusMonitor::retry_buses() {
+  Clock::time_point now = Clock::now();
+
+  for (const auto &bus : buses) {
+    if (!bus->connected && bus->next_attempt <= now) {
+      connect_bus(*bus);
+    }
+  }
+}
+
+int MprisBusMonitor::next_timeout_ms(int timeout_ms) {
+  Clock::time_point now = Clock::now();
+
+  for (const auto &bus : buses) {
+    if (bus->connected) {
+      int poll_ms = bus->watcher.next_poll_ms();
+      if (poll_ms >= 0 && (timeout_ms < 0 || poll_ms < timeout_ms)) {
+        timeout_ms = poll_ms;
+      }
+      continue;
+    }
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    bus->next_attempt - now)
+                    .count();
+    wait = std::max<int64_t>(0, wait + 1);
+    if (timeout_ms < 0 || wait < timeout_ms) {
+      timeout_ms = static_cast<int>(wait);
+    }
+  }
+
+  return timeout_ms;
+}
+
+int MprisBusMonitor::process_events(int timeout_ms) {
+  struct epoll_event events[32];
+  int output = ERROR_NONE;
+
+  if (!is_started) {
+    return ERROR_NONE;
+  }
+
+  int count = epoll_wait(epoll_fd, events, 32, next_timeout_ms(timeout_ms));
+  if (count < 0 && errno != EINTR) {
+    std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+    return ERROR_IO;
+  }
+
+  for (int i = 0; i < count; i++) {
+    Bus &bus = *static_cast<Bus *>(events[i].data.ptr);
+
+    if ((output = service_bus(bus)) != ERROR_NONE) {
+      return output;
+    }
+  }
+
+  // polls fall due without the socket saying anything
+  for (const auto &bus : buses) {
+    if (bus->connected && bus->watcher.next_poll_ms() == 0 &&
+        (output = service_bus(*bus)) != ERROR_NONE) {
+      return output;
+    }
+  }
+
+  retry_buses();
+
+  return ERROR_NONE;
+}
+
+int MprisBusMonitor::service_bus(Bus &bus) {
+  int output = bus.watcher.process_events(0);
+
+  if (output == ERROR_IO) {
+    // the reader is gone; nothing left to monitor for
+    return output;
+  }
+  if (output != ERROR_NONE) {
+    std::cerr << "bus " << bus.label << " lost, retrying" << std::endl;
+    disconnect_bus(bus);
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisBusMonitor::run(volatile int *quit) {
+  int output = ERROR_NONE;
+
+  if ((output = start()) != ERROR_NONE) {
+    return output;
+  }
+
+  // wake up now and then to notice *quit
+  while (!*quit && (output = process_events(250)) == ERROR_NONE) {
+  }
+
+  stop();
+
+  return output;
+}
@@ -0,0 +1,317 @@
+#include "mpris_election.h"
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+
+#include <algorithm>
+#include <cstring>
+
+// The PlaybackStatus in a variant, or nullptr if it is not a string
+static const char *read_status(DBusMessageIter *variant_iter) {
+  DBusMessageIter value_iter;
+  const char *status;
+
+  if (dbus_message_iter_get_arg_type(variant_iter) != DBUS_TYPE_VARIANT) {
+    return nullptr;
+  }
+  dbus_message_iter_recurse(variant_iter, &value_iter);
+  if (dbus_message_iter_get_arg_type(&value_iter) != DBUS_TYPE_STRING) {
+    return nullptr;
+  }
+  dbus_message_iter_get_basic(&value_iter, &status);
+
+  return status;
+}
+
+MprisPlayerElection::MprisPlayerElection() : MprisWatcher(-1, 0) {}
+
+MprisPlayerElection::~MprisPlayerElection() {
+  for (DBusPendingCallHandle &fetch : fetches) {
+    dbus_pending_call_cancel(fetch.get());
+  }
+  stop();
+}
+
+const std::string &MprisPlayerElection::active_player() const {
+  static const std::string none;
+
+  return ranking.empty() ? none : ranking.front();
+}
+
+void MprisPlayerElection::get_ranking(std::vector<std::string> &ranking) const {
+  ranking.assign(this->ranking.begin(), this->ranking.end());
+}
+
+void MprisPlayerElection::note_command(const std::string &player) {
+  promote(player);
+  note_input(player);
+}
+
+int MprisPlayerElection::play_pause() {
+  std::string player;
+  return route("PlayPause", player);
+}
+
+int MprisPlayerElection::play_pause(std::string &player) {
+  return route("PlayPause", player);
+}
+
+int MprisPlayerElection::next() {
+  std::string player;
+  return route("Next", player);
+}
+
+int MprisPlayerElection::next(std::string &player) {
+  return route("Next", player);
+}
+
+int MprisPlayerElection::previous() {
+  std::string player;
+  return route("Previous", player);
+}
+
+int MprisPlayerElection::previous(std::string &player) {
+  return route("Previous", player);
+}
+
+int MprisPlayerElection::route(const char *method, std::string &player) {
+  player.clear();
+  if (!conn) {
+    return ERROR_DBUS;
+  }
+
+  // whatever changed since the last dispatch decides who gets the key
+  if (process_events(0) != ERROR_NONE) {
+    return ERROR_DBUS;
+  }
+  if (ranking.empty()) {
+    return ERROR_NOT_SUPPORTED;
+  }
+
+  player = ranking.front();
+  DBusMessageHandle msg(dbus_message_new_method_call(
+      player.c_str(), MprisMediaPlayer::PATH.c_str(),
+      "org.mpris.MediaPlayer2.Player", method));
+
+  if (!msg) {
+    return ERROR_NULL_PTR;
+  }
+
+  // the player's answer would change nothing here; PlaybackStatus comes in
+  // as a signal anyway
+  dbus_message_set_no_reply(msg.get(), TRUE);
+  if (!dbus_connection_send(conn.get(), msg.get(), nullptr)) {
+    return ERROR_DBUS;
+  }
+  dbus_connection_flush(conn.get());
+  DBusRecorder::record(RecordSent, msg.get());
+
+  note_command(player);
+
+  return ERROR_NONE;
+}
+
+void MprisPlayerElection::add_candidate(const std::string &player) {
+  if (candidates.count(player)) {
+    return;
+  }
+
+  ranking.push_back(player);
+  candidates[player].rank = std::prev(ranking.end());
+}
+
+void MprisPlayerElection::remove_candidate(const std::string &player) {
+  auto it = candidates.find(player);
+
+  if (it == candidates.end()) {
+    return;
+  }
+
+  ranking.erase(it->second.rank);
+  candidates.erase(it);
+}
+
+void MprisPlayerElection::promote(const std::string &player) {
+  auto it = candidates.find(player);
+
+  if (it != candidates.end()) {
+    ranking.splice(ranking.begin(), ranking, it->second.rank);
+  }
+}
+
+void MprisPlayerElection::update_status(const std::string &player,
+                                        const std::string &status) {
+  auto it = candidates.find(player);
+
+  if (it == candidates.end()) {
+    return;
+  }
+
+  // players resend an unchanged PlaybackStatus along with other changes,
+  // e.g. on every new track; only starting to play counts as use
+  bool started = status == "Playing" && it->second.playback_status != status;
+  it->second.playback_status = status;
+  if (started) {
+    promote(player);
+  }
+}
+
+void MprisPlayerElection::on_started() {
+  std::vector<std::string> names;
+
+  // players still there from an earlier start() keep their place
+  for (const auto &entry : players) {
+    names.push_back(entry.second);
+  }
+  for (auto it = candidates.begin(); it != candidates.end();) {
+    if (std::find(names.begin(), names.end(), it->first) == names.end()) {
+      ranking.erase(it->second.rank);
+      it = candidates.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (const auto &entry : players) {
+    add_candidate(entry.second);
+    fetch_status(entry.first, entry.second, true);
+  }
+  dbus_connection_flush(conn.get());
+}
+
+void MprisPlayerElection::on_owner_changed(const std::string &name,
+                                           const char *old_owner,
+                                           const char *new_owner) {
+  if (*old_owner) {
+    remove_candidate(name);
+  }
+
+  if (*new_owner) {
+    add_candidate(name);
+    fetch_status(new_owner, name, true);
+    dbus_connection_flush(conn.get());
+  }
+}
+
+void MprisPlayerElection::on_properties_changed(const std::string &player,
+                                                DBusMessage *msg) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+  DBusMessageIter entry_iter;
+  char *iface;
+
+  if (!dbus_message_has_signature(msg, "sa{sv}as")) {
+    return;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_get_basic(&args, &iface);
+  if (strcmp(iface, "org.mpris.MediaPlayer2.Player") != 0) {
+    return;
+  }
+
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    const char *key;
+    const char *status;
+
+    dbus_message_iter_recurse(&dict_iter, &entry_iter);
+    dbus_message_iter_get_basic(&entry_iter, &key);
+    dbus_message_iter_next(&entry_iter);
+    if (strcmp(key, "PlaybackStatus") == 0 &&
+        (status = read_status(&entry_iter))) {
+      update_status(player, status);
+      return;
+    }
+    dbus_message_iter_next(&dict_iter);
+  }
+
+  // invalidated rather than sent; ask for it
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &entry_iter);
+  while (dbus_message_iter_get_arg_type(&entry_iter) == DBUS_TYPE_STRING) {
+    const char *name;
+
+    dbus_message_iter_get_basic(&entry_iter, &name);
+    if (strcmp(name, "PlaybackStatus") == 0 && dbus_message_get_sender(msg)) {
+      fetch_status(dbus_message_get_sender(msg), player, false);
+      dbus_connection_flush(conn.get());
+      return;
+    }
+    dbus_message_iter_next(&entry_iter);
+  }
+}
+
+void MprisPlayerElection::fetch_status(const std::string &owner,
+                                       const std::string &player,
+                                       bool initial) {
+  DBusMessageHandle msg(dbus_message_new_method_call(
+      owner.c_str(), MprisMediaPlayer::PATH.c_str(),
+      "org.freedesktop.DBus.Properties", "Get"));
+  const char *iface = "org.mpris.MediaPlayer2.Player";
+  const char *property = "PlaybackStatus";
+  DBusPendingCall *call = nullptr;
+
+  if (!msg) {
+    return;
+  }
+
+  dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &iface,
+                           DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+
+  // answered from the dispatch loop, so a slow player never stalls the
+  // others
+  if (!dbus_connection_send_with_reply(conn.get(), msg.get(), &call,
+                                       DBUS_TIMEOUT_USE_DEFAULT) ||
+      !call) {
+    return;
+  }
+
+  DBusRecorder::record(RecordSent, msg.get());
+
+  DBusPendingCallHandle pending(call);
+  dbus_pending_call_set_notify(pending.get(), status_reply,
+                               new PendingStatus{this, player, initial},
+                               free_pending_status);
+
+  fetches.erase(std::remove_if(fetches.begin(), fetches.end(),
+                               [](const DBusPendingCallHandle &fetch) {
+                                 return dbus_pending_call_get_completed(
+                                     fetch.get());
+                               }),
+                fetches.end());
+  fetches.push_back(std::move(pending));
+}
+
+void MprisPlayerElection::free_pending_status(void *user_data) {
+  delete static_cast<PendingStatus *>(user_data);
+}
+
+void MprisPlayerElection::status_reply(DBusPendingCall *call,
+                                       void *user_data) {
+  PendingStatus *fetch = static_cast<PendingStatus *>(user_data);
+  DBusMessageHandle reply(dbus_pending_call_steal_reply(call));
+  DBusMessageIter args;
+  const char *status;
+
+  if (reply && dbus_message_get_sender(reply.get())) {
+    DBusRecorder::record(RecordReceived, reply.get());
+  }
+
+  if (!reply || dbus_message_get_type(reply.get()) == DBUS_MESSAGE_TYPE_ERROR ||
+      !dbus_message_iter_init(reply.get(), &args) ||
+      !(status = read_status(&args))) {
+    return;
+  }
+
+  MprisPlayerElection *election = fetch->election;
+  auto it = election->candidates.find(fetch->player);
+
+  // the player may have gone away while the call was in flight, and a
+  // signal that came in meanwhile is newer than the answer
+  if (it == election->candidates.end() ||
+      (fetch->initial && !it->second.playback_status.empty())) {
+    return;
+  }
+  election->update_status(fetch->player, status);
+}
@@ -1,54 +1,116 @@
 #include "mpris_media_player.h"
 #include "dbus/dbus-protocol.h"
+#include "dbus_json.h"
+#include "dbus_recorder.h"
 #include <bits/types/struct_sched_param.h>
+#include <random>
 #include <system_error>
+#include <thread>
 
 const std::string MprisMediaPlayer::PATH = "/org/mpris/MediaPlayer2";
-
-MprisMediaPlayer::MprisMediaPlayer() : session_name(""), is_connected(false) {}
+const std::string MprisMediaPlayer::ROOT_IFACE = "org.mpris.MediaPlayer2";
+const std::string MprisMediaPlayer::TRACKLIST_IFACE =
+    "org.mpris.MediaPlayer2.TrackList";
+const std::string MprisMediaPlayer::PLAYLISTS_IFACE =
+    "org.mpris.MediaPlayer2.Playlists";
+const std::string MprisMediaPlayer::NO_TRACK =
+    "/org/mpris/MediaPlayer2/TrackList/NoTrack";
+
+DBusNameCache MprisMediaPlayer::name_cache;
+std::unordered_map<DBusTransport *, DBusSignalRouter>
+    MprisMediaPlayer::routers;
+
+MprisMediaPlayer::MprisMediaPlayer()
+    : is_connected(false), connection_holds(0),
+      session_name(""), verbose(true),
+      capabilities(CapabilityNone), capabilities_valid(false),
+      is_subscribed(false), track_list_batch_size(50),
+      consecutive_timeouts(0) {}
 
 MprisMediaPlayer::MprisMediaPlayer(const std::string &session)
-    : session_name(session), is_connected(false) {}
+    : is_connected(false), connection_holds(0),
+      session_name(session), verbose(true),
+      capabilities(CapabilityNone), capabilities_valid(false),
+      is_subscribed(false), track_list_batch_size(50),
+      consecutive_timeouts(0) {}
+
+MprisMediaPlayer::~MprisMediaPlayer() { unsubscribe(); }
 
 void MprisMediaPlayer::set_session_name(const std::string &session) {
+  bool was_subscribed = is_subscribed;
+
+  if (was_subscribed) {
+    unsubscribe();
+  }
+
   session_name = session;
+  capabilities = CapabilityNone;
+  capabilities_valid = false;
+  track_list = DBusTrackList();
+  consecutive_timeouts = 0;
+
+  if (was_subscribed) {
+    subscribe();
+  }
 
-  std::cout << "configured session name = " << session_name << "\n";
+  log() << "configured session name = " << session_name << "\n";
 }
 
-int MprisMediaPlayer::connect() {
-  DBusError err;
+void MprisMediaPlayer::set_verbose(bool verbose_on) { verbose = verbose_on; }
+
+static std::ostream &null_log() {
+  // A stream without a buffer swallows everything written to it. Writing
+  // still updates its state, so each thread (the ramp, snapshot and
+  // scheduler run players of their own) gets one.
+  static thread_local std::ostream null_stream(nullptr);
+  return null_stream;
+}
+
+std::ostream &MprisMediaPlayer::log() {
+  return verbose ? std::cout : null_log();
+}
+
+std::ostream &MprisMediaPlayer::log_error() {
+  return verbose ? std::cerr : null_log();
+}
+
+void MprisMediaPlayer::set_request_policy(
+    const DBusRequestPolicy &request_policy) {
+  policy = request_policy;
+}
 
-  // Initialize the error
-  dbus_error_init(&err);
+const DBusRequestPolicy &MprisMediaPlayer::get_request_policy() {
+  return policy;
+}
+
+int MprisMediaPlayer::connect() {
+  DBusErrorHandle err;
 
-  std::cout << "Connecting to the D-Bus session bus..." << std::endl;
+  log() << "Connecting to the D-Bus session bus..." << std::endl;
 
   if (is_connected) {
     // forcibly reconnect
-    if (conn) {
-      dbus_connection_unref(conn);
-      is_connected = false;
-    }
+    transport.reset();
+    is_connected = false;
   }
 
-  conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
-  if (dbus_error_is_set(&err)) {
+  if (DBusTransport::open_session(transport, err) != ERROR_NONE) {
     return ERROR_DBUS;
   }
 
-  if (!conn) {
-    std::cerr << "Connection Null" << std::endl;
-    return ERROR_NULL_PTR;
-  }
-
   is_connected = true;
 
   return ERROR_NONE;
 }
 
 void MprisMediaPlayer::disconnect() {
-  dbus_connection_unref(conn);
+  // keep the connection alive while PropertiesChanged signals are routed to
+  // this instance (unsubscribe() drops it) or while a batch is in flight
+  if (is_subscribed || connection_holds > 0 || !transport) {
+    return;
+  }
+
+  transport.reset();
   is_connected = false;
 }
 
@@ -149,6 +211,34 @@ MprisMediaPlayer::convert_dbus_property_type_to_string(DBusPropertyType type) {
   return property_str;
 }
 
+int MprisMediaPlayer::convert_string_to_dbus_property_type(
+    const std::string &property, DBusPropertyType &type) {
+  static const std::unordered_map<std::string, DBusPropertyType> propertyMap =
+      {{"CanControl", CanControl},
+       {"CanGoNext", CanGoNext},
+       {"CanGoPrevious", CanGoPrevious},
+       {"CanPause", CanPause},
+       {"CanPlay", CanPlay},
+       {"CanSeek", CanSeek},
+       {"LoopStatus", LoopStatus},
+       {"MaximumRate", MaximumRate},
+       {"Metadata", Metadata},
+       {"MinimumRate", MinimumRate},
+       {"PlaybackStatus", PlaybackStatus},
+       {"Position", Position},
+       {"Rate", Rate},
+       {"Shuffle", Shuffle},
+       {"Volume", Volume}};
+
+  auto it = propertyMap.find(property);
+  if (it == propertyMap.end()) {
+    return ERROR_UNKNOWN_TYPE;
+  }
+
+  type = it->second;
+  return ERROR_NONE;
+}
+
 std::string
 MprisMediaPlayer::convert_dbus_loop_status(DBusLoopStatusType loopStatus) {
   std::string loop_status_str = "None";
@@ -168,11 +258,38 @@ MprisMediaPlayer::convert_dbus_loop_status(DBusLoopStatusType loopStatus) {
   return loop_status_str;
 }
 
+std::string MprisMediaPlayer::convert_error_code_to_string(int code) {
+  switch (code) {
+  case ERROR_NONE:
+    return "ERROR_NONE";
+  case ERROR_DBUS:
+    return "ERROR_DBUS";
+  case ERROR_NULL_PTR:
+    return "ERROR_NULL_PTR";
+  case ERROR_UNKNOWN_TYPE:
+    return "ERROR_UNKNOWN_TYPE";
+  case ERROR_NOT_SUPPORTED:
+    return "ERROR_NOT_SUPPORTED";
+  case ERROR_INVALID_ARGUMENT:
+    return "ERROR_INVALID_ARGUMENT";
+  case ERROR_TIMEOUT:
+    return "ERROR_TIMEOUT";
+  case ERROR_CIRCUIT_OPEN:
+    return "ERROR_CIRCUIT_OPEN";
+  case ERROR_IO:
+    return "ERROR_IO";
+  case ERROR_NOT_FOUND:
+    return "ERROR_NOT_FOUND";
+  default:
+    return "ERROR_UNKNOWN";
+  }
+}
+
 std::string MprisMediaPlayer::get_dbus_error(const std::string &msg,
-                                             DBusError *err) {
+                                             DBusErrorHandle &err) {
   std::string err_str =
-      "[DBUS ERROR] " + msg + ": " + err->name + " - " + err->message;
-  dbus_error_free(err);
+      "[DBUS ERROR] " + msg + ": " + err.name() + " - " + err.message();
+  err.clear();
   return err_str;
 }
 
@@ -180,7 +297,7 @@ void MprisMediaPlayer::print_dbus_variant(DBusMessageIter *iter) {
   int type = dbus_message_iter_get_arg_type(iter);
   switch (type) {
   case DBUS_TYPE_BOOLEAN: {
-    bool value;
+    dbus_bool_t value;
     dbus_message_iter_get_basic(iter, &value);
     std::cout << ((value) ? "true" : "false");
     break;
@@ -249,30 +366,51 @@ void MprisMediaPlayer::print_dbus_variant(DBusMessageIter *iter) {
     std::cout << "]";
     break;
   }
+  case DBUS_TYPE_VARIANT: {
+    DBusMessageIter sub_iter;
+    dbus_message_iter_recurse(iter, &sub_iter);
+    print_dbus_variant(&sub_iter);
+    break;
+  }
+  case DBUS_TYPE_STRUCT:
+  case DBUS_TYPE_DICT_ENTRY: {
+    DBusMessageIter sub_iter;
+    dbus_message_iter_recurse(iter, &sub_iter);
+    std::cout << ((type == DBUS_TYPE_STRUCT) ? "(" : "{");
+    while (dbus_message_iter_get_arg_type(&sub_iter) != DBUS_TYPE_INVALID) {
+      print_dbus_variant(&sub_iter);
+      dbus_message_iter_next(&sub_iter);
+      if (dbus_message_iter_get_arg_type(&sub_iter) != DBUS_TYPE_INVALID) {
+        std::cout << ((type == DBUS_TYPE_STRUCT) ? ", " : ": ");
+      }
+    }
+    std::cout << ((type == DBUS_TYPE_STRUCT) ? ")" : "}");
+    break;
+  }
   default:
     std::cout << "(unsupported type " << type << ")";
     break;
   }
 }
 
-DBusMessage *MprisMediaPlayer::_dbus_msg_new_method_call(
+DBusMessageHandle MprisMediaPlayer::_dbus_msg_new_method_call(
     const std::string &dest, const std::string &path, const std::string &iface,
     const std::string &method) {
   // Create a new method call message
-  std::cout << "Creating a new method call message..." << std::endl;
-  std::cout << "\n+------------------------------------------------------\n";
-  std::cout << "| Destination: " << dest << "\n"
+  log() << "Creating a new method call message..." << std::endl;
+  log() << "\n+------------------------------------------------------\n";
+  log() << "| Destination: " << dest << "\n"
             << "| Path: " << path << "\n"
             << "| Interface: " << iface << "\n"
             << "| Method:" << method << "\n";
-  std::cout << "+------------------------------------------------------\n";
+  log() << "+------------------------------------------------------\n";
 
-  return dbus_message_new_method_call(dest.c_str(), path.c_str(), iface.c_str(),
-                                      method.c_str());
+  return DBusMessageHandle(dbus_message_new_method_call(
+      dest.c_str(), path.c_str(), iface.c_str(), method.c_str()));
 }
 
 int MprisMediaPlayer::construct_new_dbus_msg(DBusMethodType type,
-                                             DBusMessage *&msg,
+                                             DBusMessageHandle &msg,
                                              void *set_value) {
   DBusMessageIter args;
   DBusMessageIter sub_iter;
@@ -286,12 +424,12 @@ int MprisMediaPlayer::construct_new_dbus_msg(DBusMethodType type,
 
   msg = _dbus_msg_new_method_call(session_name, PATH, iface, method);
   if (!msg) {
-    std::cerr << "Message Null" << std::endl;
+    log_error() << "Message Null" << std::endl;
     return ERROR_NULL_PTR;
   }
 
   if (set_value) {
-    dbus_message_iter_init_append(msg, &args);
+    dbus_message_iter_init_append(msg.get(), &args);
 
     switch (type) {
     case Seek: {
@@ -299,12 +437,9 @@ int MprisMediaPlayer::construct_new_dbus_msg(DBusMethodType type,
                                      static_cast<int64_t *>(set_value));
       break;
     }
-    case SetPosition: {
-      std::cerr << "Not Implemented" << std::endl;
-      break;
-    }
     case OpenUri: {
-      std::cerr << "Not Implemented" << std::endl;
+      const char *uri_cstr = static_cast<std::string *>(set_value)->c_str();
+      dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &uri_cstr);
       break;
     }
     default:
@@ -312,537 +447,2067 @@ int MprisMediaPlayer::construct_new_dbus_msg(DBusMethodType type,
     } // end of switch (type)
   }
 
-  std::cout << "Method call message created." << std::endl;
+  log() << "Method call message created." << std::endl;
 
   return ERROR_NONE;
 }
 
 int MprisMediaPlayer::construct_new_dbus_msg(DBusPropertyType type,
-                                             DBusMessage *&msg,
-                                             void *set_value) {
-  DBusMessageIter args;
-  DBusMessageIter sub_iter;
+                                             DBusMessageHandle &msg) {
+  std::string param_property_name = convert_dbus_property_type_to_string(type);
+
+  if (param_property_name == "unknown") {
+    return ERROR_UNKNOWN_TYPE;
+  }
+
+  log() << "| parameters:\n|\t - property name: " << param_property_name
+        << std::endl;
+  log() << "+------------------------------------------------------\n";
 
-  std::string iface = "org.freedesktop.DBus.Properties";
-  std::string method = ((!set_value) ? "Get" : "Set");
-  std::string param_iface_name = "org.mpris.MediaPlayer2.Player";
-  std::string param_property_name;
+  return construct_get_msg("org.mpris.MediaPlayer2.Player",
+                           param_property_name, msg);
+}
 
-  msg = _dbus_msg_new_method_call(session_name.c_str(), PATH.c_str(),
-                                  iface.c_str(), method.c_str());
+int MprisMediaPlayer::construct_set_msg(const char *param_iface_name,
+                                        const char *param_property_name,
+                                        DBusMessageHandle &msg,
+                                        DBusMessageIter *args) {
+  msg = _dbus_msg_new_method_call(session_name, PATH,
+                                  "org.freedesktop.DBus.Properties", "Set");
   if (!msg) {
-    std::cerr << "Message Null" << std::endl;
+    log_error() << "Message Null" << std::endl;
     return ERROR_NULL_PTR;
   }
 
-  // append arguments
-  param_property_name = convert_dbus_property_type_to_string(type);
-  if (param_property_name == "unknown") {
-    return ERROR_UNKNOWN_TYPE;
-  }
+  dbus_message_iter_init_append(msg.get(), args);
+  dbus_message_iter_append_basic(args, DBUS_TYPE_STRING, &param_iface_name);
+  dbus_message_iter_append_basic(args, DBUS_TYPE_STRING, &param_property_name);
 
-  std::cout << "| parameters:\n|\t - iface name: " << param_iface_name
-            << "\n|\t - property name: " << param_property_name << std::endl;
-  std::cout << "+------------------------------------------------------\n";
+  return ERROR_NONE;
+}
 
-  dbus_message_iter_init_append(msg, &args);
-  dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &param_iface_name);
-  dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &param_property_name);
+int MprisMediaPlayer::construct_get_all_msg(const std::string &param_iface_name,
+                                            DBusMessageHandle &msg) {
+  DBusMessageIter args;
+  const char *param_iface_cstr = param_iface_name.c_str();
 
-  // append the value variant
-  if (set_value) {
-    DBusLoopStatusType *loop_type;
-    const char *loop_status_cstr;
-    switch (type) {
-    case LoopStatus:
-      loop_type = static_cast<DBusLoopStatusType *>(set_value);
-      std::cout << "loop_type: " << convert_dbus_loop_status(*loop_type);
-      loop_status_cstr = convert_dbus_loop_status(*loop_type).c_str();
+  msg = _dbus_msg_new_method_call(session_name, PATH,
+                                  "org.freedesktop.DBus.Properties", "GetAll");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
 
-      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "s",
-                                       &sub_iter);
-      dbus_message_iter_append_basic(&sub_iter, DBUS_TYPE_STRING,
-                                     &loop_status_cstr);
-      dbus_message_iter_close_container(&args, &sub_iter);
+  dbus_message_iter_init_append(msg.get(), &args);
+  dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &param_iface_cstr);
 
-      break;
-    case Shuffle:
-      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "b",
-                                       &sub_iter);
-      dbus_message_iter_append_basic(&sub_iter, DBUS_TYPE_BOOLEAN,
-                                     static_cast<bool *>(set_value));
-      dbus_message_iter_close_container(&args, &sub_iter);
+  return ERROR_NONE;
+}
 
-      break;
-    case Volume:
-      dbus_message_iter_open_container(&args, DBUS_TYPE_VARIANT, "d",
-                                       &sub_iter);
-      dbus_message_iter_append_basic(&sub_iter, DBUS_TYPE_DOUBLE,
-                                     static_cast<double *>(set_value));
-      dbus_message_iter_close_container(&args, &sub_iter);
+int MprisMediaPlayer::construct_get_msg(const std::string &param_iface_name,
+                                        const std::string &param_property_name,
+                                        DBusMessageHandle &msg) {
+  const char *param_iface_cstr = param_iface_name.c_str();
+  const char *param_property_cstr = param_property_name.c_str();
 
-      break;
-    default:
-      return ERROR_DBUS;
-      break;
-    }
+  msg = _dbus_msg_new_method_call(session_name, PATH,
+                                  "org.freedesktop.DBus.Properties", "Get");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
   }
-  std::cout << "Method call message created." << std::endl;
+
+  dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &param_iface_cstr,
+                           DBUS_TYPE_STRING, &param_property_cstr,
+                           DBUS_TYPE_INVALID);
 
   return ERROR_NONE;
 }
 
-int MprisMediaPlayer::send_dbus_msg(DBusMessage *&msg) {
+bool MprisMediaPlayer::is_bus_daemon_msg(DBusMessage *msg) {
+  const char *dest = dbus_message_get_destination(msg);
+  return dest && std::string(dest) == DBUS_SERVICE_DBUS;
+}
+
+bool MprisMediaPlayer::is_circuit_open() {
+  return consecutive_timeouts >= policy.breaker_threshold &&
+         std::chrono::steady_clock::now() < breaker_open_until;
+}
+
+void MprisMediaPlayer::record_call_result(bool timed_out) {
+  if (!timed_out) {
+    consecutive_timeouts = 0;
+    return;
+  }
+
+  // after the cooldown a single trial call is let through (half-open); if it
+  // times out as well the breaker opens again right away
+  if (++consecutive_timeouts >= policy.breaker_threshold) {
+    log_error() << "Circuit open for " << session_name << std::endl;
+    breaker_open_until = std::chrono::steady_clock::now() +
+                         std::chrono::milliseconds(policy.breaker_cooldown_ms);
+  }
+}
+
+void MprisMediaPlayer::retry_backoff(int attempt) {
+  static thread_local std::mt19937 rng(std::random_device{}());
+  std::uniform_real_distribution<double> jitter(0.5, 1.5);
+
+  // exponential backoff with full +/-50% jitter so players that recover do
+  // not get hit by every client at the same instant
+  double delay_ms = policy.retry_backoff_ms * (1 << attempt) * jitter(rng);
+  std::this_thread::sleep_for(
+      std::chrono::microseconds(static_cast<int64_t>(delay_ms * 1000)));
+}
+
+int MprisMediaPlayer::send_dbus_msg(DBusMessage *msg) {
   if (msg == nullptr) {
-    std::cout << "Message creation failed." << std::endl;
+    log() << "Message creation failed." << std::endl;
     return ERROR_NULL_PTR;
   }
 
+  if (!is_bus_daemon_msg(msg) && is_circuit_open()) {
+    return ERROR_CIRCUIT_OPEN;
+  }
+
   // Set the no-reply flag
   dbus_message_set_no_reply(msg, true);
 
   // Send the message and flush the connection
-  if (!dbus_connection_send(conn, msg, nullptr)) {
-    std::cout << "Out of memory." << std::endl;
+  if (transport->send(msg) != ERROR_NONE) {
+    log() << "Out of memory." << std::endl;
     return ERROR_DBUS;
   }
+  DBusRecorder::record(RecordSent, msg);
 
   return ERROR_NONE;
 }
 
-int MprisMediaPlayer::send_dbus_msg_with_reply(DBusMessage *&msg,
-                                               DBusMessage *&reply,
-                                               DBusError &err) {
-  // Send the message and get a reply
-  std::cout << "Sending the message and waiting for a reply..." << std::endl;
-  reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-  if (dbus_error_is_set(&err)) {
-    dbus_message_unref(msg);
-    return ERROR_DBUS;
+int MprisMediaPlayer::send_dbus_msg_with_reply(DBusMessage *msg,
+                                               DBusMessageHandle &reply,
+                                               DBusErrorHandle &err,
+                                               bool idempotent) {
+  // The bus daemon is not a player; it is never subject to the breaker
+  bool guarded = !is_bus_daemon_msg(msg);
+
+  for (int attempt = 0;; attempt++) {
+    if (guarded && is_circuit_open()) {
+      log_error() << "Circuit open, not calling " << session_name << std::endl;
+      return ERROR_CIRCUIT_OPEN;
+    }
+
+    // a sent message is locked and carries a serial; retries go out as a
+    // fresh copy so a late reply to an earlier attempt cannot be mistaken
+    DBusMessageHandle attempt_msg(attempt ? dbus_message_copy(msg)
+                                          : dbus_message_ref(msg));
+    if (!attempt_msg) {
+      return ERROR_NULL_PTR;
+    }
+
+    // Send the message and get a reply
+    log() << "Sending the message and waiting for a reply..." << std::endl;
+    int64_t sent_us = DBusRecorder::now_us();
+    transport->call(attempt_msg.get(), policy.timeout_ms, reply, err);
+    if (DBusRecorder::is_recording()) {
+      record_call(attempt_msg.get(), sent_us, reply.get(), err);
+    }
+
+    if (!err.is_set()) {
+      break;
+    }
+
+    if (!err.is_timeout()) {
+      // the player answered, just not with success
+      if (guarded) {
+        record_call_result(false);
+      }
+      return ERROR_DBUS;
+    }
+
+    if (guarded) {
+      record_call_result(true);
+    }
+
+    if (!idempotent || attempt >= policy.max_retries ||
+        (guarded && is_circuit_open())) {
+      return ERROR_TIMEOUT;
+    }
+
+    err.clear();
+    retry_backoff(attempt);
+  }
+
+  if (guarded) {
+    record_call_result(false);
   }
+
   if (!reply) {
-    std::cout << "Reply Null" << std::endl;
-    dbus_message_unref(msg);
+    log() << "Reply Null" << std::endl;
     return ERROR_NULL_PTR;
   }
-  std::cout << "Reply received." << std::endl;
+  log() << "Reply received." << std::endl;
 
   return ERROR_NONE;
 }
 
-void MprisMediaPlayer::execute_base_method_func(DBusMethodType type,
-                                                void *set_value) {
-  DBusMessage *msg;
+void MprisMediaPlayer::record_call(DBusMessage *msg, int64_t sent_us,
+                                   DBusMessage *reply,
+                                   const DBusErrorHandle &err) {
+  // the serial only exists once the call went out, so it is written late
+  // with the time it was sent
+  DBusRecorder::record(RecordSent, msg, sent_us);
+
+  if (reply) {
+    DBusRecorder::record(RecordReceived, reply);
+  } else if (err.is_set() && !err.is_timeout()) {
+    // libdbus hands back error replies as a DBusError only; rebuild the
+    // message. A timeout is left unanswered, as it was on the bus.
+    DBusMessageHandle error_reply(dbus_message_new_error(
+        msg, err.name().c_str(), err.message().c_str()));
+    DBusRecorder::record(RecordReceived, error_reply.get());
+  }
+}
+
+int MprisMediaPlayer::execute_base_method_func(DBusMethodType type,
+                                               void *set_value) {
+  DBusMessageHandle msg;
+  int output = ERROR_NONE;
+
+  // Refuse locally when the player does not advertise the capability
+  if ((output = check_capability(type)) != ERROR_NONE) {
+    return output;
+  }
 
   // Connect to the session bus
-  if (!is_connected && !connect()) {
-    return;
+  if (!is_connected && ((output = connect()) != ERROR_NONE)) {
+    return output;
   }
 
   // Create a new method call Message
-  if (construct_new_dbus_msg(type, msg, set_value) != ERROR_NONE) {
-    return;
+  if ((output = construct_new_dbus_msg(type, msg, set_value)) != ERROR_NONE) {
+    return output;
   }
 
-  if (send_dbus_msg(msg) != ERROR_NONE) {
-    return;
+  if ((output = send_dbus_msg(msg.get())) != ERROR_NONE) {
+    return output;
   }
 
   // Clean up
-  dbus_message_unref(msg);
   disconnect();
-  std::cout << "Cleanup done." << std::endl;
+  log() << "Cleanup done." << std::endl;
 
-  return;
+  return output;
 }
 
-int MprisMediaPlayer::execute_base_property_func(DBusPropertyType type,
-                                                 DBusMessage *&reply,
-                                                 void *set_value) {
-
-  DBusError err;
-  DBusMessage *msg;
-  DBusMessageIter args;
+int MprisMediaPlayer::execute_method_call(DBusMessage *msg,
+                                          DBusMessageHandle &reply,
+                                          bool idempotent) {
+  DBusErrorHandle err;
   int output = ERROR_NONE;
 
-  // Initialize the error
-  dbus_error_init(&err);
-
   // Connect to the session bus
   if (!is_connected && ((output = connect()) != ERROR_NONE)) {
     return output;
   }
 
-  // Create a new method call Message
-  if ((output = construct_new_dbus_msg(type, msg, set_value)) != ERROR_NONE) {
-    return output;
+  output = send_dbus_msg_with_reply(msg, reply, err, idempotent);
+  if (err.is_set()) {
+    log_error() << get_dbus_error(dbus_message_get_member(msg), err)
+                << std::endl;
   }
 
-  if ((output = send_dbus_msg_with_reply(msg, reply, err)) != ERROR_NONE) {
+  // Clean up
+  disconnect();
+
+  return output;
+}
+
+int MprisMediaPlayer::execute_method_call_no_reply(DBusMessage *msg) {
+  int output = ERROR_NONE;
+
+  // Connect to the session bus
+  if (!is_connected && ((output = connect()) != ERROR_NONE)) {
     return output;
   }
 
+  output = send_dbus_msg(msg);
+
   // Clean up
-  dbus_message_unref(msg);
   disconnect();
-  std::cout << "Cleanup done." << std::endl;
 
   return output;
 }
 
-bool MprisMediaPlayer::property_func_return_bool(DBusPropertyType type) {
-  DBusMessage *reply = nullptr;
-  bool output = false;
+int MprisMediaPlayer::execute_get_property(const std::string &iface,
+                                           const std::string &property,
+                                           DBusMessageHandle &reply,
+                                           DBusMessageIter *value_iter) {
+  DBusMessageHandle msg;
+  DBusMessageIter args;
+  int output = ERROR_NONE;
 
-  if (execute_base_property_func(type, reply) != ERROR_NONE)
+  if ((output = construct_get_msg(iface, property, msg)) != ERROR_NONE) {
     return output;
+  }
 
-  if (reply != nullptr) {
-    if (read_reply(reply, &output) == ERROR_NONE) {
-      std::cout << convert_dbus_property_type_to_string(type) << ": "
-                << ((output) ? "true" : "false") << std::endl;
-    }
-    dbus_message_unref(reply);
+  if ((output = execute_method_call(msg.get(), reply, true)) != ERROR_NONE) {
+    return output;
   }
 
-  return output;
-}
+  if (!dbus_message_iter_init(reply.get(), &args) ||
+      dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_VARIANT) {
+    log_error() << "Argument is not variant!" << std::endl;
+    return ERROR_DBUS;
+  }
 
-double MprisMediaPlayer::property_func_return_double(DBusPropertyType type) {
-  DBusMessage *reply;
-  double output = 0.0;
+  dbus_message_iter_recurse(&args, value_iter);
 
-  if (execute_base_property_func(type, reply) != ERROR_NONE)
-    return output;
+  return ERROR_NONE;
+}
 
-  if (reply != nullptr) {
-    if (read_reply(reply, &output) == ERROR_NONE) {
-      std::cout << convert_dbus_property_type_to_string(type) << ": " << output
-                << std::endl;
-    }
-    dbus_message_unref(reply);
+// Strings and object paths (mpris:trackid is one, but often sent as a string)
+static bool read_text(DBusMessageIter *iter, std::string &value) {
+  const char *str;
+  int type = dbus_message_iter_get_arg_type(iter);
+
+  if (type != DBUS_TYPE_STRING && type != DBUS_TYPE_OBJECT_PATH) {
+    return false;
   }
+  dbus_message_iter_get_basic(iter, &str);
+  value = str;
 
-  return output;
+  return true;
 }
 
-void MprisMediaPlayer::fill_in_metadata(DBusMetadata &metadata, std::string key,
+// Values of the wrong type are skipped, leaving the field as it was. A lone
+// string where the spec wants a list (xesam:artist) is taken as one entry.
+void MprisMediaPlayer::fill_in_metadata(DBusMetadata &metadata,
+                                        const std::string &key,
                                         DBusMessageIter *value_iter) {
+  DBusMetadata::KeyType type = metadata.get_keytype(key);
+  int64_t number;
 
-  DBusMessageIter sub_iter;
-
-  switch (metadata.get_keytype(key)) {
+  switch (type) {
   case DBusMetadata::ArtUrl:
-    char *artUrl;
-    dbus_message_iter_get_basic(value_iter, &artUrl);
-    metadata.art_url = artUrl;
+    read_text(value_iter, metadata.art_url);
     break;
   case DBusMetadata::Url:
-    char *url;
-    dbus_message_iter_get_basic(value_iter, &url);
-    metadata.url = url;
+    read_text(value_iter, metadata.url);
     break;
   case DBusMetadata::TrackId:
-    char *trackId;
-    dbus_message_iter_get_basic(value_iter, &trackId);
-    metadata.track_id = trackId;
+    read_text(value_iter, metadata.track_id);
     break;
   case DBusMetadata::AlbumArtist:
-    dbus_message_iter_recurse(value_iter, &sub_iter);
-
-    while (dbus_message_iter_get_arg_type(&sub_iter) != DBUS_TYPE_INVALID) {
-      char *albumArtist;
-      dbus_message_iter_get_basic(&sub_iter, &albumArtist);
-      metadata.album_artist.push_back(albumArtist);
-
-      dbus_message_iter_next(&sub_iter);
-    }
-    break;
-  case DBusMetadata::Artist:
-    dbus_message_iter_recurse(value_iter, &sub_iter);
-
-    while (dbus_message_iter_get_arg_type(&sub_iter) != DBUS_TYPE_INVALID) {
-      char *artist;
-      dbus_message_iter_get_basic(&sub_iter, &artist);
-      metadata.artist.push_back(artist);
-
-      dbus_message_iter_next(&sub_iter);
+  case DBusMetadata::Artist: {
+    std::vector<std::string> &names =
+        (type == DBusMetadata::Artist)
+            ? metadata.artist
+            : metadata.album_artist;
+    std::string name;
+
+    if (read_text(value_iter, name)) {
+      names.assign(1, name);
+    } else {
+      read_string_array(value_iter, names);
     }
     break;
+  }
   case DBusMetadata::Album:
-    char *album;
-    dbus_message_iter_get_basic(value_iter, &album);
-    metadata.album = album;
+    read_text(value_iter, metadata.album);
     break;
   case DBusMetadata::Title:
-    char *title;
-    dbus_message_iter_get_basic(value_iter, &title);
-    metadata.title = title;
+    read_text(value_iter, metadata.title);
     break;
   case DBusMetadata::DiscNumber:
-    int32_t discNum;
-    dbus_message_iter_get_basic(value_iter, &discNum);
-    metadata.disc_number = discNum;
+    if (read_dbus_integer(value_iter, number)) {
+      metadata.disc_number = static_cast<int32_t>(number);
+    }
     break;
   case DBusMetadata::TrackNumber:
-    int32_t trackNum;
-    dbus_message_iter_get_basic(value_iter, &trackNum);
-    metadata.track_number = trackNum;
+    if (read_dbus_integer(value_iter, number)) {
+      metadata.track_number = static_cast<int32_t>(number);
+    }
     break;
   case DBusMetadata::Length:
-    int64_t length;
-    dbus_message_iter_get_basic(value_iter, &length);
-    metadata.length = length;
+    if (read_dbus_integer(value_iter, number)) {
+      metadata.length = number;
+    }
     break;
   case DBusMetadata::UserRating:
-    double userRating;
-    dbus_message_iter_get_basic(value_iter, &userRating);
-    metadata.user_rating = userRating;
+    DBusPropertyCodec<double>::read(value_iter, metadata.user_rating);
+    break;
+  default:
     break;
   }
 }
 
-int MprisMediaPlayer::read_reply(DBusMessage *reply, void *output) {
+int MprisMediaPlayer::read_reply(DBusMessage *reply, int expected_type,
+                                 void *output) {
   DBusMessageIter args;
 
   if (!dbus_message_iter_init(reply, &args)) {
-    std::cerr << "Message has no arguments!" << std::endl;
+    log_error() << "Message has no arguments!" << std::endl;
     return ERROR_DBUS;
   }
 
   if (DBUS_TYPE_VARIANT != dbus_message_iter_get_arg_type(&args)) {
 
     // NOTE: special case for list of session names
-    if (DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&args)) {
-      DBusMessageIter sub_iter;
-      char *str;
-      std::vector<std::string> sessions;
-
-      dbus_message_iter_recurse(&args, &sub_iter);
-
-      while (dbus_message_iter_get_arg_type(&sub_iter) == DBUS_TYPE_STRING) {
-        dbus_message_iter_get_basic(&sub_iter, &str);
-        sessions.push_back(str);
-        dbus_message_iter_next(&sub_iter);
-      }
-
-      *static_cast<std::vector<std::string> *>(output) = sessions;
+    if (expected_type == DBUS_TYPE_ARRAY &&
+        DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&args) &&
+        DBUS_TYPE_STRING == dbus_message_iter_get_element_type(&args)) {
+      read_string_array(&args,
+                        *static_cast<std::vector<std::string> *>(output));
       return ERROR_NONE;
     }
 
-    std::cerr << "Argument is not variant!" << std::endl;
+    log_error() << "Argument is not variant!" << std::endl;
     return ERROR_DBUS;
   }
 
   DBusMessageIter variant_iter;
   dbus_message_iter_recurse(&args, &variant_iter);
 
+  // output points at the C++ type for expected_type; anything else the
+  // player sent would be written over it
   auto arg_type = dbus_message_iter_get_arg_type(&variant_iter);
+  if (arg_type != expected_type) {
+    log_error() << "Unexpected type " << static_cast<char>(arg_type)
+                << " in reply, wanted " << static_cast<char>(expected_type)
+                << std::endl;
+    return ERROR_UNKNOWN_TYPE;
+  }
 
   switch (arg_type) {
-  case DBUS_TYPE_BOOLEAN: {
-    bool value;
-    dbus_message_iter_get_basic(&variant_iter, &value);
-    *static_cast<bool *>(output) = value;
+  case DBUS_TYPE_BOOLEAN:
+    DBusPropertyCodec<bool>::read(&variant_iter, *static_cast<bool *>(output));
     break;
-  }
   case DBUS_TYPE_INT32: {
     int32_t value;
     dbus_message_iter_get_basic(&variant_iter, &value);
     *static_cast<int32_t *>(output) = value;
     break;
   }
-  case DBUS_TYPE_INT64: {
-    int64_t value;
-    dbus_message_iter_get_basic(&variant_iter, &value);
-    *static_cast<int64_t *>(output) = value;
+  case DBUS_TYPE_INT64:
+    DBusPropertyCodec<int64_t>::read(&variant_iter,
+                                     *static_cast<int64_t *>(output));
     break;
-  }
-  case DBUS_TYPE_DOUBLE: {
-    double value;
-    dbus_message_iter_get_basic(&variant_iter, &value);
-    *static_cast<double *>(output) = value;
+  case DBUS_TYPE_DOUBLE:
+    DBusPropertyCodec<double>::read(&variant_iter,
+                                    *static_cast<double *>(output));
     break;
-  }
-  case DBUS_TYPE_STRING: {
-    const char *value;
-    dbus_message_iter_get_basic(&variant_iter, &value);
-    *static_cast<std::string *>(output) = value;
+  case DBUS_TYPE_STRING:
+    DBusPropertyCodec<std::string>::read(&variant_iter,
+                                         *static_cast<std::string *>(output));
     break;
-  }
-  case DBUS_TYPE_ARRAY: {
-    DBusMetadata meta;
-
-    DBusMessageIter dict_iter;
-    dbus_message_iter_recurse(&variant_iter, &dict_iter);
-
-    while (dbus_message_iter_get_arg_type(&dict_iter) != DBUS_TYPE_INVALID) {
-
-      if (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&dict_iter)) {
-        DBusMessageIter dict_entry_iter;
-        dbus_message_iter_recurse(&dict_iter, &dict_entry_iter);
-
-        if (dbus_message_iter_get_arg_type(&dict_entry_iter) ==
-            DBUS_TYPE_STRING) {
-          char *key;
-          dbus_message_iter_get_basic(&dict_entry_iter, &key);
-          dbus_message_iter_next(&dict_entry_iter);
-
-          if (dbus_message_iter_get_arg_type(&dict_entry_iter) ==
-              DBUS_TYPE_VARIANT) {
-            DBusMessageIter value_iter;
-            dbus_message_iter_recurse(&dict_entry_iter, &value_iter);
-
-            fill_in_metadata(meta, key, &value_iter);
-          }
-        }
-      }
-      dbus_message_iter_next(&dict_iter);
+  case DBUS_TYPE_ARRAY:
+    if (!DBusPropertyCodec<DBusMetadata>::read(
+            &variant_iter, *static_cast<DBusMetadata *>(output))) {
+      return ERROR_UNKNOWN_TYPE;
     }
-
-    *static_cast<DBusMetadata *>(output) = meta;
     break;
-  }
+  default:
+    return ERROR_UNKNOWN_TYPE;
   } // end of switch (arg_type)
 
   return ERROR_NONE;
 }
 
-/*******************************************************************************
- * Public Functions
- ******************************************************************************/
-
-bool MprisMediaPlayer::can_control() {
-  return property_func_return_bool(CanControl);
-}
-
-bool MprisMediaPlayer::can_go_next() {
-  return property_func_return_bool(CanGoNext);
-}
+void MprisMediaPlayer::read_metadata(DBusMessageIter *dict_iter,
+                                     DBusMetadata &metadata) {
+  while (dbus_message_iter_get_arg_type(dict_iter) != DBUS_TYPE_INVALID) {
 
-bool MprisMediaPlayer::can_go_previous() {
-  return property_func_return_bool(CanGoPrevious);
-}
-#pragma
-bool MprisMediaPlayer::can_pause() {
-  return property_func_return_bool(CanPause);
-}
+    if (DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(dict_iter)) {
+      DBusMessageIter dict_entry_iter;
+      dbus_message_iter_recurse(dict_iter, &dict_entry_iter);
 
-bool MprisMediaPlayer::can_play() { return property_func_return_bool(CanPlay); }
+      if (dbus_message_iter_get_arg_type(&dict_entry_iter) ==
+          DBUS_TYPE_STRING) {
+        char *key;
+        dbus_message_iter_get_basic(&dict_entry_iter, &key);
+        dbus_message_iter_next(&dict_entry_iter);
 
-bool MprisMediaPlayer::can_seek() { return property_func_return_bool(CanSeek); }
+        if (dbus_message_iter_get_arg_type(&dict_entry_iter) ==
+            DBUS_TYPE_VARIANT) {
+          DBusMessageIter value_iter;
+          dbus_message_iter_recurse(&dict_entry_iter, &value_iter);
 
-bool MprisMediaPlayer::get_shuffle() {
-  return property_func_return_bool(Shuffle);
+          fill_in_metadata(metadata, key, &value_iter);
+        }
+      }
+    }
+    dbus_message_iter_next(dict_iter);
+  }
 }
 
-void MprisMediaPlayer::set_shuffle(bool shuffle_on) {
-  DBusMessage *reply;
-  if (execute_base_property_func(Shuffle, reply, &shuffle_on) != ERROR_NONE)
-    return;
+bool DBusPropertyCodec<DBusLoopStatusType>::read(DBusMessageIter *iter,
+                                                 DBusLoopStatusType &value) {
+  std::string loop_status;
 
-  if (reply != nullptr)
-    dbus_message_unref(reply);
+  if (!DBusPropertyCodec<std::string>::read(iter, loop_status)) {
+    return false;
+  }
 
-  return;
-}
-double MprisMediaPlayer::get_maximum_rate() {
-  return property_func_return_double(MaximumRate);
-}
+  if (loop_status == "None") {
+    value = LoopStatusNone;
+  } else if (loop_status == "Track") {
+    value = LoopStatusTrack;
+  } else if (loop_status == "Playlist") {
+    value = LoopStatusPlaylist;
+  } else {
+    return false;
+  }
 
-double MprisMediaPlayer::get_minimum_rate() {
-  return property_func_return_double(MinimumRate);
+  return true;
 }
 
-double MprisMediaPlayer::get_rate() {
-  return property_func_return_double(Rate);
+void DBusPropertyCodec<DBusLoopStatusType>::append(
+    DBusMessageIter *iter, const DBusLoopStatusType &value) {
+  DBusPropertyCodec<std::string>::append(
+      iter, MprisMediaPlayer::convert_dbus_loop_status(value));
 }
 
-double MprisMediaPlayer::get_volume() {
-  return property_func_return_double(Volume);
-}
+bool DBusPropertyCodec<DBusMetadata>::read(DBusMessageIter *iter,
+                                           DBusMetadata &value) {
+  DBusMessageIter dict_iter;
 
-void MprisMediaPlayer::set_volume(double volume) {
-  DBusMessage *reply;
-  if (execute_base_property_func(Volume, reply, &volume) != ERROR_NONE)
-    return;
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type(iter) != DBUS_TYPE_DICT_ENTRY) {
+    return false;
+  }
 
-  if (reply != nullptr)
-    dbus_message_unref(reply);
+  value = DBusMetadata();
+  dbus_message_iter_recurse(iter, &dict_iter);
+  MprisMediaPlayer::read_metadata(&dict_iter, value);
 
-  return;
+  return true;
 }
 
-int64_t MprisMediaPlayer::get_position() {
-  DBusMessage *reply;
-  int64_t output = 0;
+int MprisMediaPlayer::read_playlist(DBusMessageIter *struct_iter,
+                                    DBusPlaylist &playlist) {
+  DBusMessageIter field_iter;
 
-  if (execute_base_property_func(Position, reply) != ERROR_NONE)
-    return output;
+  // (oss): id, name, icon
+  if (dbus_message_iter_get_arg_type(struct_iter) != DBUS_TYPE_STRUCT) {
+    return ERROR_UNKNOWN_TYPE;
+  }
 
-  read_reply(reply, &output);
+  dbus_message_iter_recurse(struct_iter, &field_iter);
+  if (!read_text(&field_iter, playlist.id)) {
+    return ERROR_UNKNOWN_TYPE;
+  }
+  dbus_message_iter_next(&field_iter);
+  if (!read_text(&field_iter, playlist.name)) {
+    return ERROR_UNKNOWN_TYPE;
+  }
+  dbus_message_iter_next(&field_iter);
+  if (!read_text(&field_iter, playlist.icon)) {
+    return ERROR_UNKNOWN_TYPE;
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisMediaPlayer::read_active_playlist(DBusMessageIter *value_iter,
+                                           DBusPlaylist &playlist) {
+  DBusMessageIter struct_iter;
+  dbus_bool_t valid = false;
+
+  // (b(oss)): the struct is only meaningful when the flag is set
+  if (dbus_message_iter_get_arg_type(value_iter) != DBUS_TYPE_STRUCT) {
+    return ERROR_UNKNOWN_TYPE;
+  }
+
+  dbus_message_iter_recurse(value_iter, &struct_iter);
+  if (dbus_message_iter_get_arg_type(&struct_iter) != DBUS_TYPE_BOOLEAN) {
+    return ERROR_UNKNOWN_TYPE;
+  }
+  dbus_message_iter_get_basic(&struct_iter, &valid);
+  dbus_message_iter_next(&struct_iter);
+  if (!valid) {
+    playlist = DBusPlaylist();
+    return ERROR_NONE;
+  }
+
+  return read_playlist(&struct_iter, playlist);
+}
+
+DBusCapabilityType MprisMediaPlayer::method_capability(DBusMethodType type) {
+  switch (type) {
+  case Next:
+    return CapabilityCanGoNext;
+  case Previous:
+    return CapabilityCanGoPrevious;
+  case Pause:
+  case PlayPause:
+    return CapabilityCanPause;
+  case Play:
+    return CapabilityCanPlay;
+  case Seek:
+  case SetPosition:
+    return CapabilityCanSeek;
+  case Stop:
+    return CapabilityCanControl;
+  default:
+    return CapabilityNone;
+  }
+}
+
+DBusCapabilityType
+MprisMediaPlayer::property_capability(DBusPropertyType type) {
+  switch (type) {
+  case CanControl:
+    return CapabilityCanControl;
+  case CanGoNext:
+    return CapabilityCanGoNext;
+  case CanGoPrevious:
+    return CapabilityCanGoPrevious;
+  case CanPause:
+    return CapabilityCanPause;
+  case CanPlay:
+    return CapabilityCanPlay;
+  case CanSeek:
+    return CapabilityCanSeek;
+  default:
+    return CapabilityNone;
+  }
+}
+
+int MprisMediaPlayer::check_capability(DBusMethodType type,
+                                       bool fetch_unknown) {
+  DBusCapabilityType required = method_capability(type);
+
+  if (required == CapabilityNone) {
+    return ERROR_NONE;
+  }
+
+  // The first control action pays for a single GetAll, later ones are local
+  // for as long as the cache can be trusted
+  process_events(0);
+  if (!capabilities_current() &&
+      (!fetch_unknown || refresh_capabilities() != ERROR_NONE)) {
+    // unknown capabilities; let the player decide
+    return ERROR_NONE;
+  }
+
+  return test_capability(type);
+}
+
+int MprisMediaPlayer::test_capability(DBusMethodType type) {
+  DBusCapabilityType required = method_capability(type);
+
+  if (required == CapabilityNone) {
+    return ERROR_NONE;
+  }
+
+  // Every Can* property other than CanControl is only meaningful while
+  // CanControl is true (MPRIS spec)
+  if (!(capabilities & CapabilityCanControl) || !(capabilities & required)) {
+    log_error() << convert_dbus_method_type_to_string(type)
+                << " is not supported by " << session_name << std::endl;
+    return ERROR_NOT_SUPPORTED;
+  }
+
+  return ERROR_NONE;
+}
+
+void MprisMediaPlayer::update_capabilities(DBusMessageIter *dict_iter) {
+  while (dbus_message_iter_get_arg_type(dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter dict_entry_iter;
+    DBusMessageIter value_iter;
+    DBusPropertyType type;
+    DBusCapabilityType capability;
+    char *key;
+
+    dbus_message_iter_recurse(dict_iter, &dict_entry_iter);
+    dbus_message_iter_get_basic(&dict_entry_iter, &key);
+    dbus_message_iter_next(&dict_entry_iter);
+    dbus_message_iter_recurse(&dict_entry_iter, &value_iter);
+
+    if (convert_string_to_dbus_property_type(key, type) == ERROR_NONE &&
+        (capability = property_capability(type)) != CapabilityNone &&
+        dbus_message_iter_get_arg_type(&value_iter) == DBUS_TYPE_BOOLEAN) {
+      dbus_bool_t value;
+      dbus_message_iter_get_basic(&value_iter, &value);
+
+      if (value) {
+        capabilities |= capability;
+      } else {
+        capabilities &= ~capability;
+      }
+    }
+
+    dbus_message_iter_next(dict_iter);
+  }
+}
+
+std::vector<std::string> MprisMediaPlayer::subscription_match_rules() {
+  // one rule for every player's PropertiesChanged, Seeked and TrackList
+  // signals; the sender is told apart locally
+  return {"type='signal',path='" + PATH + "'",
+          "type='signal',sender='org.freedesktop.DBus',"
+          "path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',"
+          "member='NameOwnerChanged',arg0namespace='" +
+              ROOT_IFACE + "'"};
+}
+
+void MprisMediaPlayer::signal_handler(DBusMessage *msg, void *user_data) {
+  DBusSignalRouter *router = static_cast<DBusSignalRouter *>(user_data);
+  const char *sender;
+
+  DBusRecorder::record(RecordReceived, msg);
+
+  if (dbus_message_is_signal(msg, "org.freedesktop.DBus",
+                             "NameOwnerChanged")) {
+    handle_name_owner_changed(*router, msg);
+    return;
+  }
+
+  if (!dbus_message_has_path(msg, PATH.c_str()) ||
+      !(sender = dbus_message_get_sender(msg))) {
+    return;
+  }
+
+  auto it = router->senders.find(sender);
+  if (it == router->senders.end()) {
+    return;
+  }
+
+  // the handlers only update local state and never (un)subscribe, so the
+  // list cannot change underneath the loop
+  for (MprisMediaPlayer *player : it->second) {
+    if (dbus_message_is_signal(msg, "org.freedesktop.DBus.Properties",
+                               "PropertiesChanged")) {
+      player->handle_properties_changed(msg);
+    } else if (dbus_message_has_interface(msg, TRACKLIST_IFACE.c_str())) {
+      player->handle_track_list_signal(msg);
+    }
+  }
+}
+
+DBusSignalRouter *MprisMediaPlayer::attach_router() {
+  DBusErrorHandle err;
+
+  auto it = routers.find(transport.get());
+  if (it != routers.end()) {
+    return &it->second;
+  }
+
+  // first subscriber on this connection: install the handler and the rules
+  DBusSignalRouter &router = routers[transport.get()];
+  router.transport = transport;
+
+  if (transport->add_signal_handler(signal_handler, &router) != ERROR_NONE) {
+    log() << "Out of memory." << std::endl;
+    routers.erase(transport.get());
+    return nullptr;
+  }
+
+  for (const std::string &rule : subscription_match_rules()) {
+    if (transport->add_match(rule, err) != ERROR_NONE) {
+      log_error() << get_dbus_error("AddMatch failed", err) << std::endl;
+      transport->remove_signal_handler(signal_handler, &router);
+      routers.erase(transport.get());
+      return nullptr;
+    }
+  }
+
+  return &router;
+}
+
+void MprisMediaPlayer::detach_router() {
+  auto it = routers.find(transport.get());
+  if (it == routers.end()) {
+    return;
+  }
+  DBusSignalRouter &router = it->second;
+
+  DBusSignalRouter::remove(router.sessions, session_name, this);
+  if (!subscribed_owner.empty()) {
+    DBusSignalRouter::remove(router.senders, subscribed_owner, this);
+    subscribed_owner.clear();
+  }
+
+  if (!router.sessions.empty()) {
+    return;
+  }
+
+  // last subscriber gone
+  for (const std::string &rule : subscription_match_rules()) {
+    transport->remove_match(rule);
+  }
+  transport->remove_signal_handler(signal_handler, &router);
+  transport->flush();
+  routers.erase(it);
+}
+
+void MprisMediaPlayer::handle_properties_changed(DBusMessage *msg) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+  char *iface;
+
+  // signature: interface_name, changed_properties, invalidated_properties
+  if (!dbus_message_has_signature(msg, "sa{sv}as")) {
+    return;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_get_basic(&args, &iface);
+
+  if (TRACKLIST_IFACE == iface) {
+    // Tracks is only ever invalidated, its new value has to be fetched
+    track_list.valid = false;
+    return;
+  }
+
+  if (std::string(iface) != "org.mpris.MediaPlayer2.Player") {
+    return;
+  }
+
+  // DBusSignalRouter hands over only signals whose unique sender is the
+  // owner this instance is routed under, so they concern our player
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+  update_capabilities(&dict_iter);
+
+  // an invalidated capability has to be fetched again before the next call
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_STRING) {
+    DBusPropertyType type;
+    char *name;
+
+    dbus_message_iter_get_basic(&dict_iter, &name);
+    if (convert_string_to_dbus_property_type(name, type) == ERROR_NONE &&
+        property_capability(type) != CapabilityNone) {
+      capabilities_valid = false;
+    }
+    dbus_message_iter_next(&dict_iter);
+  }
+}
+
+/*******************************************************************************
+ * Public Functions
+ ******************************************************************************/
+
+int MprisMediaPlayer::refresh_capabilities() {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  DBusErrorHandle err;
+  int output = ERROR_NONE;
+
+  // Connect to the session bus
+  if (!is_connected && ((output = connect()) != ERROR_NONE)) {
+    return output;
+  }
+
+  if ((output = construct_get_all_msg("org.mpris.MediaPlayer2.Player", msg)) !=
+      ERROR_NONE) {
+    return output;
+  }
+
+  output = send_dbus_msg_with_reply(msg.get(), reply, err, true);
+  if (output != ERROR_NONE) {
+    if (err.is_set()) {
+      log_error() << get_dbus_error("GetAll failed", err) << std::endl;
+    }
+    disconnect();
+    return output;
+  }
+
+  output = read_capabilities(reply.get());
+
+  disconnect();
+
+  return output;
+}
+
+int MprisMediaPlayer::read_capabilities(DBusMessage *reply) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+
+  if (!dbus_message_iter_init(reply, &args) ||
+      dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY) {
+    return ERROR_DBUS;
+  }
+
+  capabilities = CapabilityNone;
+  dbus_message_iter_recurse(&args, &dict_iter);
+  update_capabilities(&dict_iter);
+  capabilities_valid = true;
+  capabilities_read_at = std::chrono::steady_clock::now();
+
+  return ERROR_NONE;
+}
+
+bool MprisMediaPlayer::capabilities_current() {
+  if (is_subscribed) {
+    return capabilities_valid;
+  }
+
+  return capabilities_valid &&
+         std::chrono::steady_clock::now() - capabilities_read_at <
+             std::chrono::milliseconds(UNSUBSCRIBED_CAPABILITY_TTL_MS);
+}
+
+uint32_t MprisMediaPlayer::get_capabilities() {
+  process_events(0);
+  if (!capabilities_current()) {
+    refresh_capabilities();
+  }
+
+  return capabilities;
+}
+
+bool MprisMediaPlayer::has_capability(DBusCapabilityType capability) {
+  return (get_capabilities() & capability) == capability;
+}
+
+int MprisMediaPlayer::subscribe() {
+  DBusSignalRouter *router;
+  std::string owner;
+  int output = ERROR_NONE;
+
+  if (is_subscribed) {
+    return ERROR_NONE;
+  }
+
+  // Connect to the session bus
+  if (!is_connected && ((output = connect()) != ERROR_NONE)) {
+    return output;
+  }
+
+  if (!(router = attach_router())) {
+    disconnect();
+    return ERROR_DBUS;
+  }
+
+  is_subscribed = true;
+  router->sessions[session_name].push_back(this);
+
+  // Signals arrive from the unique name. It is known locally once any
+  // instance has looked the player up; NameOwnerChanged, already matched,
+  // keeps the route current from here on. A player that is not running
+  // yet is routed when it appears.
+  if (resolve_name_owner(owner) == ERROR_NONE) {
+    subscribed_owner = owner;
+    router->senders[owner].push_back(this);
+  }
+
+  // signals only carry changes; the first control action fetches the full
+  // state with a single GetAll
+  capabilities_valid = false;
+
+  return ERROR_NONE;
+}
+
+void MprisMediaPlayer::unsubscribe() {
+  if (!is_subscribed) {
+    return;
+  }
+
+  detach_router();
+
+  is_subscribed = false;
+  capabilities_valid = false;
+  track_list.valid = false;
+  disconnect();
+}
+
+int MprisMediaPlayer::process_events(int timeout_ms) {
+  if (!is_subscribed) {
+    return ERROR_NONE;
+  }
+
+  if (transport->dispatch(timeout_ms) != ERROR_NONE) {
+    // the bus went away; capabilities can no longer be trusted
+    log_error() << "Connection closed" << std::endl;
+    capabilities_valid = false;
+    return ERROR_DBUS;
+  }
+
+  return ERROR_NONE;
+}
+
+bool MprisMediaPlayer::can_control() {
+  return has_capability(CapabilityCanControl);
+}
+
+bool MprisMediaPlayer::can_go_next() {
+  return has_capability(CapabilityCanGoNext);
+}
+
+bool MprisMediaPlayer::can_go_previous() {
+  return has_capability(CapabilityCanGoPrevious);
+}
+
+bool MprisMediaPlayer::can_pause() {
+  return has_capability(CapabilityCanPause);
+}
+
+bool MprisMediaPlayer::can_play() { return has_capability(CapabilityCanPlay); }
+
+bool MprisMediaPlayer::can_seek() { return has_capability(CapabilityCanSeek); }
+
+bool MprisMediaPlayer::get_shuffle() { return get<Shuffle>(); }
+
+void MprisMediaPlayer::set_shuffle(bool shuffle_on) {
+  set<Shuffle>(shuffle_on);
+}
+
+double MprisMediaPlayer::get_maximum_rate() { return get<MaximumRate>(); }
+
+double MprisMediaPlayer::get_minimum_rate() { return get<MinimumRate>(); }
+
+double MprisMediaPlayer::get_rate() { return get<Rate>(); }
+
+void MprisMediaPlayer::set_rate(double rate) { set<Rate>(rate); }
+
+double MprisMediaPlayer::get_volume() { return get<Volume>(); }
+
+void MprisMediaPlayer::set_volume(double volume) { set<Volume>(volume); }
+
+int64_t MprisMediaPlayer::get_position() {
+  int64_t output = get<Position>();
+
+  log() << "position: " << output << std::endl;
+
+  return output;
+}
+
+std::string MprisMediaPlayer::get_playback_status() {
+  return get<PlaybackStatus>();
+}
+
+std::string MprisMediaPlayer::get_loop_status() {
+  DBusLoopStatusType loop_status;
+
+  if (get<LoopStatus>(loop_status) != ERROR_NONE) {
+    return "";
+  }
+
+  log() << "loop status: " << convert_dbus_loop_status(loop_status)
+        << std::endl;
+
+  return convert_dbus_loop_status(loop_status);
+}
+
+void MprisMediaPlayer::set_loop_status(DBusLoopStatusType loop_status) {
+  set<LoopStatus>(loop_status);
+}
+
+void MprisMediaPlayer::get_metadata(DBusMetadata &metadata) {
+  get<Metadata>(metadata);
+}
+
+int MprisMediaPlayer::fetch_track_ids() {
+  DBusMessageHandle reply;
+  DBusMessageIter value_iter;
+  int output = ERROR_NONE;
+
+  if ((output = execute_get_property(TRACKLIST_IFACE, "Tracks", reply,
+                                     &value_iter)) != ERROR_NONE) {
+    return output;
+  }
+
+  return read_track_ids(&value_iter);
+}
+
+int MprisMediaPlayer::read_track_ids(DBusMessageIter *value_iter) {
+  DBusMessageIter array_iter;
+  std::vector<std::string> ids;
+
+  if (dbus_message_iter_get_arg_type(value_iter) != DBUS_TYPE_ARRAY) {
+    return ERROR_UNKNOWN_TYPE;
+  }
+
+  dbus_message_iter_recurse(value_iter, &array_iter);
+  while (dbus_message_iter_get_arg_type(&array_iter) ==
+         DBUS_TYPE_OBJECT_PATH) {
+    char *id;
+    dbus_message_iter_get_basic(&array_iter, &id);
+    ids.push_back(id);
+    dbus_message_iter_next(&array_iter);
+  }
+
+  track_list.replace(ids);
+
+  return ERROR_NONE;
+}
+
+bool MprisMediaPlayer::track_list_current() {
+  if (!is_subscribed) {
+    // nothing tells this instance about added or removed tracks
+    return false;
+  }
+
+  return track_list.valid;
+}
+
+int MprisMediaPlayer::check_track_list() {
+  DBusRootInfo info;
+
+  // unknown; let the player decide
+  if (get_root_info(info) != ERROR_NONE || info.has_track_list) {
+    return ERROR_NONE;
+  }
+
+  log_error() << "TrackList is not supported by " << session_name << std::endl;
+  return ERROR_NOT_SUPPORTED;
+}
+
+int MprisMediaPlayer::fetch_tracks_metadata(
+    const std::vector<std::string> &track_ids) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  // one GetTracksMetadata per batch keeps every reply small
+  for (size_t start = 0; start < track_ids.size();
+       start += track_list_batch_size) {
+    if ((output = construct_tracks_metadata_msg(track_ids, start, msg)) !=
+        ERROR_NONE) {
+      return output;
+    }
+
+    if ((output = execute_method_call(msg.get(), reply, true)) != ERROR_NONE) {
+      return output;
+    }
+
+    read_tracks_metadata(reply.get());
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisMediaPlayer::construct_tracks_metadata_msg(
+    const std::vector<std::string> &track_ids, size_t start,
+    DBusMessageHandle &msg) {
+  DBusMessageIter args;
+  DBusMessageIter array_iter;
+  size_t end = std::min(track_ids.size(), start + track_list_batch_size);
+
+  msg = _dbus_msg_new_method_call(session_name, PATH, TRACKLIST_IFACE,
+                                  "GetTracksMetadata");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+
+  dbus_message_iter_init_append(msg.get(), &args);
+  dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "o", &array_iter);
+  for (size_t i = start; i < end; i++) {
+    const char *id = track_ids[i].c_str();
+    dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_OBJECT_PATH, &id);
+  }
+  dbus_message_iter_close_container(&args, &array_iter);
+
+  return ERROR_NONE;
+}
+
+void MprisMediaPlayer::read_tracks_metadata(DBusMessage *reply) {
+  DBusMessageIter args;
+  DBusMessageIter array_iter;
+
+  // aa{sv}: the order of the reply is not guaranteed, so key by trackid
+  if (!dbus_message_iter_init(reply, &args) ||
+      dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY) {
+    return;
+  }
+
+  dbus_message_iter_recurse(&args, &array_iter);
+  while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_ARRAY) {
+    DBusMetadata metadata;
+    DBusMessageIter dict_iter;
+
+    dbus_message_iter_recurse(&array_iter, &dict_iter);
+    read_metadata(&dict_iter, metadata);
+    if (!metadata.track_id.empty()) {
+      track_list.metadata[metadata.track_id] = metadata;
+    }
+    dbus_message_iter_next(&array_iter);
+  }
+}
+
+void MprisMediaPlayer::handle_track_list_signal(DBusMessage *msg) {
+  DBusMessageIter args;
+  DBusMessageIter sub_iter;
+  char *id;
+  char *after;
+
+  if (dbus_message_is_signal(msg, TRACKLIST_IFACE.c_str(),
+                             "TrackListReplaced") &&
+      dbus_message_has_signature(msg, "aoo")) {
+    std::vector<std::string> ids;
+
+    dbus_message_iter_init(msg, &args);
+    dbus_message_iter_recurse(&args, &sub_iter);
+    while (dbus_message_iter_get_arg_type(&sub_iter) ==
+           DBUS_TYPE_OBJECT_PATH) {
+      dbus_message_iter_get_basic(&sub_iter, &id);
+      ids.push_back(id);
+      dbus_message_iter_next(&sub_iter);
+    }
+    track_list.replace(ids);
+  } else if (dbus_message_is_signal(msg, TRACKLIST_IFACE.c_str(),
+                                    "TrackAdded") &&
+             dbus_message_has_signature(msg, "a{sv}o")) {
+    DBusMetadata metadata;
+
+    dbus_message_iter_init(msg, &args);
+    dbus_message_iter_recurse(&args, &sub_iter);
+    read_metadata(&sub_iter, metadata);
+    dbus_message_iter_next(&args);
+    dbus_message_iter_get_basic(&args, &after);
+
+    if (track_list.valid && !metadata.track_id.empty()) {
+      track_list.insert_after(after, metadata.track_id);
+      track_list.metadata[metadata.track_id] = metadata;
+    }
+  } else if (dbus_message_is_signal(msg, TRACKLIST_IFACE.c_str(),
+                                    "TrackRemoved") &&
+             dbus_message_has_signature(msg, "o")) {
+    dbus_message_get_args(msg, nullptr, DBUS_TYPE_OBJECT_PATH, &id,
+                          DBUS_TYPE_INVALID);
+    track_list.remove(id);
+  } else if (dbus_message_is_signal(msg, TRACKLIST_IFACE.c_str(),
+                                    "TrackMetadataChanged") &&
+             dbus_message_has_signature(msg, "oa{sv}")) {
+    DBusMetadata metadata;
+
+    dbus_message_iter_init(msg, &args);
+    dbus_message_iter_get_basic(&args, &id);
+    dbus_message_iter_next(&args);
+    dbus_message_iter_recurse(&args, &sub_iter);
+    read_metadata(&sub_iter, metadata);
+
+    // the track id may change along with the metadata
+    if (metadata.track_id.empty()) {
+      metadata.track_id = id;
+    }
+    track_list.rename(id, metadata.track_id);
+    track_list.metadata[metadata.track_id] = metadata;
+  }
+}
+
+void MprisMediaPlayer::read_string_array(DBusMessageIter *value_iter,
+                                         std::vector<std::string> &output) {
+  DBusMessageIter array_iter;
+
+  output.clear();
+  if (dbus_message_iter_get_arg_type(value_iter) != DBUS_TYPE_ARRAY) {
+    return;
+  }
+
+  dbus_message_iter_recurse(value_iter, &array_iter);
+  while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_STRING) {
+    char *value;
+    dbus_message_iter_get_basic(&array_iter, &value);
+    output.push_back(value);
+    dbus_message_iter_next(&array_iter);
+  }
+}
+
+bool MprisMediaPlayer::known_name_owner(std::string &owner) {
+  // unique names own themselves
+  if (!session_name.empty() && session_name[0] == ':') {
+    owner = session_name;
+    return true;
+  }
+
+  DBusNameCache *cache = watch_names();
+  if (!cache) {
+    return false;
+  }
+
+  auto it = cache->name_owners.find(session_name);
+  if (it != cache->name_owners.end() && !it->second.empty()) {
+    owner = it->second;
+    return true;
+  }
+
+  return false;
+}
+
+int MprisMediaPlayer::resolve_name_owner(std::string &owner) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  DBusErrorHandle err;
+  const char *name_cstr = session_name.c_str();
+  char *owner_cstr;
+  int output = ERROR_NONE;
+
+  if (known_name_owner(owner)) {
+    return ERROR_NONE;
+  }
+
+  msg = _dbus_msg_new_method_call("org.freedesktop.DBus",
+                                  "/org/freedesktop/DBus",
+                                  "org.freedesktop.DBus", "GetNameOwner");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+  dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &name_cstr,
+                           DBUS_TYPE_INVALID);
+
+  // Connect to the session bus
+  if (!is_connected && ((output = connect()) != ERROR_NONE)) {
+    return output;
+  }
+
+  output = send_dbus_msg_with_reply(msg.get(), reply, err, true);
+  disconnect();
+  if (output != ERROR_NONE) {
+    // a player that is not running is not worth a warning
+    if (err.is_set() && !err.has_name(DBUS_ERROR_NAME_HAS_NO_OWNER)) {
+      log_error() << get_dbus_error("GetNameOwner", err) << std::endl;
+    }
+    return output;
+  }
+
+  if (!dbus_message_get_args(reply.get(), nullptr, DBUS_TYPE_STRING,
+                             &owner_cstr, DBUS_TYPE_INVALID)) {
+    return ERROR_DBUS;
+  }
+  owner = owner_cstr;
+
+  // Not dispatched since the lookup above: a NameOwnerChanged still queued
+  // is applied after this, in order, and ends on the current owner.
+  if (name_cache.transport) {
+    name_cache.name_owners[session_name] = owner;
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisMediaPlayer::fetch_root_info(DBusRootInfo &info) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = construct_get_all_msg(ROOT_IFACE, msg)) != ERROR_NONE) {
+    return output;
+  }
+
+  if ((output = execute_method_call(msg.get(), reply, true)) != ERROR_NONE) {
+    return output;
+  }
+
+  return read_root_info(reply.get(), info);
+}
+
+int MprisMediaPlayer::read_root_info(DBusMessage *reply, DBusRootInfo &info) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+
+  if (!dbus_message_iter_init(reply, &args) ||
+      dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY) {
+    return ERROR_DBUS;
+  }
+
+  info = DBusRootInfo();
+  dbus_message_iter_recurse(&args, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter dict_entry_iter;
+    DBusMessageIter value_iter;
+    char *key_cstr;
+
+    dbus_message_iter_recurse(&dict_iter, &dict_entry_iter);
+    dbus_message_iter_get_basic(&dict_entry_iter, &key_cstr);
+    dbus_message_iter_next(&dict_entry_iter);
+    dbus_message_iter_recurse(&dict_entry_iter, &value_iter);
+    read_root_property(key_cstr, &value_iter, info);
+
+    dbus_message_iter_next(&dict_iter);
+  }
+
+  return ERROR_NONE;
+}
+
+void MprisMediaPlayer::read_root_property(const std::string &key,
+                                          DBusMessageIter *value_iter,
+                                          DBusRootInfo &info) {
+  int value_type = dbus_message_iter_get_arg_type(value_iter);
+
+  if (value_type == DBUS_TYPE_STRING) {
+    char *value;
+    dbus_message_iter_get_basic(value_iter, &value);
+    if (key == "Identity") {
+      info.identity = value;
+    } else if (key == "DesktopEntry") {
+      info.desktop_entry = value;
+    }
+  } else if (value_type == DBUS_TYPE_BOOLEAN) {
+    dbus_bool_t value;
+    dbus_message_iter_get_basic(value_iter, &value);
+    if (key == "CanQuit") {
+      info.can_quit = value;
+    } else if (key == "CanRaise") {
+      info.can_raise = value;
+    } else if (key == "HasTrackList") {
+      info.has_track_list = value;
+    }
+  } else if (key == "SupportedUriSchemes") {
+    read_string_array(value_iter, info.supported_uri_schemes);
+  } else if (key == "SupportedMimeTypes") {
+    read_string_array(value_iter, info.supported_mime_types);
+  }
+}
+
+std::vector<std::string> MprisMediaPlayer::name_cache_match_rules() {
+  return {"type='signal',sender='org.freedesktop.DBus',"
+          "path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',"
+          "member='NameOwnerChanged',arg0namespace='" +
+              ROOT_IFACE + "'",
+          "type='signal',path='" + PATH +
+              "',interface='org.freedesktop.DBus.Properties',"
+              "member='PropertiesChanged',arg0='" +
+              ROOT_IFACE + "'"};
+}
+
+DBusNameCache *MprisMediaPlayer::watch_names() {
+  DBusErrorHandle err;
+
+  if (name_cache.transport &&
+      name_cache.transport->dispatch(0) == ERROR_NONE) {
+    return &name_cache;
+  }
+
+  // first lookup, or the bus went away: start over on a new connection
+  uint64_t generation = name_cache.generation + 1;
+  name_cache = DBusNameCache();
+  name_cache.generation = generation;
+  if (DBusTransport::open_private(name_cache.transport, err) != ERROR_NONE) {
+    return nullptr;
+  }
+
+  if (name_cache.transport->add_signal_handler(name_cache_handler,
+                                               &name_cache) != ERROR_NONE) {
+    name_cache.transport.reset();
+    return nullptr;
+  }
+
+  // the rules are in place before anything is cached, so no change is missed
+  for (const std::string &rule : name_cache_match_rules()) {
+    if (name_cache.transport->add_match(rule, err) != ERROR_NONE) {
+      name_cache.transport.reset();
+      return nullptr;
+    }
+  }
+
+  return &name_cache;
+}
+
+void MprisMediaPlayer::name_cache_handler(DBusMessage *msg, void *user_data) {
+  DBusNameCache *cache = static_cast<DBusNameCache *>(user_data);
+  char *name;
+  char *old_owner;
+  char *new_owner;
+
+  DBusRecorder::record(RecordReceived, msg);
+  cache->generation++;
+
+  if (dbus_message_is_signal(msg, "org.freedesktop.DBus.Properties",
+                             "PropertiesChanged")) {
+    update_root_info(msg);
+    return;
+  }
+
+  if (!dbus_message_is_signal(msg, "org.freedesktop.DBus",
+                              "NameOwnerChanged") ||
+      !dbus_message_get_args(msg, nullptr, DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner, DBUS_TYPE_STRING,
+                             &new_owner, DBUS_TYPE_INVALID)) {
+    return;
+  }
+
+  if (*old_owner) {
+    cache->root_info.erase(old_owner);
+  }
 
-  if (reply != nullptr)
-    dbus_message_unref(reply);
+  if (*new_owner) {
+    cache->name_owners[name] = new_owner;
+  } else {
+    cache->name_owners.erase(name);
+  }
+}
 
-  std::cout << "position: " << output << std::endl;
+void MprisMediaPlayer::update_root_info(DBusMessage *msg) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+  const char *sender = dbus_message_get_sender(msg);
+  char *iface;
 
-  return output;
+  if (!sender || !dbus_message_has_path(msg, PATH.c_str()) ||
+      !dbus_message_has_signature(msg, "sa{sv}as")) {
+    return;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_get_basic(&args, &iface);
+  auto it = name_cache.root_info.find(sender);
+  if (ROOT_IFACE != iface || it == name_cache.root_info.end()) {
+    return;
+  }
+
+  // an invalidated property is fetched again with all the others
+  dbus_message_iter_next(&args);
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+  if (dbus_message_iter_get_arg_type(&dict_iter) != DBUS_TYPE_INVALID) {
+    name_cache.root_info.erase(it);
+    return;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter dict_entry_iter;
+    DBusMessageIter value_iter;
+    char *key_cstr;
+
+    dbus_message_iter_recurse(&dict_iter, &dict_entry_iter);
+    dbus_message_iter_get_basic(&dict_entry_iter, &key_cstr);
+    dbus_message_iter_next(&dict_entry_iter);
+    dbus_message_iter_recurse(&dict_entry_iter, &value_iter);
+    read_root_property(key_cstr, &value_iter, it->second);
+
+    dbus_message_iter_next(&dict_iter);
+  }
 }
 
-std::string MprisMediaPlayer::get_loop_status() {
-  DBusMessage *reply;
-  std::string output;
+void MprisMediaPlayer::handle_name_owner_changed(DBusSignalRouter &router,
+                                                 DBusMessage *msg) {
+  char *name;
+  char *old_owner;
+  char *new_owner;
+
+  if (!dbus_message_get_args(msg, nullptr, DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner, DBUS_TYPE_STRING,
+                             &new_owner, DBUS_TYPE_INVALID)) {
+    return;
+  }
+
+  // name_cache keeps its own account of the owners (see DBusNameCache)
+  auto it = router.sessions.find(name);
+  if (it == router.sessions.end()) {
+    return;
+  }
+
+  // move the instances watching this name over to the new owner
+  for (MprisMediaPlayer *player : it->second) {
+    if (!player->subscribed_owner.empty()) {
+      DBusSignalRouter::remove(router.senders, player->subscribed_owner,
+                               player);
+    }
+    player->subscribed_owner = new_owner;
+    if (*new_owner) {
+      router.senders[new_owner].push_back(player);
+    }
+    player->reset_player_state();
+  }
+}
+
+void MprisMediaPlayer::reset_player_state() {
+  // our player restarted or went away; a new owner gets a fresh breaker
+  capabilities_valid = false;
+  track_list.valid = false;
+  consecutive_timeouts = 0;
+}
+
+int MprisMediaPlayer::get_player_list(std::vector<std::string> &players) {
+  std::vector<std::string> sessions;
+  DBusNameCache *cache = watch_names();
+  int output = ERROR_NONE;
+
+  players.clear();
+
+  if (cache && cache->name_owners_seeded) {
+    for (const auto &entry : cache->name_owners) {
+      players.push_back(entry.first);
+    }
+    std::sort(players.begin(), players.end());
+    return ERROR_NONE;
+  }
 
-  if (execute_base_property_func(LoopStatus, reply) != ERROR_NONE)
+  if ((output = get_session_list(sessions)) != ERROR_NONE) {
     return output;
+  }
+
+  const std::string prefix = ROOT_IFACE + ".";
+  for (const std::string &session : sessions) {
+    if (session.compare(0, prefix.size(), prefix) == 0) {
+      players.push_back(session);
+      if (cache) {
+        // the owner is resolved lazily on first use
+        cache->name_owners.emplace(session, "");
+      }
+    }
+  }
+  std::sort(players.begin(), players.end());
 
-  read_reply(reply, &output);
+  if (cache) {
+    cache->name_owners_seeded = true;
+  }
 
-  if (reply != nullptr)
-    dbus_message_unref(reply);
+  return ERROR_NONE;
+}
 
-  std::cout << "loop status: " << output.c_str() << std::endl;
+int MprisMediaPlayer::get_root_info(DBusRootInfo &info) {
+  std::string owner;
+  int output = ERROR_NONE;
 
-  return output;
+  if ((output = resolve_name_owner(owner)) != ERROR_NONE) {
+    return output;
+  }
+
+  // for a unique session name known_name_owner() has not looked yet
+  DBusNameCache *cache = watch_names();
+  if (cache) {
+    auto it = cache->root_info.find(owner);
+    if (it != cache->root_info.end()) {
+      info = it->second;
+      return ERROR_NONE;
+    }
+  }
+
+  if ((output = fetch_root_info(info)) != ERROR_NONE) {
+    return output;
+  }
+
+  // a PropertiesChanged sent after the reply is still queued and is applied
+  // on top of this by the next lookup
+  if (cache) {
+    cache->root_info[owner] = info;
+  }
+
+  return ERROR_NONE;
 }
 
-void MprisMediaPlayer::set_loop_status(DBusLoopStatusType loop_status) {
-  DBusMessage *reply;
-  if (execute_base_property_func(LoopStatus, reply, &loop_status) != ERROR_NONE)
-    return;
+std::string MprisMediaPlayer::get_identity() {
+  DBusRootInfo info;
+  get_root_info(info);
+  return info.identity;
+}
 
-  if (reply != nullptr)
-    dbus_message_unref(reply);
+std::string MprisMediaPlayer::get_desktop_entry() {
+  DBusRootInfo info;
+  get_root_info(info);
+  return info.desktop_entry;
+}
 
-  return;
+bool MprisMediaPlayer::can_quit() {
+  DBusRootInfo info;
+  get_root_info(info);
+  return info.can_quit;
 }
 
-void MprisMediaPlayer::get_metadata(DBusMetadata &metadata) {
-  DBusMessage *reply;
+bool MprisMediaPlayer::can_raise() {
+  DBusRootInfo info;
+  get_root_info(info);
+  return info.can_raise;
+}
+
+int MprisMediaPlayer::raise() {
+  DBusMessageHandle msg;
+
+  if (!can_raise()) {
+    return ERROR_NOT_SUPPORTED;
+  }
+
+  msg = _dbus_msg_new_method_call(session_name, PATH, ROOT_IFACE, "Raise");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+
+  return execute_method_call_no_reply(msg.get());
+}
+
+int MprisMediaPlayer::quit() {
+  DBusMessageHandle msg;
+
+  if (!can_quit()) {
+    return ERROR_NOT_SUPPORTED;
+  }
+
+  msg = _dbus_msg_new_method_call(session_name, PATH, ROOT_IFACE, "Quit");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+
+  return execute_method_call_no_reply(msg.get());
+}
+
+void MprisMediaPlayer::set_track_list_batch_size(size_t batch_size) {
+  track_list_batch_size = (batch_size > 0) ? batch_size : 1;
+}
+
+int MprisMediaPlayer::get_track_count(size_t &count) {
+  int output = ERROR_NONE;
+
+  if ((output = check_track_list()) != ERROR_NONE) {
+    return output;
+  }
+
+  process_events(0);
+  if (!track_list_current() && (output = fetch_track_ids()) != ERROR_NONE) {
+    return output;
+  }
+
+  count = track_list.track_ids.size();
 
-  if (execute_base_property_func(Metadata, reply) != ERROR_NONE)
+  return ERROR_NONE;
+}
+
+int MprisMediaPlayer::get_tracks(size_t offset, size_t count,
+                                 std::vector<DBusMetadata> &page) {
+  std::vector<std::string> missing;
+  int output = ERROR_NONE;
+
+  page.clear();
+
+  if ((output = check_track_list()) != ERROR_NONE) {
+    return output;
+  }
+
+  // later pages of a sweep reuse the ids of its first one
+  process_events(0);
+  if (!track_list_current() && !(offset > 0 && track_list.valid) &&
+      (output = fetch_track_ids()) != ERROR_NONE) {
+    return output;
+  }
+
+  // only the part of the page that has not been seen yet goes on the bus
+  list_missing_tracks(offset, count, missing);
+  if (!missing.empty() &&
+      (output = fetch_tracks_metadata(missing)) != ERROR_NONE) {
+    return output;
+  }
+
+  read_tracks_page(offset, count, page);
+
+  return ERROR_NONE;
+}
+
+void MprisMediaPlayer::list_missing_tracks(size_t offset, size_t count,
+                                           std::vector<std::string> &missing) {
+  missing.clear();
+  if (offset >= track_list.track_ids.size()) {
+    return;
+  }
+  count = std::min(count, track_list.track_ids.size() - offset);
+
+  auto id = track_list.at(offset);
+  for (size_t i = 0; i < count; i++, ++id) {
+    if (track_list.metadata.find(*id) == track_list.metadata.end()) {
+      missing.push_back(*id);
+    }
+  }
+}
+
+void MprisMediaPlayer::read_tracks_page(size_t offset, size_t count,
+                                        std::vector<DBusMetadata> &page) {
+  page.clear();
+  if (offset >= track_list.track_ids.size()) {
     return;
+  }
+  count = std::min(count, track_list.track_ids.size() - offset);
+
+  auto position = track_list.at(offset);
+  for (size_t i = 0; i < count; i++, ++position) {
+    const std::string &id = *position;
+    auto it = track_list.metadata.find(id);
+
+    if (it != track_list.metadata.end()) {
+      page.push_back(it->second);
+    } else {
+      // the player did not return metadata for this id
+      DBusMetadata metadata;
+      metadata.track_id = id;
+      page.push_back(metadata);
+    }
+  }
+}
+
+int MprisMediaPlayer::add_track(const std::string &uri,
+                                const std::string &after_track,
+                                bool set_as_current) {
+  DBusMessageHandle msg;
+  int output = ERROR_NONE;
 
-  read_reply(reply, &metadata);
+  if ((output = construct_add_track_msg(uri, after_track, set_as_current,
+                                        msg)) != ERROR_NONE) {
+    return output;
+  }
+  if ((output = check_track_list()) != ERROR_NONE) {
+    return output;
+  }
+
+  return execute_method_call_no_reply(msg.get());
+}
+
+int MprisMediaPlayer::construct_add_track_msg(const std::string &uri,
+                                              const std::string &after_track,
+                                              bool set_as_current,
+                                              DBusMessageHandle &msg) {
+  const char *uri_cstr = uri.c_str();
+  const char *after_cstr = after_track.c_str();
+  dbus_bool_t current = set_as_current;
+
+  if (!dbus_validate_path(after_cstr, nullptr)) {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  msg = _dbus_msg_new_method_call(session_name, PATH, TRACKLIST_IFACE,
+                                  "AddTrack");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+
+  dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &uri_cstr,
+                           DBUS_TYPE_OBJECT_PATH, &after_cstr,
+                           DBUS_TYPE_BOOLEAN, &current, DBUS_TYPE_INVALID);
+
+  return ERROR_NONE;
+}
+
+int MprisMediaPlayer::remove_track(const std::string &track_id) {
+  DBusMessageHandle msg;
+  int output = ERROR_NONE;
+
+  if ((output = construct_path_call_msg(TRACKLIST_IFACE, "RemoveTrack",
+                                        track_id, msg)) != ERROR_NONE) {
+    return output;
+  }
+  if ((output = check_track_list()) != ERROR_NONE) {
+    return output;
+  }
+
+  return execute_method_call_no_reply(msg.get());
+}
+
+int MprisMediaPlayer::go_to(const std::string &track_id) {
+  DBusMessageHandle msg;
+  int output = ERROR_NONE;
+
+  if ((output = construct_path_call_msg(TRACKLIST_IFACE, "GoTo", track_id,
+                                        msg)) != ERROR_NONE) {
+    return output;
+  }
+  if ((output = check_track_list()) != ERROR_NONE) {
+    return output;
+  }
+
+  return execute_method_call_no_reply(msg.get());
+}
+
+int MprisMediaPlayer::construct_path_call_msg(const std::string &iface,
+                                              const std::string &method,
+                                              const std::string &object,
+                                              DBusMessageHandle &msg) {
+  const char *object_cstr = object.c_str();
+
+  if (!dbus_validate_path(object_cstr, nullptr)) {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  msg = _dbus_msg_new_method_call(session_name, PATH, iface, method);
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+
+  dbus_message_append_args(msg.get(), DBUS_TYPE_OBJECT_PATH, &object_cstr,
+                           DBUS_TYPE_INVALID);
+
+  return ERROR_NONE;
+}
+
+int MprisMediaPlayer::get_playlist_count(uint32_t &count) {
+  DBusMessageHandle reply;
+  DBusMessageIter value_iter;
+  int output = ERROR_NONE;
+
+  if ((output = execute_get_property(PLAYLISTS_IFACE, "PlaylistCount", reply,
+                                     &value_iter)) != ERROR_NONE) {
+    return output;
+  }
+
+  if (dbus_message_iter_get_arg_type(&value_iter) == DBUS_TYPE_UINT32) {
+    dbus_message_iter_get_basic(&value_iter, &count);
+  } else {
+    output = ERROR_UNKNOWN_TYPE;
+  }
+
+  return output;
+}
+
+int MprisMediaPlayer::get_playlist_orderings(
+    std::vector<std::string> &orderings) {
+  DBusMessageHandle reply;
+  DBusMessageIter value_iter;
+  DBusMessageIter array_iter;
+  int output = ERROR_NONE;
+
+  if ((output = execute_get_property(PLAYLISTS_IFACE, "Orderings", reply,
+                                     &value_iter)) != ERROR_NONE) {
+    return output;
+  }
+
+  orderings.clear();
+  if (dbus_message_iter_get_arg_type(&value_iter) == DBUS_TYPE_ARRAY) {
+    dbus_message_iter_recurse(&value_iter, &array_iter);
+    while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_STRING) {
+      char *ordering;
+      dbus_message_iter_get_basic(&array_iter, &ordering);
+      orderings.push_back(ordering);
+      dbus_message_iter_next(&array_iter);
+    }
+  } else {
+    output = ERROR_UNKNOWN_TYPE;
+  }
+
+  return output;
+}
+
+int MprisMediaPlayer::get_active_playlist(DBusPlaylist &playlist) {
+  DBusMessageHandle reply;
+  DBusMessageIter value_iter;
+  int output = ERROR_NONE;
+
+  if ((output = execute_get_property(PLAYLISTS_IFACE, "ActivePlaylist", reply,
+                                     &value_iter)) != ERROR_NONE) {
+    return output;
+  }
+
+  return read_active_playlist(&value_iter, playlist);
+}
+
+int MprisMediaPlayer::get_playlists(uint32_t index, uint32_t max_count,
+                                    const std::string &order,
+                                    bool reverse_order,
+                                    std::vector<DBusPlaylist> &playlists) {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  int output = ERROR_NONE;
+
+  if ((output = construct_get_playlists_msg(index, max_count, order,
+                                            reverse_order, msg)) !=
+      ERROR_NONE) {
+    return output;
+  }
+
+  if ((output = execute_method_call(msg.get(), reply, true)) != ERROR_NONE) {
+    return output;
+  }
+
+  return read_playlists(reply.get(), playlists);
+}
+
+int MprisMediaPlayer::construct_get_playlists_msg(uint32_t index,
+                                                  uint32_t max_count,
+                                                  const std::string &order,
+                                                  bool reverse_order,
+                                                  DBusMessageHandle &msg) {
+  const char *order_cstr = order.c_str();
+  dbus_bool_t reverse = reverse_order;
+
+  msg = _dbus_msg_new_method_call(session_name, PATH, PLAYLISTS_IFACE,
+                                  "GetPlaylists");
+  if (!msg) {
+    log_error() << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+
+  dbus_message_append_args(msg.get(), DBUS_TYPE_UINT32, &index,
+                           DBUS_TYPE_UINT32, &max_count, DBUS_TYPE_STRING,
+                           &order_cstr, DBUS_TYPE_BOOLEAN, &reverse,
+                           DBUS_TYPE_INVALID);
+
+  return ERROR_NONE;
+}
+
+int MprisMediaPlayer::read_playlists(DBusMessage *reply,
+                                     std::vector<DBusPlaylist> &playlists) {
+  DBusMessageIter args;
+  DBusMessageIter array_iter;
+  int output = ERROR_NONE;
+
+  playlists.clear();
+  if (dbus_message_iter_init(reply, &args) &&
+      dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_ARRAY) {
+    dbus_message_iter_recurse(&args, &array_iter);
+    while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_STRUCT) {
+      DBusPlaylist playlist;
+      if (read_playlist(&array_iter, playlist) == ERROR_NONE) {
+        playlists.push_back(playlist);
+      }
+      dbus_message_iter_next(&array_iter);
+    }
+  } else {
+    output = ERROR_UNKNOWN_TYPE;
+  }
+
+  return output;
+}
 
-  if (reply != nullptr)
-    dbus_message_unref(reply);
+int MprisMediaPlayer::activate_playlist(const std::string &playlist_id) {
+  DBusMessageHandle msg;
+  int output = ERROR_NONE;
+
+  if ((output = construct_path_call_msg(PLAYLISTS_IFACE, "ActivatePlaylist",
+                                        playlist_id, msg)) != ERROR_NONE) {
+    return output;
+  }
 
-  return;
+  return execute_method_call_no_reply(msg.get());
 }
 
-void MprisMediaPlayer::next() { execute_base_method_func(Next); }
-void MprisMediaPlayer::pause() { execute_base_method_func(Pause); }
-void MprisMediaPlayer::play() { execute_base_method_func(Play); }
-void MprisMediaPlayer::play_pause() { execute_base_method_func(PlayPause); }
-void MprisMediaPlayer::previous() { execute_base_method_func(Previous); }
-void MprisMediaPlayer::seek(int64_t offset) {
-  execute_base_method_func(Seek, &offset);
+int MprisMediaPlayer::next() { return execute_base_method_func(Next); }
+int MprisMediaPlayer::pause() { return execute_base_method_func(Pause); }
+int MprisMediaPlayer::play() { return execute_base_method_func(Play); }
+int MprisMediaPlayer::play_pause() {
+  return execute_base_method_func(PlayPause);
+}
+int MprisMediaPlayer::previous() { return execute_base_method_func(Previous); }
+int MprisMediaPlayer::seek(int64_t offset) {
+  return execute_base_method_func(Seek, &offset);
+}
+
+int MprisMediaPlayer::set_position(const std::string &track_id,
+                                   int64_t position) {
+  DBusMessageHandle msg;
+  const char *track_cstr = track_id.c_str();
+  int output = ERROR_NONE;
+
+  if (!dbus_validate_path(track_cstr, nullptr)) {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  if ((output = check_capability(SetPosition)) != ERROR_NONE) {
+    return output;
+  }
+
+  if ((output = construct_new_dbus_msg(SetPosition, msg)) != ERROR_NONE) {
+    return output;
+  }
+
+  dbus_message_append_args(msg.get(), DBUS_TYPE_OBJECT_PATH, &track_cstr,
+                           DBUS_TYPE_INT64, &position, DBUS_TYPE_INVALID);
+
+  return execute_method_call_no_reply(msg.get());
 }
 
-//  void set_position(track, int64_t position);
-void MprisMediaPlayer::stop() { execute_base_method_func(Stop); }
+int MprisMediaPlayer::stop() { return execute_base_method_func(Stop); }
+int MprisMediaPlayer::open_uri(const std::string &uri) {
+  std::string uri_str = uri;
+  return execute_base_method_func(OpenUri, &uri_str);
+}
 
 void MprisMediaPlayer::test_menu() {
 
@@ -909,9 +2574,9 @@ void MprisMediaPlayer::test_menu() {
 }
 
 int MprisMediaPlayer::get_session_list(std::vector<std::string> &sessions) {
-  DBusMessage *msg;
-  DBusMessage *reply;
-  DBusError err;
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  DBusErrorHandle err;
   int output = ERROR_NONE;
 
   std::string session = "org.freedesktop.DBus";
@@ -919,9 +2584,6 @@ int MprisMediaPlayer::get_session_list(std::vector<std::string> &sessions) {
   std::string iface = "org.freedesktop.DBus";
   std::string method = "ListNames";
 
-  // Initialize the error
-  dbus_error_init(&err);
-
   // Connect to the session bus
   if (!is_connected && ((output = connect()) != ERROR_NONE)) {
     return output;
@@ -929,24 +2591,22 @@ int MprisMediaPlayer::get_session_list(std::vector<std::string> &sessions) {
 
   msg = _dbus_msg_new_method_call(session, path, iface, method);
   if (!msg) {
-    std::cerr << "Message Null" << std::endl;
+    log_error() << "Message Null" << std::endl;
     return ERROR_NULL_PTR;
   }
 
-  if ((output = send_dbus_msg_with_reply(msg, reply, err)) != ERROR_NONE) {
-    return output;
+  output = send_dbus_msg_with_reply(msg.get(), reply, err, true);
+  if (err.is_set()) {
+    log_error() << get_dbus_error(method, err) << std::endl;
   }
 
-  if (reply != nullptr) {
-    if (read_reply(reply, &sessions) == ERROR_NONE) {
-    }
-    // dbus_message_unref(reply);
+  if (output == ERROR_NONE) {
+    output = read_reply(reply.get(), DBUS_TYPE_ARRAY, &sessions);
   }
 
   // Clean up
-  dbus_message_unref(msg);
   disconnect();
-  std::cout << "Cleanup done." << std::endl;
+  log() << "Cleanup done." << std::endl;
 
-  return ERROR_NONE;
+  return output;
 }
@@ -0,0 +1,385 @@
+#include "mpris_publisher.h"
+#include "dbus_json.h"
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+template <size_t N>
+static void copy_string(char (&dst)[N], const char *src) {
+  snprintf(dst, N, "%s", src ? src : "");
+}
+
+static const char *read_string(DBusMessageIter *iter) {
+  int type = dbus_message_iter_get_arg_type(iter);
+  char *value = nullptr;
+
+  if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) {
+    dbus_message_iter_get_basic(iter, &value);
+  }
+
+  return value;
+}
+
+MprisPublisher::MprisPublisher(const std::string &shm_name)
+    : MprisWatcher(-1, 0), shm_name(shm_name), region(nullptr) {
+  memset(states, 0, sizeof(states));
+}
+
+MprisPublisher::~MprisPublisher() {
+  for (DBusPendingCallHandle &fetch : fetches) {
+    dbus_pending_call_cancel(fetch.get());
+  }
+  stop();
+  close();
+}
+
+int MprisPublisher::open() {
+  int fd;
+  void *addr;
+
+  if (region) {
+    return ERROR_NONE;
+  }
+
+  fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    std::cerr << "shm_open " << shm_name << ": " << strerror(errno)
+              << std::endl;
+    return ERROR_IO;
+  }
+
+  if (ftruncate(fd, sizeof(MprisShmRegion)) != 0) {
+    std::cerr << "ftruncate " << shm_name << ": " << strerror(errno)
+              << std::endl;
+    ::close(fd);
+    return ERROR_IO;
+  }
+
+  addr = mmap(nullptr, sizeof(MprisShmRegion), PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "mmap " << shm_name << ": " << strerror(errno) << std::endl;
+    return ERROR_IO;
+  }
+
+  // a region left behind by a crashed publisher is reset slot by slot so
+  // readers that still map it never see a torn header
+  region = static_cast<MprisShmRegion *>(addr);
+  region->version = MPRIS_SHM_VERSION;
+  region->max_players = MPRIS_SHM_MAX_PLAYERS;
+  region->struct_size = sizeof(MprisShmRegion);
+  region->publisher_pid.store(getpid(), std::memory_order_relaxed);
+  for (int i = 0; i < MPRIS_SHM_MAX_PLAYERS; i++) {
+    publish(i);
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  region->magic = MPRIS_SHM_MAGIC;
+
+  return ERROR_NONE;
+}
+
+void MprisPublisher::close() {
+  if (!region) {
+    return;
+  }
+
+  memset(states, 0, sizeof(states));
+  for (int i = 0; i < MPRIS_SHM_MAX_PLAYERS; i++) {
+    publish(i);
+  }
+  region->publisher_pid.store(0, std::memory_order_release);
+  slots.clear();
+
+  munmap(region, sizeof(MprisShmRegion));
+  region = nullptr;
+  shm_unlink(shm_name.c_str());
+}
+
+void MprisPublisher::publish(int slot) {
+  MprisShmSlot &s = region->slots[slot];
+  uint32_t sequence = s.sequence.load(std::memory_order_relaxed);
+
+  // leave an even sequence behind even if a previous publisher died
+  // half-way through a write
+  sequence &= ~1U;
+
+  s.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&s.player, &states[slot], sizeof(MprisShmPlayer));
+  s.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+int MprisPublisher::find_slot(const std::string &player, bool allocate) {
+  auto it = slots.find(player);
+  if (it != slots.end()) {
+    return it->second;
+  }
+
+  if (!allocate) {
+    return -1;
+  }
+
+  for (int i = 0; i < MPRIS_SHM_MAX_PLAYERS; i++) {
+    if (states[i].name[0] == '\0') {
+      memset(&states[i], 0, sizeof(MprisShmPlayer));
+      copy_string(states[i].name, player.c_str());
+      copy_string(states[i].playback_status, "Stopped");
+      states[i].rate = 1.0;
+      states[i].position_time = mpris_shm_monotonic_now();
+      slots[player] = i;
+      return i;
+    }
+  }
+
+  std::cerr << "no free slot for " << player << std::endl;
+  return -1;
+}
+
+void MprisPublisher::release_slot(const std::string &player) {
+  int slot = find_slot(player, false);
+
+  if (slot < 0) {
+    return;
+  }
+
+  memset(&states[slot], 0, sizeof(MprisShmPlayer));
+  slots.erase(player);
+  publish(slot);
+}
+
+void MprisPublisher::anchor_position(MprisShmPlayer &state, int64_t position) {
+  state.position = position;
+  state.position_time = mpris_shm_monotonic_now();
+}
+
+void MprisPublisher::fetch_state(const std::string &owner,
+                                 const std::string &player,
+                                 bool position_only) {
+  DBusMessageHandle msg(dbus_message_new_method_call(
+      owner.c_str(), MprisMediaPlayer::PATH.c_str(),
+      "org.freedesktop.DBus.Properties", position_only ? "Get" : "GetAll"));
+  const char *iface = "org.mpris.MediaPlayer2.Player";
+  const char *property = "Position";
+  DBusPendingCall *call = nullptr;
+
+  if (!msg) {
+    return;
+  }
+
+  if (position_only) {
+    dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &iface,
+                             DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+  } else {
+    dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &iface,
+                             DBUS_TYPE_INVALID);
+  }
+
+  // answered from the dispatch loop, so a slow player never stalls the
+  // others
+  if (!dbus_connection_send_with_reply(conn.get(), msg.get(), &call,
+                                       DBUS_TIMEOUT_USE_DEFAULT) ||
+      !call) {
+    return;
+  }
+
+  DBusRecorder::record(RecordSent, msg.get());
+
+  DBusPendingCallHandle pending(call);
+  dbus_pending_call_set_notify(
+      pending.get(), fetch_reply,
+      new PendingFetch{this, player, position_only}, free_pending_fetch);
+
+  fetches.erase(std::remove_if(fetches.begin(), fetches.end(),
+                               [](const DBusPendingCallHandle &fetch) {
+                                 return dbus_pending_call_get_completed(
+                                     fetch.get());
+                               }),
+                fetches.end());
+  fetches.push_back(std::move(pending));
+}
+
+void MprisPublisher::free_pending_fetch(void *user_data) {
+  delete static_cast<PendingFetch *>(user_data);
+}
+
+void MprisPublisher::fetch_reply(DBusPendingCall *call, void *user_data) {
+  PendingFetch *fetch = static_cast<PendingFetch *>(user_data);
+  MprisPublisher *publisher = fetch->publisher;
+  DBusMessageHandle reply(dbus_pending_call_steal_reply(call));
+  DBusMessageIter args;
+  DBusMessageIter value_iter;
+  int slot;
+
+  if (reply && dbus_message_get_sender(reply.get())) {
+    DBusRecorder::record(RecordReceived, reply.get());
+  }
+
+  if (!reply || dbus_message_get_type(reply.get()) == DBUS_MESSAGE_TYPE_ERROR ||
+      !dbus_message_iter_init(reply.get(), &args)) {
+    return;
+  }
+
+  // the player may have gone away while the call was in flight
+  if ((slot = publisher->find_slot(fetch->player, false)) < 0) {
+    return;
+  }
+
+  MprisShmPlayer &state = publisher->states[slot];
+
+  if (fetch->position_only) {
+    int64_t position;
+    if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_VARIANT) {
+      return;
+    }
+    dbus_message_iter_recurse(&args, &value_iter);
+    if (!read_dbus_integer(&value_iter, position)) {
+      return;
+    }
+    publisher->anchor_position(state, position);
+  } else {
+    if (dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY) {
+      return;
+    }
+    dbus_message_iter_recurse(&args, &value_iter);
+    publisher->apply_properties(state, &value_iter);
+  }
+
+  state.update_count++;
+  publisher->publish(slot);
+}
+
+void MprisPublisher::apply_properties(MprisShmPlayer &state,
+                                      DBusMessageIter *dict_iter) {
+  // rate and status changes only apply from now on
+  anchor_position(state, mpris_shm_current_position(state));
+
+  while (dbus_message_iter_get_arg_type(dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entry_iter;
+    DBusMessageIter variant_iter;
+    char *key;
+
+    dbus_message_iter_recurse(dict_iter, &entry_iter);
+    dbus_message_iter_get_basic(&entry_iter, &key);
+    dbus_message_iter_next(&entry_iter);
+    dbus_message_iter_recurse(&entry_iter, &variant_iter);
+
+    int type = dbus_message_iter_get_arg_type(&variant_iter);
+    if (strcmp(key, "PlaybackStatus") == 0 && type == DBUS_TYPE_STRING) {
+      copy_string(state.playback_status, read_string(&variant_iter));
+    } else if (strcmp(key, "Rate") == 0 && type == DBUS_TYPE_DOUBLE) {
+      dbus_message_iter_get_basic(&variant_iter, &state.rate);
+    } else if (strcmp(key, "Volume") == 0 && type == DBUS_TYPE_DOUBLE) {
+      dbus_message_iter_get_basic(&variant_iter, &state.volume);
+    } else if (strcmp(key, "Position") == 0) {
+      int64_t position;
+      if (read_dbus_integer(&variant_iter, position)) {
+        anchor_position(state, position);
+      }
+    } else if (strcmp(key, "Metadata") == 0) {
+      // decoded as MprisMediaPlayer does, so both read players alike
+      DBusMetadata metadata;
+      if (DBusPropertyCodec<DBusMetadata>::read(&variant_iter, metadata)) {
+        apply_metadata(state, metadata);
+      }
+    }
+
+    dbus_message_iter_next(dict_iter);
+  }
+}
+
+void MprisPublisher::apply_metadata(MprisShmPlayer &state,
+                                    const DBusMetadata &metadata) {
+  std::string artist;
+
+  // Metadata is always sent whole; fields it lacks are cleared
+  copy_string(state.track_id, metadata.track_id.c_str());
+  copy_string(state.title, metadata.title.c_str());
+  copy_string(state.album, metadata.album.c_str());
+  copy_string(state.art_url, metadata.art_url.c_str());
+  state.length = metadata.length;
+
+  for (const std::string &name : metadata.artist) {
+    artist += (artist.empty() ? "" : ", ") + name;
+  }
+  copy_string(state.artist, artist.c_str());
+}
+
+void MprisPublisher::on_started() {
+  for (const auto &entry : players) {
+    if (find_slot(entry.second, true) >= 0) {
+      fetch_state(entry.first, entry.second, false);
+    }
+  }
+  dbus_connection_flush(conn.get());
+}
+
+void MprisPublisher::on_owner_changed(const std::string &name,
+                                      const char *old_owner,
+                                      const char *new_owner) {
+  if (*old_owner) {
+    release_slot(name);
+  }
+
+  if (*new_owner && find_slot(name, true) >= 0) {
+    publish(slots[name]);
+    fetch_state(new_owner, name, false);
+  }
+}
+
+void MprisPublisher::on_properties_changed(const std::string &player,
+                                           DBusMessage *msg) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+  char *iface;
+  int slot;
+
+  if (!dbus_message_has_signature(msg, "sa{sv}as") ||
+      (slot = find_slot(player, false)) < 0) {
+    return;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_get_basic(&args, &iface);
+  if (strcmp(iface, "org.mpris.MediaPlayer2.Player") != 0) {
+    return;
+  }
+
+  MprisShmPlayer &state = states[slot];
+  char track_id[sizeof(state.track_id)];
+  char title[sizeof(state.title)];
+  memcpy(track_id, state.track_id, sizeof(track_id));
+  memcpy(title, state.title, sizeof(title));
+
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+  apply_properties(state, &dict_iter);
+
+  // a new track starts from its own position, which players do not signal
+  if (strcmp(track_id, state.track_id) != 0 ||
+      strcmp(title, state.title) != 0) {
+    anchor_position(state, 0);
+    fetch_state(dbus_message_get_sender(msg), player, true);
+  }
+
+  state.update_count++;
+  publish(slot);
+}
+
+void MprisPublisher::on_seeked(const std::string &player, DBusMessage *msg) {
+  dbus_int64_t position;
+  int slot;
+
+  if (!dbus_message_get_args(msg, nullptr, DBUS_TYPE_INT64, &position,
+                             DBUS_TYPE_INVALID) ||
+      (slot = find_slot(player, false)) < 0) {
+    return;
+  }
+
+  anchor_position(states[slot], position);
+  states[slot].update_count++;
+  publish(slot);
+}
@@ -0,0 +1,505 @@
+#include "mpris_scheduler.h"
+#include "dbus_json.h"
+
+#include <algorithm>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+MprisRequestScheduler::MprisRequestScheduler()
+    : wake_fd(-1), running(false), connection_lost(false),
+      handlers_running(0) {
+  class_policies[PriorityInteractive].max_in_flight = 4;
+  class_policies[PriorityInteractive].timeout_ms = 1000;
+
+  class_policies[PriorityNormal].max_in_flight = 2;
+
+  class_policies[PriorityBackground].max_in_flight = 1;
+  class_policies[PriorityBackground].max_queue_ms = 1000;
+}
+
+MprisRequestScheduler::~MprisRequestScheduler() { stop(); }
+
+void MprisRequestScheduler::set_class_policy(
+    DBusRequestPriorityType priority,
+    const DBusRequestClassPolicy &class_policy) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (priority < 0 || priority >= PriorityCount) {
+    return;
+  }
+  class_policies[priority] = class_policy;
+  class_policies[priority].max_in_flight =
+      std::max(1, class_policy.max_in_flight);
+  wake();
+}
+
+DBusRequestClassPolicy
+MprisRequestScheduler::get_class_policy(DBusRequestPriorityType priority) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (priority < 0 || priority >= PriorityCount) {
+    return DBusRequestClassPolicy();
+  }
+  return class_policies[priority];
+}
+
+int MprisRequestScheduler::start() {
+  DBusErrorHandle err;
+  int output = ERROR_NONE;
+
+  if (running) {
+    return ERROR_NONE;
+  }
+
+  if ((output = DBusTransport::open_private(transport, err)) != ERROR_NONE) {
+    std::cerr << "Connection Error (" << err.message() << ")" << std::endl;
+    return output;
+  }
+
+  if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    std::cerr << "eventfd failed" << std::endl;
+    transport.reset();
+    return ERROR_DBUS;
+  }
+
+  running = true;
+  connection_lost = false;
+  scheduler = std::thread(&MprisRequestScheduler::run, this);
+
+  return ERROR_NONE;
+}
+
+void MprisRequestScheduler::stop() {
+  std::vector<Completion> done;
+  DBusBatchResult result;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) {
+      return;
+    }
+    running = false;
+    wake();
+  }
+  scheduler.join();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    result.status = ERROR_DBUS;
+    result.error = "scheduler stopped";
+    fail_all(result);
+    done.swap(completions);
+    close(wake_fd);
+    wake_fd = -1;
+  }
+  run_handlers(done);
+
+  transport->flush();
+  transport.reset();
+  changed.notify_all();
+}
+
+int MprisRequestScheduler::submit(const std::string &session,
+                                  const std::string &command,
+                                  DBusRequestPriorityType priority,
+                                  DBusRequestHandler handler,
+                                  void *user_data) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Clock::time_point now = Clock::now();
+  Request request;
+  int output = ERROR_NONE;
+
+  if (priority < 0 || priority >= PriorityCount) {
+    return ERROR_INVALID_ARGUMENT;
+  }
+  if (!running || connection_lost) {
+    return ERROR_DBUS;
+  }
+
+  PlayerQueues &queues = find_or_add(session);
+  if (command == "refresh") {
+    typedef DBusPropertyTraits<CanControl> Traits;
+    request.returns_value = true;
+    request.is_refresh = true;
+    output = queues.player.construct_get_all_msg(Traits::iface, request.msg);
+  } else {
+    // Unknown until a refresh, or no longer trusted since the last one: let
+    // the player decide rather than block submit() on a GetAll.
+    output = queues.player.construct_batch_msg(command, request.msg,
+                                               request.returns_value, false);
+  }
+  if (output != ERROR_NONE) {
+    return output;
+  }
+
+  stats[priority].submitted++;
+  Waiter waiter = {handler, user_data, now};
+
+  // the same read already waiting to go out answers this one as well
+  if (priority != PriorityInteractive && request.returns_value) {
+    for (Request &queued : queues.queued[priority]) {
+      if (queued.command == command) {
+        queued.waiters.push_back(waiter);
+        // the later deadline, so coalescing never drops a request early
+        queued.drop_at =
+            std::max(queued.drop_at, drop_deadline(priority, now));
+        stats[priority].coalesced++;
+        return ERROR_NONE;
+      }
+    }
+  }
+
+  request.command = command;
+  request.priority = priority;
+  request.drop_at = drop_deadline(priority, now);
+  request.waiters.push_back(waiter);
+  queues.queued[priority].push_back(std::move(request));
+  wake();
+
+  return ERROR_NONE;
+}
+
+bool MprisRequestScheduler::wait_idle(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto idle = [this] { return is_idle(); };
+
+  if (timeout_ms < 0) {
+    changed.wait(lock, idle);
+    return true;
+  }
+
+  return changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), idle);
+}
+
+DBusSchedulerStats
+MprisRequestScheduler::get_stats(DBusRequestPriorityType priority) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (priority < 0 || priority >= PriorityCount) {
+    return DBusSchedulerStats();
+  }
+  return stats[priority];
+}
+
+bool MprisRequestScheduler::is_idle() {
+  if (!completions.empty() || handlers_running > 0) {
+    return false;
+  }
+
+  for (auto &entry : players) {
+    if (!entry.second->in_flight.empty()) {
+      return false;
+    }
+    for (int i = 0; i < PriorityCount; i++) {
+      if (!entry.second->queued[i].empty()) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+MprisRequestScheduler::Clock::time_point
+MprisRequestScheduler::drop_deadline(DBusRequestPriorityType priority,
+                                     Clock::time_point now) {
+  int max_queue_ms = class_policies[priority].max_queue_ms;
+
+  if (max_queue_ms <= 0) {
+    return Clock::time_point::max();
+  }
+  return now + std::chrono::milliseconds(max_queue_ms);
+}
+
+MprisRequestScheduler::PlayerQueues &
+MprisRequestScheduler::find_or_add(const std::string &session) {
+  std::unique_ptr<PlayerQueues> &queues = players[session];
+
+  if (!queues) {
+    queues.reset(new PlayerQueues(session));
+    queues->player.set_verbose(false);
+  }
+
+  return *queues;
+}
+
+void MprisRequestScheduler::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (running) {
+    Clock::time_point now = Clock::now();
+    Clock::time_point wake = Clock::time_point::max();
+    bool in_flight = false;
+
+    for (auto &entry : players) {
+      collect_replies(*entry.second);
+      wake = std::min(wake, drop_expired(*entry.second, now));
+    }
+
+    // every player's interactive requests go out before anything else
+    for (int i = 0; i < PriorityCount; i++) {
+      for (auto &entry : players) {
+        send_ready(*entry.second, static_cast<DBusRequestPriorityType>(i));
+      }
+    }
+
+    for (auto &entry : players) {
+      for (const auto &call : entry.second->in_flight) {
+        in_flight = true;
+        wake = std::min(wake, call->call->deadline());
+      }
+    }
+
+    if (!completions.empty()) {
+      std::vector<Completion> done;
+      done.swap(completions);
+      handlers_running++;
+      lock.unlock();
+      run_handlers(done);
+      lock.lock();
+      handlers_running--;
+      changed.notify_all();
+      // the handlers may have submitted more
+      continue;
+    }
+    changed.notify_all();
+
+    if (!in_flight) {
+      // nothing to read from the bus; sleep until a drop or submit()
+      if (wake == Clock::time_point::max()) {
+        changed.wait(lock);
+      } else {
+        changed.wait_until(lock, wake);
+      }
+      continue;
+    }
+
+    // Replies only come in while dispatching; submit() and stop() cut the
+    // wait short through wake_fd.
+    auto timeout = std::chrono::ceil<std::chrono::milliseconds>(wake - now);
+    lock.unlock();
+    transport->flush();
+    wait_for_traffic(std::max<int64_t>(0, timeout.count()));
+    int output = transport->dispatch(0);
+    lock.lock();
+
+    if (output != ERROR_NONE) {
+      DBusBatchResult result;
+      std::cerr << "Connection lost, requests failed" << std::endl;
+      result.status = ERROR_DBUS;
+      result.error = "connection lost";
+      connection_lost = true;
+      fail_all(result);
+    }
+  }
+}
+
+void MprisRequestScheduler::wake() {
+  uint64_t one = 1;
+
+  changed.notify_all();
+  if (wake_fd >= 0) {
+    // only fails while the counter is full, i.e. a wake is pending anyway
+    ssize_t written = write(wake_fd, &one, sizeof(one));
+    (void)written;
+  }
+}
+
+void MprisRequestScheduler::wait_for_traffic(int timeout_ms) {
+  struct pollfd fds[2] = {{transport->get_fd(), POLLIN, 0},
+                          {wake_fd, POLLIN, 0}};
+  uint64_t count;
+
+  // a descriptor of -1 is skipped, leaving the timeout
+  if (poll(fds, 2, timeout_ms) > 0 && (fds[1].revents & POLLIN)) {
+    // resets the counter; the wakes pending are all handled by this pass
+    ssize_t n = read(wake_fd, &count, sizeof(count));
+    (void)n;
+  }
+}
+
+void MprisRequestScheduler::collect_replies(PlayerQueues &queues) {
+  auto it = queues.in_flight.begin();
+
+  while (it != queues.in_flight.end()) {
+    Call &call = **it;
+    DBusBatchResult result;
+
+    if (!call.call->completed() && !call.call->expired()) {
+      ++it;
+      continue;
+    }
+
+    // a call that timed out yields NoReply, which read_reply() counts
+    DBusMessageHandle reply = call.call->block();
+    call.call.reset();
+    read_reply(queues, call, reply.get(), result);
+
+    queues.in_flight_count[call.request.priority]--;
+    complete(call.request, result, false);
+    it = queues.in_flight.erase(it);
+  }
+}
+
+MprisRequestScheduler::Clock::time_point
+MprisRequestScheduler::drop_expired(PlayerQueues &queues,
+                                    Clock::time_point now) {
+  Clock::time_point next_drop = Clock::time_point::max();
+
+  for (int i = 0; i < PriorityCount; i++) {
+    std::deque<Request> &queued = queues.queued[i];
+    auto it = queued.begin();
+
+    while (it != queued.end()) {
+      if (now < it->drop_at) {
+        next_drop = std::min(next_drop, it->drop_at);
+        ++it;
+        continue;
+      }
+
+      // stale by the time it could go out; a fresher one will follow
+      DBusBatchResult result;
+      result.status = ERROR_TIMEOUT;
+      result.error = "dropped, not sent in time";
+      complete(*it, result, true);
+      it = queued.erase(it);
+    }
+  }
+
+  return next_drop;
+}
+
+void MprisRequestScheduler::send_ready(PlayerQueues &queues,
+                                       DBusRequestPriorityType priority) {
+  const DBusRequestClassPolicy &class_policy = class_policies[priority];
+  std::deque<Request> &queued = queues.queued[priority];
+
+  // a class waits while a higher one has anything queued or in flight
+  for (int i = 0; i < priority; i++) {
+    if (!queues.queued[i].empty() || queues.in_flight_count[i] > 0) {
+      return;
+    }
+  }
+
+  while (!queued.empty() &&
+         queues.in_flight_count[priority] < class_policy.max_in_flight) {
+    Request request = std::move(queued.front());
+    queued.pop_front();
+    send_request(queues, request);
+  }
+}
+
+void MprisRequestScheduler::send_request(PlayerQueues &queues,
+                                         Request &request) {
+  int timeout_ms = class_policies[request.priority].timeout_ms;
+  std::unique_ptr<Call> call(new Call);
+  DBusBatchResult result;
+
+  if (queues.player.is_circuit_open()) {
+    result.status = ERROR_CIRCUIT_OPEN;
+    complete(request, result, false);
+    return;
+  }
+
+  if (transport->call_async(request.msg.get(), timeout_ms, call->call) !=
+      ERROR_NONE) {
+    // no memory, or the connection is already gone
+    result.status = ERROR_DBUS;
+    complete(request, result, false);
+    return;
+  }
+
+  call->request = std::move(request);
+
+  stats[call->request.priority].sent++;
+  queues.in_flight_count[call->request.priority]++;
+  queues.in_flight.push_back(std::move(call));
+}
+
+void MprisRequestScheduler::read_reply(PlayerQueues &queues, Call &call,
+                                       DBusMessage *reply,
+                                       DBusBatchResult &result) {
+  DBusErrorHandle err;
+  DBusMessageIter args;
+
+  if (!reply) {
+    result.status = ERROR_NULL_PTR;
+    return;
+  }
+
+  if (dbus_set_error_from_message(err.get(), reply)) {
+    bool timed_out = err.is_timeout();
+    queues.player.record_call_result(timed_out);
+    result.status = timed_out ? ERROR_TIMEOUT : ERROR_DBUS;
+    result.error = err.name() + ": " + err.message();
+    return;
+  }
+  queues.player.record_call_result(false);
+
+  if (call.request.is_refresh &&
+      (result.status = queues.player.read_capabilities(reply)) !=
+          ERROR_NONE) {
+    result.error = "GetAll reply is not a{sv}";
+    return;
+  }
+
+  if (call.request.returns_value && dbus_message_iter_init(reply, &args)) {
+    append_json_value(result.value, &args);
+  }
+}
+
+void MprisRequestScheduler::complete(Request &request, DBusBatchResult result,
+                                     bool dropped) {
+  DBusSchedulerStats &class_stats = stats[request.priority];
+  Clock::time_point now = Clock::now();
+
+  result.command = request.command;
+  for (const Waiter &waiter : request.waiters) {
+    int64_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                             now - waiter.submitted)
+                             .count();
+
+    if (dropped) {
+      class_stats.dropped++;
+    } else if (result.status == ERROR_NONE) {
+      class_stats.completed++;
+    } else {
+      class_stats.failed++;
+    }
+    class_stats.total_latency_us += latency_us;
+    class_stats.max_latency_us =
+        std::max(class_stats.max_latency_us, latency_us);
+
+    if (waiter.handler) {
+      completions.push_back({waiter.handler, waiter.user_data, result});
+    }
+  }
+}
+
+void MprisRequestScheduler::fail_all(const DBusBatchResult &result) {
+  for (auto &entry : players) {
+    PlayerQueues &queues = *entry.second;
+
+    for (auto &call : queues.in_flight) {
+      call->call.reset();
+      complete(call->request, result, false);
+    }
+    queues.in_flight.clear();
+
+    for (int i = 0; i < PriorityCount; i++) {
+      for (Request &request : queues.queued[i]) {
+        complete(request, result, false);
+      }
+      queues.queued[i].clear();
+      queues.in_flight_count[i] = 0;
+    }
+  }
+}
+
+void MprisRequestScheduler::run_handlers(std::vector<Completion> &done) {
+  for (Completion &completion : done) {
+    completion.handler(completion.result, completion.user_data);
+  }
+}
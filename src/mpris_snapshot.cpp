@@ -0,0 +1,504 @@
+#include "mpris_snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+// Bounds on what load() accepts, so a damaged file cannot make it allocate
+// wildly; real players stay far below them.
+static const uint32_t MAX_SNAPSHOT_PLAYERS = 1024;
+static const uint32_t MAX_SNAPSHOT_STRING = 1 << 20;
+static const uint32_t MAX_SNAPSHOT_LIST = 1024;
+
+template <typename T> static void write_value(FILE *file, const T &value) {
+  fwrite(&value, sizeof(value), 1, file);
+}
+
+static void write_string(FILE *file, const std::string &value) {
+  write_value(file, static_cast<uint32_t>(value.size()));
+  fwrite(value.data(), 1, value.size(), file);
+}
+
+static void write_strings(FILE *file, const std::vector<std::string> &values) {
+  write_value(file, static_cast<uint32_t>(values.size()));
+  for (const std::string &value : values) {
+    write_string(file, value);
+  }
+}
+
+template <typename T> static bool read_value(FILE *file, T &value) {
+  return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+static bool read_string(FILE *file, std::string &value) {
+  uint32_t length;
+
+  if (!read_value(file, length) || length > MAX_SNAPSHOT_STRING) {
+    return false;
+  }
+  value.resize(length);
+
+  return length == 0 || fread(&value[0], 1, length, file) == length;
+}
+
+static bool read_strings(FILE *file, std::vector<std::string> &values) {
+  uint32_t count;
+
+  if (!read_value(file, count) || count > MAX_SNAPSHOT_LIST) {
+    return false;
+  }
+  values.resize(count);
+
+  for (std::string &value : values) {
+    if (!read_string(file, value)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void write_player(FILE *file, const DBusPlayerState &state) {
+  const DBusMetadata &metadata = state.metadata;
+
+  write_string(file, state.name);
+  write_value(file, state.updated_us);
+  write_value(file, state.capabilities);
+  write_string(file, state.playback_status);
+  write_value(file, state.volume);
+
+  write_string(file, metadata.art_url);
+  write_string(file, metadata.url);
+  write_string(file, metadata.track_id);
+  write_strings(file, metadata.album_artist);
+  write_strings(file, metadata.artist);
+  write_string(file, metadata.album);
+  write_string(file, metadata.title);
+  write_value(file, metadata.disc_number);
+  write_value(file, metadata.track_number);
+  write_value(file, metadata.length);
+  write_value(file, metadata.user_rating);
+}
+
+static bool read_player(FILE *file, DBusPlayerState &state) {
+  DBusMetadata &metadata = state.metadata;
+
+  return read_string(file, state.name) &&
+         read_value(file, state.updated_us) &&
+         read_value(file, state.capabilities) &&
+         read_string(file, state.playback_status) &&
+         read_value(file, state.volume) &&
+         read_string(file, metadata.art_url) &&
+         read_string(file, metadata.url) &&
+         read_string(file, metadata.track_id) &&
+         read_strings(file, metadata.album_artist) &&
+         read_strings(file, metadata.artist) &&
+         read_string(file, metadata.album) &&
+         read_string(file, metadata.title) &&
+         read_value(file, metadata.disc_number) &&
+         read_value(file, metadata.track_number) &&
+         read_value(file, metadata.length) &&
+         read_value(file, metadata.user_rating);
+}
+
+MprisSnapshot::MprisSnapshot(const std::string &path)
+    : path(path), save_interval_ms(0), running(false), reconciled(false) {}
+
+MprisSnapshot::~MprisSnapshot() { stop(); }
+
+int64_t MprisSnapshot::wall_clock_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+int MprisSnapshot::load() {
+  std::map<std::string, DBusPlayerState> loaded;
+  char magic[8];
+  int64_t saved_us;
+  uint32_t count;
+  bool valid;
+
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    if (errno == ENOENT) {
+      return ERROR_NONE;
+    }
+    std::cerr << "cannot open " << path << ": " << strerror(errno)
+              << std::endl;
+    return ERROR_IO;
+  }
+
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, MPRIS_SNAPSHOT_MAGIC, sizeof(MPRIS_SNAPSHOT_MAGIC)) != 0 ||
+      magic[7] != MPRIS_SNAPSHOT_VERSION) {
+    std::cerr << path << " is not a dbus-music snapshot" << std::endl;
+    fclose(file);
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  valid = read_value(file, saved_us) && read_value(file, count) &&
+          count <= MAX_SNAPSHOT_PLAYERS;
+  for (uint32_t i = 0; valid && i < count; i++) {
+    DBusPlayerState state;
+    valid = read_player(file, state);
+    state.stale = true;
+    loaded[state.name] = state;
+  }
+  fclose(file);
+
+  if (!valid) {
+    std::cerr << path << " is truncated or damaged" << std::endl;
+    return ERROR_IO;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  // whatever the bus has already told us is newer than the file
+  if (!reconciled) {
+    players.swap(loaded);
+    changed.notify_all();
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisSnapshot::save() {
+  std::vector<DBusPlayerState> states = get_players();
+  std::string tmp_path = path + ".tmp";
+  char magic[8] = MPRIS_SNAPSHOT_MAGIC;
+
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    std::cerr << "cannot write " << tmp_path << ": " << strerror(errno)
+              << std::endl;
+    return ERROR_IO;
+  }
+
+  magic[7] = MPRIS_SNAPSHOT_VERSION;
+  fwrite(magic, sizeof(magic), 1, file);
+  write_value(file, wall_clock_us());
+  write_value(file, static_cast<uint32_t>(states.size()));
+  for (const DBusPlayerState &state : states) {
+    write_player(file, state);
+  }
+
+  if (ferror(file) | fclose(file)) {
+    std::cerr << "cannot write " << tmp_path << std::endl;
+    remove(tmp_path.c_str());
+    return ERROR_IO;
+  }
+
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::cerr << "cannot replace " << path << ": " << strerror(errno)
+              << std::endl;
+    remove(tmp_path.c_str());
+    return ERROR_IO;
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisSnapshot::start(int interval_ms) {
+  DBusErrorHandle err;
+  int output = ERROR_NONE;
+
+  if (running) {
+    return ERROR_NONE;
+  }
+
+  if ((output = DBusTransport::open_private(transport, err)) != ERROR_NONE) {
+    std::cerr << "Connection Error (" << err.message() << ")" << std::endl;
+    return output;
+  }
+
+  save_interval_ms = interval_ms;
+  running = true;
+  worker = std::thread(&MprisSnapshot::run, this);
+
+  return ERROR_NONE;
+}
+
+void MprisSnapshot::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) {
+      return;
+    }
+    running = false;
+  }
+  changed.notify_all();
+  worker.join();
+  transport.reset();
+
+  save();
+}
+
+std::vector<DBusPlayerState> MprisSnapshot::get_players() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<DBusPlayerState> states;
+
+  for (const auto &entry : players) {
+    states.push_back(entry.second);
+  }
+
+  return states;
+}
+
+bool MprisSnapshot::get_player(const std::string &name,
+                               DBusPlayerState &state) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = players.find(name);
+
+  if (it == players.end()) {
+    return false;
+  }
+  state = it->second;
+
+  return true;
+}
+
+void MprisSnapshot::update_player(const DBusPlayerState &state) {
+  std::lock_guard<std::mutex> lock(mutex);
+  DBusPlayerState &entry = players[state.name];
+
+  entry = state;
+  entry.stale = false;
+  if (entry.updated_us == 0) {
+    entry.updated_us = wall_clock_us();
+  }
+  changed.notify_all();
+}
+
+bool MprisSnapshot::is_reconciled() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return reconciled;
+}
+
+bool MprisSnapshot::wait_reconciled(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto done = [this] { return reconciled; };
+
+  if (timeout_ms < 0) {
+    changed.wait(lock, done);
+    return true;
+  }
+
+  return changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+}
+
+void MprisSnapshot::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (running) {
+    lock.unlock();
+    int output = reconcile();
+    lock.lock();
+
+    if (output != ERROR_NONE) {
+      std::cerr << "Snapshot: cannot reach the bus, serving stale state"
+                << std::endl;
+    }
+    if (save_interval_ms <= 0) {
+      break;
+    }
+
+    if (changed.wait_for(lock, std::chrono::milliseconds(save_interval_ms),
+                         [this] { return !running; })) {
+      break;
+    }
+    lock.unlock();
+    save();
+    lock.lock();
+  }
+}
+
+int MprisSnapshot::list_players(std::vector<std::string> &names) {
+  DBusMessageHandle msg(dbus_message_new_method_call(
+      DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "ListNames"));
+  DBusMessageHandle reply;
+  DBusErrorHandle err;
+  DBusMessageIter args;
+  std::vector<std::string> sessions;
+  int output = ERROR_NONE;
+
+  if (!msg) {
+    std::cerr << "Message Null" << std::endl;
+    return ERROR_NULL_PTR;
+  }
+
+  if ((output = transport->call(msg.get(), DBUS_TIMEOUT_USE_DEFAULT, reply,
+                                err)) != ERROR_NONE) {
+    std::cerr << "ListNames: " << err.message() << std::endl;
+    return output;
+  }
+
+  if (dbus_message_iter_init(reply.get(), &args)) {
+    MprisMediaPlayer::read_string_array(&args, sessions);
+  }
+
+  const std::string prefix = MprisMediaPlayer::ROOT_IFACE + ".";
+  names.clear();
+  for (const std::string &session : sessions) {
+    if (session.compare(0, prefix.size(), prefix) == 0) {
+      names.push_back(session);
+    }
+  }
+
+  return ERROR_NONE;
+}
+
+namespace {
+// One GetAll of a reconcile round
+struct SnapshotCall {
+  MprisMediaPlayer player;
+  std::unique_ptr<DBusTransportCall> call;
+
+  explicit SnapshotCall(const std::string &name) : player(name) {
+    player.set_verbose(false);
+  }
+};
+} // namespace
+
+int MprisSnapshot::reconcile() {
+  typedef std::chrono::steady_clock Clock;
+  std::vector<std::string> names;
+  std::vector<std::unique_ptr<SnapshotCall>> calls;
+  std::map<std::string, DBusPlayerState> fresh;
+  int64_t round_us = wall_clock_us();
+  int output = ERROR_NONE;
+
+  if ((output = list_players(names)) != ERROR_NONE) {
+    return output;
+  }
+
+  // every GetAll goes out before the first reply is read, so a round costs
+  // about one round trip however many players there are
+  for (const std::string &name : names) {
+    std::unique_ptr<SnapshotCall> call(new SnapshotCall(name));
+    DBusMessageHandle msg;
+
+    if (call->player.construct_get_all_msg(MprisMediaPlayer::ROOT_IFACE +
+                                               ".Player",
+                                           msg) != ERROR_NONE ||
+        transport->call_async(msg.get(), call->player.policy.timeout_ms,
+                              call->call) != ERROR_NONE) {
+      continue;
+    }
+    calls.push_back(std::move(call));
+  }
+
+  transport->flush();
+  for (;;) {
+    Clock::time_point deadline = Clock::time_point::max();
+    for (const auto &call : calls) {
+      if (!call->call->completed() && !call->call->expired()) {
+        deadline = std::min(deadline, call->call->deadline());
+      }
+    }
+    if (deadline == Clock::time_point::max()) {
+      break;
+    }
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - Clock::now());
+    if ((output = transport->dispatch(std::max<int64_t>(
+             0, timeout.count() + 1))) != ERROR_NONE) {
+      return output;
+    }
+  }
+
+  for (const auto &call : calls) {
+    const std::string &name = call->player.session_name;
+    DBusPlayerState state;
+    DBusErrorHandle err;
+    bool stale = true;
+
+    // a player that did not answer in time gets a NoReply error
+    DBusMessageHandle reply = call->call->block();
+    if (!dbus_set_error_from_message(err.get(), reply.get())) {
+      state.name = name;
+      read_player_state(call->player, reply.get(), state);
+      state.updated_us = wall_clock_us();
+      fresh[name] = state;
+      stale = false;
+    } else if (err.has_name(DBUS_ERROR_SERVICE_UNKNOWN)) {
+      // gone since ListNames
+      continue;
+    }
+
+    if (stale) {
+      // a player that does not answer keeps what was known about it
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = players.find(name);
+      if (it != players.end()) {
+        fresh[name] = it->second;
+        fresh[name].stale = true;
+      }
+    }
+  }
+  calls.clear();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const auto &entry : players) {
+    // update_player() during the round knows better than the round itself
+    if (!entry.second.stale && entry.second.updated_us > round_us &&
+        fresh.count(entry.first)) {
+      fresh[entry.first] = entry.second;
+    }
+  }
+  players.swap(fresh);
+  reconciled = true;
+  changed.notify_all();
+
+  return ERROR_NONE;
+}
+
+void MprisSnapshot::read_player_state(MprisMediaPlayer &player,
+                                      DBusMessage *reply,
+                                      DBusPlayerState &state) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+
+  if (player.read_capabilities(reply) == ERROR_NONE) {
+    state.capabilities = player.capabilities;
+  }
+
+  if (!dbus_message_iter_init(reply, &args) ||
+      dbus_message_iter_get_arg_type(&args) != DBUS_TYPE_ARRAY) {
+    return;
+  }
+
+  dbus_message_iter_recurse(&args, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter dict_entry_iter;
+    DBusMessageIter value_iter;
+    DBusPropertyType type;
+    char *key;
+
+    dbus_message_iter_recurse(&dict_iter, &dict_entry_iter);
+    dbus_message_iter_get_basic(&dict_entry_iter, &key);
+    dbus_message_iter_next(&dict_entry_iter);
+    dbus_message_iter_recurse(&dict_entry_iter, &value_iter);
+
+    if (player.convert_string_to_dbus_property_type(key, type) ==
+        ERROR_NONE) {
+      switch (type) {
+      case Metadata:
+        DBusPropertyCodec<DBusMetadata>::read(&value_iter, state.metadata);
+        break;
+      case PlaybackStatus:
+        DBusPropertyCodec<std::string>::read(&value_iter,
+                                             state.playback_status);
+        break;
+      case Volume:
+        DBusPropertyCodec<double>::read(&value_iter, state.volume);
+        break;
+      default:
+        break;
+      }
+    }
+
+    dbus_message_iter_next(&dict_iter);
+  }
+}
@@ -0,0 +1,388 @@
+#include "mpris_volume_ramp.h"
+
+#include <algorithm>
+#include <cmath>
+
+MprisVolumeRamp::MprisVolumeRamp(int max_rate_hz)
+    : min_interval(std::chrono::microseconds(1000000 /
+                                             std::max(1, max_rate_hz))),
+      running(false), active_count(0), set_count(0), coalesced_count(0) {}
+
+MprisVolumeRamp::~MprisVolumeRamp() { stop(); }
+
+int MprisVolumeRamp::start() {
+  DBusErrorHandle err;
+  int output = ERROR_NONE;
+
+  if (running) {
+    return ERROR_NONE;
+  }
+
+  if ((output = DBusTransport::open_private(transport, err)) != ERROR_NONE) {
+    std::cerr << "Connection Error (" << err.message() << ")" << std::endl;
+    return output;
+  }
+
+  running = true;
+  scheduler = std::thread(&MprisVolumeRamp::run, this);
+
+  return ERROR_NONE;
+}
+
+void MprisVolumeRamp::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) {
+      return;
+    }
+    running = false;
+  }
+  changed.notify_all();
+  scheduler.join();
+
+  // calls still in flight are cancelled; what was sent still goes out
+  for (auto &entry : players) {
+    entry.second->call.reset();
+  }
+  transport->flush();
+  transport.reset();
+}
+
+int MprisVolumeRamp::ramp(const std::string &session, double target,
+                          int duration_ms, VolumeCurveType curve) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Clock::time_point now = Clock::now();
+
+  if (target < 0 || duration_ms < 0) {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  PlayerRamp &state = find_or_add(session);
+  if (state.active && state.level_known) {
+    // retarget from wherever the running ramp has got to
+    state.from = current_level(state, now);
+  } else {
+    // unknown until the scheduler has read it
+    state.from = state.level;
+  }
+
+  state.target = target;
+  state.start = now;
+  state.duration = std::chrono::milliseconds(duration_ms);
+  state.curve = curve;
+  state.next_update = now;
+  if (!state.active) {
+    state.active = true;
+    active_count++;
+  }
+  changed.notify_all();
+
+  return ERROR_NONE;
+}
+
+int MprisVolumeRamp::ramp_from(const std::string &session, double from,
+                               double target, int duration_ms,
+                               VolumeCurveType curve) {
+  if (from < 0) {
+    return ERROR_INVALID_ARGUMENT;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    PlayerRamp &state = find_or_add(session);
+    state.level = from;
+    state.level_known = true;
+    // ramp() would take over a running ramp from its current level instead
+    if (state.active) {
+      state.active = false;
+      active_count--;
+    }
+  }
+
+  return ramp(session, target, duration_ms, curve);
+}
+
+void MprisVolumeRamp::cancel(const std::string &session) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = players.find(session);
+
+  if (it != players.end() && it->second->active) {
+    it->second->active = false;
+    active_count--;
+    changed.notify_all();
+  }
+}
+
+void MprisVolumeRamp::cancel_all() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (auto &entry : players) {
+    entry.second->active = false;
+  }
+  active_count = 0;
+  changed.notify_all();
+}
+
+bool MprisVolumeRamp::is_ramping(const std::string &session) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = players.find(session);
+
+  return it != players.end() && it->second->active;
+}
+
+bool MprisVolumeRamp::wait_idle(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto idle = [this] {
+    if (active_count > 0) {
+      return false;
+    }
+    // the last Set has been answered too
+    for (auto &entry : players) {
+      if (entry.second->call) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  if (timeout_ms < 0) {
+    changed.wait(lock, idle);
+    return true;
+  }
+
+  return changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), idle);
+}
+
+uint64_t MprisVolumeRamp::get_set_count() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return set_count;
+}
+
+uint64_t MprisVolumeRamp::get_coalesced_count() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return coalesced_count;
+}
+
+double MprisVolumeRamp::curve_level(VolumeCurveType curve, double from,
+                                    double target, double progress) {
+  if (progress <= 0) {
+    return from;
+  }
+  if (progress >= 1) {
+    return target;
+  }
+
+  if (curve == CurveExponential) {
+    // silence has no place on a log scale; fade from/to -60 dB instead
+    double low = std::max(from, SILENCE);
+    double high = std::max(target, SILENCE);
+    double value = low * std::pow(high / low, progress);
+    return (value <= SILENCE) ? 0 : value;
+  }
+
+  return from + (target - from) * progress;
+}
+
+double MprisVolumeRamp::current_level(const PlayerRamp &state,
+                                      Clock::time_point now) {
+  double progress = 1;
+
+  if (state.duration.count() > 0) {
+    progress = std::chrono::duration<double>(now - state.start) /
+               std::chrono::duration<double>(state.duration);
+  }
+
+  return curve_level(state.curve, state.from, state.target, progress);
+}
+
+MprisVolumeRamp::PlayerRamp &
+MprisVolumeRamp::find_or_add(const std::string &session) {
+  std::unique_ptr<PlayerRamp> &state = players[session];
+
+  if (!state) {
+    state.reset(new PlayerRamp(session));
+    state->player.set_verbose(false);
+  }
+
+  return *state;
+}
+
+void MprisVolumeRamp::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (running) {
+    Clock::time_point now = Clock::now();
+    Clock::time_point wake = Clock::time_point::max();
+    bool in_flight = false;
+
+    for (auto &entry : players) {
+      PlayerRamp &state = *entry.second;
+
+      if (state.call) {
+        collect_reply(state);
+      }
+      if (state.active) {
+        wake = std::min(wake, update(state, now));
+      }
+      if (state.call) {
+        in_flight = true;
+        wake = std::min(wake, state.call->deadline());
+      }
+    }
+    changed.notify_all();
+
+    if (!in_flight) {
+      // nothing to read from the bus; sleep until the next update or ramp()
+      if (wake == Clock::time_point::max()) {
+        changed.wait(lock);
+      } else {
+        changed.wait_until(lock, wake);
+      }
+      continue;
+    }
+
+    // Replies only come in while dispatching. A ramp() meanwhile is picked
+    // up within one update interval.
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::min<Clock::duration>(wake - now, min_interval));
+    lock.unlock();
+    transport->flush();
+    int output = transport->dispatch(std::max<int64_t>(0, timeout.count()));
+    lock.lock();
+
+    if (output != ERROR_NONE) {
+      std::cerr << "Connection lost, volume ramps stopped" << std::endl;
+      for (auto &entry : players) {
+        entry.second->call.reset();
+        entry.second->active = false;
+      }
+      active_count = 0;
+      changed.notify_all();
+      changed.wait(lock, [this] { return !running; });
+    }
+  }
+}
+
+MprisVolumeRamp::Clock::time_point
+MprisVolumeRamp::update(PlayerRamp &state, Clock::time_point now) {
+  if (state.call) {
+    // one call at a time per player; the update waits for the reply and
+    // goes out with the level of the moment it arrives
+    if (now >= state.next_update && !state.update_waiting) {
+      state.update_waiting = true;
+      coalesced_count++;
+    }
+    return Clock::time_point::max();
+  }
+  state.update_waiting = false;
+
+  if (!state.level_known) {
+    // the player's first ramp starts from its current Volume
+    if (send_get(state) != ERROR_NONE) {
+      state.active = false;
+      active_count--;
+    }
+    return Clock::time_point::max();
+  }
+
+  if (now < state.next_update) {
+    return state.next_update;
+  }
+
+  bool finished = now >= state.start + state.duration;
+  double value = finished ? state.target : current_level(state, now);
+
+  // steps too small to hear are skipped, except the one onto the target
+  if (finished ? value != state.level
+               : std::fabs(value - state.level) > MIN_STEP) {
+    if (send_set(state, value) == ERROR_NONE) {
+      state.level = value;
+      set_count++;
+    }
+  }
+
+  if (finished) {
+    state.active = false;
+    active_count--;
+    return Clock::time_point::max();
+  }
+
+  state.next_update = now + min_interval;
+  return state.next_update;
+}
+
+void MprisVolumeRamp::collect_reply(PlayerRamp &state) {
+  DBusMessageHandle reply;
+  DBusErrorHandle err;
+  DBusMessageIter args;
+  DBusMessageIter value_iter;
+  bool is_get = state.call_is_get;
+
+  if (!state.call->completed() && !state.call->expired()) {
+    return;
+  }
+  reply = state.call->block();
+  state.call.reset();
+
+  if (dbus_set_error_from_message(err.get(), reply.get())) {
+    std::cerr << state.player.get_dbus_error("Volume", err) << std::endl;
+  } else if (is_get && dbus_message_iter_init(reply.get(), &args) &&
+             dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_VARIANT) {
+    dbus_message_iter_recurse(&args, &value_iter);
+    if (!state.level_known &&
+        DBusPropertyCodec<double>::read(&value_iter, state.level)) {
+      state.level_known = true;
+      // the ramp starts now that its start is known
+      state.from = state.level;
+      state.start = Clock::now();
+      state.next_update = state.start;
+    }
+  }
+
+  if (is_get && !state.level_known && state.active) {
+    std::cerr << "Volume of " << state.player.session_name
+              << " is unknown, not ramping" << std::endl;
+    state.active = false;
+    active_count--;
+  }
+}
+
+int MprisVolumeRamp::send_get(PlayerRamp &state) {
+  typedef DBusPropertyTraits<Volume> Traits;
+  DBusMessageHandle msg;
+  int output = ERROR_NONE;
+
+  if ((output = state.player.construct_get_msg(Traits::iface, Traits::name,
+                                               msg)) != ERROR_NONE) {
+    return output;
+  }
+
+  return send_call(state, msg.get(), true);
+}
+
+int MprisVolumeRamp::send_set(PlayerRamp &state, double value) {
+  DBusMessageHandle msg;
+  int output = ERROR_NONE;
+
+  if ((output = state.player.construct_set_msg<Volume>(value, msg)) !=
+      ERROR_NONE) {
+    return output;
+  }
+
+  return send_call(state, msg.get(), false);
+}
+
+int MprisVolumeRamp::send_call(PlayerRamp &state, DBusMessage *msg,
+                               bool is_get) {
+  int timeout_ms = state.player.policy.timeout_ms;
+  int output = ERROR_NONE;
+
+  if ((output = transport->call_async(msg, timeout_ms, state.call)) !=
+      ERROR_NONE) {
+    return output;
+  }
+
+  state.call_is_get = is_get;
+
+  return ERROR_NONE;
+}
@@ -0,0 +1,501 @@
+#include "mpris_watcher.h"
+#include "dbus_json.h"
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+MprisWatcher::MprisWatcher(int fd, size_t buffer_size)
+    : conn(nullptr), fd(fd), flush_threshold(buffer_size - buffer_size / 4),
+      write_failed(false), is_started(false), polling(false),
+      delivering_poll(false), event_count(0), write_count(0) {
+  // a single oversized event may still grow it, but steady-state appends
+  // never reallocate
+  buffer.reserve(buffer_size);
+}
+
+MprisWatcher::~MprisWatcher() { stop(); }
+
+std::vector<std::string> MprisWatcher::match_rules() {
+  std::string base = "type='signal',path='" + MprisMediaPlayer::PATH + "',";
+
+  return {base + "interface='org.freedesktop.DBus.Properties',"
+                 "member='PropertiesChanged'",
+          base + "interface='org.mpris.MediaPlayer2.Player',member='Seeked'",
+          "type='signal',sender='org.freedesktop.DBus',"
+          "path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',"
+          "member='NameOwnerChanged',arg0namespace='" +
+              MprisMediaPlayer::ROOT_IFACE + "'"};
+}
+
+void MprisWatcher::set_bus(const std::string &address,
+                           const std::string &label) {
+  bus_address = address;
+  bus_label = label;
+}
+
+int MprisWatcher::connect() {
+  DBusErrorHandle err;
+
+  if (bus_address.empty()) {
+    conn.reset(dbus_bus_get(DBUS_BUS_SESSION, err.get()));
+  } else if (bus_address == "session" || bus_address == "system") {
+    conn.reset(dbus_bus_get_private(
+        bus_address == "system" ? DBUS_BUS_SYSTEM : DBUS_BUS_SESSION,
+        err.get()));
+  } else {
+    conn.reset(dbus_connection_open_private(bus_address.c_str(), err.get()));
+    if (conn && !dbus_bus_register(conn.get(), err.get())) {
+      dbus_connection_close(conn.get());
+      conn.reset();
+    }
+  }
+
+  if (!conn) {
+    std::cerr << "[DBUS ERROR] " << err.name() << " - " << err.message()
+              << std::endl;
+    return ERROR_DBUS;
+  }
+
+  // one bus going away must not take the others down with the process
+  if (!bus_address.empty()) {
+    dbus_connection_set_exit_on_disconnect(conn.get(), FALSE);
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisWatcher::start() {
+  DBusErrorHandle err;
+  int output = ERROR_NONE;
+
+  if (is_started) {
+    return ERROR_NONE;
+  }
+
+  if ((output = connect()) != ERROR_NONE) {
+    return output;
+  }
+
+  if (!dbus_connection_add_filter(conn.get(), signal_filter, this, nullptr)) {
+    if (!bus_address.empty()) {
+      dbus_connection_close(conn.get());
+    }
+    conn.reset();
+    return ERROR_DBUS;
+  }
+
+  for (const std::string &rule : match_rules()) {
+    dbus_bus_add_match(conn.get(), rule.c_str(), err.get());
+    if (err.is_set()) {
+      std::cerr << "[DBUS ERROR] AddMatch failed: " << err.name() << " - "
+                << err.message() << std::endl;
+      dbus_connection_remove_filter(conn.get(), signal_filter, this);
+      if (!bus_address.empty()) {
+        dbus_connection_close(conn.get());
+      }
+      conn.reset();
+      return ERROR_DBUS;
+    }
+  }
+
+  is_started = true;
+
+  // the rules are in place first, so an owner change racing with the seed
+  // shows up as a signal instead of being missed
+  if ((output = seed_name_owners()) != ERROR_NONE) {
+    stop();
+    return output;
+  }
+
+  clear_polls();
+  if (polling) {
+    for (const auto &entry : players) {
+      add_poll(entry.first, entry.second);
+    }
+  }
+
+  on_started();
+
+  return ERROR_NONE;
+}
+
+void MprisWatcher::stop() {
+  if (!is_started) {
+    return;
+  }
+
+  if (dbus_connection_get_is_connected(conn.get())) {
+    for (const std::string &rule : match_rules()) {
+      dbus_bus_remove_match(conn.get(), rule.c_str(), nullptr);
+    }
+  }
+  // the stats stay readable until the next start()
+  cancel_polls();
+  dbus_connection_remove_filter(conn.get(), signal_filter, this);
+  dbus_connection_flush(conn.get());
+  if (!bus_address.empty()) {
+    dbus_connection_close(conn.get());
+  }
+  conn.reset();
+
+  flush();
+  players.clear();
+  is_started = false;
+}
+
+int MprisWatcher::seed_name_owners() {
+  DBusMessageHandle msg;
+  DBusMessageHandle reply;
+  DBusErrorHandle err;
+  char **names;
+  int name_count;
+  std::vector<std::string> mpris_names;
+  std::vector<DBusPendingCallHandle> pending;
+  const std::string prefix = MprisMediaPlayer::ROOT_IFACE + ".";
+
+  msg.reset(dbus_message_new_method_call(
+      "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+      "ListNames"));
+  if (!msg) {
+    return ERROR_NULL_PTR;
+  }
+
+  int64_t sent_us = DBusRecorder::now_us();
+  reply.reset(dbus_connection_send_with_reply_and_block(
+      conn.get(), msg.get(), DBUS_TIMEOUT_USE_DEFAULT, err.get()));
+  DBusRecorder::record(RecordSent, msg.get(), sent_us);
+  DBusRecorder::record(RecordReceived, reply.get());
+  if (!reply ||
+      !dbus_message_get_args(reply.get(), err.get(), DBUS_TYPE_ARRAY,
+                             DBUS_TYPE_STRING, &names, &name_count,
+                             DBUS_TYPE_INVALID)) {
+    std::cerr << "[DBUS ERROR] ListNames: " << err.name() << " - "
+              << err.message() << std::endl;
+    return ERROR_DBUS;
+  }
+
+  for (int i = 0; i < name_count; i++) {
+    if (strncmp(names[i], prefix.c_str(), prefix.size()) == 0) {
+      mpris_names.push_back(names[i]);
+    }
+  }
+  dbus_free_string_array(names);
+
+  // one round trip for all owners
+  for (const std::string &name : mpris_names) {
+    DBusPendingCall *call = nullptr;
+    const char *name_cstr = name.c_str();
+
+    msg.reset(dbus_message_new_method_call(
+        "org.freedesktop.DBus", "/org/freedesktop/DBus",
+        "org.freedesktop.DBus", "GetNameOwner"));
+    if (!msg || !dbus_message_append_args(msg.get(), DBUS_TYPE_STRING,
+                                          &name_cstr, DBUS_TYPE_INVALID)) {
+      return ERROR_NULL_PTR;
+    }
+    dbus_connection_send_with_reply(conn.get(), msg.get(), &call,
+                                    DBUS_TIMEOUT_USE_DEFAULT);
+    pending.emplace_back(call);
+    // replays map the players' unique names back through these
+    DBusRecorder::record(RecordSent, msg.get());
+  }
+  dbus_connection_flush(conn.get());
+
+  for (size_t i = 0; i < pending.size(); i++) {
+    char *owner;
+
+    if (!pending[i]) {
+      continue;
+    }
+    dbus_pending_call_block(pending[i].get());
+    reply.reset(dbus_pending_call_steal_reply(pending[i].get()));
+    DBusRecorder::record(RecordReceived, reply.get());
+
+    // the player may have quit since ListNames; skip it
+    if (reply && dbus_message_get_args(reply.get(), nullptr, DBUS_TYPE_STRING,
+                                       &owner, DBUS_TYPE_INVALID)) {
+      players[owner] = mpris_names[i];
+    }
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisWatcher::process_events(int timeout_ms) {
+  int output = ERROR_NONE;
+
+  if (!is_started) {
+    return ERROR_NONE;
+  }
+
+  int poll_ms = next_poll_ms();
+  if (poll_ms >= 0 && (timeout_ms < 0 || poll_ms < timeout_ms)) {
+    timeout_ms = poll_ms;
+  }
+
+  if (dbus_connection_read_write_dispatch(conn.get(), timeout_ms)) {
+    // drain whatever else has come in without blocking, then write the
+    // whole batch out at once. With a message already queued the call
+    // above only dispatched it, leaving the socket unread.
+    do {
+      while (dbus_connection_dispatch(conn.get()) ==
+             DBUS_DISPATCH_DATA_REMAINS) {
+      }
+    } while (dbus_connection_read_write(conn.get(), 0) &&
+             dbus_connection_get_dispatch_status(conn.get()) ==
+                 DBUS_DISPATCH_DATA_REMAINS);
+  }
+
+  // libdbus closes the socket as soon as it sees the bus go, so callers
+  // polling get_fd() would not hear about it again
+  if (!dbus_connection_get_is_connected(conn.get())) {
+    std::cerr << "Connection closed" << std::endl;
+    drop_players();
+    flush();
+    return ERROR_DBUS;
+  }
+
+  if (polling) {
+    send_due_polls();
+  }
+
+  if ((output = flush()) != ERROR_NONE) {
+    return output;
+  }
+
+  return ERROR_NONE;
+}
+
+int MprisWatcher::get_fd() {
+  int unix_fd = -1;
+
+  if (!conn || !dbus_connection_get_unix_fd(conn.get(), &unix_fd)) {
+    return -1;
+  }
+
+  return unix_fd;
+}
+
+int MprisWatcher::run(volatile int *quit) {
+  int output = ERROR_NONE;
+
+  if ((output = start()) != ERROR_NONE) {
+    return output;
+  }
+
+  // wake up now and then to notice *quit
+  while (!*quit && (output = process_events(250)) == ERROR_NONE) {
+  }
+
+  stop();
+
+  return output;
+}
+
+DBusHandlerResult
+MprisWatcher::signal_filter(DBusConnection * /* connection */,
+                            DBusMessage *msg, void *user_data) {
+  MprisWatcher *watcher = static_cast<MprisWatcher *>(user_data);
+  const std::string *player;
+
+  if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL) {
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+  DBusRecorder::record(RecordReceived, msg);
+
+  if (dbus_message_is_signal(msg, "org.freedesktop.DBus",
+                             "NameOwnerChanged")) {
+    watcher->handle_name_owner_changed(msg);
+  } else if (dbus_message_has_path(msg, MprisMediaPlayer::PATH.c_str()) &&
+             (player = watcher->lookup_player(msg)) != nullptr) {
+    if (dbus_message_is_signal(msg, "org.freedesktop.DBus.Properties",
+                               "PropertiesChanged")) {
+      if (watcher->polling) {
+        watcher->note_signal(dbus_message_get_sender(msg), msg);
+      }
+      watcher->on_properties_changed(*player, msg);
+    } else if (dbus_message_is_signal(msg, "org.mpris.MediaPlayer2.Player",
+                                      "Seeked")) {
+      watcher->on_seeked(*player, msg);
+    }
+  }
+
+  // other users may share this connection
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+const std::string *MprisWatcher::lookup_player(DBusMessage *msg) {
+  const char *sender = dbus_message_get_sender(msg);
+
+  if (!sender) {
+    return nullptr;
+  }
+
+  // only names we saw being claimed under org.mpris.MediaPlayer2.*
+  auto it = players.find(sender);
+  return it != players.end() ? &it->second : nullptr;
+}
+
+void MprisWatcher::begin_event(const std::string &player, const char *event) {
+  char ts[32];
+  int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+
+  snprintf(ts, sizeof(ts), "%lld", static_cast<long long>(now));
+
+  buffer += "{\"ts\":";
+  buffer += ts;
+  if (!bus_label.empty()) {
+    buffer += ",\"bus\":";
+    append_json_string(buffer, bus_label.c_str());
+  }
+  buffer += ",\"player\":";
+  append_json_string(buffer, player.c_str());
+  buffer += ",\"event\":\"";
+  buffer += event;
+  buffer += '"';
+}
+
+void MprisWatcher::end_event() {
+  buffer += "}\n";
+  event_count++;
+
+  // only flush early if a burst outgrows the buffer; otherwise the batch
+  // goes out once the queue is drained
+  if (buffer.size() >= flush_threshold) {
+    flush();
+  }
+}
+
+void MprisWatcher::on_properties_changed(const std::string &player,
+                                         DBusMessage *msg) {
+  DBusMessageIter args;
+  char *iface;
+
+  // signature: interface_name, changed_properties, invalidated_properties
+  if (!dbus_message_has_signature(msg, "sa{sv}as")) {
+    return;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_get_basic(&args, &iface);
+
+  begin_event(player, "properties");
+  buffer += ",\"interface\":";
+  append_json_string(buffer, iface);
+
+  dbus_message_iter_next(&args);
+  buffer += ",\"changed\":";
+  append_json_value(buffer, &args);
+
+  dbus_message_iter_next(&args);
+  buffer += ",\"invalidated\":";
+  append_json_value(buffer, &args);
+  if (delivering_poll) {
+    buffer += ",\"polled\":true";
+  }
+  end_event();
+}
+
+void MprisWatcher::on_seeked(const std::string &player, DBusMessage *msg) {
+  dbus_int64_t position;
+  char position_str[32];
+
+  if (!dbus_message_get_args(msg, nullptr, DBUS_TYPE_INT64, &position,
+                             DBUS_TYPE_INVALID)) {
+    return;
+  }
+
+  snprintf(position_str, sizeof(position_str), "%lld",
+           static_cast<long long>(position));
+
+  begin_event(player, "seeked");
+  buffer += ",\"position\":";
+  buffer += position_str;
+  end_event();
+}
+
+void MprisWatcher::handle_name_owner_changed(DBusMessage *msg) {
+  char *name;
+  char *old_owner;
+  char *new_owner;
+  const std::string prefix = MprisMediaPlayer::ROOT_IFACE + ".";
+
+  if (!dbus_message_get_args(msg, nullptr, DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner, DBUS_TYPE_STRING,
+                             &new_owner, DBUS_TYPE_INVALID) ||
+      strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+    return;
+  }
+
+  if (*old_owner) {
+    players.erase(old_owner);
+    remove_poll(old_owner);
+  }
+  if (*new_owner) {
+    players[new_owner] = name;
+    if (polling) {
+      add_poll(new_owner, name);
+    }
+  }
+
+  on_owner_changed(name, old_owner, new_owner);
+}
+
+// The bus is gone and its players with it; they are reported as having
+// lost their names, as they would have been one by one
+void MprisWatcher::drop_players() {
+  std::unordered_map<std::string, std::string> gone;
+
+  gone.swap(players);
+  clear_polls();
+  for (const auto &entry : gone) {
+    on_owner_changed(entry.second, entry.first.c_str(), "");
+  }
+}
+
+void MprisWatcher::on_owner_changed(const std::string &name,
+                                    const char *old_owner,
+                                    const char *new_owner) {
+  begin_event(name, "owner");
+  buffer += ",\"old_owner\":";
+  append_json_string(buffer, old_owner);
+  buffer += ",\"new_owner\":";
+  append_json_string(buffer, new_owner);
+  end_event();
+}
+
+int MprisWatcher::flush() {
+  size_t written = 0;
+
+  if (buffer.empty()) {
+    return write_failed ? ERROR_IO : ERROR_NONE;
+  }
+
+  while (!write_failed && written < buffer.size()) {
+    ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      // e.g. EPIPE once the reader is gone; keep consuming signals but
+      // report it so the caller can stop
+      std::cerr << "write failed: " << strerror(errno) << std::endl;
+      write_failed = true;
+      break;
+    }
+    written += n;
+  }
+  write_count++;
+
+  // clear() keeps the capacity reserved in the constructor
+  buffer.clear();
+
+  return write_failed ? ERROR_IO : ERROR_NONE;
+}
@@ -0,0 +1,453 @@
+#include "dbus_json.h"
+#include "dbus_recorder.h"
+#include "mpris_media_player.h"
+#include "mpris_watcher.h"
+
+#include <algorithm>
+#include <cstring>
+
+/*******************************************************************************
+ * Polling fallback
+ ******************************************************************************/
+
+static const char *PLAYER_IFACE = "org.mpris.MediaPlayer2.Player";
+
+// Appends a copy of the value under from, containers included
+static void copy_value(DBusMessageIter *from, DBusMessageIter *to) {
+  int type = dbus_message_iter_get_arg_type(from);
+  DBusMessageIter from_sub;
+  DBusMessageIter to_sub;
+  char *signature = nullptr;
+  const char *contents = nullptr;
+
+  if (dbus_type_is_basic(type)) {
+    DBusBasicValue value;
+    dbus_message_iter_get_basic(from, &value);
+    dbus_message_iter_append_basic(to, type, &value);
+    return;
+  }
+
+  dbus_message_iter_recurse(from, &from_sub);
+  // only arrays and variants state their contents up front
+  if (type == DBUS_TYPE_VARIANT) {
+    signature = dbus_message_iter_get_signature(&from_sub);
+    contents = signature;
+  } else if (type == DBUS_TYPE_ARRAY) {
+    signature = dbus_message_iter_get_signature(from);
+    contents = signature + 1;
+  }
+
+  dbus_message_iter_open_container(to, type, contents, &to_sub);
+  while (dbus_message_iter_get_arg_type(&from_sub) != DBUS_TYPE_INVALID) {
+    copy_value(&from_sub, &to_sub);
+    dbus_message_iter_next(&from_sub);
+  }
+  dbus_message_iter_close_container(to, &to_sub);
+
+  dbus_free(signature);
+}
+
+static bool is_in_flight(const std::unique_ptr<DBusTransportCall> &call) {
+  return call && !call->completed();
+}
+
+void MprisWatcher::set_poll_policy(const DBusPollPolicy &policy) {
+  poll_policy = policy;
+  poll_policy.fast_interval_ms = std::max(1, policy.fast_interval_ms);
+  polling = true;
+}
+
+void MprisWatcher::note_input(const std::string &player) {
+  Clock::time_point soon =
+      Clock::now() + std::chrono::milliseconds(poll_policy.fast_interval_ms);
+
+  for (auto &entry : polls) {
+    PlayerPoll &poll = entry.second;
+
+    if (poll.stats.player != player || poll.stats.mode == PollSignals) {
+      continue;
+    }
+    poll.input = true;
+    poll.stats.interval_ms = poll_policy.fast_interval_ms;
+    if (!is_in_flight(poll.call)) {
+      poll.next_poll = std::min(poll.next_poll, soon);
+    }
+  }
+}
+
+int MprisWatcher::next_poll_ms() {
+  Clock::time_point next = Clock::time_point::max();
+  Clock::time_point now = Clock::now();
+
+  for (const auto &entry : polls) {
+    const PlayerPoll &poll = entry.second;
+
+    if (is_in_flight(poll.call)) {
+      next = std::min(next, poll.call->deadline());
+    } else {
+      next = std::min(next, poll.next_poll);
+    }
+  }
+
+  if (next == Clock::time_point::max()) {
+    return -1;
+  }
+  if (next <= now) {
+    return 0;
+  }
+
+  return static_cast<int>(
+      std::chrono::ceil<std::chrono::milliseconds>(next - now).count());
+}
+
+void MprisWatcher::get_poll_stats(std::vector<DBusPollStats> &stats) {
+  stats.clear();
+
+  for (const auto &entry : polls) {
+    stats.push_back(entry.second.stats);
+    stats.back().bus = bus_label;
+  }
+  std::sort(stats.begin(), stats.end(),
+            [](const DBusPollStats &a, const DBusPollStats &b) {
+              return a.player < b.player;
+            });
+}
+
+void MprisWatcher::add_poll(const std::string &owner,
+                            const std::string &name) {
+  PlayerPoll &poll = polls[owner];
+
+  // the poll in flight goes before what its notify is given
+  poll.call.reset();
+  poll = PlayerPoll();
+  poll.stats.player = name;
+  poll.stats.interval_ms = poll_policy.fast_interval_ms;
+  // the first poll only learns the state, which is not reported as a change
+  poll.next_poll = Clock::now();
+}
+
+void MprisWatcher::remove_poll(const std::string &owner) {
+  auto it = polls.find(owner);
+
+  if (it != polls.end()) {
+    polls.erase(it);
+  }
+}
+
+void MprisWatcher::cancel_polls() {
+  for (auto &entry : polls) {
+    entry.second.call.reset();
+  }
+}
+
+void MprisWatcher::clear_polls() {
+  polls.clear();
+}
+
+void MprisWatcher::send_due_polls() {
+  Clock::time_point now = Clock::now();
+  bool sent = false;
+
+  for (auto &entry : polls) {
+    PlayerPoll &poll = entry.second;
+
+    if (is_in_flight(poll.call)) {
+      if (!poll.call->expired()) {
+        continue;
+      }
+      poll.call.reset();
+      poll.stats.failures++;
+      schedule_poll(poll, false);
+    }
+
+    if (now >= poll.next_poll) {
+      send_poll(entry.first, poll);
+      sent = true;
+    }
+  }
+
+  // every poll that fell due goes out in one write
+  if (sent) {
+    dbus_connection_flush(conn.get());
+  }
+}
+
+void MprisWatcher::send_poll(const std::string &owner, PlayerPoll &poll) {
+  DBusMessageHandle msg(dbus_message_new_method_call(
+      owner.c_str(), MprisMediaPlayer::PATH.c_str(),
+      "org.freedesktop.DBus.Properties", "GetAll"));
+
+  poll.call.reset();
+  poll.next_poll = Clock::time_point::max();
+
+  if (!msg ||
+      !dbus_message_append_args(msg.get(), DBUS_TYPE_STRING, &PLAYER_IFACE,
+                                DBUS_TYPE_INVALID) ||
+      DBusTransport::call_async_on(conn.get(), msg.get(),
+                                   poll_policy.timeout_ms,
+                                   poll.call) != ERROR_NONE) {
+    poll.stats.failures++;
+    schedule_poll(poll, false);
+    return;
+  }
+  DBusRecorder::record(RecordSent, msg.get());
+
+  poll.sent = Clock::now();
+  poll.stats.polls++;
+  poll.reply_to = PendingPoll{this, owner};
+  poll.call->set_notify(poll_reply, &poll.reply_to);
+}
+
+void MprisWatcher::poll_reply(void *user_data) {
+  PendingPoll *pending = static_cast<PendingPoll *>(user_data);
+  MprisWatcher *watcher = pending->watcher;
+  auto it = watcher->polls.find(pending->owner);
+
+  // the call is left in place: dropping it here would free it from under
+  // libdbus. Only the call in flight has a notify, so the reply is current.
+  if (it == watcher->polls.end()) {
+    return;
+  }
+
+  DBusMessageHandle reply(it->second.call->block());
+  if (reply && dbus_message_get_sender(reply.get())) {
+    DBusRecorder::record(RecordReceived, reply.get());
+  }
+  watcher->handle_poll_reply(it->first, it->second, reply.get());
+}
+
+void MprisWatcher::handle_poll_reply(const std::string &owner,
+                                     PlayerPoll &poll, DBusMessage *reply) {
+  Clock::time_point now = Clock::now();
+  DBusMessageHandle changes;
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+  DBusMessageIter changes_args;
+  DBusMessageIter changes_dict;
+  bool missed = false;
+
+  int64_t rtt_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - poll.sent)
+          .count();
+  poll.stats.total_rtt_us += rtt_us;
+  poll.stats.max_rtt_us = std::max(poll.stats.max_rtt_us, rtt_us);
+
+  if (!reply || !dbus_message_has_signature(reply, "a{sv}")) {
+    poll.stats.failures++;
+    schedule_poll(poll, false);
+    return;
+  }
+
+  dbus_message_iter_init(reply, &args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entry_iter;
+    DBusMessageIter value_iter;
+    std::string value;
+    char *key;
+
+    dbus_message_iter_recurse(&dict_iter, &entry_iter);
+    dbus_message_iter_get_basic(&entry_iter, &key);
+    dbus_message_iter_next(&entry_iter);
+    value_iter = entry_iter;
+    dbus_message_iter_next(&dict_iter);
+
+    // moves on its own; players signal Seeked instead, if anything
+    if (strcmp(key, "Position") == 0) {
+      continue;
+    }
+
+    append_json_value(value, &value_iter);
+    auto it = poll.values.find(key);
+    if (it != poll.values.end() && it->second == value) {
+      continue;
+    }
+
+    if (poll.primed) {
+      DBusMessageIter change_iter;
+
+      // invalidated by a signal is not missed, only not known yet
+      missed = missed || it != poll.values.end();
+      if (!changes) {
+        changes.reset(dbus_message_new_signal(
+            MprisMediaPlayer::PATH.c_str(), "org.freedesktop.DBus.Properties",
+            "PropertiesChanged"));
+        if (!changes) {
+          break;
+        }
+        dbus_message_iter_init_append(changes.get(), &changes_args);
+        dbus_message_iter_append_basic(&changes_args, DBUS_TYPE_STRING,
+                                       &PLAYER_IFACE);
+        dbus_message_iter_open_container(&changes_args, DBUS_TYPE_ARRAY,
+                                         "{sv}", &changes_dict);
+      }
+      dbus_message_iter_open_container(&changes_dict, DBUS_TYPE_DICT_ENTRY,
+                                       nullptr, &change_iter);
+      dbus_message_iter_append_basic(&change_iter, DBUS_TYPE_STRING, &key);
+      copy_value(&value_iter, &change_iter);
+      dbus_message_iter_close_container(&changes_dict, &change_iter);
+    }
+
+    if (strcmp(key, "PlaybackStatus") == 0) {
+      DBusMessageIter status_iter;
+      dbus_message_iter_recurse(&value_iter, &status_iter);
+      if (dbus_message_iter_get_arg_type(&status_iter) == DBUS_TYPE_STRING) {
+        char *status;
+        dbus_message_iter_get_basic(&status_iter, &status);
+        poll.playback_status = status;
+      }
+    }
+    poll.values[key] = std::move(value);
+  }
+  poll.primed = true;
+
+  if (changes) {
+    DBusMessageIter invalidated_iter;
+
+    dbus_message_iter_close_container(&changes_args, &changes_dict);
+    dbus_message_iter_open_container(&changes_args, DBUS_TYPE_ARRAY, "s",
+                                     &invalidated_iter);
+    dbus_message_iter_close_container(&changes_args, &invalidated_iter);
+    dbus_message_set_sender(changes.get(), owner.c_str());
+    poll.stats.changes++;
+  }
+  if (missed) {
+    // one miss is enough to distrust its signals, however many came before
+    poll.stats.misses++;
+    poll.stats.mode = PollSilent;
+    poll.clean_polls = 0;
+    poll.signalled = false;
+  } else if (poll.stats.mode == PollSilent) {
+    poll.clean_polls++;
+  }
+  poll.stats.total_decode_us +=
+      std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                            now)
+          .count();
+
+  schedule_poll(poll, static_cast<bool>(changes));
+  check_trust(poll);
+
+  if (changes) {
+    delivering_poll = true;
+    on_properties_changed(poll.stats.player, changes.get());
+    delivering_poll = false;
+  }
+}
+
+void MprisWatcher::note_signal(const std::string &owner, DBusMessage *msg) {
+  DBusMessageIter args;
+  DBusMessageIter dict_iter;
+  DBusMessageIter invalidated_iter;
+  char *iface;
+  auto it = polls.find(owner);
+
+  if (it == polls.end() || !dbus_message_has_signature(msg, "sa{sv}as")) {
+    return;
+  }
+
+  dbus_message_iter_init(msg, &args);
+  dbus_message_iter_get_basic(&args, &iface);
+  if (strcmp(iface, PLAYER_IFACE) != 0) {
+    return;
+  }
+
+  PlayerPoll &poll = it->second;
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &dict_iter);
+  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entry_iter;
+    DBusMessageIter status_iter;
+    std::string value;
+    char *key;
+
+    dbus_message_iter_recurse(&dict_iter, &entry_iter);
+    dbus_message_iter_get_basic(&entry_iter, &key);
+    dbus_message_iter_next(&entry_iter);
+    dbus_message_iter_next(&dict_iter);
+    if (strcmp(key, "Position") == 0) {
+      continue;
+    }
+
+    append_json_value(value, &entry_iter);
+    poll.values[key] = std::move(value);
+
+    dbus_message_iter_recurse(&entry_iter, &status_iter);
+    if (strcmp(key, "PlaybackStatus") == 0 &&
+        dbus_message_iter_get_arg_type(&status_iter) == DBUS_TYPE_STRING) {
+      char *status;
+      dbus_message_iter_get_basic(&status_iter, &status);
+      poll.playback_status = status;
+    }
+  }
+
+  dbus_message_iter_next(&args);
+  dbus_message_iter_recurse(&args, &invalidated_iter);
+  while (dbus_message_iter_get_arg_type(&invalidated_iter) ==
+         DBUS_TYPE_STRING) {
+    char *key;
+    dbus_message_iter_get_basic(&invalidated_iter, &key);
+    poll.values.erase(key);
+    dbus_message_iter_next(&invalidated_iter);
+  }
+
+  if (poll.stats.mode == PollUnknown) {
+    // it does send them after all; from now on it is only audited
+    poll.stats.mode = PollSignals;
+    if (!is_in_flight(poll.call)) {
+      schedule_poll(poll, false);
+    }
+  } else if (poll.stats.mode == PollSilent) {
+    poll.signalled = true;
+    check_trust(poll);
+  }
+}
+
+void MprisWatcher::check_trust(PlayerPoll &poll) {
+  if (poll.stats.mode != PollSilent || !poll.signalled ||
+      poll.clean_polls < poll_policy.trust_after_polls) {
+    return;
+  }
+
+  poll.stats.mode = PollSignals;
+  if (!is_in_flight(poll.call)) {
+    schedule_poll(poll, false);
+  }
+}
+
+int MprisWatcher::poll_ceiling_ms(const PlayerPoll &poll) {
+  if (poll.stats.mode == PollSignals) {
+    return poll_policy.audit_interval_ms;
+  }
+  if (poll.playback_status == "Playing") {
+    return poll_policy.playing_interval_ms;
+  }
+  if (poll.playback_status == "Paused") {
+    return poll_policy.paused_interval_ms;
+  }
+  return poll_policy.stopped_interval_ms;
+}
+
+void MprisWatcher::schedule_poll(PlayerPoll &poll, bool changed) {
+  int ceiling = poll_ceiling_ms(poll);
+  int interval;
+
+  if (poll.stats.mode == PollSignals) {
+    interval = ceiling;
+  } else if (changed || poll.input) {
+    interval = poll_policy.fast_interval_ms;
+  } else if (ceiling <= 0) {
+    interval = 0;
+  } else {
+    // back off while nothing happens
+    interval = std::max(poll.stats.interval_ms, poll_policy.fast_interval_ms);
+    interval = std::min(ceiling, interval * 2);
+  }
+  poll.input = false;
+
+  poll.stats.interval_ms = interval;
+  poll.next_poll = (interval > 0)
+                       ? Clock::now() + std::chrono::milliseconds(interval)
+                       : Clock::time_point::max();
+}